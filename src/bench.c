@@ -0,0 +1,323 @@
+// Microbenchmark Harness
+// Save as: ~/OS_proj/src/bench.c
+//
+// Built into the kernel only by `make bench` (CONFIG_BENCH). kernel_main
+// then skips the demo processes and secondary CPUs and calls bench_main,
+// which runs every benchmark in bench_table from a process on the boot
+// CPU, prints one result line per benchmark and powers the machine off
+// with PSCI SYSTEM_OFF, so QEMU exits when the run is done.
+//
+// A benchmark is a function running n operations. Each sample times one
+// call with the PMU cycle counter and the generic counter and divides by
+// n; BENCH_SAMPLES samples give the min, median and p99. Results look
+// like
+//   BENCH name=kmalloc_64 n=16 samples=1000 cycles_min=.. cycles_med=..
+//         cycles_p99=.. ns_min=.. ns_med=.. ns_p99=..
+// on a single line, so `make bench | grep ^BENCH` is all a script needs.
+// The null benchmark reports the cost of the timing itself.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef CONFIG_BENCH
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+extern void uart_flush(void);
+
+// External memory functions
+extern void* kmalloc(size_t size);
+extern void kfree(void* ptr);
+extern void* alloc_pages(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+
+// External interrupt functions
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+
+// External process functions
+typedef struct process process_t;
+extern process_t* create_process(const char* name, void (*entry_point)(void));
+extern void schedule_process(process_t* proc);
+extern void start_multitasking(void);
+extern void process_yield(void);
+extern void schedule(void);
+
+// External measurement and power functions
+extern void perf_init(void);
+extern uint64_t perf_cycles(void);
+extern void psci_system_off(void);
+
+// External string functions
+extern void* memset(void* dst, int c, size_t n);
+
+// Same layout as cpu_context_t in process.c (offsets used by switch_context)
+typedef struct {
+    uint64_t x[10];     // x19-x28
+    uint64_t fp;
+    uint64_t sp;
+    uint64_t pc;
+} switch_ctx_t;
+extern void switch_context(switch_ctx_t* old_ctx, switch_ctx_t* new_ctx);
+
+#define BENCH_SAMPLES       1000
+#define BENCH_WARMUP        10          // Untimed samples first
+#define BENCH_BURST         32          // Objects live at once in the burst pattern
+#define SVC_NULL            0xFFFF      // Kernel call that does nothing (interrupts.c)
+
+typedef struct {
+    const char* name;
+    void (*run)(uint32_t n);    // Perform n operations
+    uint32_t n;                 // Operations per sample
+    void (*setup)(void);        // Optional, before the first sample
+    void (*teardown)(void);     // Optional, after the last sample
+} bench_t;
+
+static uint64_t* sample_cycles;
+static uint64_t* sample_ticks;
+
+static switch_ctx_t main_ctx;
+static switch_ctx_t partner_ctx;
+static uint8_t* partner_stack;
+
+static volatile int yield_stop;
+static void* burst[BENCH_BURST];
+
+static uint64_t read_cntvct(void) {
+    uint64_t ticks;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+    return ticks;
+}
+
+static void bench_null(uint32_t n) {
+    (void)n;
+}
+
+// kmalloc/kfree patterns: a slab size, a TLSF size and a page-sized
+// request, each freed at once, then a burst of live slab objects freed
+// in reverse order
+
+static void bench_kmalloc_64(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        kfree(kmalloc(64));
+    }
+}
+
+static void bench_kmalloc_4096(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        kfree(kmalloc(4096));
+    }
+}
+
+static void bench_kmalloc_16384(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        kfree(kmalloc(16384));
+    }
+}
+
+static void bench_kmalloc_burst(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        burst[i] = kmalloc(128);
+    }
+    for (uint32_t i = n; i > 0; i--) {
+        kfree(burst[i - 1]);
+    }
+}
+
+// switch_context round trips to a partner that bounces straight back,
+// IRQs masked so the tick cannot switch from inside the partner
+
+static void switch_partner(void) {
+    while (1) {
+        switch_context(&partner_ctx, &main_ctx);
+    }
+}
+
+static void switch_setup(void) {
+    partner_stack = (uint8_t*)alloc_pages(0);
+    memset(&partner_ctx, 0, sizeof(partner_ctx));
+    partner_ctx.sp = (uint64_t)(partner_stack + 4096);
+    partner_ctx.pc = (uint64_t)switch_partner;
+}
+
+static void switch_teardown(void) {
+    free_pages(partner_stack, 0);
+}
+
+static void bench_switch_context(uint32_t n) {
+    if (!partner_stack) {
+        return;
+    }
+    uint64_t flags = irq_save();
+    for (uint32_t i = 0; i < n; i++) {
+        switch_context(&main_ctx, &partner_ctx);
+    }
+    irq_restore(flags);
+}
+
+// schedule() with nothing else runnable: requeue, pick, no switch
+static void bench_schedule(uint32_t n) {
+    uint64_t flags = irq_save();
+    for (uint32_t i = 0; i < n; i++) {
+        schedule();
+    }
+    irq_restore(flags);
+}
+
+// process_yield to a partner process that yields straight back: each
+// operation is two full scheduler switches
+static void yield_partner(void) {
+    while (!yield_stop) {
+        process_yield();
+    }
+}
+
+static void yield_setup(void) {
+    yield_stop = 0;
+    process_t* partner = create_process("bench_yield", yield_partner);
+    if (partner) {
+        schedule_process(partner);
+    }
+    process_yield();
+}
+
+static void yield_teardown(void) {
+    yield_stop = 1;
+    process_yield();
+}
+
+static void bench_process_yield(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        process_yield();
+    }
+}
+
+// Exception entry and return through the synchronous vector
+static void bench_svc(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        asm volatile("svc %0" :: "i"(SVC_NULL) : "memory");
+    }
+}
+
+// One 16-byte line through the TX ring. Once the ring is full this
+// measures the drain rate rather than the enqueue cost.
+static void bench_uart_puts(uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        uart_puts("uart bench line\n");
+    }
+}
+
+static const bench_t bench_table[] = {
+    { "null",               bench_null,             1,              NULL,           NULL },
+    { "kmalloc_64",         bench_kmalloc_64,       16,             NULL,           NULL },
+    { "kmalloc_4096",       bench_kmalloc_4096,     16,             NULL,           NULL },
+    { "kmalloc_16384",      bench_kmalloc_16384,    4,              NULL,           NULL },
+    { "kmalloc_burst_128",  bench_kmalloc_burst,    BENCH_BURST,    NULL,           NULL },
+    { "switch_context",     bench_switch_context,   16,             switch_setup,   switch_teardown },
+    { "schedule",           bench_schedule,         16,             NULL,           NULL },
+    { "process_yield",      bench_process_yield,    16,             yield_setup,    yield_teardown },
+    { "exception_svc",      bench_svc,              16,             NULL,           NULL },
+    { "uart_puts_16",       bench_uart_puts,        1,              NULL,           NULL },
+};
+
+// Insertion sort, the samples are few
+static void sort_samples(uint64_t* v, int count) {
+    for (int i = 1; i < count; i++) {
+        uint64_t x = v[i];
+        int j = i - 1;
+        while (j >= 0 && v[j] > x) {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = x;
+    }
+}
+
+static void print_stats(const char* unit, uint64_t* v, int count) {
+    sort_samples(v, count);
+    uart_puts(" ");
+    uart_puts(unit);
+    uart_puts("_min=");
+    print_decimal(v[0]);
+    uart_puts(" ");
+    uart_puts(unit);
+    uart_puts("_med=");
+    print_decimal(v[count / 2]);
+    uart_puts(" ");
+    uart_puts(unit);
+    uart_puts("_p99=");
+    print_decimal(v[count * 99 / 100]);
+}
+
+static void run_bench(const bench_t* b, uint64_t freq) {
+    if (b->setup) {
+        b->setup();
+    }
+
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        b->run(b->n);
+    }
+
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        uint64_t ticks = read_cntvct();
+        uint64_t cycles = perf_cycles();
+        b->run(b->n);
+        cycles = perf_cycles() - cycles;
+        ticks = read_cntvct() - ticks;
+
+        sample_cycles[i] = cycles / b->n;
+        sample_ticks[i] = ticks * 1000000000ULL / freq / b->n;
+    }
+
+    if (b->teardown) {
+        b->teardown();
+    }
+
+    uart_puts("BENCH name=");
+    uart_puts(b->name);
+    uart_puts(" n=");
+    print_decimal(b->n);
+    uart_puts(" samples=");
+    print_decimal(BENCH_SAMPLES);
+    print_stats("cycles", sample_cycles, BENCH_SAMPLES);
+    print_stats("ns", sample_ticks, BENCH_SAMPLES);
+    uart_puts("\n");
+}
+
+// Runs as a process, never returns
+static void bench_run_all(void) {
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    sample_cycles = (uint64_t*)kmalloc(BENCH_SAMPLES * sizeof(uint64_t));
+    sample_ticks = (uint64_t*)kmalloc(BENCH_SAMPLES * sizeof(uint64_t));
+    if (!sample_cycles || !sample_ticks || !freq) {
+        uart_puts("BENCH error=no_memory\n");
+    } else {
+        for (size_t i = 0; i < sizeof(bench_table) / sizeof(bench_table[0]); i++) {
+            run_bench(&bench_table[i], freq);
+        }
+        uart_puts("BENCH done\n");
+    }
+
+    uart_flush();
+    psci_system_off();
+}
+
+// Start the suite from kernel_main, after interrupts are enabled
+void bench_main(void) {
+    perf_init();
+
+    process_t* bench = create_process("bench", bench_run_all);
+    if (!bench) {
+        uart_puts("BENCH error=no_process\n");
+        uart_flush();
+        psci_system_off();
+    }
+    schedule_process(bench);
+    start_multitasking();
+}
+
+#endif // CONFIG_BENCH
@@ -23,19 +23,17 @@ core0:
     mov x1, #0x40070000
     mov sp, x1
     
-    // Clear BSS section
-    ldr x1, =__bss_start
-    ldr w2, =__bss_size
-    
-clear_bss:
-    cbz w2, clear_done
-    str xzr, [x1], #8
-    sub w2, w2, #8
-    cbnz w2, clear_bss
-
-clear_done:
-    // Skip exception table installation for now
-    // bl install_exception_table
+    // Clear BSS section (caches are still off, memset uses aligned stores)
+    ldr x0, =__bss_start
+    mov w1, #0
+    ldr x2, =__bss_size
+    bl memset
+    
+    // Install exception vectors (IRQs stay masked until the kernel enables them)
+    bl install_exception_table
+    
+    // Identity map RAM/MMIO, enable MMU and caches
+    bl mmu_init
     
     // Jump to C kernel
     bl kernel_main
@@ -45,6 +43,21 @@ hang:
     wfe
     b hang
 
+// Secondary CPUs enter here from PSCI CPU_ON with the MMU and caches
+// off; x0 (the CPU_ON context ID) is the top of this CPU's idle stack
+.global secondary_entry
+secondary_entry:
+    mov sp, x0
+    
+    bl install_exception_table
+    
+    // Reuse the boot CPU's identity map
+    bl mmu_init_secondary
+    
+    // Per-CPU setup, then become this CPU's idle process (never returns)
+    bl secondary_main
+    b hang
+
 // Define BSS section symbols (will be defined by linker)
 .section ".bss"
 __bss_start:
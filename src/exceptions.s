@@ -1,147 +1,368 @@
 // ARM64 Exception Vector Table
 // Save as: ~/OS_proj/src/exceptions.s
+//
+// Every exception builds the same trap frame (pt_regs_t in interrupts.c)
+// on the kernel stack of the task it interrupts: x0-x30, SP_EL0,
+// ELR_EL1 and SPSR_EL1, stored in pairs into one block reserved up
+// front. The C handler gets a pointer to it and may change any field;
+// the exit path restores everything from the frame before eret.
+//
+// For a task running at EL0 the kernel stack is empty, so the frame
+// lands in the pt_regs area reserved at its top (process.c).
+//
+// The common case from EL0 is SVC. The system call ABI clobbers x1-x18,
+// so the fast path saves only x30 and the return state. Argument
+// registers pass straight through to the handler in syscall_table, and
+// caller-saved registers are cleared on the way out so that no kernel
+// values reach EL0.
+//
+// Task kernel stacks are mapped on demand (mm.c), so an exception taken
+// at EL1 first checks that the frame will land on a mapped page. If not,
+// it grows the stack from this CPU's fault stack before pushing anything.
 
 .section ".text"
 
+// pt_regs_t layout
+.equ S_X30,         240
+.equ S_SP,          248         // SP_EL0
+.equ S_PC,          256         // ELR_EL1
+.equ S_PSTATE,      264         // SPSR_EL1
+.equ S_FRAME_SIZE,  272         // Multiple of 16, SP stays aligned
+
+// System calls (syscall.c)
+.equ ESR_EC_SHIFT,  26
+.equ ESR_EC_SVC64,  0x15
+.equ NR_SYSCALLS,   6
+.equ ENOSYS,        38
+
+// Trace event for system calls (TRACE_SYSCALL in trace.c)
+.equ TRACE_SYSCALL, 7
+
+// Demand-paged kernel stacks (mm.c). The probe covers the frame and
+// room for handle_sync to grow the stack through an ordinary fault.
+.equ STACK_PROBE,       S_FRAME_SIZE + 1024
+.equ KSTACK_BASE,       0xC0000000
+.equ FAULT_STACK_SHIFT, 14
+.equ GROW_FRAME,        176         // x0-x18, x30, interrupted x0
+.equ KSTACK_GROWN,      1           // kstack_grow results, as in mm.c
+
+.macro kernel_entry
+    sub sp, sp, #S_FRAME_SIZE
+    stp x0, x1,   [sp, #0]
+    kernel_entry_rest
+.endm
+
+// Everything after x0/x1
+.macro kernel_entry_rest
+    stp x2, x3,   [sp, #16]
+    stp x4, x5,   [sp, #32]
+    stp x6, x7,   [sp, #48]
+    stp x8, x9,   [sp, #64]
+    stp x10, x11, [sp, #80]
+    stp x12, x13, [sp, #96]
+    stp x14, x15, [sp, #112]
+    stp x16, x17, [sp, #128]
+    stp x18, x19, [sp, #144]
+    stp x20, x21, [sp, #160]
+    stp x22, x23, [sp, #176]
+    stp x24, x25, [sp, #192]
+    stp x26, x27, [sp, #208]
+    stp x28, x29, [sp, #224]
+    mrs x21, sp_el0
+    mrs x22, elr_el1
+    mrs x23, spsr_el1
+    stp x30, x21, [sp, #S_X30]
+    stp x22, x23, [sp, #S_PC]
+.endm
+
+// ELR/SPSR come back from the frame: the handler may have switched to
+// another task, which took exceptions of its own, or edited them
+.macro kernel_exit
+    ldp x22, x23, [sp, #S_PC]
+    ldp x30, x21, [sp, #S_X30]
+    msr elr_el1, x22
+    msr spsr_el1, x23
+    msr sp_el0, x21
+    ldp x0, x1,   [sp, #0]
+    ldp x2, x3,   [sp, #16]
+    ldp x4, x5,   [sp, #32]
+    ldp x6, x7,   [sp, #48]
+    ldp x8, x9,   [sp, #64]
+    ldp x10, x11, [sp, #80]
+    ldp x12, x13, [sp, #96]
+    ldp x14, x15, [sp, #112]
+    ldp x16, x17, [sp, #128]
+    ldp x18, x19, [sp, #144]
+    ldp x20, x21, [sp, #160]
+    ldp x22, x23, [sp, #176]
+    ldp x24, x25, [sp, #192]
+    ldp x26, x27, [sp, #208]
+    ldp x28, x29, [sp, #224]
+    add sp, sp, #S_FRAME_SIZE
+    eret
+.endm
+
+// Branch to \grow if the page STACK_PROBE below SP is not mapped (AT
+// S1E1W: PAR_EL1.F set). x0 is parked in TPIDR_EL1 meanwhile.
+.macro el1_stack_probe grow
+    msr tpidr_el1, x0
+    sub x0, sp, #STACK_PROBE
+    at s1e1w, x0
+    isb
+    mrs x0, par_el1
+    tbnz x0, #0, \grow
+    mrs x0, tpidr_el1
+.endm
+
+// Grow the interrupted kernel stack down to the probed address, from
+// this CPU's fault stack (top at KSTACK_BASE + (cpu + 1) << 14), then
+// return to it with every register as it was. x0 is in TPIDR_EL1. A
+// stack that cannot grow (guard gap, or no page left) ends in
+// kstack_overflow, which reports which of the two it was.
+.macro el1_stack_grow
+    mrs x0, mpidr_el1
+    and x0, x0, #0xFF
+    add x0, x0, #1
+    lsl x0, x0, #FAULT_STACK_SHIFT
+    orr x0, x0, #KSTACK_BASE
+    add sp, sp, x0              // Swap SP and x0 without a spare register
+    sub x0, sp, x0
+    sub sp, sp, x0
+    sub sp, sp, #GROW_FRAME
+    stp x0, x1,   [sp, #0]
+    stp x2, x3,   [sp, #16]
+    stp x4, x5,   [sp, #32]
+    stp x6, x7,   [sp, #48]
+    stp x8, x9,   [sp, #64]
+    stp x10, x11, [sp, #80]
+    stp x12, x13, [sp, #96]
+    stp x14, x15, [sp, #112]
+    stp x16, x17, [sp, #128]
+    stp x18, x30, [sp, #144]
+    mrs x1, tpidr_el1
+    str x1, [sp, #160]
+    sub x0, x0, #STACK_PROBE
+    bl kstack_grow
+    cmp x0, #KSTACK_GROWN
+    b.eq 1f
+    mov x1, x0                  // KSTACK_GUARD or KSTACK_NOMEM
+    ldr x0, [sp, #0]
+    bl kstack_overflow          // Does not return
+1:  ldr x1, [sp, #160]
+    msr tpidr_el1, x1
+    ldp x2, x3,   [sp, #16]
+    ldp x4, x5,   [sp, #32]
+    ldp x6, x7,   [sp, #48]
+    ldp x8, x9,   [sp, #64]
+    ldp x10, x11, [sp, #80]
+    ldp x12, x13, [sp, #96]
+    ldp x14, x15, [sp, #112]
+    ldp x16, x17, [sp, #128]
+    ldp x18, x30, [sp, #144]
+    ldp x0, x1,   [sp, #0]
+    mov sp, x0
+    mrs x0, tpidr_el1
+.endm
+
+// Exception types for handle_bad_exception
+.equ BAD_SYNC,      0
+.equ BAD_IRQ,       1
+.equ BAD_FIQ,       2
+.equ BAD_SERROR,    3
+
+// Entry for an exception the kernel does not expect (does not return)
+.macro bad_entry type
+    kernel_entry
+    mov x0, sp
+    mov x1, #\type
+    bl handle_bad_exception
+    b .
+.endm
+
 // Exception vector table alignment
 .align 11
 .global exception_vector_table
 exception_vector_table:
 
-// Current EL with SP_EL0
+// Current EL with SP_EL0 (the kernel always runs on SP_EL1)
 .align 7
 el1_sp0_sync:
-    b exception_handler
+    b bad_sync
 .align 7
 el1_sp0_irq:
-    b irq_handler
+    b bad_irq
 .align 7
 el1_sp0_fiq:
-    b exception_handler
+    b bad_fiq
 .align 7
 el1_sp0_error:
-    b exception_handler
+    b bad_serror
 
 // Current EL with SP_ELx
 .align 7
 el1_spx_sync:
-    b exception_handler
+    el1_stack_probe el1_sync_grow
+    b sync_handler
 .align 7
 el1_spx_irq:
+    el1_stack_probe el1_irq_grow
     b irq_handler
 .align 7
 el1_spx_fiq:
-    b exception_handler
+    b bad_fiq
 .align 7
 el1_spx_error:
-    b exception_handler
+    b bad_serror
 
 // Lower EL using AArch64
 .align 7
 el0_sync:
-    b syscall_handler
+    b el0_sync_handler
 .align 7
 el0_irq:
     b irq_handler
 .align 7
 el0_fiq:
-    b exception_handler
+    b bad_fiq
 .align 7
 el0_error:
-    b exception_handler
+    b bad_serror
 
 // Lower EL using AArch32
 .align 7
 el0_32_sync:
-    b exception_handler
+    b bad_sync
 .align 7
 el0_32_irq:
-    b irq_handler
+    b bad_irq
 .align 7
 el0_32_fiq:
-    b exception_handler
+    b bad_fiq
 .align 7
 el0_32_error:
-    b exception_handler
-
-// Exception handler entry point
-exception_handler:
-    // Save registers
-    stp x0, x1, [sp, #-16]!
-    stp x2, x3, [sp, #-16]!
-    stp x4, x5, [sp, #-16]!
-    stp x6, x7, [sp, #-16]!
-    stp x8, x9, [sp, #-16]!
-    stp x10, x11, [sp, #-16]!
-    stp x12, x13, [sp, #-16]!
-    stp x14, x15, [sp, #-16]!
-    stp x16, x17, [sp, #-16]!
-    stp x18, x19, [sp, #-16]!
-    stp x20, x21, [sp, #-16]!
-    stp x22, x23, [sp, #-16]!
-    stp x24, x25, [sp, #-16]!
-    stp x26, x27, [sp, #-16]!
-    stp x28, x29, [sp, #-16]!
-    str x30, [sp, #-8]!
-
-    // Call C exception handler
-    bl handle_exception
-
-    // Restore registers
-    ldr x30, [sp], #8
-    ldp x28, x29, [sp], #16
-    ldp x26, x27, [sp], #16
-    ldp x24, x25, [sp], #16
-    ldp x22, x23, [sp], #16
-    ldp x20, x21, [sp], #16
-    ldp x18, x19, [sp], #16
-    ldp x16, x17, [sp], #16
-    ldp x14, x15, [sp], #16
-    ldp x12, x13, [sp], #16
-    ldp x10, x11, [sp], #16
-    ldp x8, x9, [sp], #16
-    ldp x6, x7, [sp], #16
-    ldp x4, x5, [sp], #16
-    ldp x2, x3, [sp], #16
-    ldp x0, x1, [sp], #16
-    
+    b bad_serror
+
+// Synchronous exceptions: handle_sync dispatches on ESR_EL1.EC
+sync_handler:
+    kernel_entry
+    mov x0, sp
+    bl handle_sync
+    kernel_exit
+
+// Synchronous exceptions from EL0: system calls take the fast path,
+// anything else (faults, FP traps) the full frame
+el0_sync_handler:
+    sub sp, sp, #S_FRAME_SIZE
+    stp x0, x1, [sp, #0]
+    mrs x0, esr_el1
+    ubfx x0, x0, #ESR_EC_SHIFT, #6
+    cmp x0, #ESR_EC_SVC64
+    b.ne el0_sync_slow
+
+    // x8 = number, x0-x5 = arguments, result in x0
+    mrs x9, sp_el0
+    mrs x10, elr_el1
+    mrs x11, spsr_el1
+    stp x30, x9, [sp, #S_X30]
+    stp x10, x11, [sp, #S_PC]
+    adrp x9, trace_mask
+    ldr w9, [x9, :lo12:trace_mask]
+    tbnz w9, #TRACE_SYSCALL, el0_svc_trace
+el0_svc_dispatch:
+    ldr x0, [sp, #0]
+    cmp x8, #NR_SYSCALLS
+    b.hs 1f
+    adrp x9, syscall_table
+    add x9, x9, :lo12:syscall_table
+    ldr x9, [x9, x8, lsl #3]
+    blr x9
+    b 2f
+1:  mov x0, #-ENOSYS
+2:  ldp x10, x11, [sp, #S_PC]
+    ldp x30, x9, [sp, #S_X30]
+    msr elr_el1, x10
+    msr spsr_el1, x11
+    msr sp_el0, x9
+    mov x1, xzr
+    mov x2, xzr
+    mov x3, xzr
+    mov x4, xzr
+    mov x5, xzr
+    mov x6, xzr
+    mov x7, xzr
+    mov x8, xzr
+    mov x9, xzr
+    mov x10, xzr
+    mov x11, xzr
+    mov x12, xzr
+    mov x13, xzr
+    mov x14, xzr
+    mov x15, xzr
+    mov x16, xzr
+    mov x17, xzr
+    mov x18, xzr
+    add sp, sp, #S_FRAME_SIZE
     eret
 
-// IRQ handler entry point
-irq_handler:
-    // Save registers (simplified for now)
-    stp x0, x1, [sp, #-16]!
-    stp x29, x30, [sp, #-16]!
+// TRACE_SYSCALL enabled: record the call as handle_syscall does, keeping
+// the argument registers in the frame across trace_event
+el0_svc_trace:
+    stp x2, x3, [sp, #16]
+    stp x4, x5, [sp, #32]
+    str x8, [sp, #64]
+    mov x0, #TRACE_SYSCALL
+    mrs x1, esr_el1
+    and x1, x1, #0xFFFF
+    mov x2, x8
+    bl trace_event
+    ldr x1, [sp, #8]
+    ldp x2, x3, [sp, #16]
+    ldp x4, x5, [sp, #32]
+    ldr x8, [sp, #64]
+    b el0_svc_dispatch
 
-    // Call C IRQ handler
+el0_sync_slow:
+    kernel_entry_rest
+    mov x0, sp
+    bl handle_sync
+    kernel_exit
+
+// Drop to EL0 with the state in a pt_regs frame (the one reserved at the
+// top of the current task's kernel stack). Does not return.
+// void ret_to_user(pt_regs_t* regs)
+.global ret_to_user
+ret_to_user:
+    msr daifset, #2             // ELR/SPSR must survive until eret
+    mov sp, x0
+    kernel_exit
+
+// IRQ handler entry point. handle_irq may switch to another process,
+// which can take its own exceptions; this frame keeps our state.
+irq_handler:
+    kernel_entry
+    mov x0, sp
     bl handle_irq
+    kernel_exit
 
-    // Restore registers
-    ldp x29, x30, [sp], #16
-    ldp x0, x1, [sp], #16
-    
-    eret
+el1_sync_grow:
+    el1_stack_grow
+    b sync_handler
+el1_irq_grow:
+    el1_stack_grow
+    b irq_handler
 
-// System call handler entry point
-syscall_handler:
-    // Save registers
-    stp x0, x1, [sp, #-16]!
-    stp x2, x3, [sp, #-16]!
-    stp x29, x30, [sp, #-16]!
-
-    // Call C syscall handler
-    bl handle_syscall
-
-    // Restore registers
-    ldp x29, x30, [sp], #16
-    ldp x2, x3, [sp], #16
-    ldp x0, x1, [sp], #16
-    
-    eret
+bad_sync:
+    bad_entry BAD_SYNC
+bad_irq:
+    bad_entry BAD_IRQ
+bad_fiq:
+    bad_entry BAD_FIQ
+bad_serror:
+    bad_entry BAD_SERROR
 
 // Function to install exception vector table
 .global install_exception_table
 install_exception_table:
     adr x0, exception_vector_table
     msr vbar_el1, x0
-    ret
\ No newline at end of file
+    ret
@@ -0,0 +1,250 @@
+// Lazy FP/SIMD Context Switching
+// Save as: ~/OS_proj/src/fpsimd.c
+//
+// FP/SIMD access is disabled in CPACR_EL1 whenever a CPU switches tasks,
+// so a task's first FP or NEON instruction afterwards traps (ESR class
+// 0x07). The trap loads that task's registers and enables access; only
+// then does the task own the register file, and only then must the next
+// switch save the 512 bytes of V0-V31. Tasks that never use FP are never
+// saved or restored and never get a state area.
+//
+// A CPU remembers whose registers it last loaded. If that task traps
+// again on the same CPU and nothing else used the registers in between,
+// they are still live and the load is skipped.
+//
+// The rest of the kernel is built with -mgeneral-regs-only. Kernel code
+// that wants NEON lives in a *_simd.c file and brackets its use with
+// kernel_fpsimd_begin/kernel_fpsimd_end.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External interrupt functions
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+
+// External SMP functions
+extern int smp_processor_id(void);
+
+// External slab functions
+typedef struct kmem_cache kmem_cache_t;
+extern kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+extern void* kmem_cache_alloc(kmem_cache_t* cache);
+extern void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// External string functions
+extern void* memset(void* dst, int c, size_t n);
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+// CPACR_EL1.FPEN, bits [21:20]: 0b11 allows FP/SIMD at EL1 and EL0
+#define CPACR_FPEN_SHIFT    20
+#define CPACR_FPEN_MASK     (3UL << CPACR_FPEN_SHIFT)
+#define CPACR_FPEN_ALL      (3UL << CPACR_FPEN_SHIFT)
+
+// Saved register file, layout shared with fpsimd.s
+typedef struct fpsimd_state {
+    uint64_t vregs[64];         // V0-V31, 128 bits each
+    uint32_t fpsr;
+    uint32_t fpcr;
+} fpsimd_state_t;
+
+// Per-task FP context, embedded in process_t
+typedef struct fpsimd_ctx {
+    fpsimd_state_t* state;      // Allocated on the first FP trap
+    int cpu;                    // CPU the registers were last loaded on
+} fpsimd_ctx_t;
+
+typedef struct {
+    fpsimd_ctx_t* owner;        // Whose registers the CPU holds, if any
+    fpsimd_ctx_t* live;         // Owner with access enabled since the switch
+    int enabled;                // FP access currently enabled
+    uint64_t switches;          // Context switches seen
+    uint64_t saves;             // Switches that saved a register file
+    uint64_t saves_avoided;     // Switches that had nothing to save
+    uint64_t traps;             // First-use traps taken
+    uint64_t restores;          // Traps that loaded a register file
+    uint64_t restores_avoided;  // Traps that found the registers still loaded
+} fpsimd_cpu_t;
+
+static fpsimd_cpu_t fpsimd_cpus[NR_CPUS];
+static kmem_cache_t* fpsimd_cache = NULL;
+
+// Register file save and load (fpsimd.s)
+extern void fpsimd_save_state(fpsimd_state_t* state);
+extern void fpsimd_load_state(const fpsimd_state_t* state);
+
+// Context of the task running on this CPU (process.c), NULL for idle
+extern fpsimd_ctx_t* current_fpsimd(void);
+
+static void fpsimd_access(int enable) {
+    uint64_t cpacr;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(cpacr));
+    cpacr &= ~CPACR_FPEN_MASK;
+    if (enable) {
+        cpacr |= CPACR_FPEN_ALL;
+    }
+    asm volatile("msr cpacr_el1, %0\n"
+                 "isb" :: "r"(cpacr) : "memory");
+    fpsimd_cpus[smp_processor_id()].enabled = enable;
+}
+
+// Trap FP/SIMD on this CPU until a task first uses it (every CPU)
+void init_fpsimd_cpu(void) {
+    fpsimd_cpu_t* c = &fpsimd_cpus[smp_processor_id()];
+    c->owner = NULL;
+    c->live = NULL;
+    fpsimd_access(0);
+}
+
+// Boot CPU, after the slab allocator is up
+void init_fpsimd(void) {
+    fpsimd_cache = kmem_cache_create("fpsimd_state", sizeof(fpsimd_state_t));
+    init_fpsimd_cpu();
+    uart_puts("FP/SIMD: lazy switching, ");
+    print_decimal(sizeof(fpsimd_state_t));
+    uart_puts(" byte state per FP task\n");
+}
+
+void fpsimd_ctx_init(fpsimd_ctx_t* ctx) {
+    ctx->state = NULL;
+    ctx->cpu = -1;
+}
+
+// Drop a task's FP state (the task must not be running)
+void fpsimd_ctx_release(fpsimd_ctx_t* ctx) {
+    uint64_t flags = irq_save();
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (fpsimd_cpus[cpu].owner == ctx) {
+            fpsimd_cpus[cpu].owner = NULL;
+        }
+    }
+    irq_restore(flags);
+
+    if (ctx->state) {
+        kmem_cache_free(fpsimd_cache, ctx->state);
+    }
+    fpsimd_ctx_init(ctx);
+}
+
+// Called by schedule() before every real switch, IRQs masked.
+// The outgoing task's registers are saved only if it used FP since it
+// was switched in; they stay loaded, so a quick return needs no reload.
+void fpsimd_switch(void) {
+    fpsimd_cpu_t* c = &fpsimd_cpus[smp_processor_id()];
+    c->switches++;
+
+    if (c->live) {
+        fpsimd_save_state(c->live->state);
+        c->live = NULL;
+        c->saves++;
+    } else {
+        c->saves_avoided++;
+    }
+
+    if (c->enabled) {
+        fpsimd_access(0);
+    }
+}
+
+// FP/SIMD access trap (ESR class 0x07), from handle_sync.
+// Returning re-executes the trapped instruction with access enabled.
+// Returns 0, access still off, if there is no memory for the task's
+// register state; the caller must not return to the instruction then.
+int fpsimd_trap(void) {
+    fpsimd_cpu_t* c = &fpsimd_cpus[smp_processor_id()];
+    fpsimd_ctx_t* ctx = current_fpsimd();
+    c->traps++;
+
+    if (!ctx) {
+        // No task to own the registers; fpsimd_switch still turns
+        // access off again at the next switch
+        uart_puts("FP/SIMD used outside a task, use kernel_fpsimd_begin\n");
+        c->owner = NULL;
+        fpsimd_access(1);
+        return 1;
+    }
+
+    if (!ctx->state) {
+        ctx->state = (fpsimd_state_t*)kmem_cache_alloc(fpsimd_cache);
+        if (!ctx->state) {
+            uart_puts("FP/SIMD: out of memory for register state\n");
+            return 0;
+        }
+        memset(ctx->state, 0, sizeof(fpsimd_state_t));
+        ctx->cpu = -1;
+    }
+
+    fpsimd_access(1);
+
+    if (c->owner == ctx && ctx->cpu == smp_processor_id()) {
+        c->restores_avoided++;
+    } else {
+        fpsimd_load_state(ctx->state);
+        c->owner = ctx;
+        ctx->cpu = smp_processor_id();
+        c->restores++;
+    }
+    c->live = ctx;
+    return 1;
+}
+
+// Let kernel code use FP/SIMD. Saves the current task's registers if
+// they are live; IRQs stay masked until kernel_fpsimd_end, so the
+// section must be short and must not sleep or nest. Put the NEON code
+// in a function of its own so no values live in vector registers
+// across the bracket.
+uint64_t kernel_fpsimd_begin(void) {
+    uint64_t flags = irq_save();
+    fpsimd_cpu_t* c = &fpsimd_cpus[smp_processor_id()];
+
+    if (c->live) {
+        fpsimd_save_state(c->live->state);
+        c->live = NULL;
+        c->saves++;
+    }
+    c->owner = NULL;
+    fpsimd_access(1);
+    return flags;
+}
+
+void kernel_fpsimd_end(uint64_t flags) {
+    fpsimd_access(0);
+    irq_restore(flags);
+}
+
+void print_fpsimd_stats(void) {
+    fpsimd_cpu_t total = {0};
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        total.switches += fpsimd_cpus[cpu].switches;
+        total.saves += fpsimd_cpus[cpu].saves;
+        total.saves_avoided += fpsimd_cpus[cpu].saves_avoided;
+        total.traps += fpsimd_cpus[cpu].traps;
+        total.restores += fpsimd_cpus[cpu].restores;
+        total.restores_avoided += fpsimd_cpus[cpu].restores_avoided;
+    }
+
+    uart_puts("FP/SIMD: ");
+    print_decimal(total.switches);
+    uart_puts(" switches, ");
+    print_decimal(total.saves);
+    uart_puts(" saved, ");
+    print_decimal(total.saves_avoided);
+    uart_puts(" without a save (");
+    print_decimal(total.switches ? total.saves_avoided * 100 / total.switches : 0);
+    uart_puts("%)\n");
+    uart_puts("FP/SIMD: ");
+    print_decimal(total.traps);
+    uart_puts(" traps, ");
+    print_decimal(total.restores);
+    uart_puts(" loads, ");
+    print_decimal(total.restores_avoided);
+    uart_puts(" found still loaded\n");
+}
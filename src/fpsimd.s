@@ -0,0 +1,60 @@
+// FP/SIMD Register Save and Restore
+// Save as: ~/OS_proj/src/fpsimd.s
+
+.section ".text"
+
+// Layout of fpsimd_state_t (fpsimd.c): V0-V31, then FPSR and FPCR
+.equ FPSIMD_FPSR, 512
+.equ FPSIMD_FPCR, 516
+
+// Function: fpsimd_save_state(fpsimd_state_t* state)
+// x0 = 16-byte aligned state area
+.global fpsimd_save_state
+fpsimd_save_state:
+    stp q0, q1, [x0, #0]
+    stp q2, q3, [x0, #32]
+    stp q4, q5, [x0, #64]
+    stp q6, q7, [x0, #96]
+    stp q8, q9, [x0, #128]
+    stp q10, q11, [x0, #160]
+    stp q12, q13, [x0, #192]
+    stp q14, q15, [x0, #224]
+    stp q16, q17, [x0, #256]
+    stp q18, q19, [x0, #288]
+    stp q20, q21, [x0, #320]
+    stp q22, q23, [x0, #352]
+    stp q24, q25, [x0, #384]
+    stp q26, q27, [x0, #416]
+    stp q28, q29, [x0, #448]
+    stp q30, q31, [x0, #480]
+    mrs x1, fpsr
+    str w1, [x0, #FPSIMD_FPSR]
+    mrs x1, fpcr
+    str w1, [x0, #FPSIMD_FPCR]
+    ret
+
+// Function: fpsimd_load_state(const fpsimd_state_t* state)
+// x0 = 16-byte aligned state area
+.global fpsimd_load_state
+fpsimd_load_state:
+    ldp q0, q1, [x0, #0]
+    ldp q2, q3, [x0, #32]
+    ldp q4, q5, [x0, #64]
+    ldp q6, q7, [x0, #96]
+    ldp q8, q9, [x0, #128]
+    ldp q10, q11, [x0, #160]
+    ldp q12, q13, [x0, #192]
+    ldp q14, q15, [x0, #224]
+    ldp q16, q17, [x0, #256]
+    ldp q18, q19, [x0, #288]
+    ldp q20, q21, [x0, #320]
+    ldp q22, q23, [x0, #352]
+    ldp q24, q25, [x0, #384]
+    ldp q26, q27, [x0, #416]
+    ldp q28, q29, [x0, #448]
+    ldp q30, q31, [x0, #480]
+    ldr w1, [x0, #FPSIMD_FPSR]
+    msr fpsr, x1
+    ldr w1, [x0, #FPSIMD_FPCR]
+    msr fpcr, x1
+    ret
@@ -0,0 +1,118 @@
+// GICv2 Interrupt Controller Driver
+// Save as: ~/OS_proj/src/gic.c
+
+#include <stdint.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+
+// GICv2 base addresses for ARM Virt machine
+#define GICD_BASE       0x08000000
+#define GICC_BASE       0x08010000
+
+// Distributor registers
+#define GICD_CTLR       ((volatile uint32_t*)(GICD_BASE + 0x000))
+#define GICD_TYPER      ((volatile uint32_t*)(GICD_BASE + 0x004))
+#define GICD_ISENABLER  ((volatile uint32_t*)(GICD_BASE + 0x100))
+#define GICD_ICENABLER  ((volatile uint32_t*)(GICD_BASE + 0x180))
+#define GICD_ICPENDR    ((volatile uint32_t*)(GICD_BASE + 0x280))
+#define GICD_IPRIORITYR ((volatile uint8_t*)(GICD_BASE + 0x400))
+#define GICD_ITARGETSR  ((volatile uint8_t*)(GICD_BASE + 0x800))
+#define GICD_ICFGR      ((volatile uint32_t*)(GICD_BASE + 0xC00))
+#define GICD_SGIR       ((volatile uint32_t*)(GICD_BASE + 0xF00))
+
+// CPU interface registers
+#define GICC_CTLR       ((volatile uint32_t*)(GICC_BASE + 0x000))
+#define GICC_PMR        ((volatile uint32_t*)(GICC_BASE + 0x004))
+#define GICC_BPR        ((volatile uint32_t*)(GICC_BASE + 0x008))
+#define GICC_IAR        ((volatile uint32_t*)(GICC_BASE + 0x00C))
+#define GICC_EOIR       ((volatile uint32_t*)(GICC_BASE + 0x010))
+
+#define GIC_PRIORITY_DEFAULT    0xA0
+#define GIC_PRIORITY_MASK       0xF0    // Accept everything above this
+#define GIC_SPI_START           32
+#define GIC_NR_SGIS             16
+#define GICD_SGIR_TARGET_SHIFT  16
+
+static uint32_t gic_num_irqs = 0;
+
+// Per-CPU part: SGI/PPI registers are banked, as is the CPU interface.
+// Every CPU calls this (secondaries from secondary_main).
+void init_gic_cpu(void) {
+    for (uint32_t i = 0; i < GIC_SPI_START; i++) {
+        GICD_IPRIORITYR[i] = GIC_PRIORITY_DEFAULT;
+    }
+
+    // SGIs carry IPIs, PPIs are enabled by their drivers (timer)
+    *GICD_ISENABLER = (1U << GIC_NR_SGIS) - 1;
+
+    // CPU interface: no preemption grouping, accept all priorities
+    *GICC_PMR = GIC_PRIORITY_MASK;
+    *GICC_BPR = 0;
+    *GICC_CTLR = 1;
+}
+
+// Initialize distributor and the boot CPU's interface
+void init_gic(void) {
+    uart_puts("Initializing GICv2...\n");
+
+    *GICD_CTLR = 0;
+
+    gic_num_irqs = 32 * ((*GICD_TYPER & 0x1F) + 1);
+    if (gic_num_irqs > 1020) {
+        gic_num_irqs = 1020;
+    }
+
+    // Everything disabled, not pending, default priority
+    for (uint32_t i = 0; i < gic_num_irqs / 32; i++) {
+        GICD_ICENABLER[i] = 0xFFFFFFFF;
+        GICD_ICPENDR[i] = 0xFFFFFFFF;
+    }
+    for (uint32_t i = 0; i < gic_num_irqs; i++) {
+        GICD_IPRIORITYR[i] = GIC_PRIORITY_DEFAULT;
+    }
+
+    // SPIs: level triggered, routed to CPU 0
+    for (uint32_t i = GIC_SPI_START; i < gic_num_irqs; i++) {
+        GICD_ITARGETSR[i] = 0x01;
+    }
+    for (uint32_t i = GIC_SPI_START / 16; i < gic_num_irqs / 16; i++) {
+        GICD_ICFGR[i] = 0;
+    }
+
+    *GICD_CTLR = 1;
+
+    init_gic_cpu();
+
+    uart_puts("GIC ready.\n");
+}
+
+void gic_enable_irq(uint32_t irq) {
+    if (irq >= gic_num_irqs) {
+        return;
+    }
+    GICD_ISENABLER[irq / 32] = 1U << (irq % 32);
+}
+
+void gic_disable_irq(uint32_t irq) {
+    if (irq >= gic_num_irqs) {
+        return;
+    }
+    GICD_ICENABLER[irq / 32] = 1U << (irq % 32);
+}
+
+// Returns the raw IAR value; the interrupt ID is in bits [9:0]
+uint32_t gic_acknowledge_irq(void) {
+    return *GICC_IAR;
+}
+
+void gic_end_of_irq(uint32_t iar) {
+    *GICC_EOIR = iar;
+}
+
+// Raise SGI `sgi` on every CPU in cpu_mask (bit n = CPU interface n)
+void gic_send_sgi(uint32_t cpu_mask, uint32_t sgi) {
+    // Order the caller's memory writes before the interrupt is seen
+    asm volatile("dsb ishst" ::: "memory");
+    *GICD_SGIR = ((cpu_mask & 0xFF) << GICD_SGIR_TARGET_SHIFT) | (sgi & 0xF);
+}
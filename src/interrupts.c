@@ -3,77 +3,314 @@
 
 #include <stdint.h>
 
-// External UART functions from kernel.c
+// External UART functions
 extern void uart_puts(const char* str);
+extern void uart_flush(void);
 
-// Timer control bits
-#define TIMER_CTRL_ENABLE    (1 << 0)
-#define TIMER_CTRL_IMASK     (1 << 1)
-#define TIMER_CTRL_ISTATUS   (1 << 2)
+// External GIC and scheduler functions
+extern uint32_t gic_acknowledge_irq(void);
+extern void gic_end_of_irq(uint32_t iar);
+extern int scheduler_need_resched(void);
+extern void schedule(void);
 
-// Global tick counter
+// External trace functions
+extern volatile uint32_t trace_mask;
+extern void trace_event(uint32_t event, uint64_t a, uint64_t b);
+#define TRACE_IRQ_ENTRY     5
+#define TRACE_IRQ_EXIT      6
+#define TRACE_SYSCALL       7
+#define trace_point(event, a, b) \
+    do { if (trace_mask & (1U << (event))) trace_event((event), (a), (b)); } while (0)
+
+// External FP/SIMD functions
+extern int fpsimd_trap(void);
+
+// External system call and process functions
+extern uint64_t syscall_dispatch(uint64_t nr, const uint64_t* args);
+extern void process_exit(int status);
+
+// External address space functions
+extern int mm_handle_fault(uint64_t far);
+
+#define MAX_IRQS        1020
+#define IRQ_SPURIOUS    1020    // IDs 1020-1023 are special/spurious
+
+// ESR_EL1 exception classes
+#define ESR_EC_SHIFT    26
+#define ESR_EC_MASK     0x3F
+#define ESR_EC_UNKNOWN  0x00    // Undefined instruction
+#define ESR_EC_FP       0x07    // FP/SIMD access trapped by CPACR_EL1
+#define ESR_EC_SVC64    0x15    // SVC from AArch64
+#define ESR_EC_IABT_LOW 0x20    // Instruction abort from EL0
+#define ESR_EC_IABT_CUR 0x21    // Instruction abort from EL1
+#define ESR_EC_PC_ALIGN 0x22
+#define ESR_EC_DABT_LOW 0x24    // Data abort from EL0
+#define ESR_EC_DABT_CUR 0x25    // Data abort from EL1
+#define ESR_EC_SP_ALIGN 0x26
+#define ESR_EC_BRK64    0x3C
+#define ESR_EC_COUNT    64
+#define ESR_ISS_IMM16   0xFFFF
+#define ESR_ISS_WNR     (1UL << 6)  // Data abort on a write
+#define ESR_ISS_DFSC    0x3C        // Fault status, without the level
+#define DFSC_TRANSLATION 0x04       // Translation fault, levels 0-3
+
+// SVC immediate that does nothing, for timing exception entry and return
+#define SVC_NULL        0xFFFF
+
+// SPSR_EL1.M: exception level and stack the exception came from
+#define SPSR_MODE_MASK  0xF
+#define SPSR_MODE_EL0T  0x0
+
+// Exit status of an EL0 task killed by a fatal exception
+#define EXIT_FAULT      (-1)
+
+// Trap frame built by kernel_entry in exceptions.s
+typedef struct pt_regs {
+    uint64_t regs[31];          // x0-x30
+    uint64_t sp;                // SP_EL0
+    uint64_t pc;                // ELR_EL1
+    uint64_t pstate;            // SPSR_EL1
+} pt_regs_t;
+
+// Synchronous exception handler for one ESR_EL1.EC value
+typedef void (*sync_handler_t)(pt_regs_t* regs, uint64_t esr);
+
+// Registered interrupt handlers, indexed by GIC interrupt ID
+static void (*irq_handlers[MAX_IRQS])(void);
+
+// Global IRQ counter
 static volatile uint64_t system_ticks = 0;
 
-// Initialize a simple timer (without actual timer for now)
-void init_timer(void) {
-    uart_puts("Timer system initialized (basic mode).\n");
-    // For now, we'll just set up the framework
-    // Real timer setup will come later when we have proper GIC setup
+void handle_syscall(pt_regs_t* regs, uint64_t esr);
+
+// Install a handler for a GIC interrupt ID
+void register_irq_handler(uint32_t irq, void (*handler)(void)) {
+    if (irq < MAX_IRQS) {
+        irq_handlers[irq] = handler;
+    }
 }
 
-// Exception handler
-void handle_exception(void) {
-    uart_puts("Exception occurred!\n");
-    
-    // Read exception syndrome register
-    uint64_t esr;
-    asm volatile("mrs %0, esr_el1" : "=r"(esr));
-    
-    // Read faulting address register  
+static void print_hex(uint64_t value) {
+    char buffer[19];
+    buffer[0] = '0';
+    buffer[1] = 'x';
+    for (int i = 0; i < 16; i++) {
+        int digit = (value >> ((15 - i) * 4)) & 0xF;
+        buffer[2 + i] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+    }
+    buffer[18] = '\0';
+    uart_puts(buffer);
+}
+
+static uint64_t read_far(void) {
     uint64_t far;
     asm volatile("mrs %0, far_el1" : "=r"(far));
+    return far;
+}
+
+static void print_reg(const char* name, uint64_t value) {
+    uart_puts(name);
+    print_hex(value);
+}
+
+// Dump the interrupted context, four registers to a line
+static void show_regs(const pt_regs_t* regs) {
+    static const char* const names[31] = {
+        " x0: ", " x1: ", " x2: ", " x3: ", " x4: ", " x5: ", " x6: ", " x7: ",
+        " x8: ", " x9: ", "x10: ", "x11: ", "x12: ", "x13: ", "x14: ", "x15: ",
+        "x16: ", "x17: ", "x18: ", "x19: ", "x20: ", "x21: ", "x22: ", "x23: ",
+        "x24: ", "x25: ", "x26: ", "x27: ", "x28: ", " fp: ", " lr: ",
+    };
     
-    // Print some debug info
-    uart_puts("ESR_EL1: ");
-    // Simple hex print for debugging
-    char buffer[20];
-    for (int i = 15; i >= 0; i--) {
-        int digit = (esr >> (i * 4)) & 0xF;
-        buffer[15-i] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+    print_reg(" pc: ", regs->pc);
+    print_reg("  pstate: ", regs->pstate);
+    print_reg("  sp_el0: ", regs->sp);
+    print_reg("  sp: ", (uint64_t)(regs + 1));
+    uart_puts("\n");
+    for (int i = 0; i < 31; i++) {
+        print_reg(names[i], regs->regs[i]);
+        uart_puts((i % 4 == 3 || i == 30) ? "\n" : "  ");
     }
-    buffer[16] = '\n';
-    buffer[17] = '\0';
-    uart_puts(buffer);
+}
+
+static int from_user(const pt_regs_t* regs) {
+    return (regs->pstate & SPSR_MODE_MASK) == SPSR_MODE_EL0T;
+}
+
+// Report a fatal exception with its full context. A fault at EL0 kills
+// the task; one in the kernel stops this CPU. Returning would re-run
+// the faulting instruction forever.
+static void die(const char* what, pt_regs_t* regs, uint64_t esr) {
+    asm volatile("msr daifset, #2");
+    uart_puts("\n*** ");
+    uart_puts(what);
+    uart_puts(from_user(regs) ? " (EL0)" : " (EL1)");
+    uart_puts(" ***\n");
+    print_reg("ESR_EL1: ", esr);
+    print_reg("  FAR_EL1: ", read_far());
+    uart_puts("\n");
+    show_regs(regs);
+    if (from_user(regs)) {
+        uart_puts("Killing task.\n");
+        process_exit(EXIT_FAULT);
+    }
+    uart_puts("CPU halted.\n");
+    uart_flush();
+    while (1) {
+        asm volatile("wfi");
+    }
+}
+
+static void do_unknown(pt_regs_t* regs, uint64_t esr) {
+    die("Undefined instruction", regs, esr);
+}
+
+// First FP/SIMD use since a context switch: load the task's registers.
+// Returning without access would trap again at once, so a task whose
+// register state cannot be allocated goes the way of a fatal fault.
+static void do_fpsimd_acc(pt_regs_t* regs, uint64_t esr) {
+    if (!fpsimd_trap()) {
+        die("FP/SIMD state allocation failed", regs, esr);
+    }
+}
+
+static void do_svc(pt_regs_t* regs, uint64_t esr) {
+    if ((esr & ESR_ISS_IMM16) == SVC_NULL) {
+        return;
+    }
+    handle_syscall(regs, esr);
+}
+
+static void do_mem_abort(pt_regs_t* regs, uint64_t esr) {
+    uint32_t ec = (esr >> ESR_EC_SHIFT) & ESR_EC_MASK;
+    if (ec == ESR_EC_IABT_LOW || ec == ESR_EC_IABT_CUR) {
+        die("Instruction abort", regs, esr);
+    }
+    // Stacks are mapped on first touch (mm.c)
+    if ((esr & ESR_ISS_DFSC) == DFSC_TRANSLATION) {
+        int handled = mm_handle_fault(read_far());
+        if (handled > 0) {
+            return;
+        }
+        if (handled == -2) {
+            die("Kernel stack: reserve empty, no page to grow into", regs, esr);
+        }
+        if (handled < 0) {
+            die("Stack overflow", regs, esr);
+        }
+    }
+    die((esr & ESR_ISS_WNR) ? "Data abort on write" : "Data abort on read", regs, esr);
+}
+
+static void do_alignment(pt_regs_t* regs, uint64_t esr) {
+    uint32_t ec = (esr >> ESR_EC_SHIFT) & ESR_EC_MASK;
+    die(ec == ESR_EC_PC_ALIGN ? "PC alignment fault" : "SP alignment fault", regs, esr);
+}
+
+// BRK: report and continue after the instruction
+static void do_brk(pt_regs_t* regs, uint64_t esr) {
+    uart_puts("Breakpoint ");
+    print_hex(esr & ESR_ISS_IMM16);
+    uart_puts("\n");
+    show_regs(regs);
+    regs->pc += 4;
+}
+
+static void do_unhandled(pt_regs_t* regs, uint64_t esr) {
+    die("Unhandled exception class", regs, esr);
+}
+
+// Synchronous exception handlers, indexed by ESR_EL1.EC
+static const sync_handler_t sync_handlers[ESR_EC_COUNT] = {
+    [ESR_EC_UNKNOWN]    = do_unknown,
+    [ESR_EC_FP]         = do_fpsimd_acc,
+    [ESR_EC_SVC64]      = do_svc,
+    [ESR_EC_IABT_LOW]   = do_mem_abort,
+    [ESR_EC_IABT_CUR]   = do_mem_abort,
+    [ESR_EC_PC_ALIGN]   = do_alignment,
+    [ESR_EC_DABT_LOW]   = do_mem_abort,
+    [ESR_EC_DABT_CUR]   = do_mem_abort,
+    [ESR_EC_SP_ALIGN]   = do_alignment,
+    [ESR_EC_BRK64]      = do_brk,
+};
+
+// Synchronous exception, called from sync_handler with the trap frame
+void handle_sync(pt_regs_t* regs) {
+    uint64_t esr;
+    asm volatile("mrs %0, esr_el1" : "=r"(esr));
     
-    uart_puts("System continuing after exception...\n");
-    // Don't halt - just return and continue
+    sync_handler_t handler = sync_handlers[(esr >> ESR_EC_SHIFT) & ESR_EC_MASK];
+    if (!handler) {
+        handler = do_unhandled;
+    }
+    handler(regs, esr);
 }
 
-// IRQ handler
-void handle_irq(void) {
+// FIQ, SError, AArch32 or SP_EL0 exceptions, none of which we use
+void handle_bad_exception(pt_regs_t* regs, int type) {
+    static const char* const types[] = {
+        "Unexpected synchronous exception", "Unexpected IRQ", "FIQ", "SError",
+    };
+    uint64_t esr;
+    asm volatile("mrs %0, esr_el1" : "=r"(esr));
+    die(types[type & 3], regs, esr);
+}
+
+// IRQ handler, called from irq_handler with the trap frame
+void handle_irq(pt_regs_t* regs) {
+    (void)regs;
     system_ticks++;
-    uart_puts("IRQ received!\n");
     
-    // For now, just acknowledge we got an interrupt
-    // Real timer handling will be added later
+    uint32_t iar = gic_acknowledge_irq();
+    uint32_t irq = iar & 0x3FF;
+    
+    if (irq < IRQ_SPURIOUS) {
+        trace_point(TRACE_IRQ_ENTRY, irq, 0);
+        if (irq_handlers[irq]) {
+            irq_handlers[irq]();
+        } else {
+            uart_puts("Unhandled IRQ!\n");
+        }
+        gic_end_of_irq(iar);
+        trace_point(TRACE_IRQ_EXIT, irq, 0);
+    }
+    
+    // Preempt on the way out, after EOI so the next tick can be taken
+    // by whichever process we switch to
+    if (scheduler_need_resched()) {
+        schedule();
+    }
 }
 
-// System call handler
-void handle_syscall(void) {
-    uart_puts("System call received!\n");
-    // For now, just acknowledge the syscall
-    // Later we'll implement actual syscall functionality
+// System call from kernel code (SVC at EL1), with the caller's registers
+// in regs: number in x8, arguments in x0-x5, result back in x0. EL0
+// calls take the fast path in exceptions.s instead, which records the
+// same TRACE_SYSCALL event.
+void handle_syscall(pt_regs_t* regs, uint64_t esr) {
+    trace_point(TRACE_SYSCALL, esr & ESR_ISS_IMM16, regs->regs[8]);
+    
+    regs->regs[0] = syscall_dispatch(regs->regs[8], regs->regs);
 }
 
 // Function to enable interrupts
 void enable_interrupts(void) {
-    uart_puts("Interrupt framework ready.\n");
-    // For now, don't actually enable interrupts until we have proper setup
-    // asm volatile("msr daifclr, #2"); // Clear IRQ mask bit
-    uart_puts("(Interrupts will be enabled in future version)\n");
+    asm volatile("msr daifclr, #2"); // Clear IRQ mask bit
+    uart_puts("Interrupts enabled.\n");
 }
 
 // Function to disable interrupts  
 void disable_interrupts(void) {
     asm volatile("msr daifset, #2"); // Set IRQ mask bit
+}
+
+// Mask IRQs and return the previous DAIF state
+uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif; msr daifset, #2" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Restore DAIF state returned by irq_save
+void irq_restore(uint64_t flags) {
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
 }
\ No newline at end of file
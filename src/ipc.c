@@ -0,0 +1,393 @@
+// Synchronous IPC
+// Save as: ~/OS_proj/src/ipc.c
+//
+// L4-style rendezvous message passing between kernel processes. Nothing
+// is buffered: a message moves only when a sender and a receiver meet
+// at an endpoint, and whichever arrives first blocks there.
+//
+//   ipc_send        deliver a message, blocking until a receiver takes it
+//   ipc_receive     wait for a message; a caller's comes with a reply token
+//   ipc_call        send, then wait for the reply (the client side)
+//   ipc_reply       answer a call without blocking
+//   ipc_reply_recv  answer a call and wait for the next one (the server
+//                   loop, one operation per request)
+//
+// A message is a label plus up to IPC_MR_WORDS message registers, copied
+// once from the sender's ipc_msg_t into the receiver's; short messages
+// need nothing else. Bulk data is either copied into a buffer the
+// receiver supplies, or, with IPC_GRANT, handed over as the page block
+// itself: the receiver gets the pointer and owns the pages from then on,
+// so nothing is copied at all.
+//
+// When a sender finds a receiver waiting (or a server replies to a
+// blocked caller), it switches to it directly with sched_handoff: the
+// receiver runs next on this CPU without a trip through the run queues.
+// A call/reply round trip is two such switches.
+//
+// Waiters live on the blocked process's kernel stack. Processes must not
+// exit while blocked in IPC or holding a reply token.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External memory functions
+extern void* alloc_pages(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+extern unsigned int pages_order(size_t size);
+extern void* memcpy(void* dst, const void* src, size_t n);
+
+// External interrupt and spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern void spin_lock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+
+// External process functions
+typedef struct process process_t;
+extern process_t* get_current(void);
+extern process_t* create_process(const char* name, void (*entry_point)(void));
+extern void schedule_process(process_t* proc);
+extern void process_prepare_block(void);
+extern int process_wake(process_t* proc);
+extern void sched_handoff(process_t* next);
+extern void schedule(void);
+
+// External timer and measurement functions
+extern uint64_t timer_now_ns(void);
+extern uint64_t perf_cycles(void);
+
+#define IPC_MR_WORDS        8           // Message registers per message
+
+// ipc_msg_t flags
+#define IPC_GRANT           (1U << 0)   // buf is a page block handed to the receiver
+#define IPC_TRUNCATED       (1U << 1)   // Copied data did not fit the receive buffer
+
+#define IPC_BENCH_BYTES     (16UL << 20)    // Payload moved per size, to pick the round count
+#define IPC_BENCH_MAX       (1UL << 20)
+#define IPC_BENCH_ROUNDS    10000
+#define IPC_BENCH_MIN       16
+#define IPC_BENCH_STOP      0xFFFF          // Label that ends the server
+
+typedef struct ipc_waiter* ipc_reply_t;
+
+// A message. For a receive, buf/len give the buffer copied data may use
+// (len is its capacity, the copied length on return). For a call, the
+// reply lands in the same message, its data in buf up to len bytes.
+typedef struct ipc_msg {
+    uint64_t label;
+    uint32_t nr_words;              // Message registers in use
+    uint32_t flags;
+    uint64_t mr[IPC_MR_WORDS];
+    void* buf;                      // Bulk data
+    size_t len;
+    ipc_reply_t reply;              // Set by receive: token for ipc_reply, NULL for a send
+} ipc_msg_t;
+
+// A process blocked at an endpoint, or a caller waiting for its reply
+typedef struct ipc_waiter {
+    process_t* proc;
+    ipc_msg_t* msg;
+    int call;                       // Sender: also waits for a reply
+    struct ipc_waiter* next;
+} ipc_waiter_t;
+
+// Rendezvous point. At most one of the queues is non-empty.
+typedef struct ipc_endpoint {
+    spinlock_t lock;
+    ipc_waiter_t* senders;
+    ipc_waiter_t* senders_tail;
+    ipc_waiter_t* receivers;
+    ipc_waiter_t* receivers_tail;
+} ipc_endpoint_t;
+
+void ipc_endpoint_init(ipc_endpoint_t* ep) {
+    ep->lock.lock = 0;
+    ep->senders = NULL;
+    ep->senders_tail = NULL;
+    ep->receivers = NULL;
+    ep->receivers_tail = NULL;
+}
+
+static void waiter_push(ipc_waiter_t** head, ipc_waiter_t** tail, ipc_waiter_t* w) {
+    w->next = NULL;
+    if (*tail) {
+        (*tail)->next = w;
+    } else {
+        *head = w;
+    }
+    *tail = w;
+}
+
+static ipc_waiter_t* waiter_pop(ipc_waiter_t** head, ipc_waiter_t** tail) {
+    ipc_waiter_t* w = *head;
+    if (w) {
+        *head = w->next;
+        if (!*head) {
+            *tail = NULL;
+        }
+    }
+    return w;
+}
+
+// Copy src into dst: the label and registers, then the bulk data by
+// reference (IPC_GRANT) or by copy into dst's buffer
+static void ipc_deliver(const ipc_msg_t* src, ipc_msg_t* dst) {
+    uint32_t words = src->nr_words < IPC_MR_WORDS ? src->nr_words : IPC_MR_WORDS;
+    dst->label = src->label;
+    dst->nr_words = words;
+    for (uint32_t i = 0; i < words; i++) {
+        dst->mr[i] = src->mr[i];
+    }
+
+    if (src->flags & IPC_GRANT) {
+        dst->buf = src->buf;
+        dst->len = src->len;
+        dst->flags = IPC_GRANT;
+        return;
+    }
+
+    size_t len = src->len < dst->len ? src->len : dst->len;
+    if (len) {
+        memcpy(dst->buf, src->buf, len);
+    }
+    dst->flags = len < src->len ? IPC_TRUNCATED : 0;
+    dst->len = len;
+}
+
+static void ipc_send_common(ipc_endpoint_t* ep, ipc_msg_t* msg, int call) {
+    uint64_t flags = irq_save();
+    ipc_waiter_t self = { get_current(), msg, call, NULL };
+
+    spin_lock(&ep->lock);
+    ipc_waiter_t* rx = waiter_pop(&ep->receivers, &ep->receivers_tail);
+    if (rx) {
+        // Rendezvous: hand the message and the CPU to the receiver. A
+        // plain sender stays runnable, a caller waits for the reply.
+        spin_unlock(&ep->lock);
+        ipc_deliver(msg, rx->msg);
+        rx->msg->reply = call ? &self : NULL;
+        if (call) {
+            process_prepare_block();
+        }
+        sched_handoff(rx->proc);
+    } else {
+        waiter_push(&ep->senders, &ep->senders_tail, &self);
+        process_prepare_block();
+        spin_unlock(&ep->lock);
+        schedule();
+    }
+
+    // Back once the message is taken, or for a call, the reply is in
+    irq_restore(flags);
+}
+
+void ipc_send(ipc_endpoint_t* ep, const ipc_msg_t* msg) {
+    ipc_send_common(ep, (ipc_msg_t*)msg, 0);
+}
+
+void ipc_call(ipc_endpoint_t* ep, ipc_msg_t* msg) {
+    ipc_send_common(ep, msg, 1);
+}
+
+// Take the message of a sender popped off an endpoint. A plain sender
+// is done and becomes runnable; a caller stays blocked for the reply.
+// The copy is made after ep->lock is dropped: nobody else can reach tx.
+static void ipc_accept(ipc_waiter_t* tx, ipc_msg_t* msg) {
+    ipc_deliver(tx->msg, msg);
+    msg->reply = tx->call ? tx : NULL;
+    if (!tx->call) {
+        process_wake(tx->proc);
+    }
+}
+
+void ipc_receive(ipc_endpoint_t* ep, ipc_msg_t* msg) {
+    uint64_t flags = irq_save();
+
+    spin_lock(&ep->lock);
+    ipc_waiter_t* tx = waiter_pop(&ep->senders, &ep->senders_tail);
+    if (tx) {
+        spin_unlock(&ep->lock);
+        ipc_accept(tx, msg);
+        irq_restore(flags);
+        return;
+    }
+
+    ipc_waiter_t self = { get_current(), msg, 0, NULL };
+    waiter_push(&ep->receivers, &ep->receivers_tail, &self);
+    process_prepare_block();
+    spin_unlock(&ep->lock);
+    schedule();
+    irq_restore(flags);
+}
+
+// Answer the call behind reply. The token is used up.
+void ipc_reply(ipc_reply_t reply, const ipc_msg_t* msg) {
+    ipc_deliver(msg, reply->msg);
+    process_wake(reply->proc);
+}
+
+// Answer the call behind reply and wait at ep for the next message. If
+// none is queued, the caller gets this CPU directly.
+void ipc_reply_recv(ipc_endpoint_t* ep, ipc_reply_t reply, const ipc_msg_t* out, ipc_msg_t* in) {
+    uint64_t flags = irq_save();
+    ipc_deliver(out, reply->msg);
+    process_t* caller = reply->proc;
+
+    spin_lock(&ep->lock);
+    ipc_waiter_t* tx = waiter_pop(&ep->senders, &ep->senders_tail);
+    if (tx) {
+        // More work queued: keep the CPU, the caller goes to a run queue
+        spin_unlock(&ep->lock);
+        process_wake(caller);
+        ipc_accept(tx, in);
+        irq_restore(flags);
+        return;
+    }
+
+    ipc_waiter_t self = { get_current(), in, 0, NULL };
+    waiter_push(&ep->receivers, &ep->receivers_tail, &self);
+    process_prepare_block();
+    spin_unlock(&ep->lock);
+    sched_handoff(caller);
+    irq_restore(flags);
+}
+
+// Ping-pong benchmark: this process calls a server that replies at once,
+// moving the payload one way per round trip. Up to IPC_MR_WORDS words go
+// in message registers; larger payloads are copied into the server's
+// buffer, and from a page up also granted (the pages go to the server
+// and come back in the reply).
+
+static ipc_endpoint_t bench_ep;
+static uint8_t* bench_rx;                  // Server's receive buffer
+
+static void ipc_bench_server(void) {
+    ipc_msg_t in;
+    in.buf = bench_rx;
+    in.len = IPC_BENCH_MAX;
+    ipc_receive(&bench_ep, &in);
+
+    while (1) {
+        // Echo the registers; granted pages go back to the client
+        ipc_msg_t out;
+        out.label = 0;
+        out.nr_words = in.nr_words;
+        for (uint32_t i = 0; i < in.nr_words; i++) {
+            out.mr[i] = in.mr[i];
+        }
+        out.flags = in.flags & IPC_GRANT;
+        out.buf = in.buf;
+        out.len = (in.flags & IPC_GRANT) ? in.len : 0;
+
+        if (in.label == IPC_BENCH_STOP) {
+            ipc_reply(in.reply, &out);
+            return;
+        }
+        ipc_reply_t reply = in.reply;
+        in.buf = bench_rx;
+        in.len = IPC_BENCH_MAX;
+        ipc_reply_recv(&bench_ep, reply, &out, &in);
+    }
+}
+
+static void ipc_bench_run(const char* mode, size_t size, uint8_t* payload, uint32_t flags) {
+    uint64_t rounds = IPC_BENCH_BYTES / size;
+    if (rounds > IPC_BENCH_ROUNDS) {
+        rounds = IPC_BENCH_ROUNDS;
+    }
+    if (rounds < IPC_BENCH_MIN) {
+        rounds = IPC_BENCH_MIN;
+    }
+
+    ipc_msg_t msg;
+    uint64_t start_ns = timer_now_ns();
+    uint64_t start = perf_cycles();
+    for (uint64_t i = 0; i < rounds; i++) {
+        msg.label = 1;
+        msg.flags = flags;
+        if (size <= IPC_MR_WORDS * sizeof(uint64_t)) {
+            msg.nr_words = (uint32_t)(size / sizeof(uint64_t));
+            for (uint32_t w = 0; w < msg.nr_words; w++) {
+                msg.mr[w] = i + w;
+            }
+            msg.len = 0;
+        } else {
+            msg.nr_words = 0;
+            msg.buf = payload;
+            msg.len = size;
+        }
+        ipc_call(&bench_ep, &msg);
+    }
+    uint64_t cycles = perf_cycles() - start;
+    uint64_t elapsed_ns = timer_now_ns() - start_ns;
+
+    uart_puts("  ");
+    print_decimal(size);
+    uart_puts("B ");
+    uart_puts(mode);
+    uart_puts(": ");
+    print_decimal(cycles / rounds);
+    uart_puts(" cycles/round trip, ");
+    print_decimal(size * rounds * 1000000ULL / (elapsed_ns ? elapsed_ns : 1) * 1000);
+    uart_puts(" bytes/s\n");
+}
+
+// Runs as a process (run_benchmarks)
+void benchmark_ipc(void) {
+    static const size_t sizes[] = {
+        8, 64, 512, 4096, 65536, 1UL << 20,
+    };
+    unsigned int order = pages_order(IPC_BENCH_MAX);
+    uint8_t* payload = (uint8_t*)alloc_pages(order);
+    bench_rx = (uint8_t*)alloc_pages(order);
+    if (!payload || !bench_rx) {
+        uart_puts("IPC benchmark: out of memory\n");
+        if (payload) {
+            free_pages(payload, order);
+        }
+        if (bench_rx) {
+            free_pages(bench_rx, order);
+        }
+        return;
+    }
+
+    ipc_endpoint_init(&bench_ep);
+    process_t* server = create_process("ipc_server", ipc_bench_server);
+    if (!server) {
+        free_pages(payload, order);
+        free_pages(bench_rx, order);
+        return;
+    }
+    schedule_process(server);
+
+    uart_puts("IPC ping-pong (call + reply):\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t size = sizes[s];
+        if (size <= IPC_MR_WORDS * sizeof(uint64_t)) {
+            ipc_bench_run("registers", size, payload, 0);
+            continue;
+        }
+        ipc_bench_run("copy", size, payload, 0);
+        if (size >= 4096) {
+            ipc_bench_run("grant", size, payload, IPC_GRANT);
+        }
+    }
+
+    ipc_msg_t stop;
+    stop.label = IPC_BENCH_STOP;
+    stop.nr_words = 0;
+    stop.flags = 0;
+    stop.len = 0;
+    ipc_call(&bench_ep, &stop);
+
+    free_pages(payload, order);
+    free_pages(bench_rx, order);
+}
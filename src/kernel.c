@@ -3,76 +3,117 @@
 
 #include <stdint.h>
 
-// UART0 base address for ARM Virt machine
-#define UART0_BASE 0x09000000
-#define UART0_DR   ((volatile uint32_t*)(UART0_BASE + 0x00))
-#define UART0_FR   ((volatile uint32_t*)(UART0_BASE + 0x18))
+// External UART functions
+extern void init_uart(void);
+extern void uart_enable_irq(void);
+extern void uart_puts(const char* str);
 
-// Simple UART functions
-void uart_putc(char c) {
-    // Wait until transmit FIFO is not full
-    while (*UART0_FR & (1 << 5));
-    *UART0_DR = c;
-}
-
-void uart_puts(const char* str) {
-    while (*str) {
-        if (*str == '\n') {
-            uart_putc('\r');
-        }
-        uart_putc(*str++);
-    }
-}
+// External atomics functions
+extern void init_atomics(void);
 
 // External memory management functions
 extern void init_memory(void);
 extern void test_memory(void);
 
+// External FP/SIMD functions
+extern void init_fpsimd(void);
+
+// External trace functions
+extern void init_trace(void);
+
+// External system call functions
+extern void init_syscalls(void);
+
+// External address space functions
+extern void init_mm(void);
+extern void init_vdso(void);
+
+// External measurement functions
+extern void measure_boot_costs(void);
+extern void benchmark_string(void);
+
 // External process management functions
 extern void init_process_manager(void);
+extern void benchmark_yield(void);
 extern void test_processes(void);
 
-// External timer functions
-extern void init_software_timer(void);
-extern void software_timer_tick(void);
+// External interrupt and timer functions
+extern void init_gic(void);
+extern void init_timer(void);
+extern void enable_interrupts(void);
+
+// External SMP functions
+extern void init_smp(void);
+
+// External benchmark functions
+extern void bench_main(void);
 
 // Kernel main function
 void kernel_main(void) {
+    // Buffered console first, everything below prints
+    init_uart();
+    
     uart_puts("Hello from your ARM64 OS!\n");
     uart_puts("Kernel successfully booted.\n");
     uart_puts("System ready for development.\n");
     
+    // Pick LL/SC or LSE atomics before anything takes a lock
+    init_atomics();
+    
     // Initialize memory management
     uart_puts("\n=== Memory Management Setup ===\n");
     init_memory();
+    init_fpsimd();
+    init_trace();
+    init_mm();
+    init_syscalls();
+    init_vdso();
     
+#ifndef CONFIG_BENCH
     // Test memory allocation
     uart_puts("\n=== Memory Allocation Test ===\n");
     test_memory();
     
+    // Time allocator and context switch hot paths
+    uart_puts("\n=== Boot Cost Measurements ===\n");
+    measure_boot_costs();
+    benchmark_string();
+#endif
+    
     // Initialize process management
     uart_puts("\n=== Process Management Setup ===\n");
     init_process_manager();
+#ifndef CONFIG_BENCH
+    benchmark_yield();
+#endif
+    
+    // Initialize interrupt controller and timer tick
+    uart_puts("\n=== Interrupt and Timer Setup ===\n");
+    init_gic();
+    init_timer();
+    uart_enable_irq();
+    enable_interrupts();
     
-    // Initialize software timer
-    uart_puts("\n=== Timer Setup ===\n");
-    init_software_timer();
+#ifdef CONFIG_BENCH
+    // `make bench`: one CPU, no demo processes, powers off when done
+    uart_puts("\n=== Benchmarks ===\n");
+    bench_main();
+#else
+    // Start the other CPUs, they idle until there is work
+    uart_puts("\n=== SMP Setup ===\n");
+    init_smp();
     
     // Test process creation and start multitasking
     uart_puts("\n=== Starting Multitasking OS ===\n");
     test_processes();
+#endif
     
     // Should never reach here if processes are running
     uart_puts("WARNING: Returned from process management!\n");
-    uart_puts("Starting timer-based kernel loop...\n");
     
-    // Timer-driven kernel loop for process switching
+    // Nothing to run, sleep until the next interrupt
     while (1) {
-        // Software timer tick for process scheduling
-        software_timer_tick();
-        
-        // Small delay to prevent overwhelming output
-        for (volatile int i = 0; i < 10000; i++);
+        asm volatile("wfi");
     }
 }
 
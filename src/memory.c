@@ -7,24 +7,86 @@
 // External UART functions
 extern void uart_puts(const char* str);
 extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External page allocator functions
+extern void init_page_alloc(void);
+extern void* alloc_pages(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+extern unsigned int pages_order(size_t size);
+extern unsigned int page_alloc_order(const void* addr);
+extern void print_page_stats(void);
+
+// External trace functions
+extern volatile uint32_t trace_mask;
+extern void trace_event(uint32_t event, uint64_t a, uint64_t b);
+#define TRACE_ALLOC         3
+#define TRACE_FREE          4
+#define trace_point(event, a, b) \
+    do { if (trace_mask & (1U << (event))) trace_event((event), (a), (b)); } while (0)
+
+// External string functions
+extern void* memset(void* dst, int c, size_t n);
+
+// External slab functions
+extern void init_slab(void);
+extern int slab_owns(const void* ptr);
+extern void* kmalloc_small(size_t size);
+extern void kfree_small(void* ptr);
+extern void kmem_cache_print_stats(void);
+
+// External spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern uint64_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags);
 
 // Memory layout definitions
 #define KERNEL_START    0x40080000
-#define HEAP_START      0x40200000  // Start heap at 2MB mark
+#define HEAP_ORDER      11          // 2^11 pages from the page allocator
 #define HEAP_SIZE       0x00800000  // 8MB heap
-#define HEAP_END        (HEAP_START + HEAP_SIZE)
+#define SLAB_MAX_SIZE   1024        // Larger requests use the first-fit list
+#define KMALLOC_PAGE_MIN 0x4000     // 16KB and up comes straight from pages
 
-// Simple block header for heap management
+// TLSF (two-level segregated fit) parameters
+#define ALIGN_SIZE_LOG2     4           // 16-byte payload alignment
+#define ALIGN_SIZE          (1UL << ALIGN_SIZE_LOG2)
+#define SL_INDEX_COUNT_LOG2 4           // 16 second-level lists per class
+#define SL_INDEX_COUNT      (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_MAX        24          // Blocks up to 16MB
+#define FL_INDEX_SHIFT      (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT      (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE    (1UL << FL_INDEX_SHIFT)
+
+// Block flags, kept in the low bits of size
+#define BLOCK_FREE          0x1UL
+#define BLOCK_PREV_FREE     0x2UL
+#define BLOCK_FLAG_MASK     (ALIGN_SIZE - 1)
+
+// Block header with boundary tag. The free list links are only valid
+// while the block is free and overlap the payload otherwise.
 typedef struct block_header {
-    size_t size;              // Size of this block (including header)
-    int is_free;             // 1 if free, 0 if allocated
-    struct block_header* next; // Next block in the list
+    struct block_header* prev_phys;  // Previous block in memory
+    size_t size;                     // Payload size | flags
+    struct block_header* next_free;  // Next block in the same free list
+    struct block_header* prev_free;  // Previous block in the same free list
 } block_header_t;
 
+#define BLOCK_OVERHEAD      offsetof(block_header_t, next_free)
+#define BLOCK_SIZE_MIN      (sizeof(block_header_t) - BLOCK_OVERHEAD)
+#define BLOCK_SIZE_MAX      ((1UL << FL_INDEX_MAX) - ALIGN_SIZE)
+
 // Global heap state
 static block_header_t* heap_start = NULL;
-static uint8_t* heap_memory = (uint8_t*)HEAP_START;
+static uint8_t* heap_memory = NULL;
 static size_t heap_initialized = 0;
+static spinlock_t heap_lock;         // TLSF state, all CPUs
+
+// Free list index: first level bitmap, second level bitmaps, list heads
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[FL_INDEX_COUNT];
+static block_header_t* free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
 
 // Simple utility functions
 static void print_hex(uint64_t value) {
@@ -36,98 +98,401 @@ static void print_hex(uint64_t value) {
     }
 }
 
-static void print_decimal(uint64_t value) {
-    if (value == 0) {
-        uart_putc('0');
-        return;
+// Block helpers
+static inline size_t block_size(const block_header_t* block) {
+    return block->size & ~BLOCK_FLAG_MASK;
+}
+
+static inline int block_is_free(const block_header_t* block) {
+    return (block->size & BLOCK_FREE) != 0;
+}
+
+static inline block_header_t* block_from_ptr(void* ptr) {
+    return (block_header_t*)((uint8_t*)ptr - BLOCK_OVERHEAD);
+}
+
+static inline void* block_to_ptr(block_header_t* block) {
+    return (uint8_t*)block + BLOCK_OVERHEAD;
+}
+
+static inline block_header_t* block_next(block_header_t* block) {
+    return (block_header_t*)((uint8_t*)block_to_ptr(block) + block_size(block));
+}
+
+// Map a size to its free list (rounding down, for insertion)
+static void mapping_insert(size_t size, int* fli, int* sli) {
+    int fl, sl;
+    if (size < SMALL_BLOCK_SIZE) {
+        fl = 0;
+        sl = (int)(size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT));
+    } else {
+        fl = 63 - __builtin_clzl(size);
+        sl = (int)(size >> (fl - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+        fl -= FL_INDEX_SHIFT - 1;
     }
-    
-    char buffer[20];
-    int pos = 0;
-    
-    while (value > 0 && pos < 19) {
-        buffer[pos++] = '0' + (value % 10);
-        value /= 10;
+    *fli = fl;
+    *sli = sl;
+}
+
+// Map a size to the first list whose blocks are all large enough
+static void mapping_search(size_t size, int* fli, int* sli) {
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += (1UL << ((63 - __builtin_clzl(size)) - SL_INDEX_COUNT_LOG2)) - 1;
     }
-    
-    // Print in reverse order
-    for (int i = pos - 1; i >= 0; i--) {
-        uart_putc(buffer[i]);
+    mapping_insert(size, fli, sli);
+}
+
+static void insert_free_block(block_header_t* block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free) {
+        block->next_free->prev_free = block;
+    }
+    free_lists[fl][sl] = block;
+
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+static void remove_free_block(block_header_t* block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl]) {
+            fl_bitmap &= ~(1U << fl);
+        }
     }
 }
 
+// Find a free block of at least size bytes in constant time
+static block_header_t* search_suitable_block(size_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_INDEX_COUNT) {
+        return NULL;
+    }
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        // Nothing in this class, move to the next non-empty one
+        uint32_t fl_map = (fl + 1 < 32) ? fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    return free_lists[fl][sl];
+}
+
+// Mark a block free/used and keep the next block's boundary tag in sync
+static void block_mark_free(block_header_t* block) {
+    block_header_t* next = block_next(block);
+    next->prev_phys = block;
+    next->size |= BLOCK_PREV_FREE;
+    block->size |= BLOCK_FREE;
+}
+
+static void block_mark_used(block_header_t* block) {
+    block_header_t* next = block_next(block);
+    next->size &= ~BLOCK_PREV_FREE;
+    block->size &= ~BLOCK_FREE;
+}
+
 // Initialize the heap
 void init_memory(void) {
     uart_puts("Initializing memory management...\n");
     
+    // All RAM after the kernel image is owned by the page allocator
+    init_page_alloc();
+    
+    // The byte-granular heap is one block of pages
+    heap_memory = (uint8_t*)alloc_pages(HEAP_ORDER);
+    if (!heap_memory) {
+        uart_puts("Failed to allocate heap!\n");
+        return;
+    }
+    
     // Print memory layout
     uart_puts("Kernel start: ");
     print_hex(KERNEL_START);
     uart_puts("\nHeap start: ");
-    print_hex(HEAP_START);
+    print_hex((uint64_t)heap_memory);
     uart_puts("\nHeap size: ");
     print_decimal(HEAP_SIZE / 1024);
     uart_puts(" KB\n");
     
-    // Initialize the first block (entire heap is one free block)
+    // Small objects come from slab caches
+    init_slab();
+    
+    fl_bitmap = 0;
+    for (int i = 0; i < FL_INDEX_COUNT; i++) {
+        sl_bitmap[i] = 0;
+        for (int j = 0; j < SL_INDEX_COUNT; j++) {
+            free_lists[i][j] = NULL;
+        }
+    }
+    
+    // Entire heap is one free block followed by a zero-size used sentinel
     heap_start = (block_header_t*)heap_memory;
-    heap_start->size = HEAP_SIZE - sizeof(block_header_t);
-    heap_start->is_free = 1;
-    heap_start->next = NULL;
+    heap_start->prev_phys = NULL;
+    heap_start->size = HEAP_SIZE - 2 * BLOCK_OVERHEAD;
+    
+    block_header_t* sentinel = block_next(heap_start);
+    sentinel->prev_phys = heap_start;
+    sentinel->size = 0;
+    
+    block_mark_free(heap_start);
+    insert_free_block(heap_start);
     
     heap_initialized = 1;
     uart_puts("Memory management initialized.\n");
 }
 
-// Simple malloc implementation
-void* kmalloc(size_t size) {
+// TLSF malloc: bitmap lookup, optional split, no list walks
+static void* tlsf_malloc(size_t size) {
+    // Add padding for alignment
+    size = (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+    if (size < BLOCK_SIZE_MIN) {
+        size = BLOCK_SIZE_MIN;
+    }
+    
+    block_header_t* block = search_suitable_block(size);
+    if (!block) {
+        return NULL; // No suitable block found
+    }
+    remove_free_block(block);
+    
+    // Split off the tail if it can hold a block of its own
+    size_t total = block_size(block);
+    if (total >= size + sizeof(block_header_t)) {
+        block_header_t* rest = (block_header_t*)((uint8_t*)block_to_ptr(block) + size);
+        rest->prev_phys = block;
+        rest->size = total - size - BLOCK_OVERHEAD;
+        block->size = size | (block->size & BLOCK_FLAG_MASK);
+        
+        block_mark_free(rest);
+        insert_free_block(rest);
+    }
+    
+    block_mark_used(block);
+    return block_to_ptr(block);
+}
+
+// TLSF free: boundary tags merge with both neighbours in O(1)
+static void tlsf_free(void* ptr) {
+    block_header_t* block = block_from_ptr(ptr);
+    if (block_is_free(block)) {
+        return; // Double free
+    }
+    
+    // Merge with the previous block
+    if (block->size & BLOCK_PREV_FREE) {
+        block_header_t* prev = block->prev_phys;
+        remove_free_block(prev);
+        prev->size += BLOCK_OVERHEAD + block_size(block);
+        block = prev;
+    }
+    
+    // Merge with the next block
+    block_header_t* next = block_next(block);
+    if (block_is_free(next)) {
+        remove_free_block(next);
+        block->size += BLOCK_OVERHEAD + block_size(next);
+    }
+    
+    block_mark_free(block);
+    insert_free_block(block);
+}
+
+// Kernel malloc: slab caches, TLSF heap or whole pages depending on size
+static void* kmalloc_any(size_t size) {
     if (!heap_initialized) {
         return NULL;
     }
     
-    // Add padding for alignment
-    size = (size + 7) & ~7;  // 8-byte alignment
+    // Small requests are O(1) from the size-class caches
+    if (size <= SLAB_MAX_SIZE) {
+        void* ptr = kmalloc_small(size);
+        if (ptr) {
+            return ptr;
+        }
+        // Slab pages exhausted, fall back to the TLSF heap
+    }
     
-    block_header_t* current = heap_start;
+    // Large requests take whole pages from the buddy allocator
+    if (size >= KMALLOC_PAGE_MIN) {
+        return alloc_pages(pages_order(size));
+    }
     
-    // First-fit allocation
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            // Found a suitable block
-            if (current->size > size + sizeof(block_header_t) + 8) {
-                // Split the block
-                block_header_t* new_block = (block_header_t*)((uint8_t*)current + sizeof(block_header_t) + size);
-                new_block->size = current->size - size - sizeof(block_header_t);
-                new_block->is_free = 1;
-                new_block->next = current->next;
-                
-                current->size = size;
-                current->next = new_block;
-            }
-            
-            current->is_free = 0;
-            return (uint8_t*)current + sizeof(block_header_t);
-        }
-        current = current->next;
+    if (size == 0 || size > BLOCK_SIZE_MAX) {
+        return NULL;
     }
     
-    return NULL; // No suitable block found
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    void* ptr = tlsf_malloc(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
 }
 
-// Simple free implementation
+void* kmalloc(size_t size) {
+    void* ptr = kmalloc_any(size);
+    trace_point(TRACE_ALLOC, (uint64_t)ptr, size);
+    return ptr;
+}
+
+// kmalloc, cleared
+void* kzalloc(size_t size) {
+    void* ptr = kmalloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// Kernel free: route the pointer back to whichever allocator owns it
 void kfree(void* ptr) {
     if (!ptr || !heap_initialized) {
         return;
     }
+    trace_point(TRACE_FREE, (uint64_t)ptr, 0);
+    
+    if (slab_owns(ptr)) {
+        kfree_small(ptr);
+        return;
+    }
+    
+    // Anything outside the heap block came from the page allocator
+    if ((uint8_t*)ptr < heap_memory || (uint8_t*)ptr >= heap_memory + HEAP_SIZE) {
+        free_pages(ptr, page_alloc_order(ptr));
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    tlsf_free(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+// Free bytes in the TLSF heap and the largest free block; external
+// fragmentation is 1 - largest / free
+void heap_free_stats(size_t* free_bytes, size_t* largest_free) {
+    size_t total = 0;
+    size_t largest = 0;
+    
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    for (block_header_t* b = heap_start; b && block_size(b) != 0; b = block_next(b)) {
+        if (block_is_free(b)) {
+            total += block_size(b);
+            if (block_size(b) > largest) {
+                largest = block_size(b);
+            }
+        }
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
     
-    block_header_t* block = (block_header_t*)((uint8_t*)ptr - sizeof(block_header_t));
-    block->is_free = 1;
+    *free_bytes = total;
+    *largest_free = largest;
+}
+
+static int heap_fail(const char* what, block_header_t* block) {
+    uart_puts("heap_check: ");
+    uart_puts(what);
+    uart_puts(" at ");
+    print_hex((uint64_t)block);
+    uart_puts("\n");
+    return 1;
+}
+
+// Walk the block chain and the free lists and check that they agree:
+// boundary tags, coalescing, list membership and bitmaps. Returns the
+// number of problems found (each is printed).
+int heap_check(void) {
+    if (!heap_initialized) {
+        return 0;
+    }
+    
+    int errors = 0;
+    size_t free_in_chain = 0;
+    size_t free_in_lists = 0;
+    uint8_t* heap_end = heap_memory + HEAP_SIZE;
+    
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    
+    // Physical chain, up to the zero-size sentinel
+    block_header_t* block = heap_start;
+    int prev_free = 0;
+    while (block_size(block) != 0) {
+        block_header_t* next = block_next(block);
+        if (block_size(block) % ALIGN_SIZE || (uint8_t*)next + BLOCK_OVERHEAD > heap_end) {
+            errors += heap_fail("bad block size", block);
+            break;
+        }
+        if (((block->size & BLOCK_PREV_FREE) != 0) != prev_free) {
+            errors += heap_fail("stale prev-free flag", block);
+        }
+        if (block_is_free(block)) {
+            if (prev_free) {
+                errors += heap_fail("adjacent free blocks", block);
+            }
+            if (next->prev_phys != block) {
+                errors += heap_fail("bad prev_phys link", next);
+            }
+            free_in_chain++;
+        }
+        prev_free = block_is_free(block);
+        block = next;
+    }
+    if ((uint8_t*)block + BLOCK_OVERHEAD != heap_end) {
+        errors += heap_fail("chain ends early", block);
+    }
     
-    // Simple coalescing with next block
-    if (block->next && block->next->is_free) {
-        block->size += block->next->size + sizeof(block_header_t);
-        block->next = block->next->next;
+    // Free lists and bitmaps
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+        if (((fl_bitmap >> fl) & 1) != (sl_bitmap[fl] != 0)) {
+            errors += heap_fail("first-level bitmap mismatch", NULL);
+        }
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+            block_header_t* head = free_lists[fl][sl];
+            if (((sl_bitmap[fl] >> sl) & 1) != (head != NULL)) {
+                errors += heap_fail("second-level bitmap mismatch", head);
+            }
+            block_header_t* prev = NULL;
+            for (block_header_t* b = head; b; b = b->next_free) {
+                int bfl, bsl;
+                mapping_insert(block_size(b), &bfl, &bsl);
+                if (!block_is_free(b) || bfl != fl || bsl != sl || b->prev_free != prev) {
+                    errors += heap_fail("bad free list entry", b);
+                    break;
+                }
+                prev = b;
+                if (++free_in_lists > free_in_chain) {
+                    break;      // Not in the chain, or a cycle
+                }
+            }
+        }
+    }
+    if (free_in_chain != free_in_lists) {
+        errors += heap_fail("free list count mismatch", NULL);
     }
+    
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return errors;
 }
 
 // Memory statistics
@@ -144,16 +509,22 @@ void print_memory_stats(void) {
     int free_blocks = 0;
     int used_blocks = 0;
     
+    size_t largest_free = 0;
+    
+    // Walk blocks in address order up to the zero-size sentinel
     block_header_t* current = heap_start;
-    while (current != NULL) {
-        if (current->is_free) {
-            total_free += current->size;
+    while (block_size(current) != 0) {
+        if (block_is_free(current)) {
+            total_free += block_size(current);
             free_blocks++;
+            if (block_size(current) > largest_free) {
+                largest_free = block_size(current);
+            }
         } else {
-            total_used += current->size;
+            total_used += block_size(current);
             used_blocks++;
         }
-        current = current->next;
+        current = block_next(current);
     }
     
     uart_puts("Free memory: ");
@@ -168,9 +539,16 @@ void print_memory_stats(void) {
     print_decimal(used_blocks);
     uart_puts(" blocks)\n");
     
+    uart_puts("Largest free block: ");
+    print_decimal(largest_free);
+    uart_puts(" bytes\n");
+    
     uart_puts("Total heap: ");
     print_decimal(HEAP_SIZE);
     uart_puts(" bytes\n");
+    
+    kmem_cache_print_stats();
+    print_page_stats();
     uart_puts("========================\n\n");
 }
 
@@ -211,5 +589,19 @@ void test_memory(void) {
     
     print_memory_stats();
     
+    // Test 5: Medium allocation bypasses the slab caches
+    void* ptr5 = kmalloc(4096);
+    uart_puts("Allocated 4096 bytes: ");
+    print_hex((uint64_t)ptr5);
+    uart_puts("\n");
+    kfree(ptr5);
+    
+    // Test 6: Large allocation comes from the page allocator
+    void* ptr6 = kmalloc(100 * 1024);
+    uart_puts("Allocated 100 KB: ");
+    print_hex((uint64_t)ptr6);
+    uart_puts("\n");
+    kfree(ptr6);
+    
     uart_puts("Memory test completed.\n");
 }
\ No newline at end of file
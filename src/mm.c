@@ -0,0 +1,852 @@
+// Per-Process Address Spaces and ASID Allocation
+// Save as: ~/OS_proj/src/mm.c
+//
+// Each EL0 task has its own translation tables, loaded into TTBR0_EL1
+// when it is switched to. Its level 1 table shares the kernel's level 2
+// tables (MMIO, RAM, .user and the vDSO page; global entries), and has
+// one private gigabyte, USER_BASE..USER_END, for its stack and anything
+// else only it may see. Those entries are non-global (nG), so the TLB
+// tags them with the address space's ASID. Kernel processes run on the
+// kernel's own table with ASID 0.
+//
+// The kernel is identity mapped at low addresses, so it cannot move to
+// TTBR1_EL1 without relinking it high. Sharing global kernel entries in
+// every TTBR0 table gives the same result: switching address space
+// leaves kernel TLB entries alone.
+//
+// ASIDs come from a generation-based allocator: mm->asid holds the
+// generation in the bits above the ASID. A context whose generation is
+// current switches with no lock and no TLB maintenance. When the ASIDs
+// run out, the generation moves on, the ASIDs running on each CPU stay
+// reserved, and every CPU flushes its TLB once before it next takes a
+// new ASID.
+//
+// Stacks are reserved as address ranges and mapped a page at a time on
+// first touch, with an unmapped guard page below each:
+//
+//   EL0 stacks   USER_STACK_SIZE under USER_STACK_TOP in the private
+//                gigabyte; a translation fault there maps a zeroed page
+//                (mm_handle_fault, from do_mem_abort).
+//   Kernel       one KSTACK_SLOT per task in the global gigabyte at
+//   stacks       KSTACK_BASE: KSTACK_SIZE of stack over a guard gap.
+//                Only the top page is mapped by kstack_alloc.
+//
+// A kernel stack cannot take an ordinary fault to grow: the trap frame
+// itself would be pushed onto the missing page. So the EL1 vectors in
+// exceptions.s probe the address the frame (plus room for the fault
+// handler) will reach with AT S1E1W first. If it is unmapped they
+// switch to this CPU's fault stack and call kstack_grow, which maps
+// pages from a per-CPU reserve without taking a lock (the interrupted
+// code may hold the page allocator's). schedule tops the reserve up
+// with kstack_refill; if it has run dry all the same, kstack_grow tries
+// the allocator with a trylock. A frame that would land in a guard gap
+// stops the CPU with a report instead of corrupting the memory below,
+// as does a stack with no page to grow into.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External memory functions
+extern void* kmalloc(size_t size);
+extern void kfree(void* ptr);
+extern void* alloc_pages_zeroed(unsigned int order);
+extern void* alloc_pages_trylock(unsigned int order);
+extern void* memset(void* dst, int c, size_t n);
+extern void free_pages(void* addr, unsigned int order);
+
+extern void uart_flush(void);
+
+// External MMU functions
+extern uint64_t* mmu_kernel_pgd(void);
+extern int mmu_enabled(void);
+
+// External SMP and interrupt functions
+extern int smp_processor_id(void);
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+
+// External spinlock and atomics functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern void spin_lock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern uint64_t atomic_xchg64(volatile uint64_t* ptr, uint64_t value);
+extern uint64_t atomic_cmpxchg64(volatile uint64_t* ptr, uint64_t old_value, uint64_t new_value);
+
+// External measurement functions
+extern uint64_t perf_cycles(void);
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+// Private user gigabyte (level 1 entry 2)
+#define USER_BASE           0x80000000UL
+#define USER_END            0xC0000000UL
+#define USER_STACK_TOP      USER_END
+#define USER_STACK_SIZE     0x40000         // Reserved; pages mapped on first touch
+#define USER_STACK_GUARD    (USER_STACK_TOP - USER_STACK_SIZE - PAGE_SIZE)
+
+// Kernel stacks (level 1 entry 3, global): a 16KB fault stack per CPU
+// in the first 2MB (bottom page of each unmapped as its guard, below
+// where it grows down to), then the task stack slots
+#define KSTACK_BASE         0xC0000000UL    // Also in exceptions.s
+#define KSTACK_END          0x100000000UL
+#define FAULT_STACK_SHIFT   14              // Also in exceptions.s
+#define FAULT_STACK_SIZE    (1UL << FAULT_STACK_SHIFT)
+#define KSTACK_SLOTS_BASE   (KSTACK_BASE + (1UL << L2_SHIFT))
+#define KSTACK_SLOT         0x20000         // 64KB guard gap + 64KB stack
+#define KSTACK_SIZE         0x10000         // PROCESS_STACK_SIZE in process.c
+#define KSTACK_ORDER        4               // MMU off: 2^4 plain pages
+#define NR_KSTACKS          ((KSTACK_END - KSTACK_SLOTS_BASE) / KSTACK_SLOT)
+#define KSTACK_RESERVE      8               // Pages per CPU for kstack_grow
+
+// kstack_grow results (also in exceptions.s)
+#define KSTACK_GROWN        1
+#define KSTACK_GUARD        0               // Guard gap or free slot
+#define KSTACK_NOMEM        (-1)            // Reserve empty, allocator busy/out
+
+// Translation table geometry and descriptor bits (as in mmu.c)
+#define ENTRIES_PER_TABLE   512
+#define L1_SHIFT            30
+#define L2_SHIFT            21
+#define L3_SHIFT            12
+#define PAGE_SIZE           (1UL << L3_SHIFT)
+#define PTE_VALID           (1UL << 0)
+#define PTE_TABLE           (1UL << 1)
+#define PTE_PAGE            (1UL << 1)
+#define PTE_ATTR(idx)       ((uint64_t)(idx) << 2)
+#define PTE_AP_RW_ALL       (1UL << 6)
+#define PTE_SH_INNER        (3UL << 8)
+#define PTE_AF              (1UL << 10)
+#define PTE_NG              (1UL << 11)     // Tagged with the ASID
+#define PTE_PXN             (1UL << 53)
+#define PTE_UXN             (1UL << 54)
+#define PTE_ADDR_MASK       0x0000FFFFFFFFF000UL
+#define MT_NORMAL           1
+
+#define PAGE_KERNEL         (PTE_VALID | PTE_PAGE | PTE_ATTR(MT_NORMAL) | PTE_SH_INNER | \
+                             PTE_AF | PTE_PXN | PTE_UXN)
+#define PAGE_USER_PRIVATE   (PTE_VALID | PTE_PAGE | PTE_ATTR(MT_NORMAL) | PTE_AP_RW_ALL | \
+                             PTE_SH_INNER | PTE_AF | PTE_NG | PTE_PXN | PTE_UXN)
+
+// ASIDs: ID_AA64MMFR0_EL1.ASIDBits says 8 or 16
+#define MMFR0_ASID_SHIFT    4
+#define MMFR0_ASID_16       2
+#define TTBR_ASID_SHIFT     48
+#define MAX_ASIDS           (1UL << 16)
+
+#define ASID_BENCH_PAGES    16
+#define ASID_BENCH_ROUNDS   1000
+#define PMU_L1D_TLB_REFILL  0x05
+
+// Address space
+typedef struct mm {
+    uint64_t* pgd;              // Level 1 table for TTBR0_EL1
+    uint64_t* l2_user;          // Level 2 table of the private gigabyte
+    volatile uint64_t asid;     // Generation | ASID, 0 before first use
+    uint32_t nr_pages;          // User pages mapped (owned by the mm)
+} mm_t;
+
+static int asid_bits = 8;
+static uint64_t asid_mask;
+static volatile uint64_t asid_generation;
+static uint64_t asid_map[MAX_ASIDS / 64];
+static uint64_t asid_cur_idx = 1;
+static spinlock_t asid_lock;
+static volatile uint64_t active_asids[NR_CPUS];
+static uint64_t reserved_asids[NR_CPUS];
+static volatile uint32_t tlb_flush_pending;     // CPUs owing a flush for the rollover
+static uint64_t asid_rollovers;
+
+static mm_t* cpu_mm[NR_CPUS];                  // Address space loaded on each CPU
+
+_Static_assert(NR_CPUS * FAULT_STACK_SIZE <= (1UL << L2_SHIFT), "fault stacks must fit 2MB");
+
+static uint64_t l2_kstack[ENTRIES_PER_TABLE] __attribute__((aligned(4096)));
+static uint64_t kstack_map[(NR_KSTACKS + 63) / 64];
+static spinlock_t kstack_lock;
+static void* kstack_reserve[NR_CPUS][KSTACK_RESERVE];
+static volatile int kstack_reserve_count[NR_CPUS];
+static int kstacks_virtual;                     // 0: MMU off, plain pages
+
+static void print_hex(uint64_t value) {
+    uart_puts("0x");
+    for (int i = 15; i >= 0; i--) {
+        int digit = (value >> (i * 4)) & 0xF;
+        uart_putc((digit < 10) ? ('0' + digit) : ('A' + digit - 10));
+    }
+}
+
+static inline int asid_test_and_set(uint64_t idx) {
+    uint64_t bit = 1UL << (idx % 64);
+    int was = (asid_map[idx / 64] & bit) != 0;
+    asid_map[idx / 64] |= bit;
+    return was;
+}
+
+// First free ASID at or after start, 0 if there is none
+static uint64_t asid_find_free(uint64_t start) {
+    uint64_t count = 1UL << asid_bits;
+    for (uint64_t idx = start; idx < count; idx++) {
+        if (!(asid_map[idx / 64] & (1UL << (idx % 64)))) {
+            return idx;
+        }
+    }
+    return 0;
+}
+
+static inline int asid_current(uint64_t asid) {
+    return ((asid ^ asid_generation) >> asid_bits) == 0;
+}
+
+// New generation: only the ASIDs live on some CPU survive, and every CPU
+// flushes its TLB before using the new ones. Called with asid_lock held.
+static void flush_context(void) {
+    for (size_t i = 0; i < MAX_ASIDS / 64; i++) {
+        asid_map[i] = 0;
+    }
+    asid_map[0] = 1;                    // ASID 0 is the kernel's
+
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        uint64_t asid = atomic_xchg64(&active_asids[cpu], 0);
+        // A CPU that rolled over before and has not switched since is
+        // still running its reserved ASID
+        if (asid == 0) {
+            asid = reserved_asids[cpu];
+        }
+        asid_test_and_set(asid & asid_mask);
+        reserved_asids[cpu] = asid;
+    }
+    tlb_flush_pending = (1U << NR_CPUS) - 1;
+    asid_rollovers++;
+}
+
+// If asid is running somewhere, keep it across the rollover
+static int check_update_reserved(uint64_t asid, uint64_t newasid) {
+    int hit = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (reserved_asids[cpu] == asid) {
+            reserved_asids[cpu] = newasid;
+            hit = 1;
+        }
+    }
+    return hit;
+}
+
+// Pick an ASID in the current generation for mm (asid_lock held)
+static uint64_t new_context(mm_t* mm) {
+    uint64_t asid = mm->asid;
+    uint64_t generation = asid_generation;
+
+    // Keep the old number if nobody took it this generation
+    if (asid != 0) {
+        uint64_t newasid = generation | (asid & asid_mask);
+        if (check_update_reserved(asid, newasid)) {
+            return newasid;
+        }
+        if (!asid_test_and_set(asid & asid_mask)) {
+            return newasid;
+        }
+    }
+
+    uint64_t idx = asid_find_free(asid_cur_idx);
+    if (!idx) {
+        generation += 1UL << asid_bits;
+        asid_generation = generation;
+        flush_context();
+        idx = asid_find_free(1);
+    }
+
+    asid_test_and_set(idx);
+    asid_cur_idx = idx;
+    return generation | idx;
+}
+
+static inline void write_ttbr0(uint64_t* pgd, uint64_t asid) {
+    asm volatile("msr ttbr0_el1, %0; isb"
+                 :: "r"((uint64_t)pgd | ((asid & 0xFFFF) << TTBR_ASID_SHIFT)) : "memory");
+}
+
+static inline void local_flush_tlb_all(void) {
+    asm volatile("dsb nshst; tlbi vmalle1; dsb nsh; isb" ::: "memory");
+}
+
+// Load mm (NULL for the kernel's table) on this CPU. IRQs masked.
+void switch_mm(mm_t* mm) {
+    int cpu = smp_processor_id();
+    if (cpu_mm[cpu] == mm || !mmu_enabled()) {
+        return;
+    }
+    cpu_mm[cpu] = mm;
+
+    if (!mm) {
+        write_ttbr0(mmu_kernel_pgd(), 0);
+        return;
+    }
+
+    // Fast path: current generation, and no rollover has cleared this
+    // CPU's active slot in the meantime
+    uint64_t asid = mm->asid;
+    uint64_t old_active = active_asids[cpu];
+    if (old_active && asid_current(asid) &&
+        atomic_cmpxchg64(&active_asids[cpu], old_active, asid) == old_active) {
+        write_ttbr0(mm->pgd, asid);
+        return;
+    }
+
+    spin_lock(&asid_lock);
+    asid = mm->asid;
+    if (!asid_current(asid)) {
+        asid = new_context(mm);
+        mm->asid = asid;
+    }
+    if (tlb_flush_pending & (1U << cpu)) {
+        tlb_flush_pending &= ~(1U << cpu);
+        local_flush_tlb_all();
+    }
+    active_asids[cpu] = asid;
+    spin_unlock(&asid_lock);
+
+    write_ttbr0(mm->pgd, asid);
+}
+
+// Create an empty address space: kernel mappings only
+mm_t* mm_create(void) {
+    mm_t* mm = (mm_t*)kmalloc(sizeof(mm_t));
+    if (!mm) {
+        return NULL;
+    }
+
+    mm->pgd = (uint64_t*)alloc_pages_zeroed(0);
+    mm->l2_user = (uint64_t*)alloc_pages_zeroed(0);
+    if (!mm->pgd || !mm->l2_user) {
+        if (mm->pgd) {
+            free_pages(mm->pgd, 0);
+        }
+        if (mm->l2_user) {
+            free_pages(mm->l2_user, 0);
+        }
+        kfree(mm);
+        return NULL;
+    }
+
+    uint64_t* kernel_pgd = mmu_kernel_pgd();
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        mm->pgd[i] = kernel_pgd[i];
+    }
+    mm->pgd[USER_BASE >> L1_SHIFT] = (uint64_t)mm->l2_user | PTE_VALID | PTE_TABLE;
+    asm volatile("dsb ishst" ::: "memory");
+
+    mm->asid = 0;
+    mm->nr_pages = 0;
+    return mm;
+}
+
+// Level 3 entry for va, allocating the table if asked. NULL if va is
+// outside the private gigabyte or there is no memory.
+static uint64_t* mm_pte(mm_t* mm, uint64_t va, int alloc) {
+    if (va < USER_BASE || va >= USER_END) {
+        return NULL;
+    }
+
+    uint64_t* l2e = &mm->l2_user[(va >> L2_SHIFT) & (ENTRIES_PER_TABLE - 1)];
+    if (!(*l2e & PTE_VALID)) {
+        if (!alloc) {
+            return NULL;
+        }
+        uint64_t* l3 = (uint64_t*)alloc_pages_zeroed(0);
+        if (!l3) {
+            return NULL;
+        }
+        *l2e = (uint64_t)l3 | PTE_VALID | PTE_TABLE;
+    }
+
+    uint64_t* l3 = (uint64_t*)(*l2e & PTE_ADDR_MASK);
+    return &l3[(va >> L3_SHIFT) & (ENTRIES_PER_TABLE - 1)];
+}
+
+// Map a zeroed page for EL0 read/write at va; the mm owns the page from
+// now on. The entry was invalid, so no TLB maintenance. Returns 0 on
+// failure.
+int mm_map_page(mm_t* mm, uint64_t va) {
+    uint64_t* pte = mm_pte(mm, va, 1);
+    if (!pte) {
+        return 0;
+    }
+    if (*pte & PTE_VALID) {
+        return 1;
+    }
+
+    void* page = alloc_pages_zeroed(0);
+    if (!page) {
+        return 0;
+    }
+    *pte = (uint64_t)page | PAGE_USER_PRIVATE;
+    asm volatile("dsb ishst" ::: "memory");
+    mm->nr_pages++;
+    return 1;
+}
+
+// Reserve the user stack and map its top page, returning the top (0 on
+// failure). The rest is mapped on first touch by mm_handle_fault.
+uint64_t mm_setup_stack(mm_t* mm) {
+    if (!mm_map_page(mm, USER_STACK_TOP - PAGE_SIZE)) {
+        return 0;
+    }
+    return USER_STACK_TOP;
+}
+
+// Bytes of mm's user stack that are mapped, and reserved
+void mm_stack_usage(mm_t* mm, size_t* resident, size_t* reserved) {
+    *resident = 0;
+    *reserved = USER_STACK_SIZE;
+    for (uint64_t va = USER_STACK_TOP - USER_STACK_SIZE; va < USER_STACK_TOP; va += PAGE_SIZE) {
+        uint64_t* pte = mm_pte(mm, va, 0);
+        if (pte && (*pte & PTE_VALID)) {
+            *resident += PAGE_SIZE;
+        }
+    }
+}
+
+// Free an address space and every page mapped in it. It must not be
+// loaded on any CPU. Its ASID is not reused before the next rollover,
+// which flushes every TLB, so stale entries need no invalidation here.
+void mm_destroy(mm_t* mm) {
+    if (!mm) {
+        return;
+    }
+
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        if (!(mm->l2_user[i] & PTE_VALID)) {
+            continue;
+        }
+        uint64_t* l3 = (uint64_t*)(mm->l2_user[i] & PTE_ADDR_MASK);
+        for (int j = 0; j < ENTRIES_PER_TABLE; j++) {
+            if (l3[j] & PTE_VALID) {
+                free_pages((void*)(l3[j] & PTE_ADDR_MASK), 0);
+            }
+        }
+        free_pages(l3, 0);
+    }
+
+    free_pages(mm->l2_user, 0);
+    free_pages(mm->pgd, 0);
+    kfree(mm);
+}
+
+// Is [ptr, ptr + len) mapped in the address space loaded on this CPU?
+// (For system calls: the .user sections are checked by the caller.)
+int mm_access_ok(uint64_t ptr, uint64_t len) {
+    uint64_t end = ptr + len;
+    if (end < ptr) {
+        return 0;
+    }
+
+    uint64_t flags = irq_save();
+    mm_t* mm = cpu_mm[smp_processor_id()];
+    int ok = mm != NULL;
+    for (uint64_t va = ptr & ~(PAGE_SIZE - 1); ok && va < end; va += PAGE_SIZE) {
+        uint64_t* pte = mm_pte(mm, va, 0);
+        ok = pte && (*pte & PTE_VALID);
+    }
+    irq_restore(flags);
+    return ok;
+}
+
+// Level 3 entry of a kernel stack address, NULL if it has no table yet
+static uint64_t* kstack_pte(uint64_t va) {
+    uint64_t l2e = l2_kstack[(va >> L2_SHIFT) & (ENTRIES_PER_TABLE - 1)];
+    if (!(l2e & PTE_VALID)) {
+        return NULL;
+    }
+    uint64_t* l3 = (uint64_t*)(l2e & PTE_ADDR_MASK);
+    return &l3[(va >> L3_SHIFT) & (ENTRIES_PER_TABLE - 1)];
+}
+
+// Level 3 table for the 2MB around va, allocated if missing (kstack_lock
+// held or before SMP). Tables are never freed.
+static uint64_t* kstack_table(uint64_t va) {
+    uint64_t* l2e = &l2_kstack[(va >> L2_SHIFT) & (ENTRIES_PER_TABLE - 1)];
+    if (!(*l2e & PTE_VALID)) {
+        uint64_t* l3 = (uint64_t*)alloc_pages_zeroed(0);
+        if (!l3) {
+            return NULL;
+        }
+        asm volatile("dsb ishst" ::: "memory");
+        *l2e = (uint64_t)l3 | PTE_VALID | PTE_TABLE;
+    }
+    return (uint64_t*)(*l2e & PTE_ADDR_MASK);
+}
+
+static int kstack_map_page(uint64_t va) {
+    void* page = alloc_pages_zeroed(0);
+    if (!page) {
+        return 0;
+    }
+    *kstack_pte(va) = (uint64_t)page | PAGE_KERNEL;
+    asm volatile("dsb ishst; isb" ::: "memory");
+    return 1;
+}
+
+// Reserve a kernel stack slot and map its top page. Returns the base of
+// the KSTACK_SIZE stack, NULL if out of slots or memory.
+uint8_t* kstack_alloc(void) {
+    if (!kstacks_virtual) {
+        return (uint8_t*)alloc_pages_zeroed(KSTACK_ORDER);
+    }
+
+    uint64_t flags = irq_save();
+    spin_lock(&kstack_lock);
+    uint64_t idx = NR_KSTACKS;
+    for (uint64_t i = 0; i < NR_KSTACKS; i++) {
+        if (!(kstack_map[i / 64] & (1UL << (i % 64)))) {
+            idx = i;
+            break;
+        }
+    }
+    uint64_t top = KSTACK_SLOTS_BASE + (idx + 1) * KSTACK_SLOT;
+    int ok = idx < NR_KSTACKS && kstack_table(top - PAGE_SIZE) != NULL;
+    if (ok) {
+        kstack_map[idx / 64] |= 1UL << (idx % 64);
+    }
+    spin_unlock(&kstack_lock);
+    irq_restore(flags);
+
+    if (!ok) {
+        return NULL;
+    }
+    if (!kstack_map_page(top - PAGE_SIZE)) {
+        flags = irq_save();
+        spin_lock(&kstack_lock);
+        kstack_map[idx / 64] &= ~(1UL << (idx % 64));
+        spin_unlock(&kstack_lock);
+        irq_restore(flags);
+        return NULL;
+    }
+    return (uint8_t*)(top - KSTACK_SIZE);
+}
+
+// Unmap and free a stack from kstack_alloc. Nothing may run on it.
+void kstack_free(uint8_t* base) {
+    if (!kstacks_virtual) {
+        free_pages(base, KSTACK_ORDER);
+        return;
+    }
+
+    for (uint64_t va = (uint64_t)base; va < (uint64_t)base + KSTACK_SIZE; va += PAGE_SIZE) {
+        uint64_t* pte = kstack_pte(va);
+        if (!(*pte & PTE_VALID)) {
+            continue;
+        }
+        void* page = (void*)(*pte & PTE_ADDR_MASK);
+        *pte = 0;
+        asm volatile("dsb ishst; tlbi vaae1is, %0; dsb ish; isb"
+                     :: "r"(va >> L3_SHIFT) : "memory");
+        free_pages(page, 0);
+    }
+
+    uint64_t idx = ((uint64_t)base - KSTACK_SLOTS_BASE) / KSTACK_SLOT;
+    uint64_t flags = irq_save();
+    spin_lock(&kstack_lock);
+    kstack_map[idx / 64] &= ~(1UL << (idx % 64));
+    spin_unlock(&kstack_lock);
+    irq_restore(flags);
+}
+
+// Map a task's kernel stack from addr's page up to the part already
+// mapped (the mapped part always runs down from the top). Called with
+// IRQs masked: from the EL1 vectors on the fault stack, and from
+// do_mem_abort. It takes pages from this CPU's reserve, and only when
+// that is empty tries the allocator with a trylock, so it is safe
+// whatever lock the interrupted code holds. Returns KSTACK_GUARD if addr
+// is in a guard gap or a free slot, KSTACK_NOMEM if no page was found.
+int kstack_grow(uint64_t addr) {
+    if (addr < KSTACK_SLOTS_BASE || addr >= KSTACK_END) {
+        return KSTACK_GUARD;
+    }
+    uint64_t offset = (addr - KSTACK_SLOTS_BASE) % KSTACK_SLOT;
+    if (offset < KSTACK_SLOT - KSTACK_SIZE) {
+        return KSTACK_GUARD;
+    }
+    uint64_t top = addr - offset + KSTACK_SLOT;
+    uint64_t* top_pte = kstack_pte(top - PAGE_SIZE);
+    if (!top_pte || !(*top_pte & PTE_VALID)) {
+        return KSTACK_GUARD;
+    }
+
+    int cpu = smp_processor_id();
+    for (uint64_t va = addr & ~(PAGE_SIZE - 1); va < top; va += PAGE_SIZE) {
+        uint64_t* pte = kstack_pte(va);
+        if (*pte & PTE_VALID) {
+            break;
+        }
+        int n = kstack_reserve_count[cpu];
+        void* page;
+        if (n) {
+            page = kstack_reserve[cpu][n - 1];
+            kstack_reserve_count[cpu] = n - 1;
+        } else {
+            // Not alloc_pages_zeroed: that spins on zone_lock, which
+            // the code we interrupted may hold
+            page = alloc_pages_trylock(0);
+            if (!page) {
+                asm volatile("dsb ishst; isb" ::: "memory");
+                return KSTACK_NOMEM;
+            }
+            memset(page, 0, PAGE_SIZE);
+        }
+        *pte = (uint64_t)page | PAGE_KERNEL;
+    }
+    asm volatile("dsb ishst; isb" ::: "memory");
+    return KSTACK_GROWN;
+}
+
+// From the EL1 vectors, on the fault stack, when a trap frame would land
+// in a guard gap (KSTACK_GUARD) or there was no page to grow the stack
+// into (KSTACK_NOMEM). There is nothing left to return to, so report and
+// stop this CPU.
+void kstack_overflow(uint64_t sp, int reason) {
+    uint64_t elr;
+    asm volatile("mrs %0, elr_el1" : "=r"(elr));
+    if (reason == KSTACK_NOMEM) {
+        uart_puts("\n*** Kernel stack: reserve empty, no page to grow into (EL1) ***\nSP: ");
+    } else {
+        uart_puts("\n*** Kernel stack overflow: guard gap (EL1) ***\nSP: ");
+    }
+    print_hex(sp);
+    uart_puts("  ELR_EL1: ");
+    print_hex(elr);
+    uart_puts("\nCPU halted.\n");
+    uart_flush();
+    while (1) {
+        asm volatile("wfi");
+    }
+}
+
+static void kstack_reserve_fill(int cpu) {
+    while (kstack_reserve_count[cpu] < KSTACK_RESERVE) {
+        void* page = alloc_pages_zeroed(0);
+        if (!page) {
+            return;
+        }
+        // The allocation may have grown our own stack from the reserve
+        int n = kstack_reserve_count[cpu];
+        kstack_reserve[cpu][n] = page;
+        kstack_reserve_count[cpu] = n + 1;
+    }
+}
+
+// Top up this CPU's reserve for kstack_grow (schedule, IRQs masked)
+void kstack_refill(void) {
+    int cpu = smp_processor_id();
+    if (kstacks_virtual && kstack_reserve_count[cpu] < KSTACK_RESERVE) {
+        kstack_reserve_fill(cpu);
+    }
+}
+
+// Bytes of a kernel stack that are mapped. Stacks not from kstack_alloc
+// (idle, MMU off) are all resident.
+size_t kstack_resident(const uint8_t* base, size_t size) {
+    uint64_t start = (uint64_t)base;
+    if (start < KSTACK_SLOTS_BASE || start >= KSTACK_END) {
+        return size;
+    }
+
+    size_t resident = 0;
+    for (uint64_t va = start; va < start + size; va += PAGE_SIZE) {
+        uint64_t* pte = kstack_pte(va);
+        if (pte && (*pte & PTE_VALID)) {
+            resident += PAGE_SIZE;
+        }
+    }
+    return resident;
+}
+
+// Translation fault at far (do_mem_abort, IRQs masked): grow the stack
+// it falls in. Returns 1 if handled, -1 for a guard page, -2 if a kernel
+// stack had no page to grow into, 0 if far is not in a stack.
+int mm_handle_fault(uint64_t far) {
+    if (far >= KSTACK_BASE && far < KSTACK_END) {
+        switch (kstack_grow(far)) {
+            case KSTACK_GROWN:
+                return 1;
+            case KSTACK_NOMEM:
+                return -2;
+            default:
+                return -1;
+        }
+    }
+
+    mm_t* mm = cpu_mm[smp_processor_id()];
+    if (!mm) {
+        return 0;
+    }
+    if (far >= USER_STACK_TOP - USER_STACK_SIZE && far < USER_STACK_TOP) {
+        return mm_map_page(mm, far & ~(PAGE_SIZE - 1));
+    }
+    if (far >= USER_STACK_GUARD && far < USER_STACK_TOP - USER_STACK_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+// Map the kernel stack gigabyte into the kernel's table (so into every
+// address space made after this) with each CPU's fault stack, and fill
+// the page reserves
+static void init_kstacks(void) {
+    if (!mmu_enabled()) {
+        uart_puts("Kernel stacks: physically contiguous (MMU off)\n");
+        return;
+    }
+
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        uint64_t base = KSTACK_BASE + cpu * FAULT_STACK_SIZE;
+        for (uint64_t va = base + PAGE_SIZE; va < base + FAULT_STACK_SIZE; va += PAGE_SIZE) {
+            if (!kstack_table(va) || !kstack_map_page(va)) {
+                uart_puts("Kernel stacks: no memory for fault stacks\n");
+                return;
+            }
+        }
+    }
+    mmu_kernel_pgd()[KSTACK_BASE >> L1_SHIFT] = (uint64_t)l2_kstack | PTE_VALID | PTE_TABLE;
+    asm volatile("dsb ishst; isb" ::: "memory");
+
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        kstack_reserve_fill(cpu);
+    }
+    kstack_lock.lock = 0;
+    kstacks_virtual = 1;
+
+    uart_puts("Kernel stacks: ");
+    print_decimal(KSTACK_SIZE / 1024);
+    uart_puts("KB reserved per task, grown on demand over a guard gap\n");
+}
+
+void init_mm(void) {
+    uint64_t mmfr0;
+    asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    asid_bits = ((mmfr0 >> MMFR0_ASID_SHIFT) & 0xF) == MMFR0_ASID_16 ? 16 : 8;
+    asid_mask = (1UL << asid_bits) - 1;
+    asid_generation = 1UL << asid_bits;
+    asid_map[0] = 1;
+    asid_lock.lock = 0;
+
+    uart_puts("Address spaces: ");
+    print_decimal(asid_bits);
+    uart_puts("-bit ASIDs\n");
+
+    init_kstacks();
+}
+
+// Is PMU event 'event' (< 32) implemented?
+static int pmu_has_event(uint32_t event) {
+    uint64_t ceid;
+    asm volatile("mrs %0, pmceid0_el0" : "=r"(ceid));
+    return (ceid >> event) & 1;
+}
+
+static uint64_t read_tlb_refills(void) {
+    uint64_t count;
+    asm volatile("isb; mrs %0, pmevcntr0_el0" : "=r"(count));
+    return count;
+}
+
+// Load mm for the no-ASID run: ASID 0 and a local TLBI VMALLE1, as a
+// switch without ASIDs would. Only this CPU, which has IRQs masked, sees
+// it; switch_mm's bookkeeping is left alone.
+static void asid_bench_load_flush(mm_t* mm) {
+    write_ttbr0(mm->pgd, 0);
+    local_flush_tlb_all();
+}
+
+// Alternate between two address spaces, touching ASID_BENCH_PAGES pages
+// of each after every switch: with ASIDs their TLB entries survive the
+// switch, with a TLBI VMALLE1 per switch every touch walks the tables
+static void asid_bench_run(mm_t* a, mm_t* b, int use_asids, uint64_t* cycles,
+                           uint64_t* refills) {
+    void (*load)(mm_t* mm) = use_asids ? switch_mm : asid_bench_load_flush;
+    uint64_t start_refills = read_tlb_refills();
+    uint64_t start = perf_cycles();
+    for (int round = 0; round < ASID_BENCH_ROUNDS; round++) {
+        load(a);
+        for (int i = 0; i < ASID_BENCH_PAGES; i++) {
+            (void)*(volatile uint64_t*)(USER_BASE + i * PAGE_SIZE);
+        }
+        load(b);
+        for (int i = 0; i < ASID_BENCH_PAGES; i++) {
+            (void)*(volatile uint64_t*)(USER_BASE + i * PAGE_SIZE);
+        }
+    }
+    *cycles = (perf_cycles() - start) / (2 * ASID_BENCH_ROUNDS);
+    *refills = (read_tlb_refills() - start_refills) / (2 * ASID_BENCH_ROUNDS);
+}
+
+void benchmark_asid(void) {
+    mm_t* a = mm_create();
+    mm_t* b = mm_create();
+    int ok = a && b;
+    for (int i = 0; ok && i < ASID_BENCH_PAGES; i++) {
+        ok = mm_map_page(a, USER_BASE + i * PAGE_SIZE) &&
+             mm_map_page(b, USER_BASE + i * PAGE_SIZE);
+    }
+    if (!ok || !mmu_enabled()) {
+        uart_puts("ASID benchmark: no memory or MMU off\n");
+        mm_destroy(a);
+        mm_destroy(b);
+        return;
+    }
+
+    // Event counter 0 counts L1 data TLB refills, if the PMU has them
+    int counted = pmu_has_event(PMU_L1D_TLB_REFILL);
+    if (counted) {
+        asm volatile("msr pmevtyper0_el0, %0" :: "r"((uint64_t)PMU_L1D_TLB_REFILL));
+        asm volatile("msr pmcntenset_el0, %0; isb" :: "r"(1UL));
+    }
+
+    uint64_t asid_cycles, asid_refills, flush_cycles, flush_refills;
+    uint64_t flags = irq_save();
+    mm_t* saved = cpu_mm[smp_processor_id()];
+    asid_bench_run(a, b, 1, &asid_cycles, &asid_refills);
+    switch_mm(NULL);
+    asid_bench_run(a, b, 0, &flush_cycles, &flush_refills);
+    // Drop the user entries the flush run left under ASID 0, the kernel
+    // table's, and put back what switch_mm thinks is loaded (NULL)
+    write_ttbr0(mmu_kernel_pgd(), 0);
+    local_flush_tlb_all();
+    switch_mm(saved);
+    irq_restore(flags);
+
+    uart_puts("Address space switch + ");
+    print_decimal(ASID_BENCH_PAGES);
+    uart_puts(" page touches:\n  ASIDs: ");
+    print_decimal(asid_cycles);
+    uart_puts(" cycles");
+    if (counted) {
+        uart_puts(", ");
+        print_decimal(asid_refills);
+        uart_puts(" TLB refills");
+    }
+    uart_puts("\n  TLBI VMALLE1 per switch: ");
+    print_decimal(flush_cycles);
+    uart_puts(" cycles");
+    if (counted) {
+        uart_puts(", ");
+        print_decimal(flush_refills);
+        uart_puts(" TLB refills");
+    } else {
+        uart_puts(" (PMU has no TLB refill event)");
+    }
+    uart_puts("\n  ASID rollovers so far: ");
+    print_decimal(asid_rollovers);
+    uart_puts("\n");
+
+    mm_destroy(a);
+    mm_destroy(b);
+}
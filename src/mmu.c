@@ -0,0 +1,251 @@
+// ARM64 MMU Setup
+// Save as: ~/OS_proj/src/mmu.c
+
+#include <stdint.h>
+
+// Address space layout (QEMU virt)
+#define MMIO_START      0x00000000UL    // Flash, GIC, UART, RTC, virtio...
+#define MMIO_END        0x40000000UL
+#define RAM_START       0x40000000UL
+#ifndef RAM_SIZE
+#define RAM_SIZE        0x10000000UL    // RAM_MB in the Makefile sets it
+#endif
+#define RAM_END         (RAM_START + RAM_SIZE)
+
+// Translation granule: 4KB pages, 39-bit VA, walk starts at level 1
+#define ENTRIES_PER_TABLE   512
+#define L1_SHIFT            30          // 1GB per level 1 entry
+#define L2_SHIFT            21          // 2MB per level 2 block
+#define L3_SHIFT            12          // 4KB per level 3 page
+#define BLOCK_SIZE          (1UL << L2_SHIFT)
+#define PAGE_SIZE           (1UL << L3_SHIFT)
+#define VA_BITS             39
+
+// Read-only alias of the vDSO data page for EL0 (vdso.c): the last page
+// of the RAM gigabyte, above RAM
+#define VDSO_VA         0x7FFFF000UL
+
+// Descriptor bits
+#define PTE_VALID       (1UL << 0)
+#define PTE_TABLE       (1UL << 1)      // Table (L1) vs block (L2)
+#define PTE_BLOCK       (0UL << 1)
+#define PTE_PAGE        (1UL << 1)      // Level 3 entries
+#define PTE_ATTR(idx)   ((uint64_t)(idx) << 2)
+#define PTE_AP_RW_EL1   (0UL << 6)
+#define PTE_AP_RW_ALL   (1UL << 6)      // EL0 read/write
+#define PTE_AP_RO_ALL   (3UL << 6)      // EL0 and EL1 read-only
+#define PTE_SH_INNER    (3UL << 8)
+#define PTE_AF          (1UL << 10)
+#define PTE_PXN         (1UL << 53)
+#define PTE_UXN         (1UL << 54)
+
+// MAIR_EL1 attribute slots
+#define MT_DEVICE_nGnRE     0
+#define MT_NORMAL           1
+#define MAIR_DEVICE_nGnRE   0x04UL
+#define MAIR_NORMAL_WB      0xFFUL      // Inner/outer write-back, RW-allocate
+#define MAIR_VALUE          ((MAIR_DEVICE_nGnRE << (8 * MT_DEVICE_nGnRE)) | \
+                             (MAIR_NORMAL_WB << (8 * MT_NORMAL)))
+
+// TCR_EL1 fields
+#define TCR_T0SZ        (64 - VA_BITS)
+#define TCR_IRGN0_WBWA  (1UL << 8)
+#define TCR_ORGN0_WBWA  (1UL << 10)
+#define TCR_SH0_INNER   (3UL << 12)
+#define TCR_TG0_4K      (0UL << 14)
+#define TCR_EPD1        (1UL << 23)     // No TTBR1 walks
+#define TCR_IPS_SHIFT   32
+#define TCR_AS          (1UL << 36)     // 16-bit ASIDs
+
+// ID_AA64MMFR0_EL1.ASIDBits
+#define MMFR0_ASID_SHIFT    4
+#define MMFR0_ASID_16       2
+
+// SCTLR_EL1 bits
+#define SCTLR_M         (1UL << 0)      // MMU enable
+#define SCTLR_A         (1UL << 1)      // Alignment check
+#define SCTLR_C         (1UL << 2)      // Data cache enable
+#define SCTLR_I         (1UL << 12)     // Instruction cache enable
+
+#define BLOCK_DEVICE    (PTE_VALID | PTE_BLOCK | PTE_ATTR(MT_DEVICE_nGnRE) | \
+                         PTE_AP_RW_EL1 | PTE_AF | PTE_PXN | PTE_UXN)
+// Kernel memory: UXN too, EL0 may fetch from pages it cannot read
+#define BLOCK_NORMAL    (PTE_VALID | PTE_BLOCK | PTE_ATTR(MT_NORMAL) | \
+                         PTE_AP_RW_EL1 | PTE_SH_INNER | PTE_AF | PTE_UXN)
+#define PAGE_NORMAL     (PTE_VALID | PTE_PAGE | PTE_ATTR(MT_NORMAL) | \
+                         PTE_AP_RW_EL1 | PTE_SH_INNER | PTE_AF | PTE_UXN)
+
+// EL0 mappings are never executable at EL1, and only code runs at EL0
+#define PAGE_USER_TEXT  (PTE_VALID | PTE_PAGE | PTE_ATTR(MT_NORMAL) | \
+                         PTE_AP_RO_ALL | PTE_SH_INNER | PTE_AF | PTE_PXN)
+#define PAGE_USER_DATA  (PTE_VALID | PTE_PAGE | PTE_ATTR(MT_NORMAL) | \
+                         PTE_AP_RW_ALL | PTE_SH_INNER | PTE_AF | PTE_PXN | PTE_UXN)
+#define PAGE_USER_RO    (PTE_VALID | PTE_PAGE | PTE_ATTR(MT_NORMAL) | \
+                         PTE_AP_RO_ALL | PTE_SH_INNER | PTE_AF | PTE_PXN | PTE_UXN)
+
+// EL0 program sections (kernel.ld)
+extern char __user_start[];
+extern char __user_data[];
+extern char __user_end[];
+
+// External string functions
+extern void string_init(void);
+
+// External UART functions
+extern void uart_puts(const char* str);
+
+// Identity map: one L1 table, one L2 table per mapped gigabyte. Every
+// entry is global; address spaces (mm.c) copy the L1 entries and share
+// the rest.
+static uint64_t l1_table[ENTRIES_PER_TABLE] __attribute__((aligned(4096)));
+static uint64_t l2_mmio[ENTRIES_PER_TABLE] __attribute__((aligned(4096)));
+static uint64_t l2_ram[ENTRIES_PER_TABLE] __attribute__((aligned(4096)));
+static uint64_t l3_user[ENTRIES_PER_TABLE] __attribute__((aligned(4096)));
+static uint64_t l3_vdso[ENTRIES_PER_TABLE] __attribute__((aligned(4096)));
+_Static_assert(RAM_SIZE <= (1UL << L1_SHIFT) && !(RAM_SIZE & (BLOCK_SIZE - 1)),
+               "RAM must be whole 2MB blocks within l2_ram's gigabyte");
+
+static int mmu_on = 0;
+
+// Fill an L2 table with 2MB blocks for [start, end)
+static void map_blocks(uint64_t* l2, uint64_t base, uint64_t start, uint64_t end, uint64_t attrs) {
+    for (uint64_t addr = start; addr < end; addr += BLOCK_SIZE) {
+        l2[(addr - base) >> L2_SHIFT] = addr | attrs;
+    }
+}
+
+// Map the 2MB block holding the EL0 program sections with pages, so
+// those sections alone can be made accessible to EL0
+static void map_user_sections(void) {
+    uint64_t block = (uint64_t)__user_start & ~(BLOCK_SIZE - 1);
+    if (((uint64_t)__user_end - 1) >> L2_SHIFT != block >> L2_SHIFT) {
+        uart_puts("MMU: EL0 sections cross a 2MB block, not mapped for EL0\n");
+        return;
+    }
+
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        uint64_t addr = block + ((uint64_t)i << L3_SHIFT);
+        uint64_t attrs = PAGE_NORMAL;
+        if (addr >= (uint64_t)__user_start && addr < (uint64_t)__user_data) {
+            attrs = PAGE_USER_TEXT;
+        } else if (addr >= (uint64_t)__user_data && addr < (uint64_t)__user_end) {
+            attrs = PAGE_USER_DATA;
+        }
+        l3_user[i] = addr | attrs;
+    }
+    l2_ram[(block - RAM_START) >> L2_SHIFT] = (uint64_t)l3_user | PTE_VALID | PTE_TABLE;
+}
+
+// Load the translation registers and turn on the MMU and caches for
+// the calling CPU. Only reads ID registers and link-time addresses, so
+// secondaries can run it before their caches are coherent.
+static void mmu_enable(void) {
+    // Physical address size supported by this CPU
+    uint64_t mmfr0;
+    asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    uint64_t ips = mmfr0 & 0x7;
+
+    uint64_t tcr = TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA |
+                   TCR_SH0_INNER | TCR_TG0_4K | TCR_EPD1 |
+                   (ips << TCR_IPS_SHIFT);
+    if (((mmfr0 >> MMFR0_ASID_SHIFT) & 0xF) == MMFR0_ASID_16) {
+        tcr |= TCR_AS;
+    }
+
+    asm volatile("msr mair_el1, %0" :: "r"(MAIR_VALUE));
+    asm volatile("msr tcr_el1, %0" :: "r"(tcr));
+    asm volatile("msr ttbr0_el1, %0" :: "r"((uint64_t)l1_table));
+
+    // Tables were written with the MMU off, make them visible to the walker
+    asm volatile("dsb ish");
+    asm volatile("tlbi vmalle1");
+    asm volatile("dsb ish");
+    asm volatile("isb");
+
+    uint64_t sctlr;
+    asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    sctlr |= SCTLR_M | SCTLR_C | SCTLR_I;
+    sctlr &= ~SCTLR_A;
+    asm volatile("msr sctlr_el1, %0" :: "r"(sctlr));
+    asm volatile("isb");
+}
+
+// Build the identity map and turn on the MMU and caches.
+// Called from boot.s with the MMU off, after BSS is cleared.
+void mmu_init(void) {
+#ifdef CONFIG_NO_MMU
+    // Build with `make MMU=0` to compare against the uncached baseline
+    return;
+#endif
+
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        l1_table[i] = 0;
+        l2_mmio[i] = 0;
+        l2_ram[i] = 0;
+    }
+
+    // First gigabyte is all MMIO: Device-nGnRE, never executable
+    map_blocks(l2_mmio, 0, MMIO_START, MMIO_END, BLOCK_DEVICE);
+
+    // RAM: Normal write-back cacheable, inner shareable
+    map_blocks(l2_ram, RAM_START, RAM_START, RAM_END, BLOCK_NORMAL);
+
+    map_user_sections();
+
+    l1_table[MMIO_START >> L1_SHIFT] = (uint64_t)l2_mmio | PTE_VALID | PTE_TABLE;
+    l1_table[RAM_START >> L1_SHIFT] = (uint64_t)l2_ram | PTE_VALID | PTE_TABLE;
+
+    mmu_enable();
+    mmu_on = 1;
+    
+    // Normal memory from here on: unaligned accesses and DC ZVA work
+    string_init();
+}
+
+// The kernel's level 1 table, loaded with ASID 0 for kernel processes
+uint64_t* mmu_kernel_pgd(void) {
+    return l1_table;
+}
+
+// Map page read-only for EL0 at VDSO_VA; the kernel keeps writing it
+// through its identity mapping. The slot was invalid, so no TLBI.
+// Returns 0 if the MMU is off.
+int mmu_map_vdso(void* page) {
+    if (!mmu_on) {
+        return 0;
+    }
+    l3_vdso[(VDSO_VA >> L3_SHIFT) & (ENTRIES_PER_TABLE - 1)] = (uint64_t)page | PAGE_USER_RO;
+    asm volatile("dsb ishst" ::: "memory");
+    l2_ram[(VDSO_VA - RAM_START) >> L2_SHIFT] = (uint64_t)l3_vdso | PTE_VALID | PTE_TABLE;
+    asm volatile("dsb ish" ::: "memory");
+    asm volatile("isb");
+    return 1;
+}
+
+// Secondary CPUs share the boot CPU's tables (called from boot.s)
+void mmu_init_secondary(void) {
+#ifdef CONFIG_NO_MMU
+    return;
+#endif
+
+    mmu_enable();
+}
+
+// Clean and invalidate [start, start + size) to the point of coherency,
+// for memory handed to a CPU that still runs with its caches off
+void dcache_clean_inval_range(const void* start, uint64_t size) {
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    uint64_t line = 4UL << ((ctr >> 16) & 0xF);     // DminLine, in words
+
+    uint64_t addr = (uint64_t)start & ~(line - 1);
+    uint64_t end = (uint64_t)start + size;
+    for (; addr < end; addr += line) {
+        asm volatile("dc civac, %0" :: "r"(addr) : "memory");
+    }
+    asm volatile("dsb ish" ::: "memory");
+}
+
+int mmu_enabled(void) {
+    return mmu_on;
+}
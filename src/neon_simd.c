@@ -0,0 +1,157 @@
+// NEON Checksum and FP/SIMD Switching Test
+// Save as: ~/OS_proj/src/neon_simd.c
+//
+// Built without -mgeneral-regs-only (see the *_simd.c rule in the
+// Makefile), so the compiler may use vector registers anywhere in this
+// file. Only call into it from processes, or from kernel code between
+// kernel_fpsimd_begin and kernel_fpsimd_end.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arm_neon.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External scheduler functions
+typedef struct process process_t;
+extern process_t* create_process(const char* name, void (*entry_point)(void));
+extern void schedule_process(process_t* proc);
+extern void process_sleep(uint64_t ns);
+
+// External SMP and spinlock functions
+extern int smp_num_online(void);
+extern int atomic_add_return(volatile int* ptr, int delta);
+
+// External FP/SIMD functions
+extern uint64_t kernel_fpsimd_begin(void);
+extern void kernel_fpsimd_end(uint64_t flags);
+extern void print_fpsimd_stats(void);
+
+#define FP_TEST_ROUNDS      16
+#define FP_TEST_SPINS       2000000     // Long enough to be preempted
+#define FP_TEST_WORDS       1024
+
+static uint32_t fp_test_data[FP_TEST_WORDS];
+static volatile int fp_next_id;
+static volatile int fp_done;
+static volatile int fp_errors;
+
+// Sum of 32-bit words, four lanes at a time (n a multiple of 4)
+uint64_t neon_sum32(const uint32_t* data, size_t n) {
+    uint64x2_t acc = vdupq_n_u64(0);
+    for (size_t i = 0; i < n; i += 4) {
+        acc = vpadalq_u32(acc, vld1q_u32(data + i));
+    }
+    return vaddvq_u64(acc);
+}
+
+static uint64_t scalar_sum32(const uint32_t* data, size_t n) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+// Fill V0-V31 with pattern, spin so the tick can switch to other FP
+// tasks, then count the 64-bit halves that no longer hold it
+static uint64_t fp_regs_survive(uint64_t pattern, uint64_t spins) {
+    uint64_t bad;
+
+    asm volatile(
+        "   dup     v0.2d, %[p]\n"
+        "   .irp    n, 1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31\n"
+        "   mov     v\\n\\().16b, v0.16b\n"
+        "   .endr\n"
+        "1: subs    %[s], %[s], #1\n"
+        "   b.ne    1b\n"
+        "   mov     %[bad], #0\n"
+        "   .irp    n, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31\n"
+        "   umov    x9, v\\n\\().d[0]\n"
+        "   cmp     x9, %[p]\n"
+        "   cinc    %[bad], %[bad], ne\n"
+        "   umov    x9, v\\n\\().d[1]\n"
+        "   cmp     x9, %[p]\n"
+        "   cinc    %[bad], %[bad], ne\n"
+        "   .endr\n"
+        : [bad] "=&r"(bad), [s] "+r"(spins)
+        : [p] "r"(pattern)
+        : "x9", "cc",
+          "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",
+          "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15",
+          "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",
+          "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31");
+
+    return bad;
+}
+
+// Each worker keeps its own pattern in every vector register while the
+// others, sharing its CPU, do the same with theirs
+static void fp_worker(void) {
+    uint64_t id = (uint64_t)atomic_add_return(&fp_next_id, 1);
+    uint64_t expected = scalar_sum32(fp_test_data, FP_TEST_WORDS);
+
+    for (uint64_t round = 0; round < FP_TEST_ROUNDS; round++) {
+        uint64_t pattern = (id << 32 | round) * 0x9E3779B97F4A7C15ULL;
+        if (fp_regs_survive(pattern, FP_TEST_SPINS) != 0) {
+            atomic_add_return(&fp_errors, 1);
+        }
+        if (neon_sum32(fp_test_data, FP_TEST_WORDS) != expected) {
+            atomic_add_return(&fp_errors, 1);
+        }
+    }
+
+    atomic_add_return(&fp_done, 1);
+}
+
+// Runs as a process: twice as many FP workers as CPUs, so every CPU
+// switches between tasks that each own a live register file
+void test_fpsimd(void) {
+    int workers = smp_num_online() * 2;
+    int started = 0;
+
+    uint32_t x = 1;
+    for (int i = 0; i < FP_TEST_WORDS; i++) {
+        x = x * 1664525 + 1013904223;
+        fp_test_data[i] = x;
+    }
+    fp_next_id = 0;
+    fp_done = 0;
+    fp_errors = 0;
+
+    for (int i = 0; i < workers; i++) {
+        process_t* worker = create_process("fp_worker", fp_worker);
+        if (!worker) {
+            break;
+        }
+        schedule_process(worker);
+        started++;
+    }
+    while (fp_done < started) {
+        process_sleep(10000000);
+    }
+
+    // Kernel-mode use of the same code, with the registers borrowed
+    uint64_t flags = kernel_fpsimd_begin();
+    uint64_t sum = neon_sum32(fp_test_data, FP_TEST_WORDS);
+    kernel_fpsimd_end(flags);
+    if (sum != scalar_sum32(fp_test_data, FP_TEST_WORDS)) {
+        fp_errors++;
+    }
+
+    uart_puts("FP/SIMD test: ");
+    print_decimal(started);
+    uart_puts(" tasks x ");
+    print_decimal(FP_TEST_ROUNDS);
+    uart_puts(" rounds, ");
+    if (fp_errors) {
+        print_decimal(fp_errors);
+        uart_puts(" errors, FAILED\n");
+    } else {
+        uart_puts("register state intact\n");
+    }
+    print_fpsimd_stats();
+}
@@ -0,0 +1,329 @@
+// Buddy Page Frame Allocator for ARM64 OS
+// Save as: ~/OS_proj/src/page_alloc.c
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern uint64_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags);
+extern int spin_trylock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern void cpu_relax(void);
+
+// External string functions
+extern void* memset(void* dst, int c, size_t n);
+
+// End of kernel image (from linker script)
+extern char __end[];
+
+// Physical memory layout (QEMU virt). RAM_SIZE comes from RAM_MB in
+// the Makefile, which also sets QEMU's -m
+#define RAM_START       0x40000000UL
+#ifndef RAM_SIZE
+#define RAM_SIZE        0x10000000UL
+#endif
+#define RAM_END         (RAM_START + RAM_SIZE)
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
+#define NR_PAGES        (RAM_SIZE >> PAGE_SHIFT)
+#define MAX_ORDER       12          // Orders 0..11, largest block is 8MB
+
+// alloc_pages_trylock: attempts before deciding the lock holder is us
+#define ALLOC_TRYLOCK_SPINS 1000
+
+// Page flags
+#define PG_RESERVED     (1 << 0)    // Kernel image, page array, firmware
+#define PG_FREE         (1 << 1)    // Head of a block on a free list
+#define PG_SLAB         (1 << 2)    // Owned by the slab layer
+
+// Page descriptor, one per physical page
+typedef struct page {
+    uint32_t flags;
+    uint32_t order;             // Block order (valid on block heads)
+    struct page* next;          // Free list links
+    struct page* prev;
+} page_t;
+
+typedef struct {
+    page_t* head;
+    uint64_t nr_free;           // Blocks on this list
+} free_area_t;
+
+static page_t* mem_map = NULL;
+static free_area_t free_area[MAX_ORDER];
+static uint64_t first_pfn = 0;     // First page managed by the allocator
+static uint64_t free_pages_count = 0;
+static spinlock_t zone_lock;       // Free lists and counters, all CPUs
+
+static void print_hex(uint64_t value) {
+    uart_puts("0x");
+    for (int i = 15; i >= 0; i--) {
+        int digit = (value >> (i * 4)) & 0xF;
+        char c = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+        uart_putc(c);
+    }
+}
+
+static inline uint64_t addr_to_pfn(uintptr_t addr) {
+    return (addr - RAM_START) >> PAGE_SHIFT;
+}
+
+static inline void* pfn_to_addr(uint64_t pfn) {
+    return (void*)(RAM_START + (pfn << PAGE_SHIFT));
+}
+
+static inline int pfn_valid(uint64_t pfn) {
+    return pfn >= first_pfn && pfn < NR_PAGES;
+}
+
+// Free list helpers
+static void free_list_add(page_t* page, unsigned int order) {
+    page->flags |= PG_FREE;
+    page->order = order;
+    page->prev = NULL;
+    page->next = free_area[order].head;
+    if (page->next) {
+        page->next->prev = page;
+    }
+    free_area[order].head = page;
+    free_area[order].nr_free++;
+}
+
+static void free_list_del(page_t* page, unsigned int order) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        free_area[order].head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags &= ~PG_FREE;
+    free_area[order].nr_free--;
+}
+
+// Split a free block down to 2^order pages
+static void* buddy_alloc(unsigned int order) {
+    // Find the smallest non-empty free list that fits
+    unsigned int current = order;
+    while (current < MAX_ORDER && !free_area[current].head) {
+        current++;
+    }
+    if (current == MAX_ORDER) {
+        return NULL;
+    }
+
+    page_t* page = free_area[current].head;
+    free_list_del(page, current);
+
+    // Split down to the requested order, returning upper halves
+    while (current > order) {
+        current--;
+        free_list_add(page + (1UL << current), current);
+    }
+
+    page->order = order;
+    free_pages_count -= 1UL << order;
+    return pfn_to_addr(page - mem_map);
+}
+
+// Return a block and merge it with free buddies
+static void buddy_free(uint64_t pfn, unsigned int order) {
+    mem_map[pfn].flags &= ~PG_SLAB;
+    free_pages_count += 1UL << order;
+
+    // Merge with free buddies as far up as possible
+    while (order < MAX_ORDER - 1) {
+        uint64_t buddy_pfn = pfn ^ (1UL << order);
+        if (!pfn_valid(buddy_pfn)) {
+            break;
+        }
+
+        page_t* buddy = &mem_map[buddy_pfn];
+        if (!(buddy->flags & PG_FREE) || buddy->order != order) {
+            break;
+        }
+
+        free_list_del(buddy, order);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    free_list_add(&mem_map[pfn], order);
+}
+
+// Allocate 2^order contiguous pages
+void* alloc_pages(unsigned int order) {
+    if (!mem_map || order >= MAX_ORDER) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&zone_lock);
+    void* addr = buddy_alloc(order);
+    spin_unlock_irqrestore(&zone_lock, flags);
+    return addr;
+}
+
+// alloc_pages for code that may have interrupted a zone_lock holder on
+// this CPU (kernel stack growth at fault time, IRQs masked): gives up
+// after a bounded wait instead of deadlocking
+void* alloc_pages_trylock(unsigned int order) {
+    if (!mem_map || order >= MAX_ORDER) {
+        return NULL;
+    }
+
+    for (int i = 0; i < ALLOC_TRYLOCK_SPINS; i++) {
+        if (spin_trylock(&zone_lock)) {
+            void* addr = buddy_alloc(order);
+            spin_unlock(&zone_lock);
+            return addr;
+        }
+        cpu_relax();
+    }
+    return NULL;
+}
+
+// Allocate 2^order pages, cleared (DC ZVA does most of the work)
+void* alloc_pages_zeroed(unsigned int order) {
+    void* addr = alloc_pages(order);
+    if (addr) {
+        memset(addr, 0, PAGE_SIZE << order);
+    }
+    return addr;
+}
+
+// Free 2^order pages previously returned by alloc_pages
+void free_pages(void* addr, unsigned int order) {
+    if (!addr || !mem_map || order >= MAX_ORDER) {
+        return;
+    }
+
+    uint64_t pfn = addr_to_pfn((uintptr_t)addr);
+    if (!pfn_valid(pfn)) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&zone_lock);
+    buddy_free(pfn, order);
+    spin_unlock_irqrestore(&zone_lock, flags);
+}
+
+// Order of the smallest block holding size bytes
+unsigned int pages_order(size_t size) {
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+// Order a block was allocated with (addr must be the block head)
+unsigned int page_alloc_order(const void* addr) {
+    uint64_t pfn = addr_to_pfn((uintptr_t)addr);
+    return pfn_valid(pfn) ? mem_map[pfn].order : 0;
+}
+
+// Slab pages are tagged so kfree can route them back to their cache
+void page_set_slab(void* addr, int is_slab) {
+    uint64_t pfn = addr_to_pfn((uintptr_t)addr);
+    if (!pfn_valid(pfn)) {
+        return;
+    }
+    if (is_slab) {
+        mem_map[pfn].flags |= PG_SLAB;
+    } else {
+        mem_map[pfn].flags &= ~PG_SLAB;
+    }
+}
+
+int page_is_slab(const void* addr) {
+    uintptr_t a = (uintptr_t)addr;
+    if (a < RAM_START || a >= RAM_END || !mem_map) {
+        return 0;
+    }
+    return (mem_map[addr_to_pfn(a)].flags & PG_SLAB) != 0;
+}
+
+// Hand all RAM above the kernel image to the buddy allocator
+void init_page_alloc(void) {
+    uart_puts("Initializing page allocator...\n");
+
+    // Page descriptors live right after the kernel image
+    uintptr_t map_start = ((uintptr_t)__end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t map_end = map_start + NR_PAGES * sizeof(page_t);
+    map_end = (map_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    mem_map = (page_t*)map_start;
+    first_pfn = addr_to_pfn(map_end);
+    free_pages_count = 0;
+
+    for (int i = 0; i < MAX_ORDER; i++) {
+        free_area[i].head = NULL;
+        free_area[i].nr_free = 0;
+    }
+
+    for (uint64_t pfn = 0; pfn < NR_PAGES; pfn++) {
+        mem_map[pfn].flags = PG_RESERVED;
+        mem_map[pfn].order = 0;
+        mem_map[pfn].next = NULL;
+        mem_map[pfn].prev = NULL;
+    }
+
+    // Add the largest naturally aligned blocks that fit
+    uint64_t pfn = first_pfn;
+    while (pfn < NR_PAGES) {
+        unsigned int order = MAX_ORDER - 1;
+        while (order > 0 && ((pfn & ((1UL << order) - 1)) || pfn + (1UL << order) > NR_PAGES)) {
+            order--;
+        }
+
+        for (uint64_t i = 0; i < (1UL << order); i++) {
+            mem_map[pfn + i].flags = 0;
+        }
+        free_list_add(&mem_map[pfn], order);
+        free_pages_count += 1UL << order;
+        pfn += 1UL << order;
+    }
+
+    uart_puts("Page array: ");
+    print_hex(map_start);
+    uart_puts("\nManaged RAM: ");
+    print_hex((uint64_t)pfn_to_addr(first_pfn));
+    uart_puts(" - ");
+    print_hex(RAM_END);
+    uart_puts("\nFree pages: ");
+    print_decimal(free_pages_count);
+    uart_puts(" (");
+    print_decimal(free_pages_count * PAGE_SIZE / 1024);
+    uart_puts(" KB)\n");
+}
+
+// Pages on the free lists, for leak checks
+uint64_t nr_free_pages(void) {
+    return free_pages_count;
+}
+
+void print_page_stats(void) {
+    uart_puts("Free pages: ");
+    print_decimal(free_pages_count);
+    uart_puts(" / ");
+    print_decimal(NR_PAGES - first_pfn);
+    uart_puts("\nFree blocks by order:");
+    for (int i = 0; i < MAX_ORDER; i++) {
+        uart_puts(" ");
+        print_decimal(free_area[i].nr_free);
+    }
+    uart_puts("\n");
+}
@@ -0,0 +1,252 @@
+// Cycle Counters and Boot-Time Cost Measurements
+// Save as: ~/OS_proj/src/perf.c
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+extern void* kmalloc(size_t size);
+extern void kfree(void* ptr);
+extern void* alloc_pages(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+extern int mmu_enabled(void);
+
+// External string functions
+extern void* memcpy(void* dst, const void* src, size_t n);
+extern void* memset(void* dst, int c, size_t n);
+extern void* memcpy_neon(void* dst, const void* src, size_t n);
+extern void* memset_neon(void* dst, int c, size_t n);
+
+// External FP/SIMD functions
+extern uint64_t kernel_fpsimd_begin(void);
+extern void kernel_fpsimd_end(uint64_t flags);
+
+// Same layout as cpu_context_t in process.c (offsets used by switch_context)
+typedef struct {
+    uint64_t x[10];     // x19-x28
+    uint64_t fp;
+    uint64_t sp;
+    uint64_t pc;
+} switch_ctx_t;
+extern void switch_context(switch_ctx_t* old_ctx, switch_ctx_t* new_ctx);
+
+#define MEASURE_ITERATIONS  1000
+#define SWITCH_ROUND_TRIPS  10000
+#define PARTNER_STACK_ORDER 0           // One page is plenty for the partner
+
+// Memory primitive sweep: 8B .. 1MB, about 4MB moved per size and routine
+#define STRING_BENCH_ORDER  8               // 1MB buffers
+#define STRING_BENCH_MIN    8
+#define STRING_BENCH_MAX    (4096UL << STRING_BENCH_ORDER)
+#define STRING_BENCH_BYTES  (4UL << 20)
+
+// PMU control bits
+#define PMCR_E          (1UL << 0)      // Enable counters
+#define PMCR_C          (1UL << 2)      // Reset cycle counter
+#define PMCR_LC         (1UL << 6)      // 64-bit cycle counter
+#define PMCNTEN_CYCLES  (1UL << 31)
+#define PMUSERENR_EN    (1UL << 0)      // EL0 may use the PMU
+#define PMUSERENR_CR    (1UL << 2)      // EL0 may read the cycle counter
+
+static switch_ctx_t main_ctx;
+static switch_ctx_t partner_ctx;
+
+// Start the PMU cycle counter, readable from EL0 too
+void perf_init(void) {
+    asm volatile("msr pmcr_el0, %0" :: "r"(PMCR_E | PMCR_C | PMCR_LC));
+    asm volatile("msr pmcntenset_el0, %0" :: "r"(PMCNTEN_CYCLES));
+    asm volatile("msr pmuserenr_el0, %0" :: "r"(PMUSERENR_EN | PMUSERENR_CR));
+    asm volatile("isb");
+}
+
+uint64_t perf_cycles(void) {
+    uint64_t cycles;
+    asm volatile("isb; mrs %0, pmccntr_el0" : "=r"(cycles) :: "memory");
+    return cycles;
+}
+
+// Switch partner: bounces straight back to the measuring context forever
+static void switch_partner(void) {
+    while (1) {
+        switch_context(&partner_ctx, &main_ctx);
+    }
+}
+
+static uint64_t read_cntvct(void) {
+    uint64_t ticks;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+    return ticks;
+}
+
+static void report(const char* what, uint64_t total) {
+    uart_puts(what);
+    print_decimal(total / MEASURE_ITERATIONS);
+    uart_puts(" cycles\n");
+}
+
+void benchmark_switch(void);
+
+// Time the hot paths that depend on the MMU/cache configuration
+void measure_boot_costs(void) {
+    perf_init();
+
+    uart_puts("MMU and caches: ");
+    uart_puts(mmu_enabled() ? "on\n" : "off\n");
+
+    // Slab path
+    uint64_t start = perf_cycles();
+    for (int i = 0; i < MEASURE_ITERATIONS; i++) {
+        kfree(kmalloc(64));
+    }
+    report("kmalloc(64)+kfree: ", perf_cycles() - start);
+
+    // TLSF path
+    start = perf_cycles();
+    for (int i = 0; i < MEASURE_ITERATIONS; i++) {
+        kfree(kmalloc(4096));
+    }
+    report("kmalloc(4096)+kfree: ", perf_cycles() - start);
+
+    benchmark_switch();
+}
+
+// Ping-pong between two contexts through the voluntary switch path.
+// Each round trip is two switch_context calls. Timed with the PMU cycle
+// counter and, independently of the PMU, with the virtual counter.
+void benchmark_switch(void) {
+    uint8_t* stack = (uint8_t*)alloc_pages(PARTNER_STACK_ORDER);
+    if (!stack) {
+        return;
+    }
+
+    memset(&partner_ctx, 0, sizeof(partner_ctx));
+    partner_ctx.sp = (uint64_t)(stack + 4096);
+    partner_ctx.pc = (uint64_t)switch_partner;
+
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    uint64_t ticks = read_cntvct();
+    uint64_t start = perf_cycles();
+    for (int i = 0; i < SWITCH_ROUND_TRIPS; i++) {
+        switch_context(&main_ctx, &partner_ctx);
+    }
+    uint64_t cycles = perf_cycles() - start;
+    ticks = read_cntvct() - ticks;
+
+    // Fastest single round trip, including the two counter reads
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < MEASURE_ITERATIONS; i++) {
+        start = perf_cycles();
+        switch_context(&main_ctx, &partner_ctx);
+        uint64_t elapsed = perf_cycles() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    uart_puts("Switch ping-pong: ");
+    print_decimal(cycles / SWITCH_ROUND_TRIPS);
+    uart_puts(" cycles (best ");
+    print_decimal(best);
+    uart_puts("), ");
+    print_decimal(ticks * 1000000000ULL / (freq ? freq : 1) / SWITCH_ROUND_TRIPS);
+    uart_puts(" ns per round trip\n");
+
+    free_pages(stack, PARTNER_STACK_ORDER);
+}
+
+// Byte at a time, the baseline the library replaced. volatile keeps the
+// compiler from turning it back into a memcpy call.
+static void byte_copy(volatile uint8_t* dst, const volatile uint8_t* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = src[i];
+    }
+}
+
+// Bytes per cycle, with two decimals
+static void print_rate(uint64_t bytes, uint64_t cycles) {
+    uint64_t rate = bytes * 100 / (cycles ? cycles : 1);
+    print_decimal(rate / 100);
+    uart_putc('.');
+    uart_putc('0' + (rate / 10) % 10);
+    uart_putc('0' + rate % 10);
+    uart_puts("  ");
+}
+
+// Throughput of the memory primitives against size, in bytes per cycle.
+// Columns: byte loop, memcpy, memcpy_neon, memset, memset of zero (DC
+// ZVA from 256 bytes), memset_neon.
+void benchmark_string(void) {
+    uint8_t* src = (uint8_t*)alloc_pages(STRING_BENCH_ORDER);
+    uint8_t* dst = (uint8_t*)alloc_pages(STRING_BENCH_ORDER);
+    if (!src || !dst) {
+        uart_puts("String benchmark: no memory\n");
+        free_pages(src, STRING_BENCH_ORDER);
+        free_pages(dst, STRING_BENCH_ORDER);
+        return;
+    }
+    memset(src, 0x5A, STRING_BENCH_MAX);
+
+    uart_puts("Memory primitives, bytes/cycle:\n");
+    uart_puts("size: byte memcpy neon memset zero neon-set\n");
+
+    for (size_t size = STRING_BENCH_MIN; size <= STRING_BENCH_MAX; size <<= 1) {
+        uint64_t iterations = STRING_BENCH_BYTES / size;
+        uint64_t bytes = iterations * size;
+        uint64_t start;
+
+        print_decimal(size);
+        uart_puts(": ");
+
+        start = perf_cycles();
+        for (uint64_t i = 0; i < iterations; i++) {
+            byte_copy(dst, src, size);
+        }
+        print_rate(bytes, perf_cycles() - start);
+
+        start = perf_cycles();
+        for (uint64_t i = 0; i < iterations; i++) {
+            memcpy(dst, src, size);
+        }
+        print_rate(bytes, perf_cycles() - start);
+
+        uint64_t flags = kernel_fpsimd_begin();
+        start = perf_cycles();
+        for (uint64_t i = 0; i < iterations; i++) {
+            memcpy_neon(dst, src, size);
+        }
+        uint64_t neon_copy = perf_cycles() - start;
+        kernel_fpsimd_end(flags);
+        print_rate(bytes, neon_copy);
+
+        start = perf_cycles();
+        for (uint64_t i = 0; i < iterations; i++) {
+            memset(dst, 0xA5, size);
+        }
+        print_rate(bytes, perf_cycles() - start);
+
+        start = perf_cycles();
+        for (uint64_t i = 0; i < iterations; i++) {
+            memset(dst, 0, size);
+        }
+        print_rate(bytes, perf_cycles() - start);
+
+        flags = kernel_fpsimd_begin();
+        start = perf_cycles();
+        for (uint64_t i = 0; i < iterations; i++) {
+            memset_neon(dst, 0xA5, size);
+        }
+        uint64_t neon_set = perf_cycles() - start;
+        kernel_fpsimd_end(flags);
+        print_rate(bytes, neon_set);
+
+        uart_puts("\n");
+    }
+
+    free_pages(src, STRING_BENCH_ORDER);
+    free_pages(dst, STRING_BENCH_ORDER);
+}
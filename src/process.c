@@ -7,9 +7,27 @@
 // External functions
 extern void uart_puts(const char* str);
 extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+extern void print_signed(int64_t value);
 extern void* kmalloc(size_t size);
 extern void kfree(void* ptr);
 
+// External page allocator functions
+extern void* alloc_pages(unsigned int order);
+extern void* alloc_pages_zeroed(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+
+// External slab functions
+typedef struct kmem_cache kmem_cache_t;
+extern kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+extern void* kmem_cache_alloc(kmem_cache_t* cache);
+extern void kmem_cache_free(kmem_cache_t* cache, void* obj);
+extern uint64_t kmem_cache_active_objs(kmem_cache_t* cache);
+
+// External string functions
+extern void* memcpy(void* dst, const void* src, size_t n);
+extern void* memset(void* dst, int c, size_t n);
+extern size_t strlen(const char* s);
 
 // Process states
 typedef enum {
@@ -19,319 +37,1897 @@ typedef enum {
     PROCESS_TERMINATED = 3
 } process_state_t;
 
-// ARM64 CPU context for process switching
+// Registers switch_context preserves: the AAPCS64 callee-saved set.
+// A preempted process's other registers are in the IRQ trap frame on
+// its stack.
 typedef struct {
-    uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
-    uint64_t x8, x9, x10, x11, x12, x13, x14, x15;
-    uint64_t x16, x17, x18, x19, x20, x21, x22, x23;
-    uint64_t x24, x25, x26, x27, x28, x29, x30;
+    uint64_t x19, x20, x21, x22, x23, x24, x25, x26, x27, x28;
+    uint64_t fp;        // x29
     uint64_t sp;        // Stack pointer
-    uint64_t pc;        // Program counter
-    uint64_t pstate;    // Processor state
+    uint64_t pc;        // Resume address (x30 at the switch)
 } cpu_context_t;
 extern void switch_context(cpu_context_t* old_ctx, cpu_context_t* new_ctx);
-extern void start_first_process(cpu_context_t* ctx);
+extern void process_start(void);
 void schedule(void);
 
-// Process Control Block
-typedef struct process {
-    int pid;                    // Process ID
-    char name[32];             // Process name
-    process_state_t state;     // Current state
-    cpu_context_t context;     // Saved CPU context
-    uint8_t* stack_base;       // Base of process stack
-    size_t stack_size;         // Stack size
-    uint64_t time_slice;       // Time slice remaining
-    struct process* next;      // Next process in list
-} process_t;
+// Same layout as pt_regs_t in interrupts.c (the trap frame in exceptions.s)
+typedef struct {
+    uint64_t regs[31];  // x0-x30
+    uint64_t sp;        // SP_EL0
+    uint64_t pc;        // ELR_EL1
+    uint64_t pstate;    // SPSR_EL1
+} pt_regs_t;
+extern void ret_to_user(pt_regs_t* regs);
+
+// External address space functions
+typedef struct mm mm_t;
+extern mm_t* mm_create(void);
+extern void mm_destroy(mm_t* mm);
+extern uint64_t mm_setup_stack(mm_t* mm);
+extern void switch_mm(mm_t* mm);
+extern void mm_stack_usage(mm_t* mm, size_t* resident, size_t* reserved);
+extern void benchmark_asid(void);
+
+// External kernel stack functions (mm.c)
+extern uint8_t* kstack_alloc(void);
+extern void kstack_free(uint8_t* base);
+extern void kstack_refill(void);
+extern size_t kstack_resident(const uint8_t* base, size_t size);
+
+// External interrupt functions
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+extern void disable_interrupts(void);
+extern void register_irq_handler(uint32_t irq, void (*handler)(void));
+extern void gic_send_sgi(uint32_t cpu_mask, uint32_t sgi);
+
+// External spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern void spin_lock(spinlock_t* lock);
+extern int spin_trylock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern uint64_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags);
+extern int atomic_cmpxchg(volatile int* ptr, int old_value, int new_value);
+extern void cpu_relax(void);
+
+// External SMP functions
+extern int smp_processor_id(void);
+extern void benchmark_smp(void);
+
+// External lock library functions
+extern void benchmark_sync(void);
+
+// External IPC functions
+extern void benchmark_ipc(void);
+
+// External blocking synchronization functions
+extern void benchmark_wait(void);
+
+// External EL0 functions
+extern void benchmark_syscall(void);
+extern void user_hello(void);
+extern void user_svc_bench(void);
+extern void user_vdso_demo(void);
+
+// External timer functions
+typedef struct ktimer ktimer_t;
+extern ktimer_t* timer_create(void (*callback)(void* data), void* data);
+extern void timer_arm(ktimer_t* timer, uint64_t deadline_ns);
+extern void timer_destroy(ktimer_t* timer);
+extern uint64_t timer_now_ns(void);
+extern void timer_tick_start(void);
+extern void timer_tick_stop(void);
+
+// External measurement functions
+extern uint64_t perf_cycles(void);
+extern uint64_t nr_free_pages(void);
+
+// External trace functions
+extern volatile uint32_t trace_mask;
+extern void trace_event(uint32_t event, uint64_t a, uint64_t b);
+extern uint32_t trace_set_events(uint32_t mask);
+extern void trace_dump(void);
+#define TRACE_SWITCH        1
+#define TRACE_WAKEUP        2
+#define TRACE_ALL           0xFE
+#define trace_point(event, a, b) \
+    do { if (trace_mask & (1U << (event))) trace_event((event), (a), (b)); } while (0)
+
+// External vDSO functions
+extern void vdso_update_cpu(int cpu, int pid, uint32_t nr_running, uint64_t ticks,
+                            uint32_t time_slice, uint64_t slice_end);
+
+// External FP/SIMD functions
+typedef struct fpsimd_state fpsimd_state_t;
+typedef struct fpsimd_ctx {
+    fpsimd_state_t* state;
+    int cpu;
+} fpsimd_ctx_t;
+extern void fpsimd_ctx_init(fpsimd_ctx_t* ctx);
+extern void fpsimd_ctx_release(fpsimd_ctx_t* ctx);
+extern void fpsimd_switch(void);
+extern void test_fpsimd(void);
+
+// External red-black tree functions
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    int color;
+} rb_node_t;
+typedef struct rb_root {
+    rb_node_t* node;
+} rb_root_t;
+extern void rb_link_node(rb_node_t* node, rb_node_t* parent, rb_node_t** link);
+extern void rb_insert_color(rb_node_t* node, rb_root_t* root);
+extern void rb_erase(rb_node_t* node, rb_root_t* root);
+extern rb_node_t* rb_next(const rb_node_t* node);
+
+// Scheduling classes, SCHED_PRIO always runs before SCHED_FAIR
+typedef enum {
+    SCHED_FAIR = 0,     // Weighted fair share by virtual runtime (default)
+    SCHED_PRIO = 1      // Fixed priority, round robin within a level
+} sched_policy_t;
+
+// Process Control Block
+typedef struct process {
+    int pid;                    // Process ID
+    char name[32];             // Process name
+    volatile process_state_t state; // Current state
+    cpu_context_t context;     // Saved CPU context
+    fpsimd_ctx_t fpsimd;       // FP/SIMD registers, saved only if used
+    uint8_t* stack_base;       // Base of process stack
+    size_t stack_size;         // Stack size
+    uint64_t time_slice;       // Time slice remaining
+    ktimer_t* sleep_timer;     // Wakes the process from process_sleep
+    sched_policy_t policy;     // Scheduling class
+    int priority;              // SCHED_PRIO: 0 is the highest
+    int nice;                  // SCHED_FAIR: -20 (most CPU) .. 19
+    uint32_t weight;           // SCHED_FAIR: load weight for nice
+    uint64_t vruntime;         // SCHED_FAIR: weighted runtime, counter ticks
+    uint64_t sum_exec_runtime; // CPU time used, counter ticks
+    uint64_t exec_start;       // Counter value at last accounting
+    uint64_t slice_start;      // sum_exec_runtime when last picked
+    int on_rq;                 // Queued on a run queue
+    int cpu;                   // CPU whose run queue owns the process
+    volatile int on_cpu;       // Still executing (until the switch away completes)
+    struct process* rq_next;   // Run queue links (per priority FIFO)
+    struct process* rq_prev;
+    rb_node_t rb_node;         // Fair run queue node, keyed by vruntime
+    uint64_t user_entry;       // EL0 tasks: entry point at EL0 (0 for kernel processes)
+    uint64_t user_stack;       // EL0 tasks: top of the user stack
+    mm_t* mm;                  // EL0 tasks: address space (NULL: the kernel's)
+    int pi_boosted;            // Running at a priority inherited through a mutex
+    sched_policy_t pi_policy;  // Class and priority to go back to after the boost
+    int pi_priority;
+    int quiet;                 // No console messages at create and exit
+    struct process* next;      // Reap list or PCB pool link
+} process_t;
+
+// Priority levels: 0 (highest) .. NR_PRIORITIES - 1 (lowest)
+#define NR_PRIORITIES 32
+#define DEFAULT_PRIORITY 16
+
+// One FIFO per priority plus a bitmap of non-empty levels. Level p is
+// bit (31 - p), so the highest runnable priority is clz(bitmap).
+typedef struct {
+    process_t* head[NR_PRIORITIES];
+    process_t* tail[NR_PRIORITIES];
+    uint32_t bitmap;
+    uint32_t nr_running;
+} run_queue_t;
+
+// Fair class: runnable processes ordered by vruntime, the running
+// process is kept out of the tree
+typedef struct {
+    rb_root_t tasks;
+    process_t* leftmost;        // Smallest vruntime, next to run
+    uint32_t nr_running;
+    uint64_t total_weight;
+    uint64_t min_vruntime;      // Monotonic floor for placing wakeups
+} fair_rq_t;
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+#ifndef HZ
+#define HZ 100
+#endif
+
+// Per-CPU scheduler state. Each lock covers its CPU's queues and curr;
+// a process is only ever moved between CPUs with its old queue locked.
+typedef struct cpu_rq {
+    spinlock_t lock;
+    int cpu;
+    volatile int online;        // Scheduling here (set by sched_start_cpu)
+    process_t* curr;            // Running process
+    process_t* idle;            // Runs when nothing else can
+    process_t* prev;            // Switched away from, on_cpu cleared after the switch
+    run_queue_t prio;           // SCHED_PRIO processes
+    fair_rq_t fair;             // SCHED_FAIR processes
+    volatile int need_resched;  // Set by the tick or a waker, checked on IRQ exit
+    uint64_t ticks;
+    uint64_t nr_switches;
+    uint64_t nr_steals;         // Processes pulled from other CPUs
+} cpu_rq_t;
+
+// SGI used to make another CPU reschedule
+#define IPI_RESCHEDULE 0
+
+// Fair class tunables
+#define SCHED_LATENCY_NS            20000000ULL  // Every fair process runs once per period
+#define SCHED_MIN_GRANULARITY_NS    4000000ULL   // Period stretches past this many tasks
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000ULL   // vruntime lead needed to preempt
+#define NICE_0_WEIGHT               1024
+#define NICE_MIN                    (-20)
+#define NICE_MAX                    19
+
+// Each nice step is ~10% CPU relative to the neighbouring level
+static const uint32_t nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+// PID table. A PID is (generation << PID_SLOT_BITS) | slot: lookup is
+// two indexes and a compare, and a stale PID never names the process
+// that reused its slot. Slot 0 stays empty, PID 0 is the idle processes.
+// The table starts with one chunk of slots and grows a chunk at a time
+// when none is free, so in practice stacks run out first (mm.c).
+#define PID_SLOT_BITS   16
+#define PID_SLOTS       (1U << PID_SLOT_BITS)
+#define PID_GEN_LIMIT   (1U << (31 - PID_SLOT_BITS))    // Keeps PIDs positive
+#define PID_CHUNK_BITS  8
+#define PID_CHUNK       (1U << PID_CHUNK_BITS)
+
+// Reaped PCBs kept with their stack and sleep timer for the next create
+#define PCB_POOL_MAX    16
+
+// A process_wait caller, queued on its own stack
+typedef struct exit_waiter {
+    process_t* proc;
+    int status;                 // Set by process_exit before the wakeup
+    struct exit_waiter* next;
+} exit_waiter_t;
+
+typedef struct {
+    process_t* proc;            // NULL when free or exited
+    int pid;                    // PID of proc, or of the last one to exit
+    int status;                 // Exit status of the last one
+    uint32_t gen;               // Generation of the next PID
+    uint32_t next_free;         // Free list link (slot index, 0 at the end)
+    exit_waiter_t* waiters;
+} pid_slot_t;
+
+// Process management globals
+static pid_slot_t pid_chunk0[PID_CHUNK];
+static pid_slot_t* pid_chunks[PID_SLOTS / PID_CHUNK];
+static uint32_t nr_pid_slots;               // Slots in the chunks so far
+static uint32_t pid_free_head;              // Free slots, FIFO so reuse comes late
+static uint32_t pid_free_tail;
+static uint32_t nr_pid_free;
+static process_t* reap_list = NULL;         // Exited, stack not yet freed
+static uint64_t nr_exited = 0;
+static uint64_t nr_reaped = 0;
+static process_t* pcb_pool = NULL;
+static int pcb_pool_count = 0;
+static spinlock_t process_table_lock;       // All of the above
+static process_t* reaper = NULL;
+static cpu_rq_t cpu_rqs[NR_CPUS];
+static volatile int active_cpus = NR_CPUS;  // New work only goes to CPUs below this
+static uint64_t counter_freq = 0;           // Generic counter frequency in Hz
+static kmem_cache_t* process_cache = NULL;
+
+static inline cpu_rq_t* this_rq(void) {
+    return &cpu_rqs[smp_processor_id()];
+}
+
+// PID table slot by index (below nr_pid_slots). Table locked.
+static inline pid_slot_t* pid_slot_at(uint32_t idx) {
+    return &pid_chunks[idx >> PID_CHUNK_BITS][idx & (PID_CHUNK - 1)];
+}
+
+static void pid_free_push(uint32_t idx) {
+    pid_slot_at(idx)->next_free = 0;
+    if (pid_free_tail) {
+        pid_slot_at(pid_free_tail)->next_free = idx;
+    } else {
+        pid_free_head = idx;
+    }
+    pid_free_tail = idx;
+    nr_pid_free++;
+}
+
+// Index of the oldest free slot, or 0 if there is none
+static uint32_t pid_free_pop(void) {
+    uint32_t idx = pid_free_head;
+    if (idx) {
+        pid_free_head = pid_slot_at(idx)->next_free;
+        if (!pid_free_head) {
+            pid_free_tail = 0;
+        }
+        nr_pid_free--;
+    }
+    return idx;
+}
+
+// Stack size for each process (64KB reserved, mapped as it is used;
+// KSTACK_SIZE in mm.c)
+#define PROCESS_STACK_SIZE 0x10000
+#define IDLE_STACK_ORDER 0          // Idle only needs room for IRQ frames
+#define TIME_SLICE_TICKS 10
+
+// pt_regs area at the top of each kernel stack, where an EL0 task's
+// trap frame lands
+#define task_pt_regs(proc) \
+    ((pt_regs_t*)((proc)->stack_base + (proc)->stack_size - sizeof(pt_regs_t)))
+
+// Utility functions
+static void print_hex(uint64_t value) {
+    uart_puts("0x");
+    for (int i = 15; i >= 0; i--) {
+        int digit = (value >> (i * 4)) & 0xF;
+        char c = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+        uart_putc(c);
+    }
+}
+
+// Copy a string, truncating it to fit max_len bytes with the terminator
+static void strcpy_simple(char* dest, const char* src, size_t max_len) {
+    size_t len = strlen(src);
+    if (len > max_len - 1) {
+        len = max_len - 1;
+    }
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+// Run queue operations, all O(1). Callers hold rq->lock with IRQs masked.
+static void rq_enqueue(cpu_rq_t* rq, process_t* proc) {
+    run_queue_t* run_queue = &rq->prio;
+    int prio = proc->priority;
+    
+    proc->rq_next = NULL;
+    proc->rq_prev = run_queue->tail[prio];
+    if (run_queue->tail[prio]) {
+        run_queue->tail[prio]->rq_next = proc;
+    } else {
+        run_queue->head[prio] = proc;
+    }
+    run_queue->tail[prio] = proc;
+    
+    run_queue->bitmap |= 1U << (31 - prio);
+    run_queue->nr_running++;
+    proc->on_rq = 1;
+}
+
+static void rq_dequeue(cpu_rq_t* rq, process_t* proc) {
+    run_queue_t* run_queue = &rq->prio;
+    int prio = proc->priority;
+    
+    if (proc->rq_prev) {
+        proc->rq_prev->rq_next = proc->rq_next;
+    } else {
+        run_queue->head[prio] = proc->rq_next;
+    }
+    if (proc->rq_next) {
+        proc->rq_next->rq_prev = proc->rq_prev;
+    } else {
+        run_queue->tail[prio] = proc->rq_prev;
+    }
+    if (!run_queue->head[prio]) {
+        run_queue->bitmap &= ~(1U << (31 - prio));
+    }
+    
+    proc->rq_next = NULL;
+    proc->rq_prev = NULL;
+    run_queue->nr_running--;
+    proc->on_rq = 0;
+}
+
+// Head of the highest non-empty priority level
+static process_t* rq_pick(cpu_rq_t* rq) {
+    if (!rq->prio.bitmap) {
+        return NULL;
+    }
+    return rq->prio.head[__builtin_clz(rq->prio.bitmap)];
+}
+
+static void rq_reset(cpu_rq_t* rq, int cpu) {
+    rq->lock.lock = 0;
+    rq->cpu = cpu;
+    rq->online = 0;
+    rq->curr = NULL;
+    rq->idle = NULL;
+    rq->prev = NULL;
+    rq->need_resched = 0;
+    rq->ticks = 0;
+    rq->nr_switches = 0;
+    rq->nr_steals = 0;
+    
+    for (int i = 0; i < NR_PRIORITIES; i++) {
+        rq->prio.head[i] = NULL;
+        rq->prio.tail[i] = NULL;
+    }
+    rq->prio.bitmap = 0;
+    rq->prio.nr_running = 0;
+    
+    rq->fair.tasks.node = NULL;
+    rq->fair.leftmost = NULL;
+    rq->fair.nr_running = 0;
+    rq->fair.total_weight = 0;
+    rq->fair.min_vruntime = 0;
+}
+
+// Runtime is measured on the generic counter, not in scheduler ticks
+static inline uint64_t read_cntvct(void) {
+    uint64_t value;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+}
+
+static uint64_t ns_to_counter(uint64_t ns) {
+    return ns * counter_freq / 1000000000ULL;
+}
+
+#define rb_to_process(node) \
+    ((process_t*)((uint8_t*)(node) - offsetof(process_t, rb_node)))
+
+// Fair class operations: O(log n) insert/erase, O(1) pick
+static void fair_enqueue(cpu_rq_t* rq, process_t* proc) {
+    fair_rq_t* fair_rq = &rq->fair;
+    rb_node_t** link = &fair_rq->tasks.node;
+    rb_node_t* parent = NULL;
+    int leftmost = 1;
+    
+    // Equal vruntimes go right, so ties run in FIFO order
+    while (*link) {
+        parent = *link;
+        if (proc->vruntime < rb_to_process(parent)->vruntime) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+    
+    rb_link_node(&proc->rb_node, parent, link);
+    rb_insert_color(&proc->rb_node, &fair_rq->tasks);
+    if (leftmost) {
+        fair_rq->leftmost = proc;
+    }
+    
+    fair_rq->nr_running++;
+    fair_rq->total_weight += proc->weight;
+    proc->on_rq = 1;
+}
+
+static void fair_dequeue(cpu_rq_t* rq, process_t* proc) {
+    fair_rq_t* fair_rq = &rq->fair;
+    
+    if (fair_rq->leftmost == proc) {
+        rb_node_t* next = rb_next(&proc->rb_node);
+        fair_rq->leftmost = next ? rb_to_process(next) : NULL;
+    }
+    rb_erase(&proc->rb_node, &fair_rq->tasks);
+    
+    fair_rq->nr_running--;
+    fair_rq->total_weight -= proc->weight;
+    proc->on_rq = 0;
+}
+
+// Wall time scaled by NICE_0_WEIGHT / weight
+static uint64_t calc_delta_fair(uint64_t delta, const process_t* proc) {
+    if (proc->weight == NICE_0_WEIGHT) {
+        return delta;
+    }
+    return delta * NICE_0_WEIGHT / proc->weight;
+}
+
+// Slice for proc: the latency period, stretched when crowded, split by weight
+static uint64_t sched_slice(cpu_rq_t* rq, const process_t* proc) {
+    uint64_t nr = rq->fair.nr_running + 1;
+    uint64_t period = SCHED_LATENCY_NS;
+    if (nr > SCHED_LATENCY_NS / SCHED_MIN_GRANULARITY_NS) {
+        period = nr * SCHED_MIN_GRANULARITY_NS;
+    }
+    
+    uint64_t total = rq->fair.total_weight + proc->weight;
+    return ns_to_counter(period) * proc->weight / total;
+}
+
+static void update_min_vruntime(cpu_rq_t* rq) {
+    fair_rq_t* fair_rq = &rq->fair;
+    process_t* curr = rq->curr;
+    uint64_t vruntime = fair_rq->min_vruntime;
+    int have = 0;
+    
+    if (curr && curr != rq->idle && curr->policy == SCHED_FAIR &&
+        curr->state == PROCESS_RUNNING) {
+        vruntime = curr->vruntime;
+        have = 1;
+    }
+    if (fair_rq->leftmost && (!have || fair_rq->leftmost->vruntime < vruntime)) {
+        vruntime = fair_rq->leftmost->vruntime;
+        have = 1;
+    }
+    
+    if (have && vruntime > fair_rq->min_vruntime) {
+        fair_rq->min_vruntime = vruntime;
+    }
+}
+
+// Charge the running process for the time since it was last accounted
+static void update_curr(cpu_rq_t* rq) {
+    process_t* curr = rq->curr;
+    if (!curr || curr == rq->idle) {
+        return;
+    }
+    
+    uint64_t now = read_cntvct();
+    uint64_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->sum_exec_runtime += delta;
+    
+    if (curr->policy == SCHED_FAIR) {
+        curr->vruntime += calc_delta_fair(delta, curr);
+        update_min_vruntime(rq);
+    }
+}
+
+// A waking process gets at most half a period of credit for having slept
+static void place_process(cpu_rq_t* rq, process_t* proc) {
+    uint64_t credit = ns_to_counter(SCHED_LATENCY_NS / 2);
+    uint64_t min_vruntime = rq->fair.min_vruntime;
+    uint64_t floor = min_vruntime > credit ? min_vruntime - credit : 0;
+    if (proc->vruntime < floor) {
+        proc->vruntime = floor;
+    }
+}
+
+// vruntime only means something relative to its queue's min_vruntime,
+// so a process changing CPU keeps its lag, not its absolute value
+static void migrate_vruntime(process_t* proc, cpu_rq_t* from, cpu_rq_t* to) {
+    if (proc->policy != SCHED_FAIR || from == to) {
+        return;
+    }
+    uint64_t lag = proc->vruntime > from->fair.min_vruntime ?
+                   proc->vruntime - from->fair.min_vruntime : 0;
+    proc->vruntime = to->fair.min_vruntime + lag;
+}
+
+// Class dispatch
+static void enqueue_process(cpu_rq_t* rq, process_t* proc, int wakeup) {
+    if (proc->policy == SCHED_PRIO) {
+        rq_enqueue(rq, proc);
+    } else {
+        if (wakeup) {
+            place_process(rq, proc);
+        }
+        fair_enqueue(rq, proc);
+    }
+}
+
+static void dequeue_process(cpu_rq_t* rq, process_t* proc) {
+    if (proc->policy == SCHED_PRIO) {
+        rq_dequeue(rq, proc);
+    } else {
+        fair_dequeue(rq, proc);
+    }
+}
+
+// Queued processes, not counting the running one. Safe to read without
+// the lock as a load estimate.
+static inline uint32_t nr_runnable(cpu_rq_t* rq) {
+    return rq->prio.nr_running + rq->fair.nr_running;
+}
+
+// Queued plus running, for placement decisions
+static inline uint32_t rq_load(cpu_rq_t* rq) {
+    process_t* curr = rq->curr;
+    return nr_runnable(rq) + (curr && curr != rq->idle ? 1 : 0);
+}
+
+// Mirror rq's running process and queue length into the vDSO page, so
+// EL0 can see how much of its slice is left. The fair class only
+// preempts when something is queued, so slice_end matters only then.
+// Called with rq->lock held.
+static void rq_publish(cpu_rq_t* rq) {
+    process_t* curr = rq->curr;
+    int pid = 0;
+    uint32_t time_slice = 0;
+    uint64_t slice_end = 0;
+    
+    if (curr && curr != rq->idle) {
+        pid = curr->pid;
+        time_slice = (uint32_t)curr->time_slice;
+        if (curr->policy == SCHED_FAIR) {
+            uint64_t ran = curr->sum_exec_runtime - curr->slice_start;
+            uint64_t slice = sched_slice(rq, curr);
+            slice_end = curr->exec_start + (slice > ran ? slice - ran : 0);
+        } else {
+            slice_end = curr->exec_start + curr->time_slice * ns_to_counter(1000000000ULL / HZ);
+        }
+    }
+    vdso_update_cpu(rq->cpu, pid, nr_runnable(rq), rq->ticks, time_slice, slice_end);
+}
+
+// Should a newly runnable process take the CPU from the running one?
+static int should_preempt(cpu_rq_t* rq, process_t* proc) {
+    process_t* curr = rq->curr;
+    if (!curr || curr->state != PROCESS_RUNNING) {
+        return 0;
+    }
+    if (curr == rq->idle) {
+        return 1;
+    }
+    
+    if (proc->policy == SCHED_PRIO) {
+        return curr->policy != SCHED_PRIO || proc->priority < curr->priority;
+    }
+    if (curr->policy == SCHED_PRIO) {
+        return 0;
+    }
+    
+    update_curr(rq);
+    return curr->vruntime > proc->vruntime + ns_to_counter(SCHED_WAKEUP_GRANULARITY_NS);
+}
+
+static void idle_loop(void);
+static void process_sleep_expired(void* data);
+void schedule_process(process_t* proc);
+int process_wake(process_t* proc);
+void process_exit(int status);
+
+// Set up a fresh context that enters process_start -> process_wrapper
+static void init_context(process_t* proc, void (*entry_point)(void), size_t stack_size) {
+    // Clear all registers
+    memset(&proc->context, 0, sizeof(cpu_context_t));
+    
+    // Stack starts below the pt_regs area (stacks grow downward)
+    proc->context.sp = (uint64_t)(proc->stack_base + stack_size - sizeof(pt_regs_t));
+    
+    // Start in the trampoline, which calls process_wrapper(entry_point)
+    proc->context.x19 = (uint64_t)entry_point;
+    proc->context.pc = (uint64_t)process_start;
+    
+    // Entered with IRQs masked, as schedule() runs; process_wrapper
+    // unmasks them once the switch that got it here is finished
+}
+
+// Make rq's CPU reschedule on its next IRQ exit, interrupting it if remote
+static void resched_rq(cpu_rq_t* rq) {
+    rq->need_resched = 1;
+    if (rq != this_rq()) {
+        gic_send_sgi(1U << rq->cpu, IPI_RESCHEDULE);
+    }
+}
+
+// IPI_RESCHEDULE: work was queued here, or there is work to steal
+static void ipi_reschedule(void) {
+    this_rq()->need_resched = 1;
+}
+
+// Idle process (PID 0) for a CPU, never on the process list or a run queue
+static process_t* create_idle_process(int cpu) {
+    process_t* idle = (process_t*)kmem_cache_alloc(process_cache);
+    if (idle) {
+        idle->stack_base = (uint8_t*)alloc_pages_zeroed(IDLE_STACK_ORDER);
+        if (!idle->stack_base) {
+            kmem_cache_free(process_cache, idle);
+            idle = NULL;
+        }
+    }
+    if (!idle) {
+        uart_puts("Failed to create idle process!\n");
+        return NULL;
+    }
+    
+    idle->pid = 0;
+    strcpy_simple(idle->name, "idle", sizeof(idle->name));
+    idle->state = PROCESS_READY;
+    idle->stack_size = 4096 << IDLE_STACK_ORDER;
+    idle->time_slice = 0;
+    idle->sleep_timer = NULL;
+    idle->policy = SCHED_PRIO;
+    idle->priority = NR_PRIORITIES - 1;
+    idle->nice = 0;
+    idle->weight = NICE_0_WEIGHT;
+    idle->vruntime = 0;
+    idle->sum_exec_runtime = 0;
+    idle->exec_start = 0;
+    idle->slice_start = 0;
+    idle->on_rq = 0;
+    idle->cpu = cpu;
+    idle->on_cpu = 0;
+    idle->rq_next = NULL;
+    idle->rq_prev = NULL;
+    idle->user_entry = 0;
+    idle->user_stack = 0;
+    idle->mm = NULL;
+    idle->pi_boosted = 0;
+    idle->quiet = 0;
+    idle->next = NULL;
+    fpsimd_ctx_init(&idle->fpsimd);
+    init_context(idle, idle_loop, idle->stack_size);
+    
+    cpu_rqs[cpu].idle = idle;
+    return idle;
+}
+
+// Initialize process management
+void init_process_manager(void) {
+    uart_puts("Initializing process management...\n");
+    
+    process_table_lock.lock = 0;
+    memset(pid_chunk0, 0, sizeof(pid_chunk0));
+    pid_chunks[0] = pid_chunk0;
+    nr_pid_slots = PID_CHUNK;
+    pid_free_head = 0;
+    pid_free_tail = 0;
+    nr_pid_free = 0;
+    for (uint32_t idx = 1; idx < PID_CHUNK; idx++) {
+        pid_free_push(idx);
+    }
+    reap_list = NULL;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        rq_reset(&cpu_rqs[cpu], cpu);
+    }
+    active_cpus = NR_CPUS;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(counter_freq));
+    
+    // PCBs come from their own slab cache
+    if (!process_cache) {
+        process_cache = kmem_cache_create("process_t", sizeof(process_t));
+    }
+    
+    // Secondary CPUs get theirs from sched_prepare_cpu
+    create_idle_process(smp_processor_id());
+    
+    register_irq_handler(IPI_RESCHEDULE, ipi_reschedule);
+    
+    uart_puts("Process manager initialized.\n");
+}
+
+// Second half of a context switch, run by the process switched to. prev
+// is off its stack now, so other CPUs may wake it or run it.
+static void finish_switch(void) {
+    cpu_rq_t* rq = this_rq();
+    process_t* prev = rq->prev;
+    if (prev) {
+        rq->prev = NULL;
+        __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// The calling process. IRQs are masked so it cannot move CPU between
+// finding its run queue and reading curr.
+process_t* get_current(void) {
+    uint64_t flags = irq_save();
+    process_t* curr = this_rq()->curr;
+    irq_restore(flags);
+    return curr;
+}
+
+// FP context of the running process, for the FP/SIMD trap (IRQs masked)
+fpsimd_ctx_t* current_fpsimd(void) {
+    cpu_rq_t* rq = this_rq();
+    if (!rq->curr || rq->curr == rq->idle) {
+        return NULL;
+    }
+    return &rq->curr->fpsimd;
+}
+
+// Process wrapper function to handle process termination
+// (entered from process_start in context_switch.s)
+void process_wrapper(void (*entry_point)(void)) {
+    finish_switch();
+    asm volatile("msr daifclr, #2");
+    
+    // Call the actual process function
+    entry_point();
+    
+    // If process returns, mark it as terminated
+    process_exit(0);
+}
+
+// Slot for pid, which may hold another generation (NULL if out of range)
+static pid_slot_t* pid_slot(int pid) {
+    uint32_t idx = (uint32_t)pid & (PID_SLOTS - 1);
+    if (pid <= 0 || idx == 0 || idx >= nr_pid_slots) {
+        return NULL;
+    }
+    return pid_slot_at(idx);
+}
+
+// Add a chunk of free slots to the PID table. Takes the table lock
+// itself, since it allocates first; returns 0 if memory or slot numbers
+// have run out.
+static int pid_table_grow(void) {
+    pid_slot_t* chunk = (pid_slot_t*)kmalloc(PID_CHUNK * sizeof(pid_slot_t));
+    if (!chunk) {
+        return 0;
+    }
+    memset(chunk, 0, PID_CHUNK * sizeof(pid_slot_t));
+    
+    uint64_t flags = spin_lock_irqsave(&process_table_lock);
+    uint32_t first = nr_pid_slots;
+    if (first >= PID_SLOTS) {
+        spin_unlock_irqrestore(&process_table_lock, flags);
+        kfree(chunk);
+        return 0;
+    }
+    pid_chunks[first >> PID_CHUNK_BITS] = chunk;
+    nr_pid_slots = first + PID_CHUNK;
+    for (uint32_t idx = first; idx < first + PID_CHUNK; idx++) {
+        pid_free_push(idx);
+    }
+    spin_unlock_irqrestore(&process_table_lock, flags);
+    return 1;
+}
+
+// Find a live process by PID (NULL if there is none). Table locked; the
+// process cannot be reaped until the lock is dropped.
+static process_t* find_process(int pid) {
+    pid_slot_t* slot = pid_slot(pid);
+    if (!slot || slot->pid != pid) {
+        return NULL;
+    }
+    return slot->proc;
+}
+
+// Terminate the calling process with an exit status for process_wait
+// (a returning entry point, SYS_EXIT, or a fatal fault at EL0). The
+// reaper frees its stack once it is switched out.
+void process_exit(int status) {
+    disable_interrupts();
+    process_t* curr = this_rq()->curr;
+    if (curr && curr != this_rq()->idle) {
+        curr->state = PROCESS_TERMINATED;
+        
+        // Out of the table: the PID now only reports status, and the
+        // slot goes to the back of the free list
+        spin_lock(&process_table_lock);
+        pid_slot_t* slot = pid_slot(curr->pid);
+        exit_waiter_t* waiters = slot->waiters;
+        slot->proc = NULL;
+        slot->status = status;
+        slot->waiters = NULL;
+        slot->gen = (slot->gen + 1) % PID_GEN_LIMIT;
+        pid_free_push((uint32_t)curr->pid & (PID_SLOTS - 1));
+        curr->next = reap_list;
+        reap_list = curr;
+        nr_exited++;
+        spin_unlock(&process_table_lock);
+        
+        if (curr->mm) {
+            // Back on the kernel's table before the tables go
+            mm_t* mm = curr->mm;
+            switch_mm(NULL);
+            curr->mm = NULL;
+            mm_destroy(mm);
+        }
+        
+        while (waiters) {
+            exit_waiter_t* waiter = waiters;
+            process_t* proc = waiter->proc;
+            waiters = waiter->next;
+            waiter->status = status;
+            process_wake(proc);
+        }
+        
+        if (!curr->quiet) {
+            uart_puts("Process ");
+            print_decimal(curr->pid);
+            uart_puts(" terminated, status ");
+            print_signed(status);
+            uart_puts(".\n");
+        }
+        if (reaper) {
+            process_wake(reaper);
+        }
+    }
+    
+    // Switch away for good
+    schedule();
+    
+    // Should never reach here
+    while(1) {
+        asm volatile("wfi");
+    }
+}
+
+// PID of the calling process (0 for idle)
+int current_pid(void) {
+    process_t* curr = get_current();
+    return curr ? curr->pid : 0;
+}
+
+// Busiest other CPU with queued work, if this CPU may take some
+static cpu_rq_t* find_busiest(cpu_rq_t* rq) {
+    if (rq->cpu >= active_cpus) {
+        return NULL;
+    }
+    
+    cpu_rq_t* busiest = NULL;
+    uint32_t max = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        cpu_rq_t* other = &cpu_rqs[cpu];
+        if (other == rq || !other->online) {
+            continue;
+        }
+        uint32_t queued = nr_runnable(other);
+        if (queued > max) {
+            max = queued;
+            busiest = other;
+        }
+    }
+    return busiest;
+}
+
+// First queued process on victim that is not still switching out
+static process_t* steal_candidate(cpu_rq_t* victim) {
+    uint32_t bitmap = victim->prio.bitmap;
+    while (bitmap) {
+        int prio = __builtin_clz(bitmap);
+        for (process_t* proc = victim->prio.head[prio]; proc; proc = proc->rq_next) {
+            if (!proc->on_cpu) {
+                return proc;
+            }
+        }
+        bitmap &= ~(1U << (31 - prio));
+    }
+    
+    rb_node_t* node = victim->fair.leftmost ? &victim->fair.leftmost->rb_node : NULL;
+    for (; node; node = rb_next(node)) {
+        if (!rb_to_process(node)->on_cpu) {
+            return rb_to_process(node);
+        }
+    }
+    return NULL;
+}
+
+// Pull one process from the busiest CPU. Called with rq->lock held; the
+// victim is only trylocked, so two CPUs stealing from each other cannot
+// deadlock. The process comes back dequeued and owned by rq.
+static process_t* steal_process(cpu_rq_t* rq) {
+    cpu_rq_t* victim = find_busiest(rq);
+    if (!victim || !spin_trylock(&victim->lock)) {
+        return NULL;
+    }
+    
+    process_t* proc = steal_candidate(victim);
+    if (proc) {
+        dequeue_process(victim, proc);
+        migrate_vruntime(proc, victim, rq);
+        proc->cpu = rq->cpu;
+        rq->nr_steals++;
+    }
+    
+    spin_unlock(&victim->lock);
+    return proc;
+}
+
+// Wake an idle CPU so it comes to steal the work queued on busy
+static void kick_idle_cpu(cpu_rq_t* busy) {
+    for (int cpu = 0; cpu < active_cpus; cpu++) {
+        cpu_rq_t* rq = &cpu_rqs[cpu];
+        if (rq != busy && rq->online && rq->curr == rq->idle && !rq->need_resched) {
+            resched_rq(rq);
+            return;
+        }
+    }
+}
+
+// Idle process: look for work here or on other CPUs, otherwise stop the
+// periodic tick and sleep until the next timer wheel expiry, IPI or
+// device interrupt
+static void idle_loop(void) {
+    while (1) {
+        disable_interrupts();
+        cpu_rq_t* rq = this_rq();
+        if (rq->need_resched || nr_runnable(rq) || find_busiest(rq)) {
+            schedule();
+        } else {
+            timer_tick_stop();
+            // wfi wakes on a pending IRQ even while masked, so a wakeup
+            // that lands between the check and wfi is not lost
+            asm volatile("wfi");
+        }
+        asm volatile("msr daifclr, #2");
+    }
+}
+
+// Make a blocked process runnable. Only one waker wins the BLOCKED ->
+// READY transition; returns 1 if it was this one.
+int process_wake(process_t* proc) {
+    if (atomic_cmpxchg((volatile int*)&proc->state, PROCESS_BLOCKED, PROCESS_READY) !=
+        PROCESS_BLOCKED) {
+        return 0;
+    }
+    
+    schedule_process(proc);
+    return 1;
+}
+
+// Mark the calling process blocked, ahead of schedule() or sched_handoff.
+// A waker that gets in before the switch turns it back to ready, so the
+// wakeup is not lost. IRQs masked.
+void process_prepare_block(void) {
+    this_rq()->curr->state = PROCESS_BLOCKED;
+}
+
+// Sleep timer expired (IRQ context): make the process runnable again
+static void process_sleep_expired(void* data) {
+    process_wake((process_t*)data);
+}
+
+// Block the current process for at least ns nanoseconds
+void process_sleep(uint64_t ns) {
+    uint64_t flags = irq_save();
+    cpu_rq_t* rq = this_rq();
+    process_t* proc = rq->curr;
+    if (!proc || proc == rq->idle || !proc->sleep_timer) {
+        irq_restore(flags);
+        return;
+    }
+    
+    proc->state = PROCESS_BLOCKED;
+    timer_arm(proc->sleep_timer, timer_now_ns() + ns);
+    schedule();
+    irq_restore(flags);
+}
+
+// A PCB with its stack reserved (only the top page mapped yet) and its
+// process_sleep timer, from the pool of reaped ones if it has any
+static process_t* pcb_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&process_table_lock);
+    process_t* proc = pcb_pool;
+    if (proc) {
+        pcb_pool = proc->next;
+        pcb_pool_count--;
+    }
+    spin_unlock_irqrestore(&process_table_lock, flags);
+    if (proc) {
+        return proc;
+    }
+    
+    proc = (process_t*)kmem_cache_alloc(process_cache);
+    if (!proc) {
+        uart_puts("Failed to allocate PCB!\n");
+        return NULL;
+    }
+    
+    proc->stack_base = kstack_alloc();
+    if (!proc->stack_base) {
+        uart_puts("Failed to allocate stack!\n");
+        kmem_cache_free(process_cache, proc);
+        return NULL;
+    }
+    
+    // Allocated now so sleeping never allocates
+    proc->sleep_timer = timer_create(process_sleep_expired, proc);
+    if (!proc->sleep_timer) {
+        uart_puts("Failed to allocate sleep timer!\n");
+        kstack_free(proc->stack_base);
+        kmem_cache_free(process_cache, proc);
+        return NULL;
+    }
+    return proc;
+}
+
+// Give back a PCB that never ran or has been switched out for good:
+// into the pool while it has room, otherwise stack, timer and all
+static void pcb_free(process_t* proc) {
+    fpsimd_ctx_release(&proc->fpsimd);
+    
+    uint64_t flags = spin_lock_irqsave(&process_table_lock);
+    if (pcb_pool_count < PCB_POOL_MAX) {
+        proc->next = pcb_pool;
+        pcb_pool = proc;
+        pcb_pool_count++;
+        spin_unlock_irqrestore(&process_table_lock, flags);
+        return;
+    }
+    spin_unlock_irqrestore(&process_table_lock, flags);
+    
+    timer_destroy(proc->sleep_timer);
+    kstack_free(proc->stack_base);
+    kmem_cache_free(process_cache, proc);
+}
+
+// Create a process without the console messages (failures excepted)
+static process_t* new_process(const char* name, void (*entry_point)(void)) {
+    process_t* proc = pcb_alloc();
+    if (!proc) {
+        return NULL;
+    }
+    
+    // Initialize process fields
+    strcpy_simple(proc->name, name, sizeof(proc->name));
+    proc->state = PROCESS_READY;
+    proc->stack_size = PROCESS_STACK_SIZE;
+    proc->time_slice = TIME_SLICE_TICKS;
+    proc->policy = SCHED_FAIR;
+    proc->priority = DEFAULT_PRIORITY;
+    proc->nice = 0;
+    proc->weight = NICE_0_WEIGHT;
+    proc->sum_exec_runtime = 0;
+    proc->exec_start = 0;
+    proc->slice_start = 0;
+    proc->on_rq = 0;
+    proc->on_cpu = 0;
+    proc->rq_next = NULL;
+    proc->rq_prev = NULL;
+    proc->user_entry = 0;
+    proc->user_stack = 0;
+    proc->mm = NULL;
+    proc->pi_boosted = 0;
+    proc->quiet = 0;
+    proc->next = NULL;
+    fpsimd_ctx_init(&proc->fpsimd);
+    
+    init_context(proc, entry_point, PROCESS_STACK_SIZE);
+    
+    // Into the PID table, starting level with everyone on this CPU
+    uint32_t idx;
+    do {
+        uint64_t flags = irq_save();
+        cpu_rq_t* rq = this_rq();
+        proc->cpu = rq->cpu;
+        proc->vruntime = rq->fair.min_vruntime;
+        spin_lock(&process_table_lock);
+        idx = pid_free_pop();
+        if (idx) {
+            pid_slot_t* slot = pid_slot_at(idx);
+            proc->pid = (int)((slot->gen << PID_SLOT_BITS) | idx);
+            slot->proc = proc;
+            slot->pid = proc->pid;
+            slot->status = 0;
+        }
+        spin_unlock(&process_table_lock);
+        irq_restore(flags);
+    } while (!idx && pid_table_grow());
+    
+    if (!idx) {
+        uart_puts("Process table full!\n");
+        pcb_free(proc);
+        return NULL;
+    }
+    return proc;
+}
+
+// Create a new process
+process_t* create_process(const char* name, void (*entry_point)(void)) {
+    uart_puts("Creating process: ");
+    uart_puts(name);
+    uart_puts("\n");
+    
+    process_t* proc = new_process(name, entry_point);
+    if (!proc) {
+        return NULL;
+    }
+    
+    uart_puts("Process created - PID: ");
+    print_decimal(proc->pid);
+    uart_puts(", Stack: ");
+    print_hex((uint64_t)proc->stack_base);
+    uart_puts("\n");
+    
+    return proc;
+}
+
+// Wait for process pid to exit. Returns pid with its exit status in
+// *status (if not NULL), or -1 if pid names no process: never created,
+// the caller itself, or exited so long ago that its slot is reused.
+int process_wait(int pid, int* status) {
+    exit_waiter_t waiter = { get_current(), 0, NULL };
+    
+    uint64_t flags = spin_lock_irqsave(&process_table_lock);
+    pid_slot_t* slot = pid_slot(pid);
+    if (!slot || slot->pid != pid || slot->proc == waiter.proc) {
+        spin_unlock_irqrestore(&process_table_lock, flags);
+        return -1;
+    }
+    
+    if (!slot->proc) {
+        // Already gone
+        waiter.status = slot->status;
+        spin_unlock_irqrestore(&process_table_lock, flags);
+    } else {
+        // process_exit fills in the status and wakes us
+        waiter.next = slot->waiters;
+        slot->waiters = &waiter;
+        process_prepare_block();
+        spin_unlock(&process_table_lock);
+        schedule();
+        irq_restore(flags);
+    }
+    
+    if (status) {
+        *status = waiter.status;
+    }
+    return pid;
+}
+
+// Frees what exited processes leave behind, since none can free the
+// stack it exits on. Blocked while there is nothing to reap.
+static void reaper_loop(void) {
+    while (1) {
+        uint64_t flags = spin_lock_irqsave(&process_table_lock);
+        process_t* list = reap_list;
+        reap_list = NULL;
+        if (!list) {
+            process_prepare_block();
+            spin_unlock(&process_table_lock);
+            schedule();
+            irq_restore(flags);
+            continue;
+        }
+        spin_unlock_irqrestore(&process_table_lock, flags);
+        
+        while (list) {
+            process_t* proc = list;
+            list = proc->next;
+            
+            // Its last switch away may still be in progress
+            while (__atomic_load_n(&proc->on_cpu, __ATOMIC_ACQUIRE)) {
+                cpu_relax();
+            }
+            pcb_free(proc);
+            
+            flags = spin_lock_irqsave(&process_table_lock);
+            nr_reaped++;
+            spin_unlock_irqrestore(&process_table_lock, flags);
+        }
+    }
+}
+
+// Kernel side of an EL0 task: fill in the pt_regs area with the user
+// entry state and eret to it. Later exceptions from EL0 use the same area.
+static void user_task_start(void) {
+    process_t* curr = get_current();
+    pt_regs_t* regs = task_pt_regs(curr);
+    
+    memset(regs, 0, sizeof(pt_regs_t));
+    regs->pc = curr->user_entry;
+    regs->sp = curr->user_stack;
+    regs->pstate = 0;           // EL0t, interrupts unmasked
+    
+    ret_to_user(regs);
+}
 
-// Process management globals
-static process_t* process_list = NULL;
-static process_t* current_process = NULL;
-static process_t* ready_queue = NULL;
-static int next_pid = 1;
-static uint64_t scheduler_ticks = 0;
+// Create a process that runs entry at EL0 in its own address space.
+// entry must live in a user_*.c file (the .user section) and leave with
+// SYS_EXIT.
+process_t* create_user_process(const char* name, void (*entry)(void)) {
+    mm_t* mm = mm_create();
+    uint64_t user_stack = mm ? mm_setup_stack(mm) : 0;
+    if (!user_stack) {
+        uart_puts("Failed to allocate address space!\n");
+        mm_destroy(mm);
+        return NULL;
+    }
+    
+    process_t* proc = create_process(name, user_task_start);
+    if (!proc) {
+        mm_destroy(mm);
+        return NULL;
+    }
+    
+    proc->user_entry = (uint64_t)entry;
+    proc->user_stack = user_stack;
+    proc->mm = mm;
+    return proc;
+}
 
-// Stack size for each process (64KB)
-#define PROCESS_STACK_SIZE 0x10000
-#define TIME_SLICE_TICKS 10
+// Lock two run queues in CPU order (they may be the same one)
+static void double_rq_lock(cpu_rq_t* a, cpu_rq_t* b) {
+    if (a == b) {
+        spin_lock(&a->lock);
+        return;
+    }
+    if (a->cpu > b->cpu) {
+        cpu_rq_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+    spin_lock(&a->lock);
+    spin_lock(&b->lock);
+}
 
-// Utility functions
-static void print_hex(uint64_t value) {
-    uart_puts("0x");
-    for (int i = 15; i >= 0; i--) {
-        int digit = (value >> (i * 4)) & 0xF;
-        char c = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
-        uart_putc(c);
+static void double_rq_unlock(cpu_rq_t* a, cpu_rq_t* b) {
+    spin_unlock(&a->lock);
+    if (a != b) {
+        spin_unlock(&b->lock);
+    }
+}
+
+// Where a new or woken process should run: its last CPU if that is idle,
+// otherwise the least loaded CPU allowed new work (lowest number on ties).
+// Before any CPU is scheduling, everything queues on the caller's.
+static cpu_rq_t* select_rq(process_t* proc) {
+    int limit = active_cpus;
+    cpu_rq_t* last = &cpu_rqs[proc->cpu];
+    if (proc->cpu < limit && last->online && rq_load(last) == 0) {
+        return last;
     }
+    
+    cpu_rq_t* best = NULL;
+    uint32_t best_load = 0;
+    for (int cpu = 0; cpu < limit; cpu++) {
+        cpu_rq_t* rq = &cpu_rqs[cpu];
+        if (!rq->online) {
+            continue;
+        }
+        uint32_t load = rq_load(rq);
+        if (!best || load < best_load) {
+            best = rq;
+            best_load = load;
+        }
+    }
+    return best ? best : this_rq();
 }
 
-static void print_decimal(int value) {
-    if (value == 0) {
-        uart_putc('0');
+// Make a new or woken process runnable in its scheduling class, on the
+// CPU select_rq picks
+void schedule_process(process_t* proc) {
+    if (!proc || proc->state != PROCESS_READY || proc->on_rq) {
         return;
     }
     
-    if (value < 0) {
-        uart_putc('-');
-        value = -value;
+    // A woken process may still be switching out on the CPU it blocked on
+    while (__atomic_load_n(&proc->on_cpu, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
     }
     
-    char buffer[12];
-    int pos = 0;
+    // Hold the old queue too, so set_priority/set_nice (which lock
+    // proc->cpu) see the move atomically
+    uint64_t flags = irq_save();
+    cpu_rq_t* from;
+    cpu_rq_t* rq;
+    while (1) {
+        from = &cpu_rqs[proc->cpu];
+        rq = select_rq(proc);
+        double_rq_lock(from, rq);
+        if (from == &cpu_rqs[proc->cpu]) {
+            break;
+        }
+        double_rq_unlock(from, rq);
+    }
     
-    while (value > 0 && pos < 11) {
-        buffer[pos++] = '0' + (value % 10);
-        value /= 10;
+    int preempt = 0;
+    if (proc->state == PROCESS_READY && !proc->on_rq) {
+        migrate_vruntime(proc, from, rq);
+        proc->cpu = rq->cpu;
+        enqueue_process(rq, proc, 1);
+        preempt = should_preempt(rq, proc);
+        rq_publish(rq);
+        trace_point(TRACE_WAKEUP, proc->pid, rq->cpu);
     }
     
-    // Print in reverse order
-    for (int i = pos - 1; i >= 0; i--) {
-        uart_putc(buffer[i]);
+    double_rq_unlock(from, rq);
+    if (preempt) {
+        resched_rq(rq);
     }
+    irq_restore(flags);
 }
 
-// Simple string copy
-static void strcpy_simple(char* dest, const char* src, size_t max_len) {
-    size_t i = 0;
-    while (src[i] && i < max_len - 1) {
-        dest[i] = src[i];
-        i++;
+// Take the next process off rq's queues: highest priority first, then
+// the fair process with the smallest vruntime
+static process_t* get_next_process(cpu_rq_t* rq) {
+    process_t* next = rq_pick(rq);
+    if (!next) {
+        next = rq->fair.leftmost;
+    }
+    if (next) {
+        dequeue_process(rq, next);
     }
-    dest[i] = '\0';
+    return next;
 }
 
-// Initialize process management
-void init_process_manager(void) {
-    uart_puts("Initializing process management...\n");
-    
-    process_list = NULL;
-    current_process = NULL;
-    ready_queue = NULL;
-    next_pid = 1;
-    scheduler_ticks = 0;
-    
-    uart_puts("Process manager initialized.\n");
+// Lock the run queue proc belongs to. Rechecks after locking, since
+// another CPU may move proc in between.
+static cpu_rq_t* task_rq_lock(process_t* proc, uint64_t* flags) {
+    while (1) {
+        cpu_rq_t* rq = &cpu_rqs[proc->cpu];
+        *flags = spin_lock_irqsave(&rq->lock);
+        if (rq == &cpu_rqs[proc->cpu]) {
+            return rq;
+        }
+        spin_unlock_irqrestore(&rq->lock, *flags);
+    }
 }
 
-// Process wrapper function to handle process termination
-static void process_wrapper(void (*entry_point)(void)) {
-    // Call the actual process function
-    entry_point();
+// Change a process's priority, requeueing it if it is runnable.
+// Returns 0 on success, -1 for an unknown PID or bad priority.
+int set_priority(int pid, int prio) {
+    if (prio < 0 || prio >= NR_PRIORITIES) {
+        return -1;
+    }
     
-    // If process returns, mark it as terminated
-    if (current_process) {
-        current_process->state = PROCESS_TERMINATED;
-        uart_puts("Process ");
-        print_decimal(current_process->pid);
-        uart_puts(" terminated.\n");
+    // The table lock keeps the process from exiting and being reaped
+    uint64_t table_flags = spin_lock_irqsave(&process_table_lock);
+    process_t* proc = find_process(pid);
+    if (!proc) {
+        spin_unlock_irqrestore(&process_table_lock, table_flags);
+        return -1;
     }
     
-    // Yield to scheduler
-    schedule();
+    uint64_t flags;
+    cpu_rq_t* rq = task_rq_lock(proc, &flags);
     
-    // Should never reach here
-    while(1) {
-        asm volatile("wfi");
+    // Moves the process into the priority class
+    update_curr(rq);
+    int queued = proc->on_rq;
+    if (queued) {
+        dequeue_process(rq, proc);
+    }
+    proc->policy = SCHED_PRIO;
+    proc->priority = prio;
+    
+    int resched = 0;
+    if (queued) {
+        enqueue_process(rq, proc, 0);
+        resched = should_preempt(rq, proc);
     }
+    
+    // Lowered the running process below something runnable
+    process_t* best = rq_pick(rq);
+    if (proc == rq->curr && best && best->priority < prio) {
+        resched = 1;
+    }
+    
+    spin_unlock(&rq->lock);
+    if (resched) {
+        resched_rq(rq);
+    }
+    irq_restore(flags);
+    spin_unlock_irqrestore(&process_table_lock, table_flags);
+    return 0;
 }
 
-// Create a new process
-process_t* create_process(const char* name, void (*entry_point)(void)) {
-    uart_puts("Creating process: ");
-    uart_puts(name);
-    uart_puts("\n");
+// Set a process's nice value (clamped to -20..19), moving it into the
+// fair class. Returns 0 on success, -1 for an unknown PID.
+int set_nice(int pid, int nice) {
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    }
+    if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
     
-    // Allocate process control block
-    process_t* proc = (process_t*)kmalloc(sizeof(process_t));
+    uint64_t table_flags = spin_lock_irqsave(&process_table_lock);
+    process_t* proc = find_process(pid);
     if (!proc) {
-        uart_puts("Failed to allocate PCB!\n");
-        return NULL;
+        spin_unlock_irqrestore(&process_table_lock, table_flags);
+        return -1;
     }
     
-    // Allocate stack
-    proc->stack_base = (uint8_t*)kmalloc(PROCESS_STACK_SIZE);
-    if (!proc->stack_base) {
-        uart_puts("Failed to allocate stack!\n");
-        kfree(proc);
-        return NULL;
-    }
+    uint64_t flags;
+    cpu_rq_t* rq = task_rq_lock(proc, &flags);
     
-    // Initialize process fields
-    proc->pid = next_pid++;
-    strcpy_simple(proc->name, name, sizeof(proc->name));
-    proc->state = PROCESS_READY;
-    proc->stack_size = PROCESS_STACK_SIZE;
-    proc->time_slice = TIME_SLICE_TICKS;
-    proc->next = NULL;
+    // Time so far is charged at the old weight
+    update_curr(rq);
+    
+    int queued = proc->on_rq;
+    if (queued) {
+        dequeue_process(rq, proc);
+    }
+    if (proc->policy != SCHED_FAIR) {
+        proc->vruntime = rq->fair.min_vruntime;
+    }
+    proc->policy = SCHED_FAIR;
+    proc->nice = nice;
+    proc->weight = nice_to_weight[nice - NICE_MIN];
     
-    // Initialize context - simpler approach
-    // Clear all registers  
-    for (int i = 0; i < 31; i++) {
-        *((uint64_t*)&proc->context + i) = 0;
+    int resched = 0;
+    if (queued) {
+        enqueue_process(rq, proc, 1);
+        resched = should_preempt(rq, proc);
     }
     
-    // Set stack pointer to top of stack (stacks grow downward)
-    proc->context.sp = (uint64_t)(proc->stack_base + PROCESS_STACK_SIZE - 16);
+    // A running process demoted from the priority class gives way
+    if (proc == rq->curr && rq->prio.nr_running) {
+        resched = 1;
+    }
     
-    // Set program counter to entry point directly
-    proc->context.pc = (uint64_t)entry_point;
+    spin_unlock(&rq->lock);
+    if (resched) {
+        resched_rq(rq);
+    }
+    irq_restore(flags);
+    spin_unlock_irqrestore(&process_table_lock, table_flags);
+    return 0;
+}
+
+// Move proc (its run queue locked) to another class and priority,
+// requeueing it if it is runnable. Returns 1 if rq should reschedule.
+static int change_class(cpu_rq_t* rq, process_t* proc, sched_policy_t policy, int prio) {
+    update_curr(rq);
+    int queued = proc->on_rq;
+    if (queued) {
+        dequeue_process(rq, proc);
+    }
+    if (policy == SCHED_FAIR && proc->policy != SCHED_FAIR) {
+        proc->vruntime = rq->fair.min_vruntime;
+    }
+    proc->policy = policy;
+    proc->priority = prio;
     
-    // Set processor state (simple)
-    proc->context.pstate = 0;
+    int resched = 0;
+    if (queued) {
+        enqueue_process(rq, proc, 0);
+        resched = should_preempt(rq, proc);
+    }
     
-    // Add to process list
-    proc->next = process_list;
-    process_list = proc;
+    // The running process lost its place to something queued
+    process_t* best = rq_pick(rq);
+    if (proc == rq->curr && best &&
+        (policy == SCHED_FAIR || best->priority < prio)) {
+        resched = 1;
+    }
+    return resched;
+}
+
+// Priority inheritance for mutexes (wait.c): run proc in the priority
+// class at prio, unless it already runs at prio or better. The class it
+// had before the first boost comes back with sched_pi_restore.
+void sched_pi_boost(process_t* proc, int prio) {
+    uint64_t flags;
+    cpu_rq_t* rq = task_rq_lock(proc, &flags);
     
-    uart_puts("Process created - PID: ");
-    print_decimal(proc->pid);
-    uart_puts(", Stack: ");
-    print_hex((uint64_t)proc->stack_base);
-    uart_puts("\n");
+    int resched = 0;
+    if (proc->policy != SCHED_PRIO || proc->priority > prio) {
+        if (!proc->pi_boosted) {
+            proc->pi_boosted = 1;
+            proc->pi_policy = proc->policy;
+            proc->pi_priority = proc->priority;
+        }
+        resched = change_class(rq, proc, SCHED_PRIO, prio);
+    }
     
-    return proc;
+    spin_unlock(&rq->lock);
+    if (resched) {
+        resched_rq(rq);
+    }
+    irq_restore(flags);
 }
 
-// Add process to ready queue
-void schedule_process(process_t* proc) {
-    if (!proc || proc->state != PROCESS_READY) {
-        return;
+void sched_pi_restore(process_t* proc) {
+    uint64_t flags;
+    cpu_rq_t* rq = task_rq_lock(proc, &flags);
+    
+    int resched = 0;
+    if (proc->pi_boosted) {
+        proc->pi_boosted = 0;
+        resched = change_class(rq, proc, proc->pi_policy, proc->pi_priority);
     }
     
-    // Simple FIFO ready queue
-    if (!ready_queue) {
-        ready_queue = proc;
-        proc->next = NULL;
-    } else {
-        process_t* current = ready_queue;
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = proc;
-        proc->next = NULL;
+    spin_unlock(&rq->lock);
+    if (resched) {
+        resched_rq(rq);
     }
+    irq_restore(flags);
+}
+
+// Priority for ordering waiters: the SCHED_PRIO level, or NR_PRIORITIES
+// (below every level) for the fair class
+int process_sched_prio(process_t* proc) {
+    return proc->policy == SCHED_PRIO ? proc->priority : NR_PRIORITIES;
 }
 
-// Get next process from ready queue
-process_t* get_next_process(void) {
-    if (!ready_queue) {
+// Is proc executing right now? (Mutex spinning: a running owner is
+// likely to release soon.)
+int process_running(process_t* proc) {
+    return proc->on_cpu && proc->state == PROCESS_RUNNING;
+}
+
+// Idle process for a secondary CPU; its stack is also the CPU's boot
+// stack until sched_start_cpu. Returns the stack base and size, or NULL.
+uint8_t* sched_prepare_cpu(int cpu, size_t* stack_size) {
+    if (cpu <= 0 || cpu >= NR_CPUS) {
+        return NULL;
+    }
+    
+    process_t* idle = cpu_rqs[cpu].idle;
+    if (!idle) {
+        idle = create_idle_process(cpu);
+    }
+    if (!idle) {
         return NULL;
     }
     
-    process_t* next = ready_queue;
-    ready_queue = ready_queue->next;
-    next->next = NULL;
+    *stack_size = idle->stack_size;
+    return idle->stack_base;
+}
+
+// Become this CPU's idle process and start scheduling. Called with IRQs
+// masked; never returns.
+void sched_start_cpu(void) {
+    cpu_rq_t* rq = this_rq();
+    process_t* idle = rq->idle;
+    
+    spin_lock(&rq->lock);
+    idle->state = PROCESS_RUNNING;
+    idle->on_cpu = 1;
+    rq->curr = idle;
+    rq->online = 1;
+    spin_unlock(&rq->lock);
     
-    return next;
+    // Idle picks up whatever is queued here or can be stolen
+    switch_context(NULL, &idle->context);
+}
+
+// Only CPUs below n take new work or steal (n = NR_CPUS for all)
+void sched_set_active_cpus(int n) {
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > NR_CPUS) {
+        n = NR_CPUS;
+    }
+    active_cpus = n;
 }
 
-// Start first process (simplified version)
-// Start first process (simplified version) 
+// Turn the boot CPU into its idle process, which runs everything queued
 void start_multitasking(void) {
-    if (!current_process) {
-        uart_puts("No process to start!\n");
+    if (!this_rq()->idle) {
+        uart_puts("No idle process to start!\n");
         return;
     }
     
-    uart_puts("Starting first process: ");
-    print_decimal(current_process->pid);
-    uart_puts("\n");
+    // Exited processes wait for the reaper to free their stacks
+    if (!reaper) {
+        reaper = create_process("reaper", reaper_loop);
+        schedule_process(reaper);
+    }
     
-    current_process->state = PROCESS_RUNNING;
+    // No ticks until the idle process is in place
+    disable_interrupts();
     
-    // Jump directly to the first process
-    start_first_process(&current_process->context);
+    uart_puts("CPU ");
+    print_decimal(smp_processor_id());
+    uart_puts(" entering the scheduler\n");
+    
+    sched_start_cpu();
 }
+
 void process_yield(void) {
-    if (!current_process) {
+    process_t* curr = get_current();
+    if (!curr) {
         return;
     }
     
-    uart_puts("Process ");
-    print_decimal(current_process->pid);
-    uart_puts(" yielding CPU\n");
-    
-    // Mark current process as ready and reschedule
-    current_process->state = PROCESS_READY;
-    schedule_process(current_process);
+    uint64_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+// Timer tick accounting (called from the timer interrupt)
+void scheduler_tick(void) {
+    cpu_rq_t* rq = this_rq();
+    process_t* curr;
+    int resched = 0;
     
-    // Get next process
-    process_t* old_process = current_process;
-    current_process = get_next_process();
+    spin_lock(&rq->lock);
+    rq->ticks++;
+    curr = rq->curr;
     
-    if (current_process && current_process != old_process) {
-        current_process->state = PROCESS_RUNNING;
-        current_process->time_slice = TIME_SLICE_TICKS;
-        
-        uart_puts("Switching to process ");
-        print_decimal(current_process->pid);
-        uart_puts("\n");
-        
-        // Perform context switch
-        switch_context(&old_process->context, &current_process->context);
+    if (!curr || curr == rq->idle) {
+        // Idle gives way as soon as anything is runnable
+        resched = curr && nr_runnable(rq);
+    } else if (curr->policy == SCHED_FAIR) {
+        // Preempt once the slice for the current load is used up
+        update_curr(rq);
+        uint64_t ran = curr->sum_exec_runtime - curr->slice_start;
+        resched = rq->fair.nr_running && ran >= sched_slice(rq, curr);
     } else {
-        // No other process available, continue with current
-        current_process = old_process;
-        current_process->state = PROCESS_RUNNING;
+        // Decrease time slice, preempt when it runs out
+        update_curr(rq);
+        if (curr->time_slice > 0) {
+            curr->time_slice--;
+        }
+        resched = curr->time_slice == 0;
+    }
+    
+    if (resched) {
+        rq->need_resched = 1;
+    }
+    rq_publish(rq);
+    uint32_t waiting = nr_runnable(rq);
+    spin_unlock(&rq->lock);
+    
+    // Work is waiting here, make sure an idle CPU comes for it
+    if (waiting) {
+        kick_idle_cpu(rq);
+    }
+}
+
+int scheduler_need_resched(void) {
+    return this_rq()->need_resched;
+}
+
+// Requeue prev if it is still runnable and take the next process to
+// run: O(1) for the priority class, O(log n) for the fair class. An
+// empty CPU steals before falling back to idle.
+static process_t* pick_next_process(cpu_rq_t* rq, process_t* prev) {
+    if (prev && prev != rq->idle && prev->state == PROCESS_RUNNING) {
+        prev->state = PROCESS_READY;
+        enqueue_process(rq, prev, 0);
+    }
+    
+    process_t* next = get_next_process(rq);
+    if (!next) {
+        next = steal_process(rq);
     }
+    return next ? next : rq->idle;
 }
 
-// Simple scheduler (called from timer interrupt or manually)
+// Scheduler: pick the next process for this CPU and switch to it.
+// Called with IRQs masked, from process_yield, process exit, the idle
+// loop, or on return from an interrupt that set need_resched.
 void schedule(void) {
-    scheduler_ticks++;
+    cpu_rq_t* rq = this_rq();
     
-    // If no current process, try to get one from ready queue
-    if (!current_process) {
-        current_process = get_next_process();
-        if (current_process) {
-            current_process->state = PROCESS_RUNNING;
-            current_process->time_slice = TIME_SLICE_TICKS;
-        }
+    // Pages for growing kernel stacks at fault time
+    kstack_refill();
+    
+    spin_lock(&rq->lock);
+    rq->need_resched = 0;
+    
+    process_t* old_process = rq->curr;
+    update_curr(rq);
+    
+    // Get next process, fall back to idle
+    process_t* next = pick_next_process(rq, old_process);
+    if (!next) {
+        spin_unlock(&rq->lock);
         return;
     }
     
-    // Decrease time slice
-    current_process->time_slice--;
+    next->state = PROCESS_RUNNING;
+    next->time_slice = TIME_SLICE_TICKS;
+    next->exec_start = read_cntvct();
+    next->slice_start = next->sum_exec_runtime;
     
-    // If time slice expired or current process is terminated, switch processes
-    if (current_process->time_slice <= 0 || current_process->state == PROCESS_TERMINATED) {
-        process_t* old_process = current_process;
-        
-        // Move current process back to ready queue (if not terminated)
-        if (current_process->state != PROCESS_TERMINATED) {
-            current_process->state = PROCESS_READY;
-            current_process->time_slice = TIME_SLICE_TICKS;
-            schedule_process(current_process);
+    if (next != old_process) {
+        // old_process stays on_cpu until finish_switch runs on the far side
+        next->on_cpu = 1;
+        rq->curr = next;
+        rq->prev = old_process;
+        rq->nr_switches++;
+    }
+    rq_publish(rq);
+    spin_unlock(&rq->lock);
+    
+    // Real work to do: make sure the tick is running for preemption
+    if (next != rq->idle) {
+        timer_tick_start();
+    }
+    
+    if (next == old_process) {
+        return;
+    }
+    
+    trace_point(TRACE_SWITCH, old_process ? old_process->pid : 0, next->pid);
+    
+    // Save FP registers only if old_process used them since its switch in
+    fpsimd_switch();
+    switch_mm(next->mm);
+    switch_context(old_process ? &old_process->context : NULL, &next->context);
+    
+    // Back in old_process, possibly on another CPU
+    finish_switch();
+}
+
+// Switch from the calling process straight to next on this CPU, leaving
+// the run queues alone: the IPC rendezvous (ipc.c). next must be blocked
+// and claimed by the caller, its IPC partner, so that nobody else wakes
+// it; it is pulled over to this CPU. The caller stays off the queues if
+// it called process_prepare_block and nothing has woken it since;
+// otherwise it is requeued as runnable. IRQs masked.
+void sched_handoff(process_t* next) {
+    // next may still be switching out on the CPU it blocked on
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
+    }
+    
+    cpu_rq_t* rq = this_rq();
+    cpu_rq_t* from;
+    while (1) {
+        from = &cpu_rqs[next->cpu];
+        double_rq_lock(from, rq);
+        if (from == &cpu_rqs[next->cpu]) {
+            break;
         }
-        
-        // Get next process
-        current_process = get_next_process();
-        if (current_process) {
-            current_process->state = PROCESS_RUNNING;
-            current_process->time_slice = TIME_SLICE_TICKS;
+        double_rq_unlock(from, rq);
+    }
+    
+    process_t* prev = rq->curr;
+    update_curr(rq);
+    if (prev->state != PROCESS_BLOCKED) {
+        prev->state = PROCESS_READY;
+        if (!prev->on_rq) {
+            enqueue_process(rq, prev, 0);
         }
-        
-        // Perform context switch if we have a new process
-        // if (current_process && current_process != old_process) {
-        //     do_context_switch();
-        // }
     }
+    
+    migrate_vruntime(next, from, rq);
+    next->cpu = rq->cpu;
+    place_process(rq, next);
+    next->state = PROCESS_RUNNING;
+    next->time_slice = TIME_SLICE_TICKS;
+    next->exec_start = read_cntvct();
+    next->slice_start = next->sum_exec_runtime;
+    next->on_cpu = 1;
+    rq->curr = next;
+    rq->prev = prev;
+    rq->nr_switches++;
+    rq_publish(rq);
+    double_rq_unlock(from, rq);
+    
+    timer_tick_start();
+    trace_point(TRACE_SWITCH, prev->pid, next->pid);
+    fpsimd_switch();
+    switch_mm(next->mm);
+    switch_context(&prev->context, &next->context);
+    
+    // Back in prev, possibly on another CPU
+    finish_switch();
 }
 
 // Print process information
 void print_processes(void) {
     uart_puts("\n=== Process List ===\n");
     
-    process_t* proc = process_list;
+    uint64_t flags = spin_lock_irqsave(&process_table_lock);
     int count = 0;
     
-    while (proc) {
+    for (uint32_t i = 1; i < nr_pid_slots; i++) {
+        process_t* proc = pid_slot_at(i)->proc;
+        if (!proc) {
+            continue;
+        }
         uart_puts("PID ");
         print_decimal(proc->pid);
         uart_puts(": ");
         uart_puts(proc->name);
-        uart_puts(" - ");
+        if (proc->policy == SCHED_PRIO) {
+            uart_puts(" (prio ");
+            print_decimal(proc->priority);
+        } else {
+            uart_puts(" (nice ");
+            print_signed(proc->nice);
+        }
+        uart_puts(", cpu ");
+        print_decimal(proc->cpu);
+        uart_puts(", ");
+        print_decimal((proc->sum_exec_runtime * 1000 / counter_freq));
+        uart_puts(" ms, stack ");
+        print_decimal((kstack_resident(proc->stack_base, proc->stack_size) / 1024));
+        uart_puts("/");
+        print_decimal((proc->stack_size / 1024));
+        uart_puts("KB");
+        if (proc->mm) {
+            size_t resident, reserved;
+            mm_stack_usage(proc->mm, &resident, &reserved);
+            uart_puts(", user stack ");
+            print_decimal((resident / 1024));
+            uart_puts("/");
+            print_decimal((reserved / 1024));
+            uart_puts("KB");
+        }
+        uart_puts(") - ");
         
         switch (proc->state) {
             case PROCESS_READY:
@@ -349,16 +1945,260 @@ void print_processes(void) {
         }
         
         uart_puts("\n");
-        proc = proc->next;
         count++;
     }
+    int pooled = pcb_pool_count;
+    int slots = (int)nr_pid_slots - 1;
+    spin_unlock_irqrestore(&process_table_lock, flags);
     
     uart_puts("Total processes: ");
     print_decimal(count);
-    uart_puts("\n");
-    uart_puts("Scheduler ticks: ");
-    print_decimal(scheduler_ticks);
-    uart_puts("\n==================\n\n");
+    uart_puts(", ");
+    print_decimal(slots);
+    uart_puts(" PID slots, ");
+    print_decimal(pooled);
+    uart_puts(" PCBs pooled\n");
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        cpu_rq_t* rq = &cpu_rqs[cpu];
+        if (!rq->online && !rq->ticks) {
+            continue;
+        }
+        uart_puts("CPU ");
+        print_decimal(cpu);
+        uart_puts(": ticks ");
+        print_decimal(rq->ticks);
+        uart_puts(", switches ");
+        print_decimal(rq->nr_switches);
+        uart_puts(", steals ");
+        print_decimal(rq->nr_steals);
+        uart_puts("\n");
+    }
+    uart_puts("==================\n\n");
+}
+
+// Yield cost against run queue length. Dummy PCBs (no stacks, never
+// switched to) fill one priority level, the worst case for a list walk,
+// or the fair tree; each step is the scheduler half of process_yield:
+// requeue the yielding process and pick the next one. Call before
+// multitasking starts.
+#define YIELD_BENCH_MAX 10000
+#define YIELD_BENCH_ITERATIONS 1000
+
+static process_t* bench_dummies[YIELD_BENCH_MAX];
+
+static void benchmark_yield_class(cpu_rq_t* rq, sched_policy_t policy) {
+    static const int counts[] = { 2, 10, 100, 1000, YIELD_BENCH_MAX };
+    
+    uart_puts(policy == SCHED_PRIO ? "Yield cost vs runnable processes (priority class):\n"
+                                   : "Yield cost vs runnable processes (fair class):\n");
+    
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int n = 0;
+        while (n < counts[c]) {
+            process_t* proc = (process_t*)kmem_cache_alloc(process_cache);
+            if (!proc) {
+                break;
+            }
+            proc->pid = -1;
+            proc->state = PROCESS_READY;
+            proc->policy = policy;
+            proc->priority = DEFAULT_PRIORITY;
+            proc->weight = NICE_0_WEIGHT;
+            proc->vruntime = (uint64_t)n;
+            proc->on_rq = 0;
+            proc->cpu = rq->cpu;
+            proc->on_cpu = 0;
+            enqueue_process(rq, proc, 0);
+            bench_dummies[n++] = proc;
+        }
+        
+        if (n < 2) {
+            uart_puts("  out of memory for dummy PCBs\n");
+            for (int i = 0; i < n; i++) {
+                dequeue_process(rq, bench_dummies[i]);
+                kmem_cache_free(process_cache, bench_dummies[i]);
+            }
+            return;
+        }
+        
+        // The running dummy yields to the next in line every step. Fair
+        // dummies are charged enough vruntime to go to the back of the tree.
+        process_t* running = get_next_process(rq);
+        running->state = PROCESS_RUNNING;
+        
+        uint64_t start = perf_cycles();
+        for (int i = 0; i < YIELD_BENCH_ITERATIONS; i++) {
+            running->vruntime += (uint64_t)n;
+            running = pick_next_process(rq, running);
+            running->state = PROCESS_RUNNING;
+        }
+        uint64_t cycles = perf_cycles() - start;
+        
+        uart_puts("  ");
+        print_decimal(n);
+        uart_puts(" runnable: ");
+        print_decimal((cycles / YIELD_BENCH_ITERATIONS));
+        uart_puts(" cycles/yield\n");
+        
+        for (int i = 0; i < n; i++) {
+            if (bench_dummies[i]->on_rq) {
+                dequeue_process(rq, bench_dummies[i]);
+            }
+            kmem_cache_free(process_cache, bench_dummies[i]);
+        }
+    }
+}
+
+// Runs on the boot CPU's queues (nothing is scheduling yet)
+void benchmark_yield(void) {
+    cpu_rq_t* rq = this_rq();
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    benchmark_yield_class(rq, SCHED_PRIO);
+    benchmark_yield_class(rq, SCHED_FAIR);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// Task churn: batches of short processes created, exited and waited
+// for, over and over. With reaping and recycling everything a task
+// takes comes back, so the PCB count, PID slots in use, slab objects and
+// free pages after the last round match the first. Other processes run
+// meanwhile, so slab objects may differ by a batch worth and pages by
+// the per-CPU stack reserves plus one resident page per stack in flight.
+#define CHURN_ROUNDS        50
+#define CHURN_BATCH         32
+#define CHURN_PAGE_SLACK    (NR_CPUS * 8 + CHURN_BATCH)
+#define CHURN_OBJ_SLACK     CHURN_BATCH
+
+typedef struct {
+    uint64_t pcbs;              // process_t objects, pooled ones included
+    uint64_t pooled;
+    uint64_t slots_used;        // PID slots not on the free list
+    uint64_t slab_objs;         // Objects in every slab cache
+    uint64_t free_pages;
+} churn_usage_t;
+
+static void churn_task(void) {
+    process_exit(current_pid() & 0xFF);
+}
+
+// Memory use once the reaper has caught up with every exit so far
+static void churn_usage(churn_usage_t* usage) {
+    while (1) {
+        uint64_t flags = spin_lock_irqsave(&process_table_lock);
+        int idle = nr_reaped == nr_exited;
+        usage->pooled = pcb_pool_count;
+        usage->slots_used = nr_pid_slots - 1 - nr_pid_free;
+        spin_unlock_irqrestore(&process_table_lock, flags);
+        if (idle) {
+            break;
+        }
+        process_sleep(1000000);
+    }
+    usage->pcbs = kmem_cache_active_objs(process_cache);
+    usage->slab_objs = kmem_cache_active_objs(NULL);
+    usage->free_pages = nr_free_pages();
+}
+
+static void print_churn_usage(const char* when, const churn_usage_t* usage) {
+    uart_puts("  ");
+    uart_puts(when);
+    uart_puts(": ");
+    print_decimal(usage->pcbs);
+    uart_puts(" PCBs (");
+    print_decimal(usage->pooled);
+    uart_puts(" pooled), ");
+    print_decimal(usage->slots_used);
+    uart_puts(" PID slots, ");
+    print_decimal(usage->slab_objs);
+    uart_puts(" slab objects, ");
+    print_decimal(usage->free_pages);
+    uart_puts(" free pages\n");
+}
+
+static void benchmark_churn(void) {
+    churn_usage_t before = {0};
+    churn_usage_t after;
+    uint64_t tasks = 0;
+    uint64_t cycles = 0;
+    uint64_t elapsed_ns = 0;
+    int bad = 0;
+    
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        uint64_t start_ns = timer_now_ns();
+        uint64_t start = perf_cycles();
+        int pids[CHURN_BATCH];
+        int n = 0;
+        while (n < CHURN_BATCH) {
+            process_t* proc = new_process("churn", churn_task);
+            if (!proc) {
+                break;
+            }
+            proc->quiet = 1;
+            pids[n++] = proc->pid;
+            schedule_process(proc);
+        }
+        
+        for (int i = 0; i < n; i++) {
+            int status;
+            if (process_wait(pids[i], &status) != pids[i] || status != (pids[i] & 0xFF)) {
+                bad++;
+            }
+        }
+        cycles += perf_cycles() - start;
+        elapsed_ns += timer_now_ns() - start_ns;
+        tasks += n;
+        
+        // Pools and caches are warm after the first round
+        if (round == 0) {
+            churn_usage(&before);
+        }
+    }
+    churn_usage(&after);
+    
+    uart_puts("Task churn: ");
+    print_decimal(tasks);
+    uart_puts(" create/exit/wait, ");
+    print_decimal((tasks ? cycles / tasks : 0));
+    uart_puts(" cycles each, ");
+    print_decimal((tasks * 1000000000ULL / (elapsed_ns ? elapsed_ns : 1)));
+    uart_puts(" tasks/s\n");
+    print_churn_usage("after round 1", &before);
+    print_churn_usage("after the last", &after);
+    
+    if (bad) {
+        uart_puts("  ");
+        print_decimal(bad);
+        uart_puts(" wrong exit statuses - FAILED\n");
+    }
+    if (after.pcbs > before.pcbs || after.pooled < before.pooled ||
+        after.slots_used > before.slots_used ||
+        after.slab_objs > before.slab_objs + CHURN_OBJ_SLACK ||
+        after.free_pages + CHURN_PAGE_SLACK < before.free_pages) {
+        uart_puts("  memory grew - LEAKING\n");
+    }
+}
+
+// How long run_benchmarks traces the system for, after the benchmarks
+#define TRACE_WINDOW_NS     (100 * 1000000ULL)
+
+// Boot benchmarks that need the scheduler, run one after the other so
+// they do not skew each other, with tracing off
+static void run_benchmarks(void) {
+    benchmark_smp();
+    benchmark_sync();
+    benchmark_syscall();
+    benchmark_asid();
+    benchmark_ipc();
+    benchmark_wait();
+    benchmark_churn();
+    test_fpsimd();
+    
+    // Traced separately so no benchmark pays for the tracepoints: a
+    // window of whatever else runs (test processes, EL0 tasks, ticks)
+    trace_set_events(TRACE_ALL);
+    process_sleep(TRACE_WINDOW_NS);
+    trace_set_events(0);
+    trace_dump();
 }
 
 // Forward declaration for cooperative yielding
@@ -372,8 +2212,8 @@ void test_process_1(void) {
         print_decimal(counter++);
         uart_puts("\n");
         
-        // Shorter busy wait for better responsiveness
-        for (volatile int i = 0; i < 50000; i++);
+        // Sleep instead of burning the CPU
+        process_sleep(50 * 1000000ULL);
         
         // Yield every few iterations to allow process switching
         if (counter % 3 == 0) {
@@ -390,8 +2230,8 @@ void test_process_2(void) {
         print_decimal(counter++);
         uart_puts("\n");
         
-        // Different busy wait timing
-        for (volatile int i = 0; i < 75000; i++);
+        // Different sleep timing
+        process_sleep(75 * 1000000ULL);
         
         // Yield every few iterations
         if (counter % 4 == 0) {
@@ -410,6 +2250,14 @@ void test_processes(void) {
     process_t* proc1 = create_process("test_proc_1", test_process_1);
     process_t* proc2 = create_process("test_proc_2", test_process_2);
     
+    // SMP and lock benchmarks, alongside the test processes
+    process_t* bench = create_process("bench", run_benchmarks);
+    
+    // EL0 tasks, talking to the kernel only through system calls
+    process_t* user1 = create_user_process("user_hello", user_hello);
+    process_t* user2 = create_user_process("user_svc_bench", user_svc_bench);
+    process_t* user3 = create_user_process("user_vdso_demo", user_vdso_demo);
+    
     if (proc1) {
         schedule_process(proc1);
     }
@@ -418,15 +2266,27 @@ void test_processes(void) {
         schedule_process(proc2);
     }
     
-    print_processes();
+    if (bench) {
+        schedule_process(bench);
+    }
+    
+    if (user1) {
+        schedule_process(user1);
+    }
     
-    uart_puts("Starting cooperative multitasking...\n");
+    if (user2) {
+        schedule_process(user2);
+    }
     
-    // Get the first process and start it
-    current_process = get_next_process();
-    if (current_process) {
-        start_multitasking();  // Changed from start_first_process()
-    } else {
-        uart_puts("No processes to run!\n");
+    if (user3) {
+        schedule_process(user3);
     }
-}
\ No newline at end of file
+    
+    print_processes();
+    
+    uart_puts("Starting multitasking...\n");
+    
+    // The boot CPU joins the others in the scheduler
+    start_multitasking();
+    uart_puts("No processes to run!\n");
+}
@@ -0,0 +1,268 @@
+// Intrusive Red-Black Tree
+// Save as: ~/OS_proj/src/rbtree.c
+//
+// Nodes are embedded in the owning structure. Callers do the ordered
+// descent themselves, link the new node with rb_link_node() and then
+// call rb_insert_color() to rebalance, so the tree never needs a
+// comparison callback.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    int color;
+} rb_node_t;
+
+typedef struct rb_root {
+    rb_node_t* node;
+} rb_root_t;
+
+static inline int is_red(rb_node_t* node) {
+    return node && node->color == RB_RED;
+}
+
+static inline int is_black(rb_node_t* node) {
+    return !node || node->color == RB_BLACK;
+}
+
+// Point whatever referenced old (parent link or root) at new
+static void replace_child(rb_root_t* root, rb_node_t* parent, rb_node_t* old, rb_node_t* new) {
+    if (!parent) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+static void rotate_left(rb_root_t* root, rb_node_t* node) {
+    rb_node_t* right = node->right;
+    rb_node_t* parent = node->parent;
+
+    node->right = right->left;
+    if (right->left) {
+        right->left->parent = node;
+    }
+
+    right->left = node;
+    right->parent = parent;
+    replace_child(root, parent, node, right);
+    node->parent = right;
+}
+
+static void rotate_right(rb_root_t* root, rb_node_t* node) {
+    rb_node_t* left = node->left;
+    rb_node_t* parent = node->parent;
+
+    node->left = left->right;
+    if (left->right) {
+        left->right->parent = node;
+    }
+
+    left->right = node;
+    left->parent = parent;
+    replace_child(root, parent, node, left);
+    node->parent = left;
+}
+
+// Attach a new red leaf at *link under parent
+void rb_link_node(rb_node_t* node, rb_node_t* parent, rb_node_t** link) {
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+// Restore the red-black properties after rb_link_node
+void rb_insert_color(rb_node_t* node, rb_root_t* root) {
+    while (is_red(node->parent)) {
+        rb_node_t* parent = node->parent;
+        rb_node_t* gparent = parent->parent;    // Red parent is never the root
+
+        if (parent == gparent->left) {
+            rb_node_t* uncle = gparent->right;
+            if (is_red(uncle)) {
+                // Recolor and continue from the grandparent
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(root, gparent);
+        } else {
+            rb_node_t* uncle = gparent->left;
+            if (is_red(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(root, gparent);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+// Rebalance after removing a black node; child took its place under parent
+static void erase_fixup(rb_root_t* root, rb_node_t* child, rb_node_t* parent) {
+    while (child != root->node && is_black(child)) {
+        if (child == parent->left) {
+            rb_node_t* sibling = parent->right;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(root, parent);
+            child = root->node;
+        } else {
+            rb_node_t* sibling = parent->left;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(root, parent);
+            child = root->node;
+        }
+    }
+
+    if (child) {
+        child->color = RB_BLACK;
+    }
+}
+
+// Remove node from the tree
+void rb_erase(rb_node_t* node, rb_root_t* root) {
+    rb_node_t* child;
+    rb_node_t* parent;
+    int color;
+
+    if (node->left && node->right) {
+        // Two children: splice out the in-order successor instead and
+        // move it into node's position
+        rb_node_t* succ = node->right;
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        child = succ->right;
+        color = succ->color;
+
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            parent->left = child;
+            if (child) {
+                child->parent = parent;
+            }
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        succ->color = node->color;
+        replace_child(root, node->parent, node, succ);
+    } else {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child) {
+            child->parent = parent;
+        }
+        replace_child(root, parent, node, child);
+    }
+
+    if (color == RB_BLACK) {
+        erase_fixup(root, child, parent);
+    }
+}
+
+// Smallest node, NULL for an empty tree
+rb_node_t* rb_first(const rb_root_t* root) {
+    rb_node_t* node = root->node;
+    if (!node) {
+        return NULL;
+    }
+    while (node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+// In-order successor, NULL after the last node
+rb_node_t* rb_next(const rb_node_t* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (rb_node_t*)node;
+    }
+
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
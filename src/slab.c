@@ -0,0 +1,361 @@
+// Slab Object Caches for ARM64 OS
+// Save as: ~/OS_proj/src/slab.c
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External page allocator functions
+extern void* alloc_pages(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+extern void page_set_slab(void* addr, int is_slab);
+extern int page_is_slab(const void* addr);
+
+// External spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern uint64_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags);
+
+// Slab geometry
+#define SLAB_PAGE_SIZE   4096
+#define SLAB_PAGE_MASK   (~((uintptr_t)SLAB_PAGE_SIZE - 1))
+#define SLAB_MIN_ALIGN   16
+
+// kmalloc size classes: 16, 32, ... 1024 bytes
+#define KMALLOC_MIN_SHIFT   4
+#define KMALLOC_MAX_SHIFT   10
+#define KMALLOC_NUM_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define KMALLOC_MAX_SMALL   (1UL << KMALLOC_MAX_SHIFT)
+
+struct kmem_cache;
+
+// Slab header, stored at the start of each slab page
+typedef struct slab {
+    struct kmem_cache* cache;  // Owning cache
+    struct slab* prev;         // Previous slab in cache list
+    struct slab* next;         // Next slab in cache list
+    void* free_list;           // Free objects in this slab
+    uint32_t inuse;            // Allocated objects in this slab
+} slab_t;
+
+// Object cache
+typedef struct kmem_cache {
+    const char* name;          // Cache name (for statistics)
+    size_t obj_size;           // Object size (rounded to alignment)
+    uint32_t objs_per_slab;    // Objects that fit in one slab page
+    slab_t* partial;           // Slabs with at least one free object
+    slab_t* full;              // Slabs with no free objects
+    slab_t* empty;             // One cached empty slab to avoid thrashing
+    uint64_t hits;             // Allocations served from an existing slab
+    uint64_t misses;           // Allocations that needed a new slab page
+    uint64_t active_objs;      // Objects currently allocated
+    uint64_t total_objs;       // Object capacity of all slabs
+    uint64_t slabs;            // Slab pages owned by this cache
+    spinlock_t lock;           // Protects everything above
+    struct kmem_cache* next;   // Next cache in registry
+} kmem_cache_t;
+
+// Cache registry
+static kmem_cache_t cache_cache;   // Cache of kmem_cache_t descriptors
+static kmem_cache_t* cache_list = NULL;
+static spinlock_t cache_list_lock;
+static kmem_cache_t* kmalloc_caches[KMALLOC_NUM_CLASSES];
+static const char* kmalloc_names[KMALLOC_NUM_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static void* slab_alloc(kmem_cache_t* cache);
+
+// Get a page for a new slab
+static void* slab_page_alloc(void) {
+    void* page = alloc_pages(0);
+    if (!page) {
+        return NULL;
+    }
+
+    page_set_slab(page, 1);
+    return page;
+}
+
+// Return an empty slab page to the page allocator
+static void slab_page_free(void* page) {
+    page_set_slab(page, 0);
+    free_pages(page, 0);
+}
+
+// Doubly linked slab list helpers
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_del(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+// Offset of the first object in a slab page
+static size_t slab_obj_offset(void) {
+    return (sizeof(slab_t) + SLAB_MIN_ALIGN - 1) & ~((size_t)SLAB_MIN_ALIGN - 1);
+}
+
+// Carve a fresh page into objects for a cache
+static slab_t* slab_create(kmem_cache_t* cache) {
+    uint8_t* page = (uint8_t*)slab_page_alloc();
+    if (!page) {
+        return NULL;
+    }
+
+    slab_t* slab = (slab_t*)page;
+    slab->cache = cache;
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->inuse = 0;
+    slab->free_list = NULL;
+
+    // Thread the free list through the objects, lowest address first
+    uint8_t* obj = page + slab_obj_offset() + (cache->objs_per_slab - 1) * cache->obj_size;
+    for (uint32_t i = 0; i < cache->objs_per_slab; i++) {
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+        obj -= cache->obj_size;
+    }
+
+    cache->slabs++;
+    cache->total_objs += cache->objs_per_slab;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, slab_t* slab) {
+    cache->slabs--;
+    cache->total_objs -= cache->objs_per_slab;
+    slab_page_free(slab);
+}
+
+static void cache_setup(kmem_cache_t* cache, const char* name, size_t size) {
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    size = (size + SLAB_MIN_ALIGN - 1) & ~((size_t)SLAB_MIN_ALIGN - 1);
+
+    cache->name = name;
+    cache->obj_size = size;
+    cache->objs_per_slab = (SLAB_PAGE_SIZE - slab_obj_offset()) / size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->active_objs = 0;
+    cache->total_objs = 0;
+    cache->slabs = 0;
+    cache->lock.lock = 0;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+// Create a cache of fixed-size objects
+kmem_cache_t* kmem_cache_create(const char* name, size_t size) {
+    if (size == 0 || size > SLAB_PAGE_SIZE - slab_obj_offset()) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache_cache.lock);
+    kmem_cache_t* cache = (kmem_cache_t*)slab_alloc(&cache_cache);
+    spin_unlock_irqrestore(&cache_cache.lock, flags);
+    if (cache) {
+        cache_setup(cache, name, size);
+    }
+    return cache;
+}
+
+// Pop an object, growing the cache by one slab if needed
+static void* slab_alloc(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+
+    if (slab) {
+        cache->hits++;
+    } else if (cache->empty) {
+        // Reuse the cached empty slab
+        slab = cache->empty;
+        cache->empty = NULL;
+        slab_list_add(&cache->partial, slab);
+        cache->hits++;
+    } else {
+        slab = slab_create(cache);
+        if (!slab) {
+            return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+        cache->misses++;
+    }
+
+    void* obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    slab->inuse++;
+    cache->active_objs++;
+
+    // Slab just became full
+    if (!slab->free_list) {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    return obj;
+}
+
+// Push an object back onto its slab
+static void slab_free(kmem_cache_t* cache, void* obj) {
+    slab_t* slab = (slab_t*)((uintptr_t)obj & SLAB_PAGE_MASK);
+
+    // Slab was full, it has room again
+    if (!slab->free_list) {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+    cache->active_objs--;
+
+    // Slab is now empty: keep one around, release the rest
+    if (slab->inuse == 0) {
+        slab_list_del(&cache->partial, slab);
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+}
+
+// Allocate one object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    void* obj = slab_alloc(cache);
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!cache || !obj) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    slab_free(cache, obj);
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+// Initialize slab layer (page allocator must be up)
+void init_slab(void) {
+    cache_list = NULL;
+
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t));
+
+    for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1UL << (i + KMALLOC_MIN_SHIFT));
+    }
+}
+
+// Check whether a pointer belongs to a slab page
+int slab_owns(const void* ptr) {
+    return page_is_slab((const void*)((uintptr_t)ptr & SLAB_PAGE_MASK));
+}
+
+// Small kmalloc requests are served from the power-of-two caches
+void* kmalloc_small(size_t size) {
+    if (size == 0 || size > KMALLOC_MAX_SMALL) {
+        return NULL;
+    }
+
+    int shift = (size <= (1UL << KMALLOC_MIN_SHIFT))
+              ? KMALLOC_MIN_SHIFT
+              : 64 - __builtin_clzl(size - 1);
+    kmem_cache_t* cache = kmalloc_caches[shift - KMALLOC_MIN_SHIFT];
+    if (!cache) {
+        return NULL;
+    }
+
+    return kmem_cache_alloc(cache);
+}
+
+void kfree_small(void* ptr) {
+    slab_t* slab = (slab_t*)((uintptr_t)ptr & SLAB_PAGE_MASK);
+    kmem_cache_free(slab->cache, ptr);
+}
+
+// Objects allocated from cache, or from every cache if NULL (leak checks)
+uint64_t kmem_cache_active_objs(kmem_cache_t* cache) {
+    if (cache) {
+        return cache->active_objs;
+    }
+
+    uint64_t total = 0;
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t* c = cache_list; c; c = c->next) {
+        total += c->active_objs;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    return total;
+}
+
+// Per-cache statistics, called from print_memory_stats
+void kmem_cache_print_stats(void) {
+    uint64_t pages = 0;
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        pages += cache->slabs;
+    }
+    uart_puts("Slab pages: ");
+    print_decimal(pages);
+    uart_puts("\n");
+
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        // Skip caches that were never touched
+        if (cache->hits == 0 && cache->misses == 0) {
+            continue;
+        }
+
+        uart_puts("  ");
+        uart_puts(cache->name);
+        uart_puts(": ");
+        print_decimal(cache->active_objs);
+        uart_puts("/");
+        print_decimal(cache->total_objs);
+        uart_puts(" objs, ");
+        print_decimal(cache->slabs);
+        uart_puts(" slabs, hits ");
+        print_decimal(cache->hits);
+        uart_puts(", misses ");
+        print_decimal(cache->misses);
+        uart_puts("\n");
+    }
+}
@@ -0,0 +1,239 @@
+// SMP Bring-up for ARM64 OS
+// Save as: ~/OS_proj/src/smp.c
+//
+// Secondary CPUs are started with PSCI CPU_ON, which QEMU virt provides
+// over HVC. Each enters secondary_entry (boot.s) on its idle stack,
+// turns on the MMU with the boot CPU's tables, sets up its banked GIC
+// and timer state, and then schedules from its own run queue.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External scheduler functions
+typedef struct process process_t;
+extern uint8_t* sched_prepare_cpu(int cpu, size_t* stack_size);
+extern void sched_start_cpu(void);
+extern void sched_set_active_cpus(int n);
+extern process_t* create_process(const char* name, void (*entry_point)(void));
+extern void schedule_process(process_t* proc);
+extern void process_sleep(uint64_t ns);
+
+// External MMU functions
+extern int mmu_enabled(void);
+extern void dcache_clean_inval_range(const void* start, uint64_t size);
+
+// External GIC and timer functions
+extern void init_gic_cpu(void);
+extern void timer_init_cpu(void);
+extern uint64_t timer_now_ns(void);
+
+// External measurement functions
+extern void perf_init(void);
+
+// External FP/SIMD functions
+extern void init_fpsimd_cpu(void);
+
+// External vDSO functions
+extern void vdso_init_cpu(void);
+
+// External spinlock functions
+extern int atomic_add_return(volatile int* ptr, int delta);
+extern void cpu_relax(void);
+
+// Secondary CPU entry point (boot.s)
+extern void secondary_entry(void);
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+// PSCI (SMC Calling Convention, 64-bit function IDs)
+#define PSCI_CPU_ON_64              0xC4000003
+#define PSCI_SYSTEM_OFF             0x84000008
+#define PSCI_SUCCESS                0
+#define PSCI_INVALID_PARAMETERS     (-2)
+#define PSCI_ALREADY_ON             (-4)
+
+#define CPU_ON_TIMEOUT_NS           100000000ULL    // 100ms
+
+static volatile int cpu_online[NR_CPUS];
+
+// CPU number, Aff0 of MPIDR (QEMU virt numbers CPUs 0..n-1 there)
+int smp_processor_id(void) {
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return (int)(mpidr & 0xFF);
+}
+
+int smp_num_online(void) {
+    int count = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        count += cpu_online[cpu];
+    }
+    return count;
+}
+
+static int64_t psci_call(uint64_t function, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    register uint64_t x0 asm("x0") = function;
+    register uint64_t x1 asm("x1") = arg0;
+    register uint64_t x2 asm("x2") = arg1;
+    register uint64_t x3 asm("x3") = arg2;
+
+    // SMCCC lets the firmware clobber x4-x17
+    asm volatile("hvc #0"
+                 : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                 :
+                 : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+                   "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+    return (int64_t)x0;
+}
+
+// Power the machine off (QEMU exits). Does not return.
+void psci_system_off(void) {
+    psci_call(PSCI_SYSTEM_OFF, 0, 0, 0);
+    while (1) {
+        asm volatile("wfi");
+    }
+}
+
+// Start every other CPU QEMU was given, up to NR_CPUS
+void init_smp(void) {
+    uart_puts("Starting secondary CPUs...\n");
+
+    cpu_online[smp_processor_id()] = 1;
+
+    // With caches off the secondaries' exclusives would not be coherent
+    // with the boot CPU's, so spinlocks cannot work
+    if (!mmu_enabled()) {
+        uart_puts("MMU disabled, staying on CPU 0\n");
+        return;
+    }
+
+    for (int cpu = 1; cpu < NR_CPUS; cpu++) {
+        size_t stack_size;
+        uint8_t* stack = sched_prepare_cpu(cpu, &stack_size);
+        if (!stack) {
+            break;
+        }
+
+        // The CPU starts with its caches off and reads its stack from RAM
+        dcache_clean_inval_range(stack, stack_size);
+
+        int64_t ret = psci_call(PSCI_CPU_ON_64, (uint64_t)cpu,
+                                (uint64_t)secondary_entry, (uint64_t)(stack + stack_size));
+        if (ret == PSCI_INVALID_PARAMETERS) {
+            break;      // No such CPU, QEMU was started with fewer
+        }
+        if (ret != PSCI_SUCCESS && ret != PSCI_ALREADY_ON) {
+            uart_puts("CPU ");
+            print_decimal(cpu);
+            uart_puts(": CPU_ON failed\n");
+            continue;
+        }
+
+        uint64_t deadline = timer_now_ns() + CPU_ON_TIMEOUT_NS;
+        while (!cpu_online[cpu] && timer_now_ns() < deadline) {
+            cpu_relax();
+        }
+        if (!cpu_online[cpu]) {
+            uart_puts("CPU ");
+            print_decimal(cpu);
+            uart_puts(" did not come online\n");
+        }
+    }
+
+    uart_puts("CPUs online: ");
+    print_decimal(smp_num_online());
+    uart_puts("\n");
+}
+
+// C entry for secondary CPUs (from secondary_entry, MMU on, IRQs masked)
+void secondary_main(void) {
+    int cpu = smp_processor_id();
+
+    init_gic_cpu();
+    timer_init_cpu();
+    perf_init();
+    init_fpsimd_cpu();
+    vdso_init_cpu();
+
+    uart_puts("CPU ");
+    print_decimal(cpu);
+    uart_puts(" online\n");
+    __atomic_store_n(&cpu_online[cpu], 1, __ATOMIC_RELEASE);
+
+    sched_start_cpu();
+}
+
+// Throughput against CPU count: the same batch of CPU-bound workers is
+// run on 1, 2, ... CPUs. Runs as a process; workers that finish are
+// reaped and their PCBs and stacks recycled for the next batch.
+#define SMP_BENCH_WORKERS       8
+#define SMP_BENCH_ITERATIONS    20000000
+
+static volatile int bench_done;
+static volatile uint64_t bench_sink;
+
+static void bench_worker(void) {
+    // LCG steps: pure register work the compiler cannot fold away
+    uint64_t x = (uint64_t)smp_processor_id() + 1;
+    for (int i = 0; i < SMP_BENCH_ITERATIONS; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    bench_sink = x;
+
+    atomic_add_return(&bench_done, 1);
+}
+
+void benchmark_smp(void) {
+    int online = smp_num_online();
+    uint64_t base_ns = 0;
+
+    uart_puts("SMP throughput, ");
+    print_decimal(SMP_BENCH_WORKERS);
+    uart_puts(" CPU-bound workers:\n");
+
+    for (int n = 1; n <= online; n++) {
+        sched_set_active_cpus(n);
+        bench_done = 0;
+
+        uint64_t start = timer_now_ns();
+        int started = 0;
+        for (int i = 0; i < SMP_BENCH_WORKERS; i++) {
+            process_t* worker = create_process("smp_worker", bench_worker);
+            if (!worker) {
+                break;
+            }
+            schedule_process(worker);
+            started++;
+        }
+        while (bench_done < started) {
+            process_sleep(1000000);
+        }
+        uint64_t elapsed = timer_now_ns() - start;
+        if (n == 1) {
+            base_ns = elapsed;
+        }
+
+        uint64_t speedup = base_ns * 100 / (elapsed ? elapsed : 1);
+        uart_puts("  ");
+        print_decimal(n);
+        uart_puts(n == 1 ? " CPU:  " : " CPUs: ");
+        print_decimal(elapsed / 1000000);
+        uart_puts(" ms, ");
+        print_decimal(started * 1000000000ULL / (elapsed ? elapsed : 1));
+        uart_puts(" workers/s, speedup ");
+        print_decimal(speedup / 100);
+        uart_putc('.');
+        uart_putc('0' + (speedup / 10) % 10);
+        uart_putc('0' + speedup % 10);
+        uart_puts("x\n");
+    }
+
+    sched_set_active_cpus(NR_CPUS);
+}
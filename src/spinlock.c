@@ -0,0 +1,302 @@
+// Spinlocks and Atomics for SMP
+// Save as: ~/OS_proj/src/spinlock.c
+//
+// Ticket locks: the low halfword is the ticket being served, the high
+// halfword the next ticket to hand out, so CPUs get the lock in FIFO
+// order. Waiters sleep in wfe; the unlocking store clears their
+// exclusive monitor, which wakes them. A zeroed lock is unlocked.
+//
+// Every read-modify-write has two implementations: LDAXR/STLXR loops,
+// which any ARMv8.0 core runs, and single ARMv8.1 LSE instructions
+// (LDADD, CAS, SWP), which do not retry under contention. init_atomics
+// picks one from ID_AA64ISAR0_EL1; until then the LL/SC path is used.
+// Both paths operate on the same memory, so they can be mixed safely.
+
+#include <stdint.h>
+
+// External interrupt functions
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+
+// External UART functions
+extern void uart_puts(const char* str);
+
+// The assembler only accepts LSE instructions once told about them
+#define LSE_PREAMBLE    ".arch_extension lse\n"
+
+// ID_AA64ISAR0_EL1.Atomic, bits [23:20]: 2 means LSE is implemented
+#define ISAR0_ATOMIC_SHIFT  20
+#define ISAR0_ATOMIC_LSE    2
+
+static int have_lse = 0;        // CPU implements LSE
+static int use_lse = 0;         // LSE path selected
+
+// Other files see only the word (struct spinlock, same layout); the
+// halfwords give the asm that touches one of them a properly typed operand
+typedef union spinlock {
+    volatile uint32_t lock;     // [15:0] owner, [31:16] next
+    struct {
+        volatile uint16_t owner;    // Ticket being served
+        volatile uint16_t next;     // Next ticket to hand out
+    } tickets;
+} spinlock_t;
+
+// Select the atomics implementation (boot CPU, before the others start)
+void init_atomics(void) {
+    uint64_t isar0;
+    asm volatile("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+
+    have_lse = ((isar0 >> ISAR0_ATOMIC_SHIFT) & 0xF) >= ISAR0_ATOMIC_LSE;
+    use_lse = have_lse;
+
+    uart_puts(use_lse ? "Atomics: ARMv8.1 LSE\n" : "Atomics: LL/SC (no LSE)\n");
+}
+
+int atomics_have_lse(void) {
+    return have_lse;
+}
+
+int atomics_use_lse(void) {
+    return use_lse;
+}
+
+// Switch paths at run time, for comparing them. Returns the path in use.
+int atomics_set_lse(int enable) {
+    use_lse = enable && have_lse;
+    return use_lse;
+}
+
+void spin_lock_init(spinlock_t* lock) {
+    lock->lock = 0;
+}
+
+// Wait for the owner halfword to reach our ticket
+static inline void ticket_wait(spinlock_t* lock, uint32_t ticket) {
+    uint32_t owner, tmp;
+
+    asm volatile(
+        "   eor     %w1, %w2, %w2, ror #16\n"
+        "   cbz     %w1, 2f\n"
+        "   sevl\n"
+        "1: wfe\n"
+        "   ldaxrh  %w0, %3\n"
+        "   eor     %w1, %w0, %w2, lsr #16\n"
+        "   cbnz    %w1, 1b\n"
+        "2:"
+        : "=&r"(owner), "=&r"(tmp)
+        : "r"(ticket), "Q"(lock->tickets.owner)
+        : "memory");
+}
+
+void spin_lock(spinlock_t* lock) {
+    uint32_t ticket, tmp, status;
+
+    if (use_lse) {
+        // One LDADDA takes a ticket, with no retry loop
+        asm volatile(
+            LSE_PREAMBLE
+            "   ldadda  %w2, %w0, %1\n"
+            : "=&r"(ticket), "+Q"(lock->lock)
+            : "r"(0x10000)
+            : "memory");
+    } else {
+        asm volatile(
+            "   prfm    pstl1strm, %3\n"
+            "1: ldaxr   %w0, %3\n"
+            "   add     %w1, %w0, #0x10000\n"
+            "   stxr    %w2, %w1, %3\n"
+            "   cbnz    %w2, 1b\n"
+            : "=&r"(ticket), "=&r"(tmp), "=&r"(status), "+Q"(lock->lock)
+            :
+            : "memory");
+    }
+
+    ticket_wait(lock, ticket);
+}
+
+// Returns 1 if the lock was taken, 0 if it is held
+int spin_trylock(spinlock_t* lock) {
+    uint32_t value, tmp;
+
+    if (use_lse) {
+        // Only take a ticket if it would be served at once
+        value = lock->lock;
+        if ((value & 0xFFFF) != (value >> 16)) {
+            return 0;
+        }
+        tmp = value;
+        asm volatile(
+            LSE_PREAMBLE
+            "   casa    %w0, %w2, %1\n"
+            : "+&r"(tmp), "+Q"(lock->lock)
+            : "r"(value + 0x10000)
+            : "memory");
+        return tmp == value;
+    }
+
+    asm volatile(
+        "   prfm    pstl1strm, %2\n"
+        "1: ldaxr   %w0, %2\n"
+        "   eor     %w1, %w0, %w0, ror #16\n"
+        "   cbnz    %w1, 2f\n"
+        "   add     %w0, %w0, #0x10000\n"
+        "   stxr    %w1, %w0, %2\n"
+        "   cbnz    %w1, 1b\n"
+        "2:"
+        : "=&r"(value), "=&r"(tmp), "+Q"(lock->lock)
+        :
+        : "memory");
+
+    return tmp == 0;
+}
+
+// Only the owner writes the owner halfword, so a plain release store
+// does on both paths
+void spin_unlock(spinlock_t* lock) {
+    uint32_t tmp;
+
+    asm volatile(
+        "   ldrh    %w1, %0\n"
+        "   add     %w1, %w1, #1\n"
+        "   stlrh   %w1, %0\n"
+        : "+Q"(lock->tickets.owner), "=&r"(tmp)
+        :
+        : "memory");
+}
+
+int spin_is_locked(spinlock_t* lock) {
+    uint32_t value = lock->lock;
+    return (value & 0xFFFF) != (value >> 16);
+}
+
+// Lock with IRQs masked on this CPU, for data also touched from IRQs
+uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+// Atomically replace *ptr with new_value if it equals old_value.
+// Returns the value found, so success is (result == old_value).
+// Acquire and release ordering, as for all the RMW operations below.
+int atomic_cmpxchg(volatile int* ptr, int old_value, int new_value) {
+    int found;
+    uint32_t status;
+
+    if (use_lse) {
+        found = old_value;
+        asm volatile(
+            LSE_PREAMBLE
+            "   casal   %w0, %w2, %1\n"
+            : "+&r"(found), "+Q"(*ptr)
+            : "r"(new_value)
+            : "memory");
+        return found;
+    }
+
+    asm volatile(
+        "1: ldaxr   %w0, %2\n"
+        "   cmp     %w0, %w3\n"
+        "   b.ne    2f\n"
+        "   stlxr   %w1, %w4, %2\n"
+        "   cbnz    %w1, 1b\n"
+        "2:"
+        : "=&r"(found), "=&r"(status), "+Q"(*ptr)
+        : "r"(old_value), "r"(new_value)
+        : "cc", "memory");
+
+    return found;
+}
+
+// Atomically add delta to *ptr, returning the new value
+int atomic_add_return(volatile int* ptr, int delta) {
+    int result;
+    uint32_t status;
+
+    if (use_lse) {
+        asm volatile(
+            LSE_PREAMBLE
+            "   ldaddal %w2, %w0, %1\n"
+            : "=&r"(result), "+Q"(*ptr)
+            : "r"(delta)
+            : "memory");
+        return result + delta;
+    }
+
+    asm volatile(
+        "1: ldaxr   %w0, %2\n"
+        "   add     %w0, %w0, %w3\n"
+        "   stlxr   %w1, %w0, %2\n"
+        "   cbnz    %w1, 1b\n"
+        : "=&r"(result), "=&r"(status), "+Q"(*ptr)
+        : "r"(delta)
+        : "memory");
+
+    return result;
+}
+
+// 64-bit exchange, for pointers. Returns the old value.
+uint64_t atomic_xchg64(volatile uint64_t* ptr, uint64_t value) {
+    uint64_t old;
+    uint32_t status;
+
+    if (use_lse) {
+        asm volatile(
+            LSE_PREAMBLE
+            "   swpal   %2, %0, %1\n"
+            : "=&r"(old), "+Q"(*ptr)
+            : "r"(value)
+            : "memory");
+        return old;
+    }
+
+    asm volatile(
+        "1: ldaxr   %0, %2\n"
+        "   stlxr   %w1, %3, %2\n"
+        "   cbnz    %w1, 1b\n"
+        : "=&r"(old), "=&r"(status), "+Q"(*ptr)
+        : "r"(value)
+        : "memory");
+
+    return old;
+}
+
+// 64-bit compare and swap, returns the value found
+uint64_t atomic_cmpxchg64(volatile uint64_t* ptr, uint64_t old_value, uint64_t new_value) {
+    uint64_t found;
+    uint32_t status;
+
+    if (use_lse) {
+        found = old_value;
+        asm volatile(
+            LSE_PREAMBLE
+            "   casal   %0, %2, %1\n"
+            : "+&r"(found), "+Q"(*ptr)
+            : "r"(new_value)
+            : "memory");
+        return found;
+    }
+
+    asm volatile(
+        "1: ldaxr   %0, %2\n"
+        "   cmp     %0, %3\n"
+        "   b.ne    2f\n"
+        "   stlxr   %w1, %4, %2\n"
+        "   cbnz    %w1, 1b\n"
+        "2:"
+        : "=&r"(found), "=&r"(status), "+Q"(*ptr)
+        : "r"(old_value), "r"(new_value)
+        : "cc", "memory");
+
+    return found;
+}
+
+// Busy-wait hint for polling loops
+void cpu_relax(void) {
+    asm volatile("yield" ::: "memory");
+}
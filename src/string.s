@@ -0,0 +1,414 @@
+// Memory and String Primitives for ARM64 OS
+// Save as: ~/OS_proj/src/string.s
+//
+// memcpy, memmove, memset, memcmp and strlen, tuned for Cortex-A72:
+// 64 bytes per loop iteration with LDP/STP, overlapping unaligned
+// loads and stores for the head and tail instead of byte loops, and
+// DC ZVA for large zeroing.
+//
+// Until string_init runs (from mmu_init, once the caches are on) memory
+// is Device memory, where unaligned accesses and DC ZVA fault, so the
+// copy and fill routines fall back to aligned and byte accesses.
+//
+// memcpy_neon and memset_neon move 64 bytes per iteration through Q
+// registers. They need FP/SIMD enabled, i.e. kernel_fpsimd_begin.
+
+.section ".data"
+.align 3
+string_fast:
+    .quad 0                     // Caches on: unaligned access and DC ZVA allowed
+zva_block_size:
+    .quad 0                     // DC ZVA block in bytes, 0 if prohibited
+
+.section ".text"
+
+// Function: string_init(void)
+// Enable the fast paths; called once the MMU and caches are on
+.global string_init
+string_init:
+    mrs x0, dczid_el0
+    mov x1, #0
+    tbnz x0, #4, 1f             // DZP: DC ZVA prohibited
+    and x0, x0, #0xF            // BS: log2 of the block size in words
+    mov x1, #4
+    lsl x1, x1, x0
+1:  ldr x2, =zva_block_size
+    str x1, [x2]
+    ldr x2, =string_fast
+    mov x1, #1
+    str x1, [x2]
+    ret
+
+// Function: memset(void* dst, int c, size_t n)
+// Returns dst
+.global memset
+memset:
+    and w1, w1, #0xFF
+    mov x9, #0x0101010101010101
+    mul x7, x1, x9              // c in every byte
+    add x11, x0, x2             // End of the buffer
+    ldr x10, =string_fast
+    ldr x10, [x10]
+    cbz x10, .Lset_slow
+
+    cmp x2, #16
+    b.lo .Lset_small
+
+    // Unaligned first 16 bytes, then continue from the next 16-byte boundary
+    stp x7, x7, [x0]
+    add x8, x0, #16
+    and x8, x8, #~15
+    sub x2, x11, x8
+    cbnz w1, .Lset_loop64
+
+    // Zeroing: whole DC ZVA blocks for large buffers
+    ldr x12, =zva_block_size
+    ldr x12, [x12]
+    cbz x12, .Lset_loop64
+    cmp x2, #256
+    b.lo .Lset_loop64
+    cmp x2, x12, lsl #1
+    b.lo .Lset_loop64
+    sub x13, x12, #1
+1:  tst x8, x13                 // 16 bytes at a time up to a block boundary
+    b.eq 2f
+    stp xzr, xzr, [x8], #16
+    sub x2, x2, #16
+    b 1b
+2:  dc zva, x8
+    add x8, x8, x12
+    sub x2, x2, x12
+    cmp x2, x12
+    b.hs 2b
+
+.Lset_loop64:
+    cmp x2, #64
+    b.lo .Lset_tail
+    stp x7, x7, [x8]
+    stp x7, x7, [x8, #16]
+    stp x7, x7, [x8, #32]
+    stp x7, x7, [x8, #48]
+    add x8, x8, #64
+    sub x2, x2, #64
+    b .Lset_loop64
+
+.Lset_tail:
+    cmp x2, #16
+    b.lo 3f
+    stp x7, x7, [x8], #16
+    sub x2, x2, #16
+    b .Lset_tail
+3:  stp x7, x7, [x11, #-16]     // Last 16 bytes, overlapping what is done
+    ret
+
+    // Fewer than 16 bytes: two overlapping stores cover 4..15
+.Lset_small:
+    tbz x2, #3, 1f
+    str x7, [x0]
+    str x7, [x11, #-8]
+    ret
+1:  tbz x2, #2, 2f
+    str w7, [x0]
+    str w7, [x11, #-4]
+    ret
+2:  cbz x2, 3f
+    strb w7, [x0]
+    tbz x2, #1, 3f
+    strh w7, [x11, #-2]
+3:  ret
+
+    // Caches off: naturally aligned stores only
+.Lset_slow:
+    mov x8, x0
+1:  cbz x2, 4f                  // Bytes up to a 16-byte boundary
+    tst x8, #15
+    b.eq 2f
+    strb w7, [x8], #1
+    sub x2, x2, #1
+    b 1b
+2:  cmp x2, #16
+    b.lo 3f
+    stp x7, x7, [x8], #16
+    sub x2, x2, #16
+    b 2b
+3:  cbz x2, 4f
+    strb w7, [x8], #1
+    sub x2, x2, #1
+    b 3b
+4:  ret
+
+// Function: memcpy(void* dst, const void* src, size_t n)
+// Buffers must not overlap. Returns dst
+.global memcpy
+memcpy:
+    add x4, x1, x2              // Source end
+    add x5, x0, x2              // Destination end
+    ldr x10, =string_fast
+    ldr x10, [x10]
+    cbz x10, .Lcpy_bytes
+
+    cmp x2, #16
+    b.ls .Lcpy_16
+    cmp x2, #64
+    b.hi .Lcpy_large
+
+    // 17..64 bytes: first and last 16 or 32, overlapping in the middle
+    ldp x6, x7, [x1]
+    ldp x8, x9, [x4, #-16]
+    cmp x2, #32
+    b.hi 1f
+    stp x6, x7, [x0]
+    stp x8, x9, [x5, #-16]
+    ret
+1:  ldp x10, x11, [x1, #16]
+    ldp x12, x13, [x4, #-32]
+    stp x6, x7, [x0]
+    stp x10, x11, [x0, #16]
+    stp x12, x13, [x5, #-32]
+    stp x8, x9, [x5, #-16]
+    ret
+
+    // 0..16 bytes
+.Lcpy_16:
+    tbz x2, #4, 1f
+    ldp x6, x7, [x1]
+    stp x6, x7, [x0]
+    ret
+1:  tbz x2, #3, 2f
+    ldr x6, [x1]
+    ldr x7, [x4, #-8]
+    str x6, [x0]
+    str x7, [x5, #-8]
+    ret
+2:  tbz x2, #2, 3f
+    ldr w6, [x1]
+    ldr w7, [x4, #-4]
+    str w6, [x0]
+    str w7, [x5, #-4]
+    ret
+3:  cbz x2, 4f                  // 1..3: first, middle and last byte
+    lsr x9, x2, #1
+    ldrb w6, [x1]
+    ldrb w7, [x1, x9]
+    ldrb w8, [x4, #-1]
+    strb w6, [x0]
+    strb w7, [x0, x9]
+    strb w8, [x5, #-1]
+4:  ret
+
+    // Over 64 bytes: unaligned first 16, then 64-byte blocks to a 16-byte
+    // aligned destination, then the last 64 from the end
+.Lcpy_large:
+    ldp x6, x7, [x1]
+    and x9, x0, #15
+    sub x3, x0, x9
+    sub x1, x1, x9
+    add x2, x2, x9
+    stp x6, x7, [x0]
+    add x3, x3, #16
+    add x1, x1, #16
+    sub x2, x2, #16
+1:  cmp x2, #64
+    b.ls 2f
+    ldp x6, x7, [x1]
+    ldp x8, x9, [x1, #16]
+    ldp x10, x11, [x1, #32]
+    ldp x12, x13, [x1, #48]
+    add x1, x1, #64
+    stp x6, x7, [x3]
+    stp x8, x9, [x3, #16]
+    stp x10, x11, [x3, #32]
+    stp x12, x13, [x3, #48]
+    add x3, x3, #64
+    sub x2, x2, #64
+    b 1b
+2:  ldp x6, x7, [x4, #-64]
+    ldp x8, x9, [x4, #-48]
+    ldp x10, x11, [x4, #-32]
+    ldp x12, x13, [x4, #-16]
+    stp x6, x7, [x5, #-64]
+    stp x8, x9, [x5, #-48]
+    stp x10, x11, [x5, #-32]
+    stp x12, x13, [x5, #-16]
+    ret
+
+    // Caches off: bytes, or 8 bytes at a time when both are aligned
+.Lcpy_bytes:
+    mov x3, x0
+    orr x9, x0, x1
+    tst x9, #7
+    b.ne 2f
+1:  cmp x2, #8
+    b.lo 2f
+    ldr x6, [x1], #8
+    str x6, [x3], #8
+    sub x2, x2, #8
+    b 1b
+2:  cbz x2, 3f
+    ldrb w6, [x1], #1
+    strb w6, [x3], #1
+    sub x2, x2, #1
+    b 2b
+3:  ret
+
+// Function: memmove(void* dst, const void* src, size_t n)
+// Buffers may overlap. Returns dst
+.global memmove
+memmove:
+    sub x9, x0, x1
+    cmp x9, x2
+    b.lo .Lmove_back            // dst inside (src, src + n): copy downwards
+    sub x9, x1, x0
+    cmp x9, x2
+    b.hs memcpy                 // No overlap
+
+    // dst below src: forward, each chunk loaded before it is stored
+    mov x3, x0
+    ldr x10, =string_fast
+    ldr x10, [x10]
+    cbz x10, 2f
+1:  cmp x2, #16
+    b.lo 2f
+    ldp x6, x7, [x1], #16
+    stp x6, x7, [x3], #16
+    sub x2, x2, #16
+    b 1b
+2:  cbz x2, 3f
+    ldrb w6, [x1], #1
+    strb w6, [x3], #1
+    sub x2, x2, #1
+    b 2b
+3:  ret
+
+.Lmove_back:
+    cbz x2, 3f                  // dst == src with n == 0 lands here
+    add x4, x1, x2
+    add x5, x0, x2
+    ldr x10, =string_fast
+    ldr x10, [x10]
+    cbz x10, 2f
+1:  cmp x2, #16
+    b.lo 2f
+    ldp x6, x7, [x4, #-16]!
+    stp x6, x7, [x5, #-16]!
+    sub x2, x2, #16
+    b 1b
+2:  cbz x2, 3f
+    ldrb w6, [x4, #-1]!
+    strb w6, [x5, #-1]!
+    sub x2, x2, #1
+    b 2b
+3:  ret
+
+// Function: memcmp(const void* a, const void* b, size_t n)
+// Returns <0, 0 or >0 as for the first differing byte
+.global memcmp
+memcmp:
+    ldr x10, =string_fast
+    ldr x10, [x10]
+    cbz x10, 2f
+1:  cmp x2, #8
+    b.lo 2f
+    ldr x3, [x0], #8
+    ldr x4, [x1], #8
+    sub x2, x2, #8
+    cmp x3, x4
+    b.eq 1b
+    rev x3, x3                  // Compare as big-endian: first byte decides
+    rev x4, x4
+    cmp x3, x4
+    cset w0, hi
+    csinv w0, w0, wzr, hs
+    ret
+2:  cbz x2, 3f
+    ldrb w3, [x0], #1
+    ldrb w4, [x1], #1
+    sub x2, x2, #1
+    subs w5, w3, w4
+    b.eq 2b
+    mov w0, w5
+    ret
+3:  mov w0, #0
+    ret
+
+// Function: strlen(const char* s)
+// Aligned 8-byte loads never cross into an unmapped page, and are safe
+// with the caches off
+.global strlen
+strlen:
+    mov x1, x0
+1:  tst x1, #7                  // Bytes up to an 8-byte boundary
+    b.eq 2f
+    ldrb w2, [x1]
+    cbz w2, 4f
+    add x1, x1, #1
+    b 1b
+2:  mov x3, #0x0101010101010101
+    lsl x4, x3, #7              // 0x8080...80
+3:  ldr x2, [x1], #8            // Zero byte test: (x - 0x01..) & ~x & 0x80..
+    sub x5, x2, x3
+    bic x5, x5, x2
+    ands x5, x5, x4
+    b.eq 3b
+    sub x1, x1, #8
+    rbit x5, x5                 // Lowest flagged byte is the first zero
+    clz x5, x5
+    add x1, x1, x5, lsr #3
+4:  sub x0, x1, x0
+    ret
+
+// Function: memcpy_neon(void* dst, const void* src, size_t n)
+// memcpy through Q registers; FP/SIMD must be enabled. Returns dst
+.global memcpy_neon
+memcpy_neon:
+    cmp x2, #128
+    b.lo memcpy
+    add x4, x1, x2
+    add x5, x0, x2
+    ldr q0, [x1]                // Unaligned first 16, then align dst
+    and x9, x0, #15
+    sub x3, x0, x9
+    sub x1, x1, x9
+    add x2, x2, x9
+    str q0, [x0]
+    add x3, x3, #16
+    add x1, x1, #16
+    sub x2, x2, #16
+1:  cmp x2, #64
+    b.ls 2f
+    ldp q0, q1, [x1]
+    ldp q2, q3, [x1, #32]
+    add x1, x1, #64
+    stp q0, q1, [x3]
+    stp q2, q3, [x3, #32]
+    add x3, x3, #64
+    sub x2, x2, #64
+    b 1b
+2:  ldp q0, q1, [x4, #-64]
+    ldp q2, q3, [x4, #-32]
+    stp q0, q1, [x5, #-64]
+    stp q2, q3, [x5, #-32]
+    ret
+
+// Function: memset_neon(void* dst, int c, size_t n)
+// memset through Q registers; FP/SIMD must be enabled. Returns dst
+.global memset_neon
+memset_neon:
+    cmp x2, #128
+    b.lo memset
+    dup v0.16b, w1
+    add x11, x0, x2
+    str q0, [x0]
+    add x8, x0, #16
+    and x8, x8, #~15
+    sub x2, x11, x8
+1:  cmp x2, #64
+    b.lo 2f
+    stp q0, q0, [x8]
+    stp q0, q0, [x8, #32]
+    add x8, x8, #64
+    sub x2, x2, #64
+    b 1b
+2:  stp q0, q0, [x11, #-64]     // Last 64 bytes, overlapping what is done
+    stp q0, q0, [x11, #-32]
+    ret
@@ -0,0 +1,654 @@
+// Scalable Locks and Lock-Free Queues
+// Save as: ~/OS_proj/src/sync.c
+//
+// Built on the atomics in spinlock.c, so every primitive follows the
+// LL/SC or LSE path selected at boot:
+//   MCS lock   - queue lock, each waiter spins on its own node
+//   rwlock     - many readers or one writer; a waiting writer holds
+//                off new readers so it cannot starve
+//   seqlock    - readers take no lock and retry if a writer got in
+//   MPSC queue - intrusive, wait-free push, one consumer (Vyukov)
+//   SPSC ring  - bounded, one producer and one consumer, no RMW at all
+// benchmark_sync stress-tests each of them and the ticket spinlock on
+// every online CPU, checking the protected data and reporting ops/s.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External spinlock and atomic functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern void spin_lock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern int spin_is_locked(spinlock_t* lock);
+extern int atomic_cmpxchg(volatile int* ptr, int old_value, int new_value);
+extern int atomic_add_return(volatile int* ptr, int delta);
+extern uint64_t atomic_xchg64(volatile uint64_t* ptr, uint64_t value);
+extern uint64_t atomic_cmpxchg64(volatile uint64_t* ptr, uint64_t old_value, uint64_t new_value);
+extern int atomics_have_lse(void);
+extern int atomics_use_lse(void);
+extern int atomics_set_lse(int enable);
+extern void cpu_relax(void);
+
+// External page allocator functions
+extern void* alloc_pages(unsigned int order);
+extern void free_pages(void* addr, unsigned int order);
+extern unsigned int pages_order(size_t size);
+
+// External process and SMP functions
+typedef struct process process_t;
+extern process_t* create_process(const char* name, void (*entry_point)(void));
+extern void schedule_process(process_t* proc);
+extern void process_sleep(uint64_t ns);
+extern int smp_num_online(void);
+extern uint64_t timer_now_ns(void);
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+#define CACHE_LINE 64
+
+// MCS lock: waiters form a queue through their nodes and each spins on
+// its own node's flag, so a handover touches one remote cache line
+// instead of every waiter's. The node must stay live until unlock.
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile int locked;        // Set by the previous holder on handover
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t* volatile tail;  // Last in the queue, NULL when free
+} mcs_lock_t;
+
+void mcs_lock_init(mcs_lock_t* lock) {
+    lock->tail = NULL;
+}
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    node->next = NULL;
+    node->locked = 0;
+
+    mcs_node_t* prev = (mcs_node_t*)atomic_xchg64((volatile uint64_t*)&lock->tail, (uint64_t)node);
+    if (!prev) {
+        return;
+    }
+
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
+    }
+}
+
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    mcs_node_t* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        // No one queued: free the lock, unless someone swaps in right now
+        if (atomic_cmpxchg64((volatile uint64_t*)&lock->tail, (uint64_t)node, 0) == (uint64_t)node) {
+            return;
+        }
+        // A waiter took the tail but has not linked itself to us yet
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+            cpu_relax();
+        }
+    }
+
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+int mcs_is_locked(mcs_lock_t* lock) {
+    return lock->tail != NULL;
+}
+
+// Reader-writer lock: reader count in the low bits, plus writer flags
+#define RW_WRITER       (1 << 30)   // Held for writing
+#define RW_WAITING      (1 << 29)   // A writer is waiting, readers hold off
+
+typedef struct {
+    volatile int value;
+} rwlock_t;
+
+void rwlock_init(rwlock_t* rw) {
+    rw->value = 0;
+}
+
+void read_lock(rwlock_t* rw) {
+    while (1) {
+        int value = rw->value;
+        if (!(value & (RW_WRITER | RW_WAITING)) &&
+            atomic_cmpxchg(&rw->value, value, value + 1) == value) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+void read_unlock(rwlock_t* rw) {
+    atomic_add_return(&rw->value, -1);
+}
+
+void write_lock(rwlock_t* rw) {
+    while (1) {
+        int value = rw->value;
+        if (!(value & ~RW_WAITING)) {
+            // No readers, no writer: take it (this clears RW_WAITING,
+            // other waiting writers set it again)
+            if (atomic_cmpxchg(&rw->value, value, RW_WRITER) == value) {
+                return;
+            }
+        } else if (!(value & RW_WAITING)) {
+            atomic_cmpxchg(&rw->value, value, value | RW_WAITING);
+        }
+        cpu_relax();
+    }
+}
+
+void write_unlock(rwlock_t* rw) {
+    atomic_add_return(&rw->value, -RW_WRITER);
+}
+
+// Seqlock: the sequence is odd while a write is in progress. Readers
+// copy the data out and retry if the sequence moved underneath them.
+typedef struct {
+    volatile uint32_t sequence;
+    spinlock_t lock;            // Serializes writers
+} seqlock_t;
+
+void seqlock_init(seqlock_t* sl) {
+    sl->sequence = 0;
+    sl->lock.lock = 0;
+}
+
+void write_seqlock(seqlock_t* sl) {
+    spin_lock(&sl->lock);
+    sl->sequence++;
+    asm volatile("dmb ishst" ::: "memory");
+}
+
+void write_sequnlock(seqlock_t* sl) {
+    asm volatile("dmb ishst" ::: "memory");
+    sl->sequence++;
+    spin_unlock(&sl->lock);
+}
+
+uint32_t read_seqbegin(seqlock_t* sl) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+// Non-zero if the data read since read_seqbegin may be torn
+int read_seqretry(seqlock_t* sl, uint32_t seq) {
+    asm volatile("dmb ishld" ::: "memory");
+    return sl->sequence != seq;
+}
+
+// MPSC queue: producers swap themselves in at head with one atomic
+// exchange, the consumer walks from tail. The stub node keeps the queue
+// from ever being empty of nodes, so push never has to touch tail.
+typedef struct mpsc_node {
+    struct mpsc_node* volatile next;
+} mpsc_node_t;
+
+typedef struct {
+    mpsc_node_t* volatile head;                                 // Producers
+    mpsc_node_t* tail __attribute__((aligned(CACHE_LINE)));     // Consumer
+    mpsc_node_t stub;
+} mpsc_queue_t;
+
+void mpsc_init(mpsc_queue_t* q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+// Any CPU, wait-free
+void mpsc_push(mpsc_queue_t* q, mpsc_node_t* node) {
+    node->next = NULL;
+    mpsc_node_t* prev = (mpsc_node_t*)atomic_xchg64((volatile uint64_t*)&q->head, (uint64_t)node);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Consumer only. NULL when empty, or when the next producer is between
+// its exchange and its link (try again later).
+mpsc_node_t* mpsc_pop(mpsc_queue_t* q) {
+    mpsc_node_t* tail = q->tail;
+    mpsc_node_t* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != q->head) {
+        return NULL;
+    }
+
+    // tail is the last node: put the stub behind it so it can be taken
+    mpsc_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// SPSC ring: each side owns one index and only reads the other's, so
+// acquire/release loads and stores are all it needs, on either path.
+// Items must not be NULL.
+#define SPSC_SIZE 256               // Power of two
+
+typedef struct {
+    volatile uint32_t head __attribute__((aligned(CACHE_LINE)));   // Consumer
+    volatile uint32_t tail __attribute__((aligned(CACHE_LINE)));   // Producer
+    void* slots[SPSC_SIZE] __attribute__((aligned(CACHE_LINE)));
+} spsc_ring_t;
+
+void spsc_init(spsc_ring_t* ring) {
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Returns 0 if the ring is full
+int spsc_push(spsc_ring_t* ring, void* item) {
+    uint32_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SPSC_SIZE) {
+        return 0;
+    }
+
+    ring->slots[tail & (SPSC_SIZE - 1)] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Returns NULL if the ring is empty
+void* spsc_pop(spsc_ring_t* ring) {
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    void* item = ring->slots[head & (SPSC_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// Stress and throughput suite. One worker process per online CPU runs
+// every test between barriers; worker 0 sets up, times and checks each
+// one. A test fails if the data it protects ends up inconsistent.
+#define SYNC_BENCH_ITERATIONS   50000   // Per worker, lock tests
+#define SYNC_QUEUE_ITERATIONS   20000   // Per producer, queue tests
+#define SYNC_WRITE_EVERY        10      // rwlock: one write per 10 ops
+
+typedef struct {
+    volatile int count;
+    volatile int sense;
+    int total;
+} barrier_t;
+
+typedef struct {
+    mpsc_node_t link;
+    int producer;
+    int seq;
+} bench_item_t;
+
+static barrier_t bench_barrier;
+static volatile int bench_next_id;
+static volatile int bench_finished;
+static int bench_workers;
+
+// What the tests protect
+static spinlock_t bench_spinlock;
+static mcs_lock_t bench_mcs;
+static rwlock_t bench_rwlock;
+static seqlock_t bench_seqlock;
+static mpsc_queue_t bench_mpsc;
+static spsc_ring_t bench_spsc;
+static volatile uint64_t shared_counter;
+static volatile uint64_t shared_pair[2];    // Writers keep both equal
+static bench_item_t* bench_items;
+static unsigned int bench_items_order;
+
+// Per worker results, written once at the end of each test
+static uint64_t bench_ops[NR_CPUS];         // Completed operations
+static uint64_t bench_attempts[NR_CPUS];    // Acquisitions or polls
+static uint64_t bench_contended[NR_CPUS];   // Of those, found busy/empty/full
+static uint64_t bench_errors[NR_CPUS];
+
+// Sense-reversing barrier for the worker processes
+static void barrier_wait(barrier_t* b) {
+    int sense = b->sense;
+    if (atomic_add_return(&b->count, 1) == b->total) {
+        b->count = 0;
+        __atomic_store_n(&b->sense, !sense, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) == sense) {
+        cpu_relax();
+    }
+}
+
+static void record(int id, uint64_t ops, uint64_t attempts, uint64_t contended, uint64_t errors) {
+    bench_ops[id] = ops;
+    bench_attempts[id] = attempts;
+    bench_contended[id] = contended;
+    bench_errors[id] = errors;
+}
+
+static void run_ticket(int id) {
+    uint64_t contended = 0;
+    for (int i = 0; i < SYNC_BENCH_ITERATIONS; i++) {
+        contended += spin_is_locked(&bench_spinlock);
+        spin_lock(&bench_spinlock);
+        shared_counter++;
+        spin_unlock(&bench_spinlock);
+    }
+    record(id, SYNC_BENCH_ITERATIONS, SYNC_BENCH_ITERATIONS, contended, 0);
+}
+
+static void run_mcs(int id) {
+    mcs_node_t node;
+    uint64_t contended = 0;
+    for (int i = 0; i < SYNC_BENCH_ITERATIONS; i++) {
+        contended += mcs_is_locked(&bench_mcs);
+        mcs_lock(&bench_mcs, &node);
+        shared_counter++;
+        mcs_unlock(&bench_mcs, &node);
+    }
+    record(id, SYNC_BENCH_ITERATIONS, SYNC_BENCH_ITERATIONS, contended, 0);
+}
+
+static void run_rwlock(int id) {
+    uint64_t contended = 0;
+    uint64_t errors = 0;
+    for (int i = 0; i < SYNC_BENCH_ITERATIONS; i++) {
+        if (i % SYNC_WRITE_EVERY == 0) {
+            contended += bench_rwlock.value != 0;
+            write_lock(&bench_rwlock);
+            shared_pair[0]++;
+            shared_pair[1]++;
+            shared_counter++;
+            write_unlock(&bench_rwlock);
+        } else {
+            contended += (bench_rwlock.value & (RW_WRITER | RW_WAITING)) != 0;
+            read_lock(&bench_rwlock);
+            errors += shared_pair[0] != shared_pair[1];
+            read_unlock(&bench_rwlock);
+        }
+    }
+    record(id, SYNC_BENCH_ITERATIONS, SYNC_BENCH_ITERATIONS, contended, errors);
+}
+
+// Worker 0 writes, everyone else reads; contention is reader retries
+static void run_seqlock(int id) {
+    if (id == 0) {
+        for (int i = 0; i < SYNC_BENCH_ITERATIONS; i++) {
+            write_seqlock(&bench_seqlock);
+            shared_pair[0]++;
+            shared_pair[1]++;
+            write_sequnlock(&bench_seqlock);
+        }
+        record(id, SYNC_BENCH_ITERATIONS, SYNC_BENCH_ITERATIONS, 0, 0);
+        return;
+    }
+
+    uint64_t retries = 0;
+    uint64_t errors = 0;
+    for (int i = 0; i < SYNC_BENCH_ITERATIONS; i++) {
+        uint64_t a, b;
+        uint32_t seq;
+        do {
+            seq = read_seqbegin(&bench_seqlock);
+            a = shared_pair[0];
+            b = shared_pair[1];
+        } while (read_seqretry(&bench_seqlock, seq) && ++retries);
+        errors += a != b;
+    }
+    record(id, SYNC_BENCH_ITERATIONS, SYNC_BENCH_ITERATIONS + retries, retries, errors);
+}
+
+// Workers 1.. produce, worker 0 consumes and checks per-producer order
+static void run_mpsc(int id) {
+    if (id != 0) {
+        bench_item_t* items = bench_items + (id - 1) * SYNC_QUEUE_ITERATIONS;
+        for (int i = 0; i < SYNC_QUEUE_ITERATIONS; i++) {
+            items[i].producer = id;
+            items[i].seq = i;
+            mpsc_push(&bench_mpsc, &items[i].link);
+        }
+        record(id, 0, 0, 0, 0);
+        return;
+    }
+
+    int next_seq[NR_CPUS] = { 0 };
+    uint64_t total = (uint64_t)(bench_workers - 1) * SYNC_QUEUE_ITERATIONS;
+    uint64_t received = 0, polls = 0, empty = 0, errors = 0;
+    while (received < total) {
+        bench_item_t* item = (bench_item_t*)mpsc_pop(&bench_mpsc);
+        polls++;
+        if (!item) {
+            empty++;
+            cpu_relax();
+            continue;
+        }
+        errors += item->seq != next_seq[item->producer];
+        next_seq[item->producer] = item->seq + 1;
+        received++;
+    }
+    record(id, received, polls, empty, errors);
+}
+
+// Worker 0 produces, worker 1 consumes; the rest sit this one out
+static void run_spsc(int id) {
+    uint64_t polls = 0, busy = 0, errors = 0;
+
+    if (id == 0) {
+        for (uintptr_t i = 1; i <= SYNC_QUEUE_ITERATIONS; i++) {
+            polls++;
+            while (!spsc_push(&bench_spsc, (void*)i)) {
+                polls++;
+                busy++;
+                cpu_relax();
+            }
+        }
+        record(id, 0, polls, busy, 0);
+    } else if (id == 1) {
+        uintptr_t expect = 1;
+        while (expect <= SYNC_QUEUE_ITERATIONS) {
+            void* item = spsc_pop(&bench_spsc);
+            polls++;
+            if (!item) {
+                busy++;
+                cpu_relax();
+                continue;
+            }
+            errors += (uintptr_t)item != expect;
+            expect++;
+        }
+        record(id, SYNC_QUEUE_ITERATIONS, polls, busy, errors);
+    } else {
+        record(id, 0, 0, 0, 0);
+    }
+}
+
+// Checks on the shared data after a test (worker 0, all others done)
+static uint64_t check_counter(void) {
+    uint64_t expect = (uint64_t)bench_workers * SYNC_BENCH_ITERATIONS;
+    return shared_counter != expect;
+}
+
+static uint64_t check_rwlock(void) {
+    uint64_t writes = (uint64_t)bench_workers *
+                      ((SYNC_BENCH_ITERATIONS + SYNC_WRITE_EVERY - 1) / SYNC_WRITE_EVERY);
+    return shared_counter != writes || shared_pair[0] != writes || shared_pair[1] != writes;
+}
+
+static uint64_t check_seqlock(void) {
+    return shared_pair[0] != SYNC_BENCH_ITERATIONS || shared_pair[1] != SYNC_BENCH_ITERATIONS;
+}
+
+static uint64_t check_queue(void) {
+    return 0;   // Consumers check order and count as they go
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(int id);
+    uint64_t (*check)(void);
+    int min_workers;
+} sync_test_t;
+
+static const sync_test_t sync_tests[] = {
+    { "ticket spinlock", run_ticket,  check_counter, 1 },
+    { "MCS lock",        run_mcs,     check_counter, 1 },
+    { "rwlock (90% rd)", run_rwlock,  check_rwlock,  1 },
+    { "seqlock",         run_seqlock, check_seqlock, 1 },
+    { "MPSC queue",      run_mpsc,    check_queue,   2 },
+    { "SPSC ring",       run_spsc,    check_queue,   2 },
+};
+
+#define NR_SYNC_TESTS (sizeof(sync_tests) / sizeof(sync_tests[0]))
+
+// Worker 0 only: reset everything a test touches
+static void setup_test(void) {
+    bench_spinlock.lock = 0;
+    mcs_lock_init(&bench_mcs);
+    rwlock_init(&bench_rwlock);
+    seqlock_init(&bench_seqlock);
+    mpsc_init(&bench_mpsc);
+    spsc_init(&bench_spsc);
+    shared_counter = 0;
+    shared_pair[0] = 0;
+    shared_pair[1] = 0;
+}
+
+static void report(const sync_test_t* test, uint64_t elapsed_ns, uint64_t check_failed) {
+    uint64_t ops = 0, attempts = 0, contended = 0, errors = check_failed;
+    for (int i = 0; i < bench_workers; i++) {
+        ops += bench_ops[i];
+        attempts += bench_attempts[i];
+        contended += bench_contended[i];
+        errors += bench_errors[i];
+    }
+
+    uart_puts("  ");
+    uart_puts(test->name);
+    uart_puts(": ");
+    print_decimal(ops * 1000000000ULL / (elapsed_ns ? elapsed_ns : 1));
+    uart_puts(" ops/s, ");
+    print_decimal(attempts ? contended * 100 / attempts : 0);
+    uart_puts("% contended");
+    uart_puts(errors ? " - FAILED\n" : "\n");
+}
+
+static void run_suite(int id) {
+    for (size_t t = 0; t < NR_SYNC_TESTS; t++) {
+        const sync_test_t* test = &sync_tests[t];
+        if (bench_workers < test->min_workers) {
+            continue;
+        }
+
+        if (id == 0) {
+            setup_test();
+        }
+        barrier_wait(&bench_barrier);
+
+        uint64_t start = timer_now_ns();
+        test->run(id);
+        barrier_wait(&bench_barrier);
+
+        if (id == 0) {
+            report(test, timer_now_ns() - start, test->check());
+        }
+    }
+}
+
+static void sync_worker(void) {
+    int id = atomic_add_return(&bench_next_id, 1) - 1;
+
+    // The boot-selected path first, then LL/SC for comparison
+    int lse = atomics_use_lse();
+    for (int pass = 0; pass < (lse ? 2 : 1); pass++) {
+        if (id == 0) {
+            atomics_set_lse(pass == 0 ? lse : 0);
+            uart_puts(atomics_use_lse() ? " LSE atomics:\n" : " LL/SC atomics:\n");
+        }
+        barrier_wait(&bench_barrier);
+        run_suite(id);
+    }
+
+    if (id == 0) {
+        atomics_set_lse(lse);
+    }
+    atomic_add_return(&bench_finished, 1);
+}
+
+// Run the suite with one worker per online CPU. Runs as a process.
+void benchmark_sync(void) {
+    int workers = smp_num_online();
+    if (workers > NR_CPUS) {
+        workers = NR_CPUS;
+    }
+
+    // MPSC nodes: one array per producer
+    size_t items_size = (size_t)(workers > 1 ? workers - 1 : 1) * SYNC_QUEUE_ITERATIONS *
+                        sizeof(bench_item_t);
+    bench_items_order = pages_order(items_size);
+    bench_items = (bench_item_t*)alloc_pages(bench_items_order);
+    if (!bench_items) {
+        uart_puts("Lock stress test: out of memory\n");
+        return;
+    }
+
+    // Create everyone first so the barrier knows how many to expect
+    process_t* procs[NR_CPUS];
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        procs[started] = create_process("sync_worker", sync_worker);
+        if (procs[started]) {
+            started++;
+        }
+    }
+    if (!started) {
+        free_pages(bench_items, bench_items_order);
+        return;
+    }
+
+    bench_workers = started;
+    bench_barrier.count = 0;
+    bench_barrier.sense = 0;
+    bench_barrier.total = started;
+    bench_next_id = 0;
+    bench_finished = 0;
+
+    uart_puts("Lock stress test, ");
+    print_decimal(started);
+    uart_puts(" CPUs:\n");
+
+    for (int i = 0; i < started; i++) {
+        schedule_process(procs[i]);
+    }
+    while (bench_finished < started) {
+        process_sleep(10000000);
+    }
+
+    free_pages(bench_items, bench_items_order);
+}
@@ -0,0 +1,198 @@
+// System Calls for EL0 Tasks
+// Save as: ~/OS_proj/src/syscall.c
+//
+// An EL0 task is an ordinary process (create_user_process) whose kernel
+// side drops to EL0 with eret as soon as it first runs, on a stack in
+// its own address space (mm.c). Its code and data are the user_*.c
+// files, which the linker gathers into the .user section and the MMU
+// maps for EL0.
+//
+// ABI: svc #0 with the number in x8 and arguments in x0-x5. The result
+// comes back in x0, negative on error. x1-x18 are clobbered; x19-x30 and
+// SP are preserved. EL0 calls take the fast path in exceptions.s, which
+// calls syscall_table directly. Kernel code may make the same calls
+// with svc, through the full trap frame and syscall_dispatch.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+extern size_t uart_write(const char* buf, size_t len, int flags);
+
+// External process functions
+extern void process_yield(void);
+extern void process_exit(int status);
+extern void process_sleep(uint64_t ns);
+extern int current_pid(void);
+
+// External timer and measurement functions
+extern uint64_t timer_now_ns(void);
+extern uint64_t perf_cycles(void);
+
+// External address space functions
+extern int mm_access_ok(uint64_t ptr, uint64_t len);
+
+// EL0 program sections (kernel.ld)
+extern char __user_start[];
+extern char __user_end[];
+
+// System call numbers; NR_SYSCALLS is also in exceptions.s
+#define SYS_YIELD       0
+#define SYS_EXIT        1       // x0 = exit status
+#define SYS_SLEEP       2       // x0 = nanoseconds
+#define SYS_WRITE       3       // x0 = fd, x1 = buffer, x2 = length
+#define SYS_GETPID      4
+#define SYS_CLOCK       5       // Nanoseconds since boot
+#define NR_SYSCALLS     6
+
+// Error numbers, returned negated
+#define EBADF           9
+#define EFAULT          14
+#define ENOSYS          38
+
+#define SYSCALL_BENCH_CALLS 10000
+#define SYSCALL_BENCH_BEST  100
+
+// Handlers take the argument registers they need of x0-x5; none needs
+// more than three yet
+typedef uint64_t (*syscall_t)(uint64_t a0, uint64_t a1, uint64_t a2);
+
+// [ptr, ptr + len) lies in memory EL0 may read: the .user sections or
+// pages mapped in the caller's address space
+static int user_range_ok(uint64_t ptr, uint64_t len) {
+    uint64_t end = ptr + len;
+    if (end < ptr) {
+        return 0;
+    }
+    if (ptr >= (uint64_t)__user_start && end <= (uint64_t)__user_end) {
+        return 1;
+    }
+    return mm_access_ok(ptr, len);
+}
+
+static uint64_t sys_yield(uint64_t a0, uint64_t a1, uint64_t a2) {
+    (void)a0;
+    (void)a1;
+    (void)a2;
+    process_yield();
+    return 0;
+}
+
+static uint64_t sys_exit(uint64_t status, uint64_t a1, uint64_t a2) {
+    (void)a1;
+    (void)a2;
+    process_exit((int)status);
+    return 0;
+}
+
+static uint64_t sys_sleep(uint64_t ns, uint64_t a1, uint64_t a2) {
+    (void)a1;
+    (void)a2;
+    process_sleep(ns);
+    return 0;
+}
+
+// Console output with \n expanded to \r\n, as uart_puts does
+static uint64_t sys_write(uint64_t fd, uint64_t buf, uint64_t len) {
+    if (fd != 1 && fd != 2) {
+        return (uint64_t)-EBADF;
+    }
+    if (!user_range_ok(buf, len)) {
+        return (uint64_t)-EFAULT;
+    }
+
+    const char* p = (const char*)buf;
+    const char* end = p + len;
+    while (p < end) {
+        const char* line = p;
+        while (p < end && *p != '\n') {
+            p++;
+        }
+        uart_write(line, (size_t)(p - line), 0);
+        if (p < end) {
+            uart_write("\r\n", 2, 0);
+            p++;
+        }
+    }
+    return len;
+}
+
+static uint64_t sys_getpid(uint64_t a0, uint64_t a1, uint64_t a2) {
+    (void)a0;
+    (void)a1;
+    (void)a2;
+    return (uint64_t)current_pid();
+}
+
+static uint64_t sys_clock(uint64_t a0, uint64_t a1, uint64_t a2) {
+    (void)a0;
+    (void)a1;
+    (void)a2;
+    return timer_now_ns();
+}
+
+// Indexed by x8 from the EL0 fast path in exceptions.s
+const syscall_t syscall_table[NR_SYSCALLS] = {
+    [SYS_YIELD]     = sys_yield,
+    [SYS_EXIT]      = sys_exit,
+    [SYS_SLEEP]     = sys_sleep,
+    [SYS_WRITE]     = sys_write,
+    [SYS_GETPID]    = sys_getpid,
+    [SYS_CLOCK]     = sys_clock,
+};
+
+// Kernel-mode system calls (svc at EL1), from handle_syscall with the
+// caller's x0-x5
+uint64_t syscall_dispatch(uint64_t nr, const uint64_t* args) {
+    if (nr >= NR_SYSCALLS) {
+        return (uint64_t)-ENOSYS;
+    }
+    return syscall_table[nr](args[0], args[1], args[2]);
+}
+
+void init_syscalls(void) {
+    uart_puts("EL0: ");
+    print_decimal(NR_SYSCALLS);
+    uart_puts(" system calls\n");
+}
+
+// getpid through svc from EL1: the full trap frame and handle_sync,
+// the kernel-mode call that the EL0 fast path replaces. The EL0 side
+// is measured by user_svc_bench (user_tasks.c).
+static uint64_t svc_getpid(void) {
+    register uint64_t x0 asm("x0");
+    register uint64_t x8 asm("x8") = SYS_GETPID;
+    asm volatile("svc #0"
+                 : "=r"(x0), "+r"(x8)
+                 :
+                 : "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x9", "x10",
+                   "x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "memory");
+    return x0;
+}
+
+void benchmark_syscall(void) {
+    uint64_t start = perf_cycles();
+    for (int i = 0; i < SYSCALL_BENCH_CALLS; i++) {
+        svc_getpid();
+    }
+    uint64_t cycles = perf_cycles() - start;
+
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < SYSCALL_BENCH_BEST; i++) {
+        start = perf_cycles();
+        svc_getpid();
+        uint64_t elapsed = perf_cycles() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    uart_puts("EL1 svc getpid (full trap frame): ");
+    print_decimal(cycles / SYSCALL_BENCH_CALLS);
+    uart_puts(" cycles (best ");
+    print_decimal(best);
+    uart_puts(")\n");
+}
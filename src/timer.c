@@ -1,42 +1,582 @@
-// Software Timer System for Process Scheduling
+// ARM Generic Timer, Tickless Scheduling Tick and Timer Wheel
 // Save as: ~/OS_proj/src/timer.c
 
 #include <stdint.h>
+#include <stddef.h>
 
 // External functions
 extern void uart_puts(const char* str);
-extern void schedule(void);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+extern void scheduler_tick(void);
+extern void register_irq_handler(uint32_t irq, void (*handler)(void));
+extern void gic_enable_irq(uint32_t irq);
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+extern int smp_processor_id(void);
+
+// External vDSO functions
+extern void vdso_set_timebase(uint64_t cntfrq, uint64_t boot_count, uint64_t tick_interval, uint32_t hz);
+
+// External spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern void spin_lock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern uint64_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags);
+extern void cpu_relax(void);
+
+// External slab functions
+typedef struct kmem_cache kmem_cache_t;
+extern kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+extern void* kmem_cache_alloc(kmem_cache_t* cache);
+extern void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Tick rate, override with `make HZ=...`
+#ifndef HZ
+#define HZ 100
+#endif
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+// Virtual timer (CNTV) PPI on QEMU virt
+#define TIMER_IRQ            27
+
+// Timer control bits
+#define TIMER_CTRL_ENABLE    (1 << 0)
+#define TIMER_CTRL_IMASK     (1 << 1)
+#define TIMER_CTRL_ISTATUS   (1 << 2)
+#define CNTKCTL_EL0VCTEN     (1 << 1)   // EL0 may read CNTVCT_EL0
+
+// Hierarchical timer wheel: 4 levels of 64 slots, 1ms granularity.
+// Level n slots are 64^n granules wide, so the wheel spans ~4.6 hours;
+// later deadlines are parked in the last slot and re-queued on expiry.
+// Each CPU has its own wheel and tick; a timer fires on the CPU that
+// armed it.
+#define WHEEL_GRANULE_US     1000
+#define WHEEL_LEVELS         4
+#define WHEEL_SLOT_BITS      6
+#define WHEEL_SLOTS          (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE          (1UL << (WHEEL_LEVELS * WHEEL_SLOT_BITS))
+#define WHEEL_NEVER          UINT64_MAX
+
+#define NSEC_PER_SEC         1000000000UL
+
+// Wheel timer. Expiry is in granules; callbacks run in IRQ context.
+typedef struct ktimer {
+    struct ktimer* next;         // Slot list links
+    struct ktimer* prev;
+    uint64_t expires;            // Absolute expiry in granules
+    void (*callback)(void* data);
+    void* data;
+    int16_t slot;                // level * WHEEL_SLOTS + index, -1 if idle
+    int16_t oneshot;             // Freed by the wheel after it fires
+    int16_t cpu;                 // Base the timer was last armed on
+} ktimer_t;
+
+// Per-CPU wheel and tick state. The lock is only contended by other
+// CPUs cancelling timers queued here.
+typedef struct timer_base {
+    spinlock_t lock;
+    ktimer_t* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t bitmap[WHEEL_LEVELS];   // Non-empty slots per level
+    uint64_t clk;                    // Granules processed so far
+    ktimer_t* running;               // Callback in progress (lock dropped)
+    uint64_t next_tick;              // Absolute counter value of next tick
+    int tick_running;                // Periodic tick armed
+    uint64_t tick_irqs;              // Scheduler ticks actually taken
+} timer_base_t;
 
 // Timer state
-static volatile uint64_t timer_counter = 0;
-static volatile uint64_t schedule_interval = 1000000; // Process switch interval
+static uint64_t timer_freq = 0;          // Counter frequency in Hz
+static uint64_t timer_interval = 0;      // Counter ticks per scheduler tick
+static uint64_t granule_cycles = 0;      // Counter ticks per wheel granule
+static uint64_t boot_count = 0;          // Counter value at init
+static timer_base_t timer_bases[NR_CPUS];
+static kmem_cache_t* timer_cache = NULL;
+
+static inline uint64_t read_cntvct(void) {
+    uint64_t value;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cntv_cval(uint64_t value) {
+    asm volatile("msr cntv_cval_el0, %0" :: "r"(value));
+}
+
+static inline void write_cntv_ctl(uint64_t value) {
+    asm volatile("msr cntv_ctl_el0, %0; isb" :: "r"(value));
+}
+
+static inline uint64_t ror64(uint64_t value, unsigned int shift) {
+    shift &= 63;
+    return shift ? (value >> shift) | (value << (64 - shift)) : value;
+}
+
+// Nanoseconds <-> counter ticks without overflowing for large values
+static uint64_t ns_to_cycles(uint64_t ns) {
+    return (ns / NSEC_PER_SEC) * timer_freq +
+           ((ns % NSEC_PER_SEC) * timer_freq) / NSEC_PER_SEC;
+}
+
+static uint64_t cycles_to_ns(uint64_t cycles) {
+    return (cycles / timer_freq) * NSEC_PER_SEC +
+           ((cycles % timer_freq) * NSEC_PER_SEC) / timer_freq;
+}
+
+// Current time in nanoseconds since timer init
+uint64_t timer_now_ns(void) {
+    return cycles_to_ns(read_cntvct() - boot_count);
+}
+
+// Wheel slot helpers
+static void slot_add(timer_base_t* base, ktimer_t* timer, int level, int index) {
+    ktimer_t** head = &base->wheel[level][index];
+
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head) {
+        (*head)->prev = timer;
+    }
+    *head = timer;
+
+    timer->slot = (int16_t)(level * WHEEL_SLOTS + index);
+    base->bitmap[level] |= 1UL << index;
+}
+
+static void slot_del(timer_base_t* base, ktimer_t* timer) {
+    int level = timer->slot / WHEEL_SLOTS;
+    int index = timer->slot % WHEEL_SLOTS;
+
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        base->wheel[level][index] = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    if (!base->wheel[level][index]) {
+        base->bitmap[level] &= ~(1UL << index);
+    }
 
-// Initialize software timer
-void init_software_timer(void) {
-    uart_puts("Initializing software timer for preemptive scheduling...\n");
-    timer_counter = 0;
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = -1;
 }
 
-// Software timer tick - call this from a loop
-void software_timer_tick(void) {
-    timer_counter++;
-    
-    // Check if it's time to schedule
-    if (timer_counter >= schedule_interval) {
-        timer_counter = 0;
-        
-        // Call scheduler for process switching
-        uart_puts("[TIMER] Process switch time\n");
-        schedule();
+// Queue a timer in the level matching its distance from base->clk: O(1)
+static void wheel_insert(timer_base_t* base, ktimer_t* timer) {
+    uint64_t clk = base->clk;
+    uint64_t expires = timer->expires;
+    if (expires <= clk) {
+        expires = clk + 1;
+    }
+
+    uint64_t delta = expires - clk;
+    if (delta >= WHEEL_RANGE) {
+        // Park it at the far end, it is re-queued when that slot expires
+        expires = clk + WHEEL_RANGE - 1;
+        delta = WHEEL_RANGE - 1;
+    }
+
+    int level = 0;
+    while (delta >= (1UL << ((level + 1) * WHEEL_SLOT_BITS))) {
+        level++;
+    }
+
+    int index = (expires >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK;
+    slot_add(base, timer, level, index);
+}
+
+// Re-queue every timer in a higher-level slot into lower levels
+static void wheel_cascade(timer_base_t* base, int level, int index) {
+    ktimer_t* timer = base->wheel[level][index];
+    base->wheel[level][index] = NULL;
+    base->bitmap[level] &= ~(1UL << index);
+
+    while (timer) {
+        ktimer_t* next = timer->next;
+        if (timer->expires <= base->clk) {
+            // Due now: the level 0 slot for clk runs right after
+            slot_add(base, timer, 0, base->clk & WHEEL_SLOT_MASK);
+        } else {
+            wheel_insert(base, timer);
+        }
+        timer = next;
     }
 }
 
-// Get current timer value
+// Earliest granule at which the wheel has work (expiry or cascade)
+static uint64_t wheel_next_event(timer_base_t* base) {
+    uint64_t next = WHEEL_NEVER;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (!base->bitmap[level]) {
+            continue;
+        }
+
+        int shift = level * WHEEL_SLOT_BITS;
+        uint64_t start = (base->clk >> shift) + 1;
+        uint64_t offset = __builtin_ctzl(ror64(base->bitmap[level], start & WHEEL_SLOT_MASK));
+        uint64_t when = (start + offset) << shift;
+
+        if (when < next) {
+            next = when;
+        }
+    }
+
+    return next;
+}
+
+static int wheel_empty(timer_base_t* base) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (base->bitmap[level]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Advance the wheel to granule `now`, firing expired timers.
+// Empty stretches are skipped using the slot bitmaps. Called with the
+// base lock held; it is dropped around each callback so callbacks can
+// arm timers, and base->running lets timer_destroy wait them out.
+static void wheel_run(timer_base_t* base, uint64_t now) {
+    while (base->clk < now) {
+        uint64_t next = wheel_next_event(base);
+        if (next > now) {
+            base->clk = now;
+            break;
+        }
+        base->clk = next;
+
+        // Cascade each level whose lower level just wrapped around
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            int shift = (level - 1) * WHEEL_SLOT_BITS;
+            if ((base->clk >> shift) & WHEEL_SLOT_MASK) {
+                break;
+            }
+            wheel_cascade(base, level, (base->clk >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK);
+        }
+
+        // Fire the level 0 slot for this granule, one timer at a time
+        int index = base->clk & WHEEL_SLOT_MASK;
+        while (base->wheel[0][index]) {
+            ktimer_t* timer = base->wheel[0][index];
+            slot_del(base, timer);
+
+            if (timer->expires > base->clk) {
+                // Deadline was beyond the wheel range
+                wheel_insert(base, timer);
+                continue;
+            }
+
+            void (*callback)(void*) = timer->callback;
+            void* data = timer->data;
+            base->running = timer;
+            spin_unlock(&base->lock);
+
+            callback(data);
+
+            spin_lock(&base->lock);
+            if (timer->oneshot && timer->slot < 0) {
+                kmem_cache_free(timer_cache, timer);
+            }
+            base->running = NULL;
+        }
+    }
+}
+
+// Program this CPU's CNTV for the earlier of the next tick and the next
+// wheel event
+static void timer_reprogram(timer_base_t* base) {
+    uint64_t deadline = WHEEL_NEVER;
+
+    if (base->tick_running) {
+        deadline = base->next_tick;
+    }
+
+    uint64_t event = wheel_next_event(base);
+    if (event != WHEEL_NEVER) {
+        uint64_t cycles = boot_count + event * granule_cycles;
+        if (cycles < deadline) {
+            deadline = cycles;
+        }
+    }
+
+    if (deadline == WHEEL_NEVER) {
+        // Nothing pending at all: leave the timer masked
+        write_cntv_ctl(TIMER_CTRL_ENABLE | TIMER_CTRL_IMASK);
+    } else {
+        write_cntv_cval(deadline);
+        write_cntv_ctl(TIMER_CTRL_ENABLE);
+    }
+}
+
+static inline timer_base_t* this_base(void) {
+    return &timer_bases[smp_processor_id()];
+}
+
+// Lock the base a timer is queued on (it can move while we wait)
+static timer_base_t* lock_timer_base(ktimer_t* timer) {
+    while (1) {
+        timer_base_t* base = &timer_bases[timer->cpu];
+        spin_lock(&base->lock);
+        if (base == &timer_bases[timer->cpu]) {
+            return base;
+        }
+        spin_unlock(&base->lock);
+    }
+}
+
+// Timer interrupt: scheduler tick (if running) and wheel expiry
+static void timer_irq(void) {
+    timer_base_t* base = this_base();
+    uint64_t now = read_cntvct();
+    int tick = 0;
+
+    spin_lock(&base->lock);
+    if (base->tick_running && now >= base->next_tick) {
+        // Re-arm relative to the previous deadline so the tick does not drift
+        base->next_tick += timer_interval;
+        if (base->next_tick <= now) {
+            // Missed ticks (e.g. long IRQ-off section), resynchronize
+            base->next_tick = now + timer_interval;
+        }
+        base->tick_irqs++;
+        tick = 1;
+    }
+    spin_unlock(&base->lock);
+
+    // The scheduler takes its own locks
+    if (tick) {
+        scheduler_tick();
+    }
+
+    spin_lock(&base->lock);
+    wheel_run(base, (now - boot_count) / granule_cycles);
+    timer_reprogram(base);
+    spin_unlock(&base->lock);
+}
+
+// Restart this CPU's periodic tick when a real process gets the CPU
+void timer_tick_start(void) {
+    timer_base_t* base = this_base();
+    uint64_t flags = spin_lock_irqsave(&base->lock);
+    if (!base->tick_running) {
+        base->tick_running = 1;
+        base->next_tick = read_cntvct() + timer_interval;
+        timer_reprogram(base);
+    }
+    spin_unlock_irqrestore(&base->lock, flags);
+}
+
+// Stop this CPU's periodic tick, leaving only wheel events armed (idle)
+void timer_tick_stop(void) {
+    timer_base_t* base = this_base();
+    uint64_t flags = spin_lock_irqsave(&base->lock);
+    if (base->tick_running) {
+        base->tick_running = 0;
+        timer_reprogram(base);
+    }
+    spin_unlock_irqrestore(&base->lock, flags);
+}
+
+// Create a timer that can be armed repeatedly
+ktimer_t* timer_create(void (*callback)(void* data), void* data) {
+    ktimer_t* timer = (ktimer_t*)kmem_cache_alloc(timer_cache);
+    if (!timer) {
+        return NULL;
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->slot = -1;
+    timer->oneshot = 0;
+    timer->cpu = (int16_t)smp_processor_id();
+    return timer;
+}
+
+// Cancel if pending: O(1), from any CPU
+void timer_cancel(ktimer_t* timer) {
+    if (!timer) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    timer_base_t* base = lock_timer_base(timer);
+    int free_it = 0;
+    if (timer->slot >= 0) {
+        slot_del(base, timer);
+        free_it = timer->oneshot;
+    }
+    spin_unlock(&base->lock);
+    irq_restore(flags);
+
+    if (free_it) {
+        kmem_cache_free(timer_cache, timer);
+    }
+}
+
+// Cancel and free a timer, waiting for a running callback to finish
+// (so never call it from the timer's own callback)
+void timer_destroy(ktimer_t* timer) {
+    if (!timer) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    timer_base_t* base = lock_timer_base(timer);
+    timer->oneshot = 0;
+    if (timer->slot >= 0) {
+        slot_del(base, timer);
+    }
+    while (base->running == timer) {
+        spin_unlock(&base->lock);
+        cpu_relax();
+        spin_lock(&base->lock);
+    }
+    spin_unlock(&base->lock);
+    irq_restore(flags);
+
+    kmem_cache_free(timer_cache, timer);
+}
+
+// Arm (or re-arm) a timer for an absolute deadline in ns since boot.
+// It fires on the calling CPU. A timer must not be armed from two CPUs
+// at once.
+void timer_arm(ktimer_t* timer, uint64_t deadline_ns) {
+    uint64_t flags = irq_save();
+    timer_base_t* base = this_base();
+
+    // Take it off whichever wheel it is on
+    timer_base_t* old = lock_timer_base(timer);
+    if (timer->slot >= 0) {
+        slot_del(old, timer);
+    }
+    if (old != base) {
+        spin_unlock(&old->lock);
+        spin_lock(&base->lock);
+    }
+
+    // An empty wheel may not have advanced for a long time (tickless
+    // idle), catch up so the new timer lands in the finest level it can
+    if (wheel_empty(base)) {
+        base->clk = (read_cntvct() - boot_count) / granule_cycles;
+    }
+
+    // Round up: a timer never fires before its deadline
+    uint64_t cycles = ns_to_cycles(deadline_ns);
+    if (cycles_to_ns(cycles) < deadline_ns) {
+        cycles++;
+    }
+    timer->expires = (cycles + granule_cycles - 1) / granule_cycles;
+    timer->cpu = (int16_t)smp_processor_id();
+    wheel_insert(base, timer);
+
+    timer_reprogram(base);
+    spin_unlock(&base->lock);
+    irq_restore(flags);
+}
+
+// One-shot timer: callback(data) runs once at deadline_ns (ns since boot).
+// The returned handle is only valid until the timer fires.
+ktimer_t* timer_add(void (*callback)(void* data), void* data, uint64_t deadline_ns) {
+    ktimer_t* timer = timer_create(callback, data);
+    if (!timer) {
+        return NULL;
+    }
+
+    timer->oneshot = 1;
+    timer_arm(timer, deadline_ns);
+    return timer;
+}
+
+// Per-CPU part: unmask the (banked) timer PPI and start this CPU's wheel
+// at the current time. The tick stays off until a process runs here.
+void timer_init_cpu(void) {
+    timer_base_t* base = this_base();
+
+    uint64_t flags = spin_lock_irqsave(&base->lock);
+    base->clk = (read_cntvct() - boot_count) / granule_cycles;
+    write_cntv_ctl(TIMER_CTRL_ENABLE | TIMER_CTRL_IMASK);
+    spin_unlock_irqrestore(&base->lock, flags);
+
+    // EL0 tasks read the time without a system call
+    uint64_t cntkctl;
+    asm volatile("mrs %0, cntkctl_el1" : "=r"(cntkctl));
+    asm volatile("msr cntkctl_el1, %0" :: "r"(cntkctl | CNTKCTL_EL0VCTEN));
+
+    gic_enable_irq(TIMER_IRQ);
+}
+
+// Initialize the generic timer and the boot CPU's tick
+void init_timer(void) {
+    uart_puts("Initializing generic timer...\n");
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(timer_freq));
+    timer_interval = timer_freq / HZ;
+    granule_cycles = timer_freq / (1000000 / WHEEL_GRANULE_US);
+    boot_count = read_cntvct();
+    vdso_set_timebase(timer_freq, boot_count, timer_interval, HZ);
+
+    uart_puts("Counter frequency: ");
+    print_decimal(timer_freq);
+    uart_puts(" Hz, tick rate: ");
+    print_decimal(HZ);
+    uart_puts(" Hz\n");
+
+    timer_cache = kmem_cache_create("ktimer", sizeof(ktimer_t));
+
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        timer_base_t* base = &timer_bases[cpu];
+        base->lock.lock = 0;
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            base->bitmap[level] = 0;
+            for (int i = 0; i < WHEEL_SLOTS; i++) {
+                base->wheel[level][i] = NULL;
+            }
+        }
+        base->clk = 0;
+        base->running = NULL;
+        base->next_tick = 0;
+        base->tick_running = 0;
+        base->tick_irqs = 0;
+    }
+
+    register_irq_handler(TIMER_IRQ, timer_irq);
+    timer_init_cpu();
+
+    timer_tick_start();
+}
+
+// Get number of scheduler ticks since boot (derived from the counter,
+// so it keeps advancing while the tick is stopped in idle)
 uint64_t get_timer_ticks(void) {
-    return timer_counter;
+    return (read_cntvct() - boot_count) / timer_interval;
 }
 
-// Set scheduling interval
-void set_schedule_interval(uint64_t interval) {
-    schedule_interval = interval;
-}
\ No newline at end of file
+// Scheduler ticks actually taken on all CPUs (lower than
+// get_timer_ticks per CPU when idle)
+uint64_t get_tick_irqs(void) {
+    uint64_t total = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        total += timer_bases[cpu].tick_irqs;
+    }
+    return total;
+}
+
+// Counter frequency, for converting cntvct_el0 deltas to time
+uint64_t get_timer_freq(void) {
+    return timer_freq;
+}
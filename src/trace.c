@@ -0,0 +1,168 @@
+// Binary Event Tracing
+// Save as: ~/OS_proj/src/trace.c
+//
+// Tracepoints write fixed 32-byte records, stamped with CNTVCT_EL0, into
+// a ring owned by the CPU they run on. Only that CPU writes its ring,
+// with IRQs masked for the few stores a record takes, so no locks or
+// atomics are needed. Rings wrap, keeping the newest records.
+//
+// Each call site tests trace_mask before calling trace_event, so a
+// disabled tracepoint costs one load and a branch. Events are turned on
+// and off at run time with trace_set_events.
+//
+// trace_dump sends the rings over the UART as hex, one record per line,
+// between TRACE BEGIN and TRACE END lines. tools/trace2json.py turns a
+// console log holding a dump into Chrome trace / Perfetto JSON.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External interrupt functions
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+
+// External SMP functions
+extern int smp_processor_id(void);
+
+// External page allocator functions
+extern void* alloc_pages(unsigned int order);
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+// Event types (bit n of trace_mask enables event n), shared with the
+// call sites and tools/trace2json.py
+#define TRACE_SWITCH        1       // a = previous pid, b = next pid
+#define TRACE_WAKEUP        2       // a = pid, b = target CPU
+#define TRACE_ALLOC         3       // a = address, b = size
+#define TRACE_FREE          4       // a = address
+#define TRACE_IRQ_ENTRY     5       // a = interrupt ID
+#define TRACE_IRQ_EXIT      6       // a = interrupt ID
+#define TRACE_SYSCALL       7       // a = SVC immediate, b = number (x8)
+#define TRACE_ALL           0xFE
+
+#define TRACE_RING_ORDER    3       // 32KB per CPU
+#define TRACE_RING_RECORDS  ((4096UL << TRACE_RING_ORDER) / sizeof(trace_rec_t))
+
+typedef struct {
+    uint64_t timestamp;         // CNTVCT_EL0
+    uint32_t event;
+    uint32_t cpu;
+    uint64_t a;
+    uint64_t b;
+} trace_rec_t;
+
+typedef struct {
+    trace_rec_t* records;
+    uint64_t written;           // Records ever written; the ring holds the last ones
+} trace_ring_t;
+
+volatile uint32_t trace_mask = 0;
+static trace_ring_t trace_rings[NR_CPUS];
+
+void init_trace(void) {
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_rings[cpu].records = (trace_rec_t*)alloc_pages(TRACE_RING_ORDER);
+        trace_rings[cpu].written = 0;
+        if (!trace_rings[cpu].records) {
+            uart_puts("Trace: no memory for ring\n");
+        }
+    }
+
+    uart_puts("Trace: ");
+    print_decimal(TRACE_RING_RECORDS);
+    uart_puts(" records per CPU\n");
+}
+
+// Enable exactly the events in mask (TRACE_ALL for everything).
+// Returns the previous mask.
+uint32_t trace_set_events(uint32_t mask) {
+    uint32_t old = trace_mask;
+    trace_mask = mask;
+    return old;
+}
+
+// Append a record to this CPU's ring (call through a mask test)
+void trace_event(uint32_t event, uint64_t a, uint64_t b) {
+    uint64_t flags = irq_save();
+    int cpu = smp_processor_id();
+    trace_ring_t* ring = &trace_rings[cpu];
+
+    if (ring->records) {
+        uint64_t now;
+        asm volatile("mrs %0, cntvct_el0" : "=r"(now));
+
+        trace_rec_t* rec = &ring->records[ring->written % TRACE_RING_RECORDS];
+        rec->timestamp = now;
+        rec->event = event;
+        rec->cpu = (uint32_t)cpu;
+        rec->a = a;
+        rec->b = b;
+        ring->written++;
+    }
+
+    irq_restore(flags);
+}
+
+// Record bytes as hex, in memory order
+static void dump_record(const trace_rec_t* rec) {
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t* bytes = (const uint8_t*)rec;
+    char line[2 * sizeof(trace_rec_t) + 2];
+    size_t pos = 0;
+
+    for (size_t i = 0; i < sizeof(trace_rec_t); i++) {
+        line[pos++] = hex[bytes[i] >> 4];
+        line[pos++] = hex[bytes[i] & 0xF];
+    }
+    line[pos++] = '\n';
+    line[pos] = '\0';
+    uart_puts(line);
+}
+
+// Send every ring, oldest record first, with tracing paused
+void trace_dump(void) {
+    uint32_t saved = trace_set_events(0);
+
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    uart_puts("TRACE BEGIN cpus=");
+    print_decimal(NR_CPUS);
+    uart_puts(" freq=");
+    print_decimal(freq);
+    uart_puts(" record=");
+    print_decimal(sizeof(trace_rec_t));
+    uart_puts("\n");
+
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_ring_t* ring = &trace_rings[cpu];
+        if (!ring->records) {
+            continue;
+        }
+
+        uint64_t written = ring->written;
+        uint64_t count = written < TRACE_RING_RECORDS ? written : TRACE_RING_RECORDS;
+
+        uart_puts("TRACE CPU ");
+        print_decimal(cpu);
+        uart_puts(" records=");
+        print_decimal(count);
+        uart_puts(" lost=");
+        print_decimal(written - count);
+        uart_puts("\n");
+
+        for (uint64_t i = written - count; i < written; i++) {
+            dump_record(&ring->records[i % TRACE_RING_RECORDS]);
+        }
+    }
+
+    uart_puts("TRACE END\n");
+    trace_set_events(saved);
+}
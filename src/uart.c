@@ -0,0 +1,347 @@
+// Buffered PL011 UART Driver
+// Save as: ~/OS_proj/src/uart.c
+//
+// Output goes into a ring buffer and reaches the UART from whoever gets
+// to drain it: the writer itself if the FIFO has room, otherwise the TX
+// interrupt once the FIFO falls below its trigger level. Writers never
+// wait for the hardware; they only wait (or drop, see uart_write) when
+// the ring itself is full.
+//
+// The TX ring takes writers on every CPU without a lock. A writer
+// reserves a run of slots by advancing head with a compare and swap,
+// fills them, and publishes each slot by storing its position in
+// tx_seq. The drainer, one at a time under tx_lock, sends slots in
+// order up to the first unpublished one. Reserving a whole message at
+// once keeps concurrent lines from interleaving.
+//
+// Input is collected by the RX and receive-timeout interrupts into a
+// second ring, read with uart_getc.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External interrupt functions
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+extern void register_irq_handler(uint32_t irq, void (*handler)(void));
+extern void gic_enable_irq(uint32_t irq);
+
+// External spinlock functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern int spin_trylock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern int atomic_cmpxchg(volatile int* ptr, int old_value, int new_value);
+extern int atomic_add_return(volatile int* ptr, int delta);
+extern void cpu_relax(void);
+
+// UART0 on the ARM Virt machine, SPI 1
+#define UART0_BASE      0x09000000
+#define UART0_IRQ       33
+
+// PL011 registers
+#define UART_DR         ((volatile uint32_t*)(UART0_BASE + 0x00))
+#define UART_FR         ((volatile uint32_t*)(UART0_BASE + 0x18))
+#define UART_IBRD       ((volatile uint32_t*)(UART0_BASE + 0x24))
+#define UART_FBRD       ((volatile uint32_t*)(UART0_BASE + 0x28))
+#define UART_LCR_H      ((volatile uint32_t*)(UART0_BASE + 0x2C))
+#define UART_CR         ((volatile uint32_t*)(UART0_BASE + 0x30))
+#define UART_IFLS       ((volatile uint32_t*)(UART0_BASE + 0x34))
+#define UART_IMSC       ((volatile uint32_t*)(UART0_BASE + 0x38))
+#define UART_MIS        ((volatile uint32_t*)(UART0_BASE + 0x40))
+#define UART_ICR        ((volatile uint32_t*)(UART0_BASE + 0x44))
+
+#define FR_BUSY         (1 << 3)
+#define FR_RXFE         (1 << 4)    // RX FIFO empty
+#define FR_TXFF         (1 << 5)    // TX FIFO full
+#define LCR_H_FEN       (1 << 4)    // FIFOs enabled
+#define LCR_H_WLEN_8    (3 << 5)
+#define CR_UARTEN       (1 << 0)
+#define CR_TXE          (1 << 8)
+#define CR_RXE          (1 << 9)
+#define INT_RX          (1 << 4)
+#define INT_TX          (1 << 5)
+#define INT_RT          (1 << 6)    // Receive timeout: data sitting below the RX level
+#define INT_ALL         0x7FF
+
+// FIFO trigger levels: TX interrupt at 1/8 full, RX at 1/2 full
+#define IFLS_TX_1_8     (0 << 0)
+#define IFLS_RX_1_2     (2 << 3)
+
+// 115200 8N1 from the 24MHz reference clock (QEMU ignores the rate)
+#define UART_IBRD_115200    13
+#define UART_FBRD_115200    1
+
+// Ring sizes, powers of two
+#define UART_TX_SIZE    8192
+#define UART_TX_MASK    (UART_TX_SIZE - 1)
+#define UART_RX_SIZE    256
+#define UART_RX_MASK    (UART_RX_SIZE - 1)
+
+// Longest run uart_puts reserves at once; longer strings are split
+#define UART_CHUNK      256
+
+void uart_putc(char c);
+void print_decimal(uint64_t value);
+
+// uart_write flags
+#define UART_NONBLOCK   1           // Drop what does not fit instead of waiting
+
+static volatile char tx_buf[UART_TX_SIZE];
+static volatile uint32_t tx_seq[UART_TX_SIZE];  // Position + 1 once published
+static volatile int tx_head;        // Next position to reserve
+static volatile int tx_tail;        // Next position to send
+static spinlock_t tx_lock;          // Held by the one CPU draining
+static volatile int tx_dropped;     // Bytes lost to UART_NONBLOCK
+static int tx_irq_on = 0;           // TX interrupt may be used
+static int tx_policy = 0;           // Flags for uart_puts and uart_putc
+
+static volatile char rx_buf[UART_RX_SIZE];
+static volatile int rx_head;        // Written by the RX interrupt only
+static volatile int rx_tail;        // Written by the reader only
+static volatile int rx_dropped;
+
+static inline int tx_ready(uint32_t pos) {
+    return __atomic_load_n(&tx_seq[pos & UART_TX_MASK], __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+// Move published bytes into the TX FIFO while it has room. Whoever is
+// already draining keeps going, so this never waits for another CPU.
+void uart_tx_drain(void) {
+    while (spin_trylock(&tx_lock)) {
+        uint32_t tail = (uint32_t)tx_tail;
+        while (!(*UART_FR & FR_TXFF) && tx_ready(tail)) {
+            *UART_DR = tx_buf[tail & UART_TX_MASK];
+            tail++;
+        }
+        __atomic_store_n(&tx_tail, (int)tail, __ATOMIC_RELEASE);
+
+        // Let the FIFO draining below its trigger level call us back.
+        // With the FIFO full that is wanted even if the ring looks empty:
+        // a writer may publish just after the check.
+        int fifo_full = (*UART_FR & FR_TXFF) != 0;
+        if (tx_irq_on) {
+            if (fifo_full || tx_ready(tail)) {
+                *UART_IMSC |= INT_TX;
+            } else {
+                *UART_IMSC &= ~INT_TX;
+            }
+        }
+        spin_unlock(&tx_lock);
+
+        // A writer that published while we held the lock left its bytes
+        // to us; pick them up unless the interrupt will
+        if (fifo_full || !tx_ready((uint32_t)tx_tail)) {
+            return;
+        }
+    }
+}
+
+// Claim n consecutive slots, returning the first position, or -1 if the
+// ring is full and flags say not to wait. IRQs are masked by the caller,
+// so a reservation is always filled before this CPU runs anything else.
+static int tx_reserve(uint32_t n, int flags) {
+    while (1) {
+        int head = tx_head;
+        uint32_t used = (uint32_t)head - (uint32_t)__atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE);
+        if (used + n <= UART_TX_SIZE) {
+            if (atomic_cmpxchg(&tx_head, head, (int)((uint32_t)head + n)) == head) {
+                return head;
+            }
+            continue;
+        }
+
+        if (flags & UART_NONBLOCK) {
+            atomic_add_return(&tx_dropped, (int)n);
+            return -1;
+        }
+
+        // Full: drain ourselves, the TX interrupt may target a CPU with
+        // IRQs masked (this one)
+        uart_tx_drain();
+        cpu_relax();
+    }
+}
+
+static inline void tx_publish(uint32_t pos, char c) {
+    tx_buf[pos & UART_TX_MASK] = c;
+    __atomic_store_n(&tx_seq[pos & UART_TX_MASK], pos + 1, __ATOMIC_RELEASE);
+}
+
+// Queue len raw bytes. Returns the number queued, which is less than len
+// only with UART_NONBLOCK and a full ring.
+size_t uart_write(const char* buf, size_t len, int flags) {
+    size_t done = 0;
+
+    while (done < len) {
+        uint32_t n = (len - done > UART_CHUNK) ? UART_CHUNK : (uint32_t)(len - done);
+
+        uint64_t irq_flags = irq_save();
+        int pos = tx_reserve(n, flags);
+        if (pos < 0) {
+            irq_restore(irq_flags);
+            break;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            tx_publish((uint32_t)pos + i, buf[done + i]);
+        }
+        irq_restore(irq_flags);
+
+        uart_tx_drain();
+        done += n;
+    }
+    return done;
+}
+
+void uart_putc(char c) {
+    uart_write(&c, 1, tx_policy);
+}
+
+// Queue a string with \n expanded to \r\n; each chunk of up to
+// UART_CHUNK bytes lands in the ring as one piece
+void uart_puts(const char* str) {
+    while (*str) {
+        // Size the next chunk, counting the added carriage returns
+        uint32_t n = 0;
+        const char* end = str;
+        while (*end && n + 2 <= UART_CHUNK) {
+            n += (*end == '\n') ? 2 : 1;
+            end++;
+        }
+
+        uint64_t irq_flags = irq_save();
+        int pos = tx_reserve(n, tx_policy);
+        if (pos >= 0) {
+            uint32_t p = (uint32_t)pos;
+            for (const char* s = str; s < end; s++) {
+                if (*s == '\n') {
+                    tx_publish(p++, '\r');
+                }
+                tx_publish(p++, *s);
+            }
+        }
+        irq_restore(irq_flags);
+
+        uart_tx_drain();
+        str = end;
+    }
+}
+
+// Print an unsigned value in decimal (up to 20 digits)
+void print_decimal(uint64_t value) {
+    if (value == 0) {
+        uart_putc('0');
+        return;
+    }
+
+    char buffer[20];
+    int pos = 0;
+
+    while (value > 0) {
+        buffer[pos++] = '0' + (value % 10);
+        value /= 10;
+    }
+
+    // Print in reverse order
+    for (int i = pos - 1; i >= 0; i--) {
+        uart_putc(buffer[i]);
+    }
+}
+
+// Print a signed value in decimal
+void print_signed(int64_t value) {
+    if (value < 0) {
+        uart_putc('-');
+        print_decimal(-(uint64_t)value);
+        return;
+    }
+    print_decimal((uint64_t)value);
+}
+
+// Choose whether uart_puts/uart_putc drop output (1) or wait for room (0)
+void uart_set_nonblock(int nonblock) {
+    tx_policy = nonblock ? UART_NONBLOCK : 0;
+}
+
+// Push everything queued out to the UART, waiting on the hardware.
+// For shutdown and crash paths only.
+void uart_flush(void) {
+    while (tx_tail != tx_head) {
+        uart_tx_drain();
+        cpu_relax();
+    }
+    while (*UART_FR & FR_BUSY) {
+        cpu_relax();
+    }
+}
+
+// Next received byte, or -1 if none (single reader)
+int uart_getc(void) {
+    int tail = rx_tail;
+    if (tail == __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    char c = rx_buf[tail & UART_RX_MASK];
+    __atomic_store_n(&rx_tail, tail + 1, __ATOMIC_RELEASE);
+    return (unsigned char)c;
+}
+
+static void uart_irq(void) {
+    uint32_t mis = *UART_MIS;
+
+    if (mis & (INT_RX | INT_RT)) {
+        int head = rx_head;
+        while (!(*UART_FR & FR_RXFE)) {
+            char c = (char)*UART_DR;
+            if (head - __atomic_load_n(&rx_tail, __ATOMIC_ACQUIRE) < UART_RX_SIZE) {
+                rx_buf[head & UART_RX_MASK] = c;
+                head++;
+            } else {
+                rx_dropped++;
+            }
+        }
+        __atomic_store_n(&rx_head, head, __ATOMIC_RELEASE);
+        *UART_ICR = INT_RX | INT_RT;
+    }
+
+    if (mis & INT_TX) {
+        *UART_ICR = INT_TX;
+        uart_tx_drain();
+    }
+}
+
+// Program the PL011: 8N1, FIFOs on, trigger levels, interrupts masked.
+// Runs first thing in kernel_main; output is buffered from here on.
+void init_uart(void) {
+    // Let anything the firmware sent finish before reprogramming
+    while (*UART_FR & FR_BUSY) {
+        cpu_relax();
+    }
+
+    *UART_CR = 0;
+    *UART_IMSC = 0;
+    *UART_ICR = INT_ALL;
+    *UART_IBRD = UART_IBRD_115200;
+    *UART_FBRD = UART_FBRD_115200;
+    *UART_LCR_H = LCR_H_WLEN_8 | LCR_H_FEN;
+    *UART_IFLS = IFLS_TX_1_8 | IFLS_RX_1_2;
+    *UART_CR = CR_UARTEN | CR_TXE | CR_RXE;
+}
+
+// Take RX and TX interrupts (after init_gic)
+void uart_enable_irq(void) {
+    register_irq_handler(UART0_IRQ, uart_irq);
+
+    uint64_t flags = irq_save();
+    tx_irq_on = 1;
+    *UART_IMSC |= INT_RX | INT_RT;
+    irq_restore(flags);
+
+    gic_enable_irq(UART0_IRQ);
+    uart_tx_drain();
+
+    uart_puts("UART: interrupt driven, ");
+    print_decimal(UART_TX_SIZE);
+    uart_puts(" byte TX ring\n");
+}
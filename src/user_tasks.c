@@ -0,0 +1,173 @@
+// EL0 Test Programs
+// Save as: ~/OS_proj/src/user_tasks.c
+//
+// Runs at EL0 (see syscall.c). The linker puts this file in the .user
+// section, and it may touch nothing outside it except its own stack and
+// the read-only vDSO page: no kernel functions or data, only system
+// calls.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// System call numbers (syscall.c)
+#define SYS_YIELD       0
+#define SYS_EXIT        1
+#define SYS_SLEEP       2
+#define SYS_WRITE       3
+#define SYS_GETPID      4
+#define SYS_CLOCK       5
+
+#define SVC_BENCH_CALLS 10000
+#define SVC_BENCH_BEST  100
+
+#define VDSO_SPIN_NS        200000000ULL    // How long user_vdso_demo computes
+#define VDSO_YIELD_MARGIN   1000000ULL      // Yield with under 1ms of slice left
+
+// Shared time and scheduler page readers (user_vdso.c)
+extern uint64_t vdso_clock_ns(void);
+extern uint64_t vdso_ticks(void);
+extern int vdso_should_yield(int pid, uint64_t margin_ns);
+
+// svc #0: number in x8, arguments in x0-x2, result in x0, x1-x18 clobbered
+static inline uint64_t syscall3(uint64_t nr, uint64_t a0, uint64_t a1, uint64_t a2) {
+    register uint64_t x0 asm("x0") = a0;
+    register uint64_t x1 asm("x1") = a1;
+    register uint64_t x2 asm("x2") = a2;
+    register uint64_t x8 asm("x8") = nr;
+    asm volatile("svc #0"
+                 : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x8)
+                 :
+                 : "x3", "x4", "x5", "x6", "x7", "x9", "x10", "x11", "x12",
+                   "x13", "x14", "x15", "x16", "x17", "x18", "memory");
+    return x0;
+}
+
+static inline uint64_t syscall0(uint64_t nr) {
+    return syscall3(nr, 0, 0, 0);
+}
+
+static inline uint64_t read_cycles(void) {
+    uint64_t cycles;
+    asm volatile("isb; mrs %0, pmccntr_el0" : "=r"(cycles));
+    return cycles;
+}
+
+static void u_puts(const char* str) {
+    size_t len = 0;
+    while (str[len]) {
+        len++;
+    }
+    syscall3(SYS_WRITE, 1, (uint64_t)str, len);
+}
+
+static void u_print_decimal(uint64_t value) {
+    char buffer[20];
+    int pos = sizeof(buffer);
+
+    do {
+        buffer[--pos] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0 && pos > 0);
+
+    syscall3(SYS_WRITE, 1, (uint64_t)&buffer[pos], sizeof(buffer) - pos);
+}
+
+static void __attribute__((noreturn)) u_exit(void) {
+    syscall0(SYS_EXIT);
+    while (1) {
+    }
+}
+
+// Sleeps and yields through the kernel, then exits
+void user_hello(void) {
+    u_puts("EL0: hello from PID ");
+    u_print_decimal(syscall0(SYS_GETPID));
+    u_puts("\n");
+
+    for (int i = 0; i < 3; i++) {
+        uint64_t start = syscall0(SYS_CLOCK);
+        syscall3(SYS_SLEEP, 20 * 1000000ULL, 0, 0);
+        uint64_t slept = syscall0(SYS_CLOCK) - start;
+
+        u_puts("EL0: slept ");
+        u_print_decimal(slept / 1000);
+        u_puts(" us\n");
+        syscall0(SYS_YIELD);
+    }
+
+    u_puts("EL0: exiting\n");
+    u_exit();
+}
+
+// getpid round trips from EL0 through the fast path, to compare with
+// benchmark_syscall's EL1 figure for the full trap frame
+void user_svc_bench(void) {
+    uint64_t start = read_cycles();
+    for (int i = 0; i < SVC_BENCH_CALLS; i++) {
+        syscall0(SYS_GETPID);
+    }
+    uint64_t cycles = read_cycles() - start;
+
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < SVC_BENCH_BEST; i++) {
+        start = read_cycles();
+        syscall0(SYS_GETPID);
+        uint64_t elapsed = read_cycles() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    u_puts("EL0 svc getpid (fast path): ");
+    u_print_decimal(cycles / SVC_BENCH_CALLS);
+    u_puts(" cycles (best ");
+    u_print_decimal(best);
+    u_puts(")\n");
+    u_exit();
+}
+
+// Clock reads through the vDSO page against SYS_CLOCK, then a busy loop
+// that yields only when its slice is about to end, checking with no
+// system calls
+void user_vdso_demo(void) {
+    int pid = (int)syscall0(SYS_GETPID);
+
+    uint64_t start = read_cycles();
+    for (int i = 0; i < SVC_BENCH_CALLS; i++) {
+        vdso_clock_ns();
+    }
+    uint64_t vdso_cycles = read_cycles() - start;
+
+    start = read_cycles();
+    for (int i = 0; i < SVC_BENCH_CALLS; i++) {
+        syscall0(SYS_CLOCK);
+    }
+    uint64_t svc_cycles = read_cycles() - start;
+
+    u_puts("EL0 clock read: vDSO ");
+    u_print_decimal(vdso_cycles / SVC_BENCH_CALLS);
+    u_puts(" cycles, SYS_CLOCK ");
+    u_print_decimal(svc_cycles / SVC_BENCH_CALLS);
+    u_puts(" cycles\n");
+
+    uint64_t first_tick = vdso_ticks();
+    uint64_t end = vdso_clock_ns() + VDSO_SPIN_NS;
+    uint64_t checks = 0;
+    uint64_t yields = 0;
+    while (vdso_clock_ns() < end) {
+        checks++;
+        if (vdso_should_yield(pid, VDSO_YIELD_MARGIN)) {
+            syscall0(SYS_YIELD);
+            yields++;
+        }
+    }
+
+    u_puts("EL0 cooperative loop: ");
+    u_print_decimal(checks);
+    u_puts(" slice checks, ");
+    u_print_decimal(yields);
+    u_puts(" yields over ");
+    u_print_decimal(vdso_ticks() - first_tick);
+    u_puts(" ticks\n");
+    u_exit();
+}
@@ -0,0 +1,129 @@
+// EL0 Readers for the Shared Time and Scheduler Page
+// Save as: ~/OS_proj/src/user_vdso.c
+//
+// Runs at EL0, linked into .user like user_tasks.c. Reads the page
+// vdso.c publishes at VDSO_VA with the seqlock protocol described there;
+// none of these functions make a system call.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+#define VDSO_VA         0x7FFFF000UL
+#define NSEC_PER_SEC    1000000000UL
+
+// Same layout as vdso_data_t in vdso.c
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t hz;
+    uint64_t cntfrq;
+    uint64_t boot_count;
+    uint64_t tick_interval;
+    uint64_t reserved[4];
+} vdso_time_t;
+
+typedef struct {
+    volatile uint32_t seq;
+    int32_t pid;
+    uint32_t nr_running;
+    uint32_t time_slice;
+    uint64_t ticks;
+    uint64_t slice_end;
+    uint64_t reserved[4];
+} vdso_cpu_t;
+
+typedef struct {
+    vdso_time_t time;
+    vdso_cpu_t cpu[NR_CPUS];
+} vdso_data_t;
+
+#define vdso ((const vdso_data_t*)VDSO_VA)
+
+static inline uint64_t read_cntvct(void) {
+    uint64_t value;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+}
+
+static inline int read_cpu(void) {
+    uint64_t cpu;
+    asm volatile("mrs %0, tpidrro_el0" : "=r"(cpu));
+    return (int)cpu;
+}
+
+static inline uint32_t seq_read_begin(const volatile uint32_t* seq) {
+    uint32_t value;
+    do {
+        value = *seq;
+    } while (value & 1);
+    asm volatile("dmb ishld" ::: "memory");
+    return value;
+}
+
+static inline int seq_read_retry(const volatile uint32_t* seq, uint32_t start) {
+    asm volatile("dmb ishld" ::: "memory");
+    return *seq != start;
+}
+
+static void read_timebase(uint64_t* freq, uint64_t* boot, uint64_t* interval) {
+    uint32_t seq;
+    do {
+        seq = seq_read_begin(&vdso->time.seq);
+        *freq = vdso->time.cntfrq;
+        *boot = vdso->time.boot_count;
+        *interval = vdso->time.tick_interval;
+    } while (seq_read_retry(&vdso->time.seq, seq));
+}
+
+// Nanoseconds since boot, the same clock as SYS_CLOCK
+uint64_t vdso_clock_ns(void) {
+    uint64_t freq, boot, interval;
+    read_timebase(&freq, &boot, &interval);
+    if (!freq) {
+        return 0;
+    }
+
+    uint64_t cycles = read_cntvct() - boot;
+    return (cycles / freq) * NSEC_PER_SEC + ((cycles % freq) * NSEC_PER_SEC) / freq;
+}
+
+// Scheduler ticks since boot (get_timer_ticks in the kernel)
+uint64_t vdso_ticks(void) {
+    uint64_t freq, boot, interval;
+    read_timebase(&freq, &boot, &interval);
+    return interval ? (read_cntvct() - boot) / interval : 0;
+}
+
+// Should the task pid yield now? True when something is queued behind
+// it on its CPU and less than margin_ns of its slice is left. A task
+// that moved CPU mid-read starts a fresh slice, so that is a no.
+int vdso_should_yield(int pid, uint64_t margin_ns) {
+    uint64_t freq, boot, interval;
+    read_timebase(&freq, &boot, &interval);
+
+    int cpu = read_cpu();
+    if (cpu < 0 || cpu >= NR_CPUS) {
+        return 0;
+    }
+
+    const vdso_cpu_t* entry = &vdso->cpu[cpu];
+    uint32_t seq;
+    int32_t owner;
+    uint32_t queued;
+    uint64_t slice_end;
+    do {
+        seq = seq_read_begin(&entry->seq);
+        owner = entry->pid;
+        queued = entry->nr_running;
+        slice_end = entry->slice_end;
+    } while (seq_read_retry(&entry->seq, seq));
+
+    if (owner != pid || !queued) {
+        return 0;
+    }
+    uint64_t margin = margin_ns * freq / NSEC_PER_SEC;
+    return read_cntvct() + margin >= slice_end;
+}
@@ -0,0 +1,112 @@
+// Shared Time and Scheduler Page (vDSO data)
+// Save as: ~/OS_proj/src/vdso.c
+//
+// One page the kernel keeps up to date and every task can read at
+// VDSO_VA (mapped read-only for EL0 by mmu.c), so EL0 code can tell the
+// time and decide whether to yield without a system call:
+//
+//   time    the counter time base (frequency, value at boot, counter
+//           ticks per scheduler tick). With CNTVCT_EL0 readable at EL0
+//           this gives timer_now_ns and get_timer_ticks directly.
+//   cpu[n]  what CPU n is running: its PID, the processes queued
+//           behind it, scheduler ticks taken, the remaining time_slice
+//           and the counter value at which its slice ends.
+//
+// Each part is a seqlock: the writer makes seq odd, updates, then makes
+// it even again; readers retry if seq was odd or changed under them. A
+// cpu[] entry is only written with that CPU's run queue lock held, so
+// there is one writer at a time. TPIDRRO_EL0 holds the CPU number,
+// letting EL0 find its own entry (user_vdso.c has the reader side).
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+
+// External SMP functions
+extern int smp_processor_id(void);
+
+// External MMU functions
+extern int mmu_map_vdso(void* page);
+
+#ifndef NR_CPUS
+#define NR_CPUS 4
+#endif
+
+// Layout shared with user_vdso.c
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t hz;                // Scheduler ticks per second
+    uint64_t cntfrq;            // Counter frequency in Hz
+    uint64_t boot_count;        // CNTVCT_EL0 at time 0 (timer_now_ns)
+    uint64_t tick_interval;     // Counter ticks per scheduler tick
+    uint64_t reserved[4];
+} vdso_time_t;
+
+typedef struct {
+    volatile uint32_t seq;
+    int32_t pid;                // Running process, 0 when idle
+    uint32_t nr_running;        // Processes queued behind it
+    uint32_t time_slice;        // Ticks left (priority class)
+    uint64_t ticks;             // Scheduler ticks taken on this CPU
+    uint64_t slice_end;         // CNTVCT_EL0 value the slice runs out at
+    uint64_t reserved[4];
+} vdso_cpu_t;
+
+typedef struct {
+    vdso_time_t time;
+    vdso_cpu_t cpu[NR_CPUS];
+} vdso_data_t;
+
+_Static_assert(sizeof(vdso_data_t) <= 4096, "vDSO data must fit one page");
+
+static vdso_data_t vdso_data __attribute__((aligned(4096)));
+
+static inline void seq_begin(volatile uint32_t* seq) {
+    *seq = *seq + 1;
+    asm volatile("dmb ishst" ::: "memory");
+}
+
+static inline void seq_end(volatile uint32_t* seq) {
+    asm volatile("dmb ishst" ::: "memory");
+    *seq = *seq + 1;
+}
+
+// Record the counter time base (init_timer)
+void vdso_set_timebase(uint64_t cntfrq, uint64_t boot_count, uint64_t tick_interval, uint32_t hz) {
+    vdso_time_t* time = &vdso_data.time;
+    seq_begin(&time->seq);
+    time->cntfrq = cntfrq;
+    time->boot_count = boot_count;
+    time->tick_interval = tick_interval;
+    time->hz = hz;
+    seq_end(&time->seq);
+}
+
+// Publish a CPU's scheduling state (process.c, run queue lock held)
+void vdso_update_cpu(int cpu, int pid, uint32_t nr_running, uint64_t ticks,
+                     uint32_t time_slice, uint64_t slice_end) {
+    vdso_cpu_t* entry = &vdso_data.cpu[cpu];
+    seq_begin(&entry->seq);
+    entry->pid = pid;
+    entry->nr_running = nr_running;
+    entry->ticks = ticks;
+    entry->time_slice = time_slice;
+    entry->slice_end = slice_end;
+    seq_end(&entry->seq);
+}
+
+// Tell EL0 which CPU it is on (every CPU, the register is per CPU)
+void vdso_init_cpu(void) {
+    asm volatile("msr tpidrro_el0, %0" :: "r"((uint64_t)smp_processor_id()));
+}
+
+void init_vdso(void) {
+    vdso_init_cpu();
+    if (!mmu_map_vdso(&vdso_data)) {
+        uart_puts("vDSO: not mapped (MMU off)\n");
+        return;
+    }
+    uart_puts("vDSO: time and scheduler page mapped for EL0\n");
+}
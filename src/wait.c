@@ -0,0 +1,616 @@
+// Blocking Synchronization
+// Save as: ~/OS_proj/src/wait.c
+//
+// Primitives that put a waiting process to sleep instead of spinning
+// (sync.c has the spinning ones). A blocked process is off every run
+// queue until it is woken, so it costs no CPU time at all:
+//
+//   wait queue   list of blocked processes; wait_on / wake_up
+//   mutex        sleeping lock with an atomic fast path, adaptive
+//                spinning while the owner runs, priority-ordered
+//                waiters, direct handoff and priority inheritance
+//   semaphore    counting, FIFO; up hands its unit to the first waiter
+//   condvar      wait with a mutex, signal or broadcast
+//   futex        futex_wait(addr, val) sleeps only if *addr still holds
+//                val; futex_wake(addr, n) wakes up to n. Waiters sit in
+//                a hash of wait queues keyed on the address.
+//
+// Entries live on the waiter's kernel stack. Only a waker removes an
+// entry, and it reads everything it needs before the wakeup, so the
+// waiter can return as soon as it runs.
+//
+// Priority inheritance is one level deep: a waiter boosts the mutex
+// owner to its own priority, and unlock drops the owner back to the
+// class it had. An owner of several contended mutexes loses the boost
+// when it releases the first one.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// External UART functions
+extern void uart_puts(const char* str);
+extern void uart_putc(char c);
+extern void print_decimal(uint64_t value);
+
+// External interrupt, spinlock and atomic functions
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+extern void spin_lock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern uint64_t irq_save(void);
+extern void irq_restore(uint64_t flags);
+extern uint64_t atomic_cmpxchg64(volatile uint64_t* ptr, uint64_t old_value, uint64_t new_value);
+extern int atomic_add_return(volatile int* ptr, int delta);
+extern void cpu_relax(void);
+
+// External process functions
+typedef struct process process_t;
+extern process_t* get_current(void);
+extern process_t* create_process(const char* name, void (*entry_point)(void));
+extern void schedule_process(process_t* proc);
+extern void process_prepare_block(void);
+extern int process_wake(process_t* proc);
+extern void schedule(void);
+extern int process_sched_prio(process_t* proc);
+extern int process_running(process_t* proc);
+extern void sched_pi_boost(process_t* proc, int prio);
+extern void sched_pi_restore(process_t* proc);
+extern int smp_num_online(void);
+
+// External timer and measurement functions
+extern uint64_t timer_now_ns(void);
+extern uint64_t perf_cycles(void);
+
+#define MUTEX_HAS_WAITERS   1UL         // Low bit of mutex_t.owner
+#define MUTEX_SPIN_LIMIT    1000        // cpu_relax rounds before blocking
+#define FUTEX_HASH_BITS     6
+#define EAGAIN              11
+
+#define WAIT_BENCH_WORKERS  6           // More than CPUs, so some block
+#define WAIT_BENCH_LOCKS    20000       // Per worker
+#define WAIT_BENCH_PINGS    2000
+#define WAIT_BENCH_ITEMS    20000
+#define WAIT_BENCH_SLOTS    16
+
+typedef struct wait_entry {
+    process_t* proc;
+    int prio;                       // Mutex waiters: process_sched_prio
+    volatile uintptr_t key;         // Futex address
+    struct wait_entry* next;
+} wait_entry_t;
+
+typedef struct wait_queue {
+    spinlock_t lock;
+    wait_entry_t* head;
+    wait_entry_t* tail;
+} wait_queue_t;
+
+typedef struct mutex {
+    volatile uint64_t owner;        // process_t* | MUTEX_HAS_WAITERS, 0 if free
+    wait_queue_t wait;              // Highest priority first
+} mutex_t;
+
+typedef struct semaphore {
+    int count;                      // Protected by wait.lock
+    wait_queue_t wait;
+} semaphore_t;
+
+typedef struct condvar {
+    wait_queue_t wait;
+} condvar_t;
+
+// Futex hash buckets; all-zero is an empty, unlocked queue
+static wait_queue_t futex_queues[1 << FUTEX_HASH_BITS];
+
+// Slow path counters, for the benchmark
+static volatile int mutex_spins_won;
+static volatile int mutex_blocks;
+static volatile int mutex_pi_boosts;
+
+void wait_queue_init(wait_queue_t* wq) {
+    wq->lock.lock = 0;
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+static void wq_push(wait_queue_t* wq, wait_entry_t* entry) {
+    entry->next = NULL;
+    if (wq->tail) {
+        wq->tail->next = entry;
+    } else {
+        wq->head = entry;
+    }
+    wq->tail = entry;
+}
+
+// Insert behind every entry of equal or better priority (FIFO per level)
+static void wq_push_prio(wait_queue_t* wq, wait_entry_t* entry) {
+    wait_entry_t** link = &wq->head;
+    while (*link && (*link)->prio <= entry->prio) {
+        link = &(*link)->next;
+    }
+    entry->next = *link;
+    *link = entry;
+    if (!entry->next) {
+        wq->tail = entry;
+    }
+}
+
+static wait_entry_t* wq_pop(wait_queue_t* wq) {
+    wait_entry_t* entry = wq->head;
+    if (entry) {
+        wq->head = entry->next;
+        if (!wq->head) {
+            wq->tail = NULL;
+        }
+    }
+    return entry;
+}
+
+// Sleep on wq: called with wq->lock held and IRQs masked, having queued
+// entry; returns woken, with the lock dropped
+static void wq_sleep_locked(wait_queue_t* wq) {
+    process_prepare_block();
+    spin_unlock(&wq->lock);
+    schedule();
+}
+
+// Wake the process behind a dequeued entry. Nothing may touch the entry
+// after this: its owner can return as soon as it runs.
+static void wq_wake_entry(wait_entry_t* entry) {
+    process_t* proc = entry->proc;
+    process_wake(proc);
+}
+
+// Block until the next wake_up on wq
+void wait_on(wait_queue_t* wq) {
+    wait_entry_t entry = { get_current(), 0, 0, NULL };
+    uint64_t flags = irq_save();
+    spin_lock(&wq->lock);
+    wq_push(wq, &entry);
+    wq_sleep_locked(wq);
+    irq_restore(flags);
+}
+
+// Wake up to n waiters in order (n < 0 for all). Returns how many.
+int wake_up(wait_queue_t* wq, int n) {
+    wait_entry_t* woken = NULL;
+    int count = 0;
+
+    uint64_t flags = irq_save();
+    spin_lock(&wq->lock);
+    while (n < 0 || count < n) {
+        wait_entry_t* entry = wq_pop(wq);
+        if (!entry) {
+            break;
+        }
+        entry->next = woken;
+        woken = entry;
+        count++;
+    }
+    spin_unlock(&wq->lock);
+
+    while (woken) {
+        wait_entry_t* entry = woken;
+        woken = entry->next;
+        wq_wake_entry(entry);
+    }
+    irq_restore(flags);
+    return count;
+}
+
+// Mutex. owner is the holder's process_t*, with MUTEX_HAS_WAITERS set
+// while anyone is queued so that unlock takes the slow path. Unlock
+// hands the mutex straight to the best waiter, which wakes up owning it.
+
+void mutex_init(mutex_t* m) {
+    m->owner = 0;
+    wait_queue_init(&m->wait);
+}
+
+static inline process_t* mutex_owner(uint64_t owner) {
+    return (process_t*)(owner & ~MUTEX_HAS_WAITERS);
+}
+
+int mutex_trylock(mutex_t* m) {
+    return atomic_cmpxchg64(&m->owner, 0, (uint64_t)get_current()) == 0;
+}
+
+void mutex_lock(mutex_t* m) {
+    process_t* self = get_current();
+    if (atomic_cmpxchg64(&m->owner, 0, (uint64_t)self) == 0) {
+        return;
+    }
+
+    // Adaptive: an owner on a CPU will likely let go before a sleep and
+    // wakeup would pay off, one that is not running will not
+    for (int i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+        uint64_t owner = m->owner;
+        if (!owner) {
+            if (atomic_cmpxchg64(&m->owner, 0, (uint64_t)self) == 0) {
+                atomic_add_return(&mutex_spins_won, 1);
+                return;
+            }
+            continue;
+        }
+        if (owner & MUTEX_HAS_WAITERS || !process_running(mutex_owner(owner))) {
+            break;
+        }
+        cpu_relax();
+    }
+
+    wait_entry_t entry = { self, process_sched_prio(self), 0, NULL };
+    uint64_t flags = irq_save();
+    spin_lock(&m->wait.lock);
+    while (1) {
+        uint64_t owner = m->owner;
+        if (!mutex_owner(owner)) {
+            // Freed meanwhile: take it, keeping the flag for those queued
+            uint64_t mine = (uint64_t)self | (m->wait.head ? MUTEX_HAS_WAITERS : 0);
+            if (atomic_cmpxchg64(&m->owner, owner, mine) == owner) {
+                spin_unlock(&m->wait.lock);
+                irq_restore(flags);
+                return;
+            }
+            continue;
+        }
+        if (owner & MUTEX_HAS_WAITERS ||
+            atomic_cmpxchg64(&m->owner, owner, owner | MUTEX_HAS_WAITERS) == owner) {
+            break;
+        }
+    }
+
+    // Lend the owner our priority while we wait for it
+    process_t* holder = mutex_owner(m->owner);
+    if (entry.prio < process_sched_prio(holder)) {
+        sched_pi_boost(holder, entry.prio);
+        atomic_add_return(&mutex_pi_boosts, 1);
+    }
+
+    wq_push_prio(&m->wait, &entry);
+    atomic_add_return(&mutex_blocks, 1);
+    wq_sleep_locked(&m->wait);
+    irq_restore(flags);
+    // mutex_unlock made us the owner before waking us
+}
+
+void mutex_unlock(mutex_t* m) {
+    process_t* self = get_current();
+    if (atomic_cmpxchg64(&m->owner, (uint64_t)self, 0) == (uint64_t)self) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    spin_lock(&m->wait.lock);
+    wait_entry_t* next = wq_pop(&m->wait);
+    process_t* heir = next->proc;
+    m->owner = (uint64_t)heir | (m->wait.head ? MUTEX_HAS_WAITERS : 0);
+
+    // The boost was for the waiters; the heir inherits from those left
+    sched_pi_restore(self);
+    if (m->wait.head && m->wait.head->prio < process_sched_prio(heir)) {
+        sched_pi_boost(heir, m->wait.head->prio);
+        atomic_add_return(&mutex_pi_boosts, 1);
+    }
+    spin_unlock(&m->wait.lock);
+
+    wq_wake_entry(next);
+    irq_restore(flags);
+}
+
+// Counting semaphore
+
+void sema_init(semaphore_t* sem, int count) {
+    sem->count = count;
+    wait_queue_init(&sem->wait);
+}
+
+int down_trylock(semaphore_t* sem) {
+    uint64_t flags = irq_save();
+    spin_lock(&sem->wait.lock);
+    int ok = sem->count > 0;
+    if (ok) {
+        sem->count--;
+    }
+    spin_unlock(&sem->wait.lock);
+    irq_restore(flags);
+    return ok;
+}
+
+void down(semaphore_t* sem) {
+    uint64_t flags = irq_save();
+    spin_lock(&sem->wait.lock);
+    if (sem->count > 0) {
+        sem->count--;
+        spin_unlock(&sem->wait.lock);
+        irq_restore(flags);
+        return;
+    }
+
+    // up hands the unit over without touching count
+    wait_entry_t entry = { get_current(), 0, 0, NULL };
+    wq_push(&sem->wait, &entry);
+    wq_sleep_locked(&sem->wait);
+    irq_restore(flags);
+}
+
+void up(semaphore_t* sem) {
+    uint64_t flags = irq_save();
+    spin_lock(&sem->wait.lock);
+    wait_entry_t* entry = wq_pop(&sem->wait);
+    if (!entry) {
+        sem->count++;
+    }
+    spin_unlock(&sem->wait.lock);
+    if (entry) {
+        wq_wake_entry(entry);
+    }
+    irq_restore(flags);
+}
+
+// Condition variable
+
+void cond_init(condvar_t* cv) {
+    wait_queue_init(&cv->wait);
+}
+
+// Release m and sleep until signalled, then take m again. We are queued
+// before m is released, so a signal sent after that is not missed.
+void cond_wait(condvar_t* cv, mutex_t* m) {
+    wait_entry_t entry = { get_current(), 0, 0, NULL };
+    uint64_t flags = irq_save();
+    spin_lock(&cv->wait.lock);
+    wq_push(&cv->wait, &entry);
+    process_prepare_block();
+    spin_unlock(&cv->wait.lock);
+    mutex_unlock(m);
+    schedule();
+    irq_restore(flags);
+    mutex_lock(m);
+}
+
+void cond_signal(condvar_t* cv) {
+    wake_up(&cv->wait, 1);
+}
+
+void cond_broadcast(condvar_t* cv) {
+    wake_up(&cv->wait, -1);
+}
+
+// Futex
+
+static wait_queue_t* futex_queue(volatile uint32_t* addr) {
+    uint64_t hash = ((uintptr_t)addr >> 2) * 0x9E3779B97F4A7C15ULL;
+    return &futex_queues[hash >> (64 - FUTEX_HASH_BITS)];
+}
+
+// Sleep if *addr == val, checked under the bucket lock so a futex_wake
+// after the caller changed *addr cannot slip in between. Returns 0 when
+// woken, -EAGAIN if *addr had already changed.
+int futex_wait(volatile uint32_t* addr, uint32_t val) {
+    wait_queue_t* wq = futex_queue(addr);
+    wait_entry_t entry = { get_current(), 0, (uintptr_t)addr, NULL };
+
+    uint64_t flags = irq_save();
+    spin_lock(&wq->lock);
+    if (*addr != val) {
+        spin_unlock(&wq->lock);
+        irq_restore(flags);
+        return -EAGAIN;
+    }
+    wq_push(wq, &entry);
+    wq_sleep_locked(wq);
+    irq_restore(flags);
+    return 0;
+}
+
+// Wake up to n processes waiting on addr. Returns how many.
+int futex_wake(volatile uint32_t* addr, int n) {
+    wait_queue_t* wq = futex_queue(addr);
+    wait_entry_t* woken = NULL;
+    int count = 0;
+
+    uint64_t flags = irq_save();
+    spin_lock(&wq->lock);
+    wait_entry_t** link = &wq->head;
+    wait_entry_t* prev = NULL;
+    while (*link && count < n) {
+        wait_entry_t* entry = *link;
+        if (entry->key != (uintptr_t)addr) {
+            prev = entry;
+            link = &entry->next;
+            continue;
+        }
+        *link = entry->next;
+        if (wq->tail == entry) {
+            wq->tail = prev;
+        }
+        entry->next = woken;
+        woken = entry;
+        count++;
+    }
+    spin_unlock(&wq->lock);
+
+    while (woken) {
+        wait_entry_t* entry = woken;
+        woken = entry->next;
+        wq_wake_entry(entry);
+    }
+    irq_restore(flags);
+    return count;
+}
+
+// Benchmark and self-check, run as a process. Workers report back
+// through a semaphore, so the caller sleeps instead of polling.
+
+static mutex_t bench_mutex;
+static uint64_t bench_counter;
+static semaphore_t bench_done;
+static semaphore_t bench_ping;
+static semaphore_t bench_pong;
+static volatile uint32_t bench_futex;
+static mutex_t bench_queue_lock;
+static condvar_t bench_not_empty;
+static condvar_t bench_not_full;
+static uint32_t bench_slots[WAIT_BENCH_SLOTS];
+static uint32_t bench_head;
+static uint32_t bench_tail;
+static uint64_t bench_sum;
+
+static void mutex_worker(void) {
+    for (int i = 0; i < WAIT_BENCH_LOCKS; i++) {
+        mutex_lock(&bench_mutex);
+        bench_counter++;
+        mutex_unlock(&bench_mutex);
+    }
+    up(&bench_done);
+}
+
+static void sema_ponger(void) {
+    for (int i = 0; i < WAIT_BENCH_PINGS; i++) {
+        down(&bench_ping);
+        up(&bench_pong);
+    }
+    up(&bench_done);
+}
+
+// Futex ping-pong: bench_futex odd means it is the ponger's turn
+static void futex_ponger(void) {
+    for (uint32_t i = 0; i < WAIT_BENCH_PINGS; i++) {
+        while (bench_futex != 2 * i + 1) {
+            futex_wait(&bench_futex, 2 * i);
+        }
+        bench_futex = 2 * i + 2;
+        futex_wake(&bench_futex, 1);
+    }
+    up(&bench_done);
+}
+
+static void queue_consumer(void) {
+    for (int i = 0; i < WAIT_BENCH_ITEMS; i++) {
+        mutex_lock(&bench_queue_lock);
+        while (bench_head == bench_tail) {
+            cond_wait(&bench_not_empty, &bench_queue_lock);
+        }
+        bench_sum += bench_slots[bench_head % WAIT_BENCH_SLOTS];
+        bench_head++;
+        cond_signal(&bench_not_full);
+        mutex_unlock(&bench_queue_lock);
+    }
+    up(&bench_done);
+}
+
+// Start entry as a process; 0 if it could not be created
+static int start_worker(const char* name, void (*entry)(void)) {
+    process_t* proc = create_process(name, entry);
+    if (!proc) {
+        return 0;
+    }
+    schedule_process(proc);
+    return 1;
+}
+
+static void report(const char* what, uint64_t count, uint64_t cycles, uint64_t elapsed_ns) {
+    uart_puts("  ");
+    uart_puts(what);
+    uart_puts(": ");
+    print_decimal(count * 1000000000ULL / (elapsed_ns ? elapsed_ns : 1));
+    uart_puts(" ops/s, ");
+    print_decimal(count ? cycles / count : 0);
+    uart_puts(" cycles each");
+}
+
+void benchmark_wait(void) {
+    uart_puts("Blocking synchronization (");
+    print_decimal(smp_num_online());
+    uart_puts(" CPUs):\n");
+    sema_init(&bench_done, 0);
+
+    // Mutex: more workers than CPUs, so some find the owner preempted
+    mutex_init(&bench_mutex);
+    bench_counter = 0;
+    mutex_spins_won = 0;
+    mutex_blocks = 0;
+    mutex_pi_boosts = 0;
+    int started = 0;
+    uint64_t start_ns = timer_now_ns();
+    uint64_t start = perf_cycles();
+    for (int i = 0; i < WAIT_BENCH_WORKERS; i++) {
+        started += start_worker("mutex_worker", mutex_worker);
+    }
+    for (int i = 0; i < started; i++) {
+        down(&bench_done);
+    }
+    report("mutex", bench_counter, perf_cycles() - start, timer_now_ns() - start_ns);
+    uart_puts(", ");
+    print_decimal(mutex_spins_won);
+    uart_puts(" won by spinning, ");
+    print_decimal(mutex_blocks);
+    uart_puts(" blocked, ");
+    print_decimal(mutex_pi_boosts);
+    uart_puts(" PI boosts");
+    uart_puts(bench_counter == (uint64_t)started * WAIT_BENCH_LOCKS ? "\n" : " - FAILED\n");
+
+    // Semaphore ping-pong: every round trip blocks both sides
+    sema_init(&bench_ping, 0);
+    sema_init(&bench_pong, 0);
+    if (start_worker("sema_ponger", sema_ponger)) {
+        start_ns = timer_now_ns();
+        start = perf_cycles();
+        for (int i = 0; i < WAIT_BENCH_PINGS; i++) {
+            up(&bench_ping);
+            down(&bench_pong);
+        }
+        report("semaphore ping-pong", WAIT_BENCH_PINGS, perf_cycles() - start,
+               timer_now_ns() - start_ns);
+        uart_puts("\n");
+        down(&bench_done);
+    }
+
+    // Futex ping-pong
+    bench_futex = 0;
+    if (start_worker("futex_ponger", futex_ponger)) {
+        start_ns = timer_now_ns();
+        start = perf_cycles();
+        for (uint32_t i = 0; i < WAIT_BENCH_PINGS; i++) {
+            bench_futex = 2 * i + 1;
+            futex_wake(&bench_futex, 1);
+            while (bench_futex != 2 * i + 2) {
+                futex_wait(&bench_futex, 2 * i + 1);
+            }
+        }
+        report("futex ping-pong", WAIT_BENCH_PINGS, perf_cycles() - start,
+               timer_now_ns() - start_ns);
+        uart_puts("\n");
+        down(&bench_done);
+    }
+
+    // Bounded queue on a mutex and two condition variables
+    mutex_init(&bench_queue_lock);
+    cond_init(&bench_not_empty);
+    cond_init(&bench_not_full);
+    bench_head = 0;
+    bench_tail = 0;
+    bench_sum = 0;
+    if (start_worker("queue_consumer", queue_consumer)) {
+        uint64_t expected = 0;
+        start_ns = timer_now_ns();
+        start = perf_cycles();
+        for (uint32_t i = 0; i < WAIT_BENCH_ITEMS; i++) {
+            mutex_lock(&bench_queue_lock);
+            while (bench_tail - bench_head == WAIT_BENCH_SLOTS) {
+                cond_wait(&bench_not_full, &bench_queue_lock);
+            }
+            bench_slots[bench_tail % WAIT_BENCH_SLOTS] = i;
+            bench_tail++;
+            expected += i;
+            cond_signal(&bench_not_empty);
+            mutex_unlock(&bench_queue_lock);
+        }
+        down(&bench_done);
+        report("condvar queue", WAIT_BENCH_ITEMS, perf_cycles() - start,
+               timer_now_ns() - start_ns);
+        uart_puts(bench_sum == expected ? "\n" : " - FAILED\n");
+    }
+}
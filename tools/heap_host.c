@@ -0,0 +1,473 @@
+// Host Build of the Kernel Allocators
+// Save as: ~/OS_proj/tools/heap_host.c
+//
+// Links src/memory.c, src/slab.c and src/page_alloc.c into a Linux
+// program (`make heap-fuzz`, `make heap-replay TRACE=console.log`).
+// The kernel's RAM (RAM_MB in the Makefile, 256MB by default) is an
+// anonymous mapping at its physical address, so the allocators run
+// unmodified; the UART, lock and trace functions they call are stubbed
+// below.
+//
+//   heap_host fuzz [seed] [ops]   random kmalloc/kfree with heap_check
+//                                 after every operation and a pattern in
+//                                 every live object
+//   heap_host replay FILE         replay a trace, then report throughput,
+//                                 worst-case latency and fragmentation
+//
+// A trace is either a console log holding a trace_dump (src/trace.c)
+// with alloc and free events enabled, or a text file of lines
+// "a ID SIZE" and "f ID".
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Kernel allocator functions
+extern void init_memory(void);
+extern void* kmalloc(size_t size);
+extern void kfree(void* ptr);
+extern int heap_check(void);
+extern void heap_free_stats(size_t* free_bytes, size_t* largest_free);
+
+// Kernel RAM, as in page_alloc.c (the Makefile passes RAM_SIZE)
+#define RAM_START       0x40000000UL
+#ifndef RAM_SIZE
+#define RAM_SIZE        0x10000000UL
+#endif
+
+#define FUZZ_SLOTS      2048
+#define FUZZ_OPS        200000
+#define FRAG_INTERVAL   64          // Replay ops between fragmentation samples
+#define TRACE_ALLOC     3           // Event numbers from src/trace.c
+#define TRACE_FREE      4
+#define TRACE_RECORD    32
+
+// Stubs for what the allocators call in the kernel
+
+volatile uint32_t trace_mask = 0;
+
+void trace_event(uint32_t event, uint64_t a, uint64_t b) {
+    (void)event;
+    (void)a;
+    (void)b;
+}
+
+void uart_puts(const char* str) {
+    fputs(str, stdout);
+}
+
+void uart_putc(char c) {
+    putchar(c);
+}
+
+void print_decimal(uint64_t value) {
+    printf("%llu", (unsigned long long)value);
+}
+
+typedef struct spinlock {
+    volatile uint32_t lock;
+} spinlock_t;
+
+uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    (void)lock;
+    return 0;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    (void)lock;
+    (void)flags;
+}
+
+int spin_trylock(spinlock_t* lock) {
+    (void)lock;
+    return 1;
+}
+
+void spin_unlock(spinlock_t* lock) {
+    (void)lock;
+}
+
+void cpu_relax(void) {
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, reproducible from the seed
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Mostly slab sizes, then TLSF sizes, a few page-sized requests
+static size_t fuzz_size(void) {
+    uint64_t r = rng();
+    switch (r % 16) {
+    case 0:
+        return 16384 + (r >> 8) % (128 * 1024);
+    case 1: case 2: case 3: case 4:
+        return 1025 + (r >> 8) % (16384 - 1025);
+    default:
+        return 1 + (r >> 8) % 1024;
+    }
+}
+
+typedef struct {
+    uint8_t* ptr;
+    size_t size;
+} slot_t;
+
+static void fill(slot_t* s, uint8_t tag) {
+    memset(s->ptr, tag, s->size);
+}
+
+static int intact(const slot_t* s, uint8_t tag) {
+    for (size_t i = 0; i < s->size; i++) {
+        if (s->ptr[i] != tag) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int run_fuzz(uint64_t seed, long ops) {
+    static slot_t slots[FUZZ_SLOTS];
+    long failures = 0;
+    long allocs = 0;
+    long frees = 0;
+
+    rng_state = seed ? seed : 1;
+
+    for (long op = 0; op < ops && failures < 10; op++) {
+        int i = (int)(rng() % FUZZ_SLOTS);
+        uint8_t tag = (uint8_t)(i * 31 + 7);
+        slot_t* s = &slots[i];
+
+        if (s->ptr) {
+            if (!intact(s, tag)) {
+                printf("op %ld: object %p (%zu bytes) overwritten\n", op, (void*)s->ptr, s->size);
+                failures++;
+            }
+            kfree(s->ptr);
+            s->ptr = NULL;
+            frees++;
+        } else {
+            s->size = fuzz_size();
+            s->ptr = (uint8_t*)kmalloc(s->size);
+            if (!s->ptr) {
+                continue;       // Out of memory is allowed
+            }
+            if ((uintptr_t)s->ptr % 16) {
+                printf("op %ld: kmalloc(%zu) returned misaligned %p\n", op, s->size, (void*)s->ptr);
+                failures++;
+            }
+            fill(s, tag);
+            allocs++;
+        }
+
+        if (heap_check() != 0) {
+            printf("op %ld: heap invariants broken\n", op);
+            failures++;
+        }
+    }
+
+    // Everything back: the TLSF heap must be one free block again
+    for (int i = 0; i < FUZZ_SLOTS; i++) {
+        kfree(slots[i].ptr);
+        slots[i].ptr = NULL;
+    }
+    size_t free_bytes, largest;
+    heap_free_stats(&free_bytes, &largest);
+    if (heap_check() != 0 || free_bytes != largest) {
+        printf("heap not coalesced after freeing everything\n");
+        failures++;
+    }
+
+    printf("fuzz seed=%llu ops=%ld allocs=%ld frees=%ld failures=%ld\n",
+           (unsigned long long)seed, ops, allocs, frees, failures);
+    return failures ? 1 : 0;
+}
+
+// Replay: one operation per trace entry, ids are kernel addresses or the
+// text format's ids
+
+typedef struct {
+    uint64_t timestamp;
+    uint32_t event;
+    uint32_t cpu;
+    uint64_t a;
+    uint64_t b;
+} trace_rec_t;
+
+typedef struct {
+    int alloc;
+    uint64_t id;
+    size_t size;
+} replay_op_t;
+
+typedef struct {
+    uint64_t id;                // 0 marks an empty entry
+    void* ptr;
+    size_t size;
+} live_t;
+
+static replay_op_t* ops_buf;
+static size_t ops_count;
+static size_t ops_cap;
+
+static live_t* live;
+static size_t live_cap;
+
+static void add_op(int alloc, uint64_t id, size_t size) {
+    if (ops_count == ops_cap) {
+        ops_cap = ops_cap ? ops_cap * 2 : 4096;
+        ops_buf = realloc(ops_buf, ops_cap * sizeof(replay_op_t));
+        if (!ops_buf) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    ops_buf[ops_count].alloc = alloc;
+    ops_buf[ops_count].id = id;
+    ops_buf[ops_count].size = size;
+    ops_count++;
+}
+
+static int by_timestamp(const void* x, const void* y) {
+    const trace_rec_t* a = x;
+    const trace_rec_t* b = y;
+    return (a->timestamp > b->timestamp) - (a->timestamp < b->timestamp);
+}
+
+static int hex_record(const char* line, trace_rec_t* rec) {
+    uint8_t bytes[TRACE_RECORD];
+    for (int i = 0; i < TRACE_RECORD; i++) {
+        unsigned int v;
+        if (sscanf(line + 2 * i, "%2x", &v) != 1) {
+            return 0;
+        }
+        bytes[i] = (uint8_t)v;
+    }
+    memcpy(rec, bytes, sizeof(*rec));      // Little-endian, as on the target
+    return 1;
+}
+
+static void load_trace(FILE* f) {
+    char line[256];
+    trace_rec_t* recs = NULL;
+    size_t nrecs = 0, cap = 0;
+    int in_dump = 0, saw_dump = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (strncmp(line, "TRACE BEGIN", 11) == 0) {
+            in_dump = saw_dump = 1;
+            continue;
+        }
+        if (strcmp(line, "TRACE END") == 0) {
+            in_dump = 0;
+            continue;
+        }
+        if (in_dump) {
+            trace_rec_t rec;
+            if (strlen(line) != 2 * TRACE_RECORD || !hex_record(line, &rec)) {
+                continue;       // CPU headers and console noise
+            }
+            if ((rec.event == TRACE_ALLOC && rec.a) || rec.event == TRACE_FREE) {
+                if (nrecs == cap) {
+                    cap = cap ? cap * 2 : 4096;
+                    recs = realloc(recs, cap * sizeof(trace_rec_t));
+                    if (!recs) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                recs[nrecs++] = rec;
+            }
+            continue;
+        }
+        if (saw_dump) {
+            continue;
+        }
+
+        unsigned long long id, size;
+        if (sscanf(line, "a %llu %llu", &id, &size) == 2) {
+            add_op(1, id + 1, (size_t)size);
+        } else if (sscanf(line, "f %llu", &id) == 1) {
+            add_op(0, id + 1, 0);
+        }
+    }
+
+    // Per-CPU rings, merged back into one timeline
+    qsort(recs, nrecs, sizeof(trace_rec_t), by_timestamp);
+    for (size_t i = 0; i < nrecs; i++) {
+        add_op(recs[i].event == TRACE_ALLOC, recs[i].a, (size_t)recs[i].b);
+    }
+    free(recs);
+}
+
+static live_t* live_find(uint64_t id, int insert) {
+    size_t mask = live_cap - 1;
+    size_t i = (size_t)(id * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+    while (live[i].id && live[i].id != id) {
+        i = (i + 1) & mask;
+    }
+    if (!live[i].id && !insert) {
+        return NULL;
+    }
+    return &live[i];
+}
+
+// Backward-shift delete keeps the probe chains intact
+static void live_remove(live_t* e) {
+    size_t mask = live_cap - 1;
+    size_t i = (size_t)(e - live);
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!live[j].id) {
+            break;
+        }
+        size_t home = (size_t)(live[j].id * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            live[i] = live[j];
+            i = j;
+        }
+    }
+    live[i].id = 0;
+}
+
+static int run_replay(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    load_trace(f);
+    fclose(f);
+    if (!ops_count) {
+        printf("%s: no allocation events\n", path);
+        return 1;
+    }
+
+    live_cap = 1;
+    while (live_cap < ops_count * 2) {
+        live_cap <<= 1;
+    }
+    live = calloc(live_cap, sizeof(live_t));
+    if (!live) {
+        perror("calloc");
+        return 1;
+    }
+
+    uint64_t total_ns = 0, worst_alloc = 0, worst_free = 0;
+    size_t live_bytes = 0, peak_bytes = 0;
+    long failed = 0, unmatched = 0;
+    double frag_max = 0.0;
+
+    for (size_t i = 0; i < ops_count; i++) {
+        replay_op_t* op = &ops_buf[i];
+
+        if (op->alloc) {
+            live_t* e = live_find(op->id, 0);
+            if (e) {
+                // Freed by an event the ring dropped; forget the old one
+                kfree(e->ptr);
+                live_bytes -= e->size;
+                live_remove(e);
+            }
+            uint64_t t = now_ns();
+            void* ptr = kmalloc(op->size);
+            t = now_ns() - t;
+            total_ns += t;
+            worst_alloc = t > worst_alloc ? t : worst_alloc;
+            if (!ptr) {
+                failed++;
+                continue;
+            }
+            e = live_find(op->id, 1);
+            e->id = op->id;
+            e->ptr = ptr;
+            e->size = op->size;
+            live_bytes += op->size;
+            peak_bytes = live_bytes > peak_bytes ? live_bytes : peak_bytes;
+        } else {
+            live_t* e = live_find(op->id, 0);
+            if (!e) {
+                unmatched++;    // Allocated before the ring's window
+                continue;
+            }
+            uint64_t t = now_ns();
+            kfree(e->ptr);
+            t = now_ns() - t;
+            total_ns += t;
+            worst_free = t > worst_free ? t : worst_free;
+            live_bytes -= e->size;
+            live_remove(e);
+        }
+
+        if (i % FRAG_INTERVAL == 0) {
+            size_t free_bytes, largest;
+            heap_free_stats(&free_bytes, &largest);
+            double frag = free_bytes ? 1.0 - (double)largest / (double)free_bytes : 0.0;
+            frag_max = frag > frag_max ? frag : frag_max;
+        }
+    }
+
+    size_t free_bytes, largest;
+    heap_free_stats(&free_bytes, &largest);
+    double frag_end = free_bytes ? 1.0 - (double)largest / (double)free_bytes : 0.0;
+    int errors = heap_check();
+
+    printf("replay %s: %zu ops, %ld failed, %ld frees without an alloc\n",
+           path, ops_count, failed, unmatched);
+    printf("throughput: %.1f Mops/s (%.1f ns/op)\n",
+           total_ns ? ops_count * 1000.0 / (double)total_ns : 0.0,
+           (double)total_ns / (double)ops_count);
+    printf("worst case: kmalloc %llu ns, kfree %llu ns\n",
+           (unsigned long long)worst_alloc, (unsigned long long)worst_free);
+    printf("peak live: %zu bytes\n", peak_bytes);
+    printf("TLSF fragmentation: %.1f%% at end, %.1f%% worst (1 - largest/free)\n",
+           frag_end * 100.0, frag_max * 100.0);
+    printf("heap_check: %d errors\n", errors);
+    return errors ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || (strcmp(argv[1], "replay") == 0 && argc < 3)) {
+        fprintf(stderr, "usage: %s fuzz [seed] [ops] | replay FILE\n", argv[0]);
+        return 2;
+    }
+
+    void* ram = mmap((void*)RAM_START, RAM_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+    if (ram != (void*)RAM_START) {
+        fprintf(stderr, "cannot map kernel RAM at %#lx\n", RAM_START);
+        return 1;
+    }
+    init_memory();
+
+    if (strcmp(argv[1], "fuzz") == 0) {
+        uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : (uint64_t)time(NULL);
+        long ops = argc > 3 ? strtol(argv[3], NULL, 0) : FUZZ_OPS;
+        return run_fuzz(seed, ops);
+    }
+    if (strcmp(argv[1], "replay") == 0) {
+        return run_replay(argv[2]);
+    }
+    fprintf(stderr, "unknown mode %s\n", argv[1]);
+    return 2;
+}
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+# Convert a kernel trace dump to Chrome trace / Perfetto JSON
+#
+# Usage: trace2json.py console.log > trace.json
+#
+# Reads the block between "TRACE BEGIN" and "TRACE END" that trace_dump
+# (src/trace.c) prints, and writes one track per CPU. Open the result in
+# ui.perfetto.dev or chrome://tracing.
+
+import json
+import struct
+import sys
+
+# Event types, as in src/trace.c
+TRACE_SWITCH = 1
+TRACE_WAKEUP = 2
+TRACE_ALLOC = 3
+TRACE_FREE = 4
+TRACE_IRQ_ENTRY = 5
+TRACE_IRQ_EXIT = 6
+TRACE_SYSCALL = 7
+
+RECORD = struct.Struct("<QIIQQ")    # timestamp, event, cpu, a, b
+
+
+def parse_header(line):
+    fields = {}
+    for word in line.split()[2:]:
+        key, _, value = word.partition("=")
+        fields[key] = int(value)
+    return fields
+
+
+def read_dump(lines):
+    header = None
+    records = []
+    for line in lines:
+        line = line.strip()
+        if line.startswith("TRACE BEGIN"):
+            header = parse_header(line)
+            records = []
+        elif header is None:
+            continue
+        elif line == "TRACE END":
+            return header, records
+        elif line.startswith("TRACE CPU"):
+            continue
+        elif len(line) == 2 * RECORD.size:
+            try:
+                records.append(RECORD.unpack(bytes.fromhex(line)))
+            except ValueError:
+                pass    # Console noise mixed into the dump
+    if header is None:
+        sys.exit("trace2json: no TRACE BEGIN found")
+    sys.exit("trace2json: dump is truncated (no TRACE END)")
+
+
+def to_events(header, records):
+    freq = header["freq"]
+    records.sort(key=lambda r: r[0])
+    base = records[0][0] if records else 0
+
+    def usec(ticks):
+        return (ticks - base) * 1e6 / freq
+
+    events = []
+    for cpu in range(header["cpus"]):
+        events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": cpu,
+                       "args": {"name": "CPU %d" % cpu}})
+
+    running = {}    # cpu -> (pid, start)
+    for ts, event, cpu, a, b in records:
+        common = {"pid": 0, "tid": cpu, "ts": usec(ts)}
+        if event == TRACE_SWITCH:
+            if cpu in running:
+                prev, start = running[cpu]
+                events.append({"name": "pid %d" % prev, "ph": "X", "pid": 0,
+                               "tid": cpu, "ts": start, "dur": usec(ts) - start})
+            running[cpu] = (b, usec(ts))
+        elif event == TRACE_IRQ_ENTRY:
+            events.append(dict(common, name="irq %d" % a, ph="B"))
+        elif event == TRACE_IRQ_EXIT:
+            events.append(dict(common, name="irq %d" % a, ph="E"))
+        elif event == TRACE_WAKEUP:
+            events.append(dict(common, name="wakeup", ph="i", s="t",
+                               args={"pid": a, "target_cpu": b}))
+        elif event == TRACE_ALLOC:
+            events.append(dict(common, name="alloc", ph="i", s="t",
+                               args={"addr": hex(a), "size": b}))
+        elif event == TRACE_FREE:
+            events.append(dict(common, name="free", ph="i", s="t",
+                               args={"addr": hex(a)}))
+        elif event == TRACE_SYSCALL:
+            events.append(dict(common, name="syscall", ph="i", s="t",
+                               args={"imm": a, "nr": b}))
+
+    # Close the slices still running when the dump was taken
+    end = usec(records[-1][0]) if records else 0
+    for cpu, (pid, start) in running.items():
+        events.append({"name": "pid %d" % pid, "ph": "X", "pid": 0,
+                       "tid": cpu, "ts": start, "dur": end - start})
+    return events
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: trace2json.py console.log > trace.json")
+    with open(sys.argv[1], errors="replace") as f:
+        header, records = read_dump(f.read().replace("\r", "").splitlines())
+    json.dump({"traceEvents": to_events(header, records),
+               "displayTimeUnit": "ns"}, sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()